@@ -20,6 +20,7 @@
 #include "config.h"
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <SDL.h>
 #include <opus.h>
 
@@ -29,6 +30,11 @@
 #include "fv-mutex.h"
 #include "fv-speech.h"
 
+/* The most packets in a row that will be replaced with Opus's packet
+ * loss concealment when the sequence numbers show a gap. A longer gap
+ * is just left silent. */
+#define FV_AUDIO_BUFFER_MAX_CONCEALED_PACKETS 5
+
 struct fv_audio_buffer {
         struct fv_mutex *mutex;
 
@@ -48,6 +54,12 @@ struct fv_audio_buffer_channel {
          * data for this channel.
          */
         int offset;
+
+        /* The sequence number and timestamp of the last packet if it
+         * had them */
+        bool has_sequence;
+        uint16_t last_sequence;
+        uint32_t last_timestamp;
 };
 
 struct fv_audio_buffer *
@@ -131,24 +143,49 @@ reserve_buffer_space(struct fv_audio_buffer *ab,
         ab->start = 0;
 }
 
-void
-fv_audio_buffer_add_packet(struct fv_audio_buffer *ab,
-                           int channel_num,
-                           const uint8_t *packet_data,
-                           size_t packet_length)
+static void
+mix_samples(struct fv_audio_buffer *ab,
+            struct fv_audio_buffer_channel *channel,
+            const int16_t *buf,
+            int n_samples)
 {
-        struct fv_audio_buffer_channel *channel;
-        int16_t *buf;
-        int n_samples;
         int to_copy;
         int start;
 
-        fv_mutex_lock(ab->mutex);
+        reserve_buffer_space(ab, channel->offset + n_samples);
 
-        channel = get_channel(ab, channel_num);
+        start = (channel->offset + ab->start) & (ab->size - 1);
+        to_copy = MIN(ab->size - start, n_samples);
 
-        if (channel == NULL)
-                goto done;
+        SDL_MixAudioFormat((Uint8 *) (ab->buffer + start),
+                           (Uint8 *) buf,
+                           AUDIO_S16SYS,
+                           to_copy * sizeof *buf,
+                           SDL_MIX_MAXVOLUME);
+
+        SDL_MixAudioFormat((Uint8 *) ab->buffer,
+                           (Uint8 *) (buf + to_copy),
+                           AUDIO_S16SYS,
+                           sizeof *buf * (n_samples - to_copy),
+                           SDL_MIX_MAXVOLUME);
+
+        channel->offset += n_samples;
+        ab->length = MAX(ab->length, channel->offset);
+}
+
+/* Decodes the packet and mixes it into the buffer after the
+ * channel's previous packet. If n_lost is not zero then that many
+ * packets of the same length are concealed first. */
+static void
+add_packet(struct fv_audio_buffer *ab,
+           struct fv_audio_buffer_channel *channel,
+           int n_lost,
+           const uint8_t *packet_data,
+           size_t packet_length)
+{
+        int16_t *buf;
+        int n_samples;
+        int i;
 
         n_samples = opus_packet_get_nb_samples(packet_data,
                                                packet_length,
@@ -156,10 +193,22 @@ fv_audio_buffer_add_packet(struct fv_audio_buffer *ab,
 
         /* Ignore invalid packets */
         if (n_samples < 0)
-                goto done;
+                return;
 
         buf = alloca(sizeof *buf * n_samples);
 
+        /* Passing no data makes the decoder extrapolate from the
+         * previous packets */
+        for (i = 0; i < n_lost; i++) {
+                if (opus_decode(channel->decoder,
+                                NULL, /* data */
+                                0, /* len */
+                                buf,
+                                n_samples,
+                                false /* decode_fec */) == n_samples)
+                        mix_samples(ab, channel, buf, n_samples);
+        }
+
         n_samples = opus_decode(channel->decoder,
                                 packet_data,
                                 packet_length,
@@ -168,27 +217,70 @@ fv_audio_buffer_add_packet(struct fv_audio_buffer *ab,
                                 false /* decode_fec */);
 
         if (n_samples < 0)
+                return;
+
+        mix_samples(ab, channel, buf, n_samples);
+}
+
+void
+fv_audio_buffer_add_packet(struct fv_audio_buffer *ab,
+                           int channel_num,
+                           const uint8_t *packet_data,
+                           size_t packet_length)
+{
+        struct fv_audio_buffer_channel *channel;
+
+        fv_mutex_lock(ab->mutex);
+
+        channel = get_channel(ab, channel_num);
+
+        if (channel) {
+                channel->has_sequence = false;
+                add_packet(ab, channel, 0, packet_data, packet_length);
+        }
+
+        fv_mutex_unlock(ab->mutex);
+}
+
+void
+fv_audio_buffer_add_sequenced_packet(struct fv_audio_buffer *ab,
+                                     int channel_num,
+                                     uint16_t sequence,
+                                     uint32_t timestamp,
+                                     const uint8_t *packet_data,
+                                     size_t packet_length)
+{
+        struct fv_audio_buffer_channel *channel;
+        uint16_t n_lost;
+        uint32_t elapsed;
+
+        fv_mutex_lock(ab->mutex);
+
+        channel = get_channel(ab, channel_num);
+
+        if (channel == NULL)
                 goto done;
 
-        reserve_buffer_space(ab, channel->offset + n_samples);
+        n_lost = 0;
 
-        start = (channel->offset + ab->start) & (ab->size - 1);
-        to_copy = MIN(ab->size - start, n_samples);
+        if (channel->has_sequence) {
+                n_lost = sequence - channel->last_sequence - 1;
+                elapsed = timestamp - channel->last_timestamp;
 
-        SDL_MixAudioFormat((Uint8 *) (ab->buffer + start),
-                           (Uint8 *) buf,
-                           AUDIO_S16SYS,
-                           to_copy * sizeof *buf,
-                           SDL_MIX_MAXVOLUME);
+                /* The gap is only concealed if the server received
+                 * the packets on either side of it at about the
+                 * right interval. Otherwise the talker had probably
+                 * stopped or was out of range in the meantime. */
+                if (n_lost > FV_AUDIO_BUFFER_MAX_CONCEALED_PACKETS ||
+                    elapsed > n_lost + 2)
+                        n_lost = 0;
+        }
 
-        SDL_MixAudioFormat((Uint8 *) ab->buffer,
-                           (Uint8 *) (buf + to_copy),
-                           AUDIO_S16SYS,
-                           sizeof *buf * (n_samples - to_copy),
-                           SDL_MIX_MAXVOLUME);
+        channel->has_sequence = true;
+        channel->last_sequence = sequence;
+        channel->last_timestamp = timestamp;
 
-        channel->offset += n_samples;
-        ab->length = MAX(ab->length, channel->offset);
+        add_packet(ab, channel, n_lost, packet_data, packet_length);
 
 done:
         fv_mutex_unlock(ab->mutex);
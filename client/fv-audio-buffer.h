@@ -33,6 +33,18 @@ fv_audio_buffer_add_packet(struct fv_audio_buffer *ab,
                            const uint8_t *packet_data,
                            size_t packet_length);
 
+/* Thread safe. Like fv_audio_buffer_add_packet but for a packet with
+ * the talker's sequence number and the timestamp of when the server
+ * received it in units of FV_PROTO_SPEECH_TIME. A short gap in the
+ * sequence numbers is filled in with packet loss concealment. */
+void
+fv_audio_buffer_add_sequenced_packet(struct fv_audio_buffer *ab,
+                                     int channel,
+                                     uint16_t sequence,
+                                     uint32_t timestamp,
+                                     const uint8_t *packet_data,
+                                     size_t packet_length);
+
 /* Thread safe */
 void
 fv_audio_buffer_get(struct fv_audio_buffer *ab,
@@ -23,7 +23,10 @@ struct fv_network_base {
         struct fv_audio_buffer *audio_buffer;
         struct fv_recorder *recorder;
 
+        bool sent_features;
         bool sent_hello;
+        /* The FV_PROTO_FEATURE_* bits that the server enabled */
+        uint32_t features;
         bool has_player_id;
         uint64_t player_id;
 
@@ -64,9 +67,25 @@ write_command(struct fv_network *nw,
               uint8_t command,
               ...);
 
+/* Returns a pointer to write a message of the given size to with one
+ * of the fv_proto_write_* functions or NULL if there isn't enough
+ * space. The message is sent with add_message.
+ */
+static uint8_t *
+get_message_space(struct fv_network *nw,
+                  size_t size);
+
+static void
+add_message(struct fv_network *nw,
+            size_t length);
+
 static bool
 write_speech(struct fv_network *nw);
 
+/* Returns the FV_PROTO_FEATURE_* bits that the client can handle */
+static uint32_t
+get_requested_features(struct fv_network *nw);
+
 static bool
 write_buf_is_empty(struct fv_network *nw);
 
@@ -97,103 +116,114 @@ needs_write_poll_base(struct fv_network *nw)
         return false;
 }
 
+static bool
+write_request_features(struct fv_network *nw)
+{
+        struct fv_network_base *base = fv_network_get_base(nw);
+        struct fv_proto_request_features message = {
+                .features = get_requested_features(nw)
+        };
+        uint8_t *buf;
+
+        if (message.features != 0) {
+                buf = get_message_space(nw, FV_PROTO_REQUEST_FEATURES_SIZE);
+
+                if (buf == NULL)
+                        return false;
+
+                add_message(nw,
+                            fv_proto_write_request_features(buf, &message));
+        }
+
+        base->sent_features = true;
+
+        return true;
+}
+
 static bool
 write_new_player(struct fv_network *nw)
 {
         struct fv_network_base *base = fv_network_get_base(nw);
-        int res;
+        uint8_t *buf;
 
-        res = write_command(nw,
-                            FV_PROTO_NEW_PLAYER,
-                            FV_PROTO_TYPE_NONE);
+        buf = get_message_space(nw, FV_PROTO_NEW_PLAYER_SIZE);
 
-        if (res != -1) {
-                base->sent_hello = true;
-                return true;
-        } else {
+        if (buf == NULL)
                 return false;
-        }
+
+        add_message(nw, fv_proto_write_new_player(buf));
+        base->sent_hello = true;
+
+        return true;
 }
 
 static bool
 write_reconnect(struct fv_network *nw)
 {
         struct fv_network_base *base = fv_network_get_base(nw);
-        int res;
+        struct fv_proto_reconnect message = {
+                .player_id = base->player_id
+        };
+        uint8_t *buf;
 
-        res = write_command(nw,
-                            FV_PROTO_RECONNECT,
-                            FV_PROTO_TYPE_UINT64,
-                            base->player_id,
-                            FV_PROTO_TYPE_NONE);
+        buf = get_message_space(nw, FV_PROTO_RECONNECT_SIZE);
 
-        if (res != -1) {
-                base->sent_hello = true;
-                return true;
-        } else {
+        if (buf == NULL)
                 return false;
-        }
+
+        add_message(nw, fv_proto_write_reconnect(buf, &message));
+        base->sent_hello = true;
+
+        return true;
 }
 
 static bool
 write_position(struct fv_network *nw)
 {
         struct fv_network_base *base = fv_network_get_base(nw);
-        uint32_t x, y;
-        uint16_t direction;
+        struct fv_proto_update_position message;
         float direction_float;
-        int res;
+        uint8_t *buf;
+
+        buf = get_message_space(nw, FV_PROTO_UPDATE_POSITION_SIZE);
 
-        x = base->player.pos.x / (float) FV_MAP_WIDTH * UINT32_MAX;
-        y = base->player.pos.y / (float) FV_MAP_HEIGHT * UINT32_MAX;
+        if (buf == NULL)
+                return false;
+
+        message.x_position = (base->player.pos.x / (float) FV_MAP_WIDTH *
+                              UINT32_MAX);
+        message.y_position = (base->player.pos.y / (float) FV_MAP_HEIGHT *
+                              UINT32_MAX);
 
         direction_float = base->player.pos.direction;
         if (direction_float < 0)
                 direction_float += 2 * M_PI;
-        direction = direction_float / (2 * M_PI) * UINT16_MAX;
-
-        res = write_command(nw,
-                            FV_PROTO_UPDATE_POSITION,
-
-                            FV_PROTO_TYPE_UINT32,
-                            x,
-
-                            FV_PROTO_TYPE_UINT32,
-                            y,
-
-                            FV_PROTO_TYPE_UINT16,
-                            direction,
+        message.direction = direction_float / (2 * M_PI) * UINT16_MAX;
 
-                            FV_PROTO_TYPE_NONE);
+        add_message(nw, fv_proto_write_update_position(buf, &message));
+        base->dirty_player_state &= ~FV_PERSON_STATE_POSITION;
 
-        if (res != -1) {
-                base->dirty_player_state &= ~FV_PERSON_STATE_POSITION;
-                return true;
-        } else {
-                return false;
-        }
+        return true;
 }
 
 static bool
 write_appearance(struct fv_network *nw)
 {
         struct fv_network_base *base = fv_network_get_base(nw);
-        int res;
+        struct fv_proto_update_appearance message = {
+                .image = base->player.appearance.type
+        };
+        uint8_t *buf;
 
-        res = write_command(nw,
-                            FV_PROTO_UPDATE_APPEARANCE,
+        buf = get_message_space(nw, FV_PROTO_UPDATE_APPEARANCE_SIZE);
 
-                            FV_PROTO_TYPE_UINT8,
-                            (uint8_t) base->player.appearance.type,
+        if (buf == NULL)
+                return false;
 
-                            FV_PROTO_TYPE_NONE);
+        add_message(nw, fv_proto_write_update_appearance(buf, &message));
+        base->dirty_player_state &= ~FV_PERSON_STATE_APPEARANCE;
 
-        if (res != -1) {
-                base->dirty_player_state &= ~FV_PERSON_STATE_APPEARANCE;
-                return true;
-        } else {
-                return false;
-        }
+        return true;
 }
 
 static bool
@@ -222,17 +252,16 @@ write_flags(struct fv_network *nw)
 static bool
 write_keep_alive(struct fv_network *nw)
 {
-        int res;
+        uint8_t *buf;
 
-        res = write_command(nw,
-                            FV_PROTO_KEEP_ALIVE,
-
-                            FV_PROTO_TYPE_NONE);
+        buf = get_message_space(nw, FV_PROTO_KEEP_ALIVE_SIZE);
 
         /* This should always succeed because it'll only be attempted
          * if the write buffer is empty.
          */
-        assert(res > 0);
+        assert(buf != NULL);
+
+        add_message(nw, fv_proto_write_keep_alive(buf));
 
         return true;
 }
@@ -242,6 +271,9 @@ fill_write_buf(struct fv_network *nw)
 {
         struct fv_network_base *base = fv_network_get_base(nw);
 
+        if (!base->sent_features && !write_request_features(nw))
+                return;
+
         if (!base->sent_hello) {
                 if (base->has_player_id) {
                         if (!write_reconnect(nw))
@@ -307,17 +339,14 @@ handle_player_id(struct fv_network *nw,
                  size_t payload_length)
 {
         struct fv_network_base *base = fv_network_get_base(nw);
-        uint64_t player_id;
+        struct fv_proto_player_id message;
 
-        if (!fv_proto_read_payload(payload,
-                                   payload_length,
-                                   FV_PROTO_TYPE_UINT64, &player_id,
-                                   FV_PROTO_TYPE_NONE)) {
+        if (!fv_proto_read_player_id(payload, payload_length, &message)) {
                 set_socket_error(nw);
                 return false;
         }
 
-        base->player_id = player_id;
+        base->player_id = message.player_id;
         base->has_player_id = true;
 
         return true;
@@ -331,9 +360,7 @@ handle_consistent(struct fv_network *nw,
         struct fv_network_base *base = fv_network_get_base(nw);
         struct fv_network_consistent_event event;
 
-        if (!fv_proto_read_payload(payload,
-                                   payload_length,
-                                   FV_PROTO_TYPE_NONE)) {
+        if (!fv_proto_read_consistent(payload, payload_length)) {
                 set_socket_error(nw);
                 return false;
         }
@@ -351,22 +378,42 @@ handle_consistent(struct fv_network *nw,
         return true;
 }
 
+static bool
+handle_features(struct fv_network *nw,
+                const uint8_t *payload,
+                size_t payload_length)
+{
+        struct fv_network_base *base = fv_network_get_base(nw);
+        struct fv_proto_features message;
+
+        if (!fv_proto_read_features(payload, payload_length, &message)) {
+                set_socket_error(nw);
+                return false;
+        }
+
+        /* The server only enables features that were requested but
+         * some of them change the layout of later messages */
+        base->features = message.features;
+
+        return true;
+}
+
 static bool
 handle_n_players(struct fv_network *nw,
                  const uint8_t *payload,
                  size_t payload_length)
 {
         struct fv_network_base *base = fv_network_get_base(nw);
+        struct fv_proto_n_players message;
         uint16_t n_players;
 
-        if (!fv_proto_read_payload(payload,
-                                   payload_length,
-                                   FV_PROTO_TYPE_UINT16, &n_players,
-                                   FV_PROTO_TYPE_NONE)) {
+        if (!fv_proto_read_n_players(payload, payload_length, &message)) {
                 set_socket_error(nw);
                 return false;
         }
 
+        n_players = message.n_players;
+
         fv_buffer_set_length(&base->players,
                              sizeof (struct fv_person) * n_players);
         fv_bitmask_set_length(&base->dirty_players,
@@ -375,43 +422,79 @@ handle_n_players(struct fv_network *nw,
         return true;
 }
 
+/* The positions are given as fractions of the map size where max
+ * represents the top-right corner */
+static void
+set_player_position(struct fv_network *nw,
+                    uint16_t player_num,
+                    float x_position,
+                    float y_position,
+                    float max,
+                    uint16_t direction)
+{
+        struct fv_network_base *base = fv_network_get_base(nw);
+        struct fv_person *person;
+
+        if (player_num >= FV_NETWORK_N_PLAYERS(nw))
+                return;
+
+        person = (struct fv_person *) base->players.data + player_num;
+        person->pos.x = x_position / max * FV_MAP_WIDTH;
+        person->pos.y = y_position / max * FV_MAP_HEIGHT;
+
+        person->pos.direction = direction / (float) UINT16_MAX * 2 * M_PI;
+
+        if (person->pos.direction > M_PI)
+                person->pos.direction -= 2 * M_PI;
+
+        dirty_player_state(base, player_num, FV_PERSON_STATE_POSITION);
+}
+
 static bool
 handle_player_position(struct fv_network *nw,
                        const uint8_t *payload,
                        size_t payload_length)
 {
-        struct fv_network_base *base = fv_network_get_base(nw);
-        struct fv_person *person;
-        uint32_t x, y;
-        uint16_t direction;
-        uint16_t player_num;
+        struct fv_proto_player_position message;
 
-        if (!fv_proto_read_payload(payload,
-                                   payload_length,
-                                   FV_PROTO_TYPE_UINT16, &player_num,
-                                   FV_PROTO_TYPE_UINT32, &x,
-                                   FV_PROTO_TYPE_UINT32, &y,
-                                   FV_PROTO_TYPE_UINT16, &direction,
-                                   FV_PROTO_TYPE_NONE)) {
+        if (!fv_proto_read_player_position(payload,
+                                           payload_length,
+                                           &message)) {
                 set_socket_error(nw);
                 return false;
         }
 
-        if (player_num < FV_NETWORK_N_PLAYERS(nw)) {
-                person = (struct fv_person *) base->players.data + player_num;
-                person->pos.x = x / (float) UINT32_MAX * FV_MAP_WIDTH;
-                person->pos.y = y / (float) UINT32_MAX * FV_MAP_HEIGHT;
+        set_player_position(nw,
+                            message.player_num,
+                            message.x_position,
+                            message.y_position,
+                            UINT32_MAX,
+                            message.direction);
 
-                person->pos.direction = (direction /
-                                         (float) UINT16_MAX *
-                                         2 * M_PI);
+        return true;
+}
 
-                if (person->pos.direction > M_PI)
-                        person->pos.direction -= 2 * M_PI;
+static bool
+handle_player_position_compact(struct fv_network *nw,
+                               const uint8_t *payload,
+                               size_t payload_length)
+{
+        struct fv_proto_player_position_compact message;
 
-                dirty_player_state(base, player_num, FV_PERSON_STATE_POSITION);
+        if (!fv_proto_read_player_position_compact(payload,
+                                                   payload_length,
+                                                   &message)) {
+                set_socket_error(nw);
+                return false;
         }
 
+        set_player_position(nw,
+                            message.player_num,
+                            message.x_position,
+                            message.y_position,
+                            UINT16_MAX,
+                            message.direction);
+
         return true;
 }
 
@@ -422,21 +505,21 @@ handle_player_appearance(struct fv_network *nw,
 {
         struct fv_network_base *base = fv_network_get_base(nw);
         struct fv_person *person;
-        uint8_t type;
+        struct fv_proto_player_appearance message;
         uint16_t player_num;
 
-        if (!fv_proto_read_payload(payload,
-                                   payload_length,
-                                   FV_PROTO_TYPE_UINT16, &player_num,
-                                   FV_PROTO_TYPE_UINT8, &type,
-                                   FV_PROTO_TYPE_NONE)) {
+        if (!fv_proto_read_player_appearance(payload,
+                                             payload_length,
+                                             &message)) {
                 set_socket_error(nw);
                 return false;
         }
 
+        player_num = message.player_num;
+
         if (player_num < FV_NETWORK_N_PLAYERS(nw)) {
                 person = (struct fv_person *) base->players.data + player_num;
-                person->appearance.type = type;
+                person->appearance.type = message.image;
                 dirty_player_state(base,
                                    player_num,
                                    FV_PERSON_STATE_APPEARANCE);
@@ -478,31 +561,53 @@ handle_player_flags(struct fv_network *nw,
         return true;
 }
 
+static bool
+handle_player_speech_sequence(struct fv_network *nw,
+                              const uint8_t *payload,
+                              size_t payload_length)
+{
+        struct fv_network_base *base = fv_network_get_base(nw);
+        struct fv_proto_player_speech_sequence message;
+
+        if (!fv_proto_read_player_speech_sequence(payload,
+                                                  payload_length,
+                                                  &message)) {
+                set_socket_error(nw);
+                return false;
+        }
+
+        fv_audio_buffer_add_sequenced_packet(base->audio_buffer,
+                                             message.player_num,
+                                             message.sequence,
+                                             message.timestamp,
+                                             message.packet,
+                                             message.packet_size);
+
+        return true;
+}
+
 static bool
 handle_player_speech(struct fv_network *nw,
                      const uint8_t *payload,
                      size_t payload_length)
 {
         struct fv_network_base *base = fv_network_get_base(nw);
-        const uint8_t *packet;
-        size_t packet_size;
-        uint16_t player_num;
+        struct fv_proto_player_speech message;
 
-        if (!fv_proto_read_payload(payload,
-                                   payload_length,
-                                   FV_PROTO_TYPE_UINT16, &player_num,
-                                   FV_PROTO_TYPE_BLOB,
-                                   &packet_size,
-                                   &packet,
-                                   FV_PROTO_TYPE_NONE)) {
+        if ((base->features & FV_PROTO_FEATURE_SPEECH_SEQUENCE))
+                return handle_player_speech_sequence(nw,
+                                                     payload,
+                                                     payload_length);
+
+        if (!fv_proto_read_player_speech(payload, payload_length, &message)) {
                 set_socket_error(nw);
                 return false;
         }
 
         fv_audio_buffer_add_packet(base->audio_buffer,
-                                   player_num,
-                                   packet,
-                                   packet_size);
+                                   message.player_num,
+                                   message.packet,
+                                   message.packet_size);
 
         return true;
 }
@@ -531,6 +636,11 @@ handle_message(struct fv_network *nw,
                                               message_payload,
                                               message_payload_length);
 
+        case FV_PROTO_PLAYER_POSITION_COMPACT:
+                return handle_player_position_compact(nw,
+                                                      message_payload,
+                                                      message_payload_length);
+
         case FV_PROTO_PLAYER_APPEARANCE:
                 return handle_player_appearance(nw,
                                                 message_payload,
@@ -545,6 +655,11 @@ handle_message(struct fv_network *nw,
                 return handle_player_speech(nw,
                                             message_payload,
                                             message_payload_length);
+
+        case FV_PROTO_FEATURES:
+                return handle_features(nw,
+                                       message_payload,
+                                       message_payload_length);
         }
 
         assert(!"unknown message_id");
@@ -557,7 +672,9 @@ init_new_connection(struct fv_network *nw)
 {
         struct fv_network_base *base = fv_network_get_base(nw);
 
+        base->sent_features = false;
         base->sent_hello = false;
+        base->features = 0;
         base->dirty_player_state = FV_PERSON_STATE_ALL;
         base->last_update_time = SDL_GetTicks();
 }
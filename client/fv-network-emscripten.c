@@ -372,6 +372,28 @@ write_command(struct fv_network *nw,
         return res;
 }
 
+static uint8_t *
+get_message_space(struct fv_network *nw,
+                  size_t size)
+{
+        if (write_buffer_full(nw))
+                return NULL;
+
+        assert(size <= sizeof nw->buf);
+
+        return nw->buf;
+}
+
+static void
+add_message(struct fv_network *nw,
+            size_t length)
+{
+        /* The browser adds its own frame header */
+        send_buf(nw,
+                 nw->buf + FV_PROTO_SHORT_FRAME_HEADER_LENGTH,
+                 length - FV_PROTO_SHORT_FRAME_HEADER_LENGTH);
+}
+
 static bool
 write_speech(struct fv_network *nw)
 {
@@ -403,6 +425,14 @@ write_buf_is_empty(struct fv_network *nw)
         return buffered_amount == 0;
 }
 
+/* The buffer that the messages are copied into is only big enough for
+ * a single message so this doesn't ask for bundles */
+static uint32_t
+get_requested_features(struct fv_network *nw)
+{
+        return FV_PROTO_FEATURE_COMPACT_POSITIONS;
+}
+
 void EMSCRIPTEN_KEEPALIVE
 fv_network_write_timeout_cb(struct fv_network *nw)
 {
@@ -104,6 +104,9 @@ struct fv_network {
          */
         uint8_t ws_terminator_pos;
 
+        _Static_assert(FV_PROTO_EXTENDED_FRAME_HEADER_LENGTH +
+                       FV_PROTO_MAX_BUNDLE_SIZE <= 1024,
+                       "A bundle might not fit in the read buffer");
         uint8_t read_buf[1024];
         size_t read_buf_pos;
 
@@ -373,12 +376,37 @@ write_command(struct fv_network *nw,
         return res;
 }
 
+static uint8_t *
+get_message_space(struct fv_network *nw,
+                  size_t size)
+{
+        if (nw->write_buf_pos + size > sizeof nw->write_buf)
+                return NULL;
+
+        return nw->write_buf + nw->write_buf_pos;
+}
+
+static void
+add_message(struct fv_network *nw,
+            size_t length)
+{
+        nw->write_buf_pos += length;
+}
+
 static bool
 write_buf_is_empty(struct fv_network *nw)
 {
         return nw->write_buf_pos == 0;
 }
 
+static uint32_t
+get_requested_features(struct fv_network *nw)
+{
+        return (FV_PROTO_FEATURE_BUNDLE |
+                FV_PROTO_FEATURE_COMPACT_POSITIONS |
+                FV_PROTO_FEATURE_SPEECH_SEQUENCE);
+}
+
 static bool
 write_speech(struct fv_network *nw)
 {
@@ -434,10 +462,43 @@ handle_write(struct fv_network *nw)
         return true;
 }
 
+static bool
+handle_bundle(struct fv_network *nw,
+              const uint8_t *payload,
+              size_t payload_length)
+{
+        size_t message_length;
+
+        /* Each message in the bundle is preceded by a byte for its
+         * length */
+        while (payload_length > 0) {
+                message_length = payload[0];
+
+                if (message_length < FV_PROTO_HEADER_SIZE ||
+                    message_length >= payload_length ||
+                    payload[1] == FV_PROTO_BUNDLE) {
+                        set_socket_error(nw);
+                        return false;
+                }
+
+                if (!handle_message(nw,
+                                    payload[1],
+                                    payload + 1 + FV_PROTO_HEADER_SIZE,
+                                    message_length - FV_PROTO_HEADER_SIZE))
+                        return false;
+
+                payload += message_length + 1;
+                payload_length -= message_length + 1;
+        }
+
+        return true;
+}
+
 static bool
 handle_server_data(struct fv_network *nw)
 {
         size_t frame_payload_length, message_payload_length;
+        size_t frame_header_length;
         const uint8_t *frame, *message_payload;
         size_t pos = 0;
         int got;
@@ -482,30 +543,53 @@ found_terminator:
 
         while (pos + FV_PROTO_HEADER_SIZE + 2 <= nw->read_buf_pos) {
                 /* This assumes none of the messages will be
-                 * fragmented, the length is only in one byte and there
-                 * is no masking. We are talking directly to the
-                 * server without going through a browser so there
-                 * should be no reason for anything to end up using
-                 * the more complicated WebSocket protocol features.
+                 * fragmented, the length fits in 16 bits and there is
+                 * no masking. We are talking directly to the server
+                 * without going through a browser so there should be
+                 * no reason for anything to end up using the more
+                 * complicated WebSocket protocol features. The
+                 * extended length is only used for bundles and for
+                 * the largest speech packets once the sequence
+                 * numbers are added.
                  */
                 frame = nw->read_buf + pos;
                 frame_payload_length = frame[1];
+                frame_header_length = FV_PROTO_SHORT_FRAME_HEADER_LENGTH;
+
+                if (frame_payload_length == 126) {
+                        if (pos + FV_PROTO_EXTENDED_FRAME_HEADER_LENGTH >
+                            nw->read_buf_pos)
+                                break;
+
+                        frame_payload_length = (frame[2] << 8) | frame[3];
+                        frame_header_length =
+                                FV_PROTO_EXTENDED_FRAME_HEADER_LENGTH;
+                }
 
                 /* If we haven't got a complete message then stop processing */
-                if (pos + frame_payload_length + 2 > nw->read_buf_pos)
+                if (pos + frame_payload_length + frame_header_length >
+                    nw->read_buf_pos)
                         break;
 
-                message_payload = frame + 2 + FV_PROTO_HEADER_SIZE;
+                message_payload = (frame +
+                                   frame_header_length +
+                                   FV_PROTO_HEADER_SIZE);
                 message_payload_length = (frame_payload_length -
                                           FV_PROTO_HEADER_SIZE);
 
-                if (!handle_message(nw,
-                                    frame[2],
-                                    message_payload,
-                                    message_payload_length))
+                if (frame[frame_header_length] == FV_PROTO_BUNDLE) {
+                        if (!handle_bundle(nw,
+                                           message_payload,
+                                           message_payload_length))
+                                return false;
+                } else if (!handle_message(nw,
+                                           frame[frame_header_length],
+                                           message_payload,
+                                           message_payload_length)) {
                         return false;
+                }
 
-                pos += frame_payload_length + 2;
+                pos += frame_payload_length + frame_header_length;
         }
 
         /* Move any remaining partial message to the beginning of the buffer */
@@ -0,0 +1,155 @@
+/*
+ * Babiling
+ * Copyright (C) 2026  Neil Roberts
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+
+/* This header is the schema of the messages that have a fixed layout.
+ * It is included multiple times by fv-proto.h with different
+ * definitions of the macros to generate a struct, the size constants
+ * and an encode and decode function for each message. A message is
+ * described like this:
+ *
+ * FV_PROTO_MESSAGE_BEGIN(name - used for the struct and functions,
+ *                        NAME - used for the size constants,
+ *                        id - the message ID)
+ * FV_PROTO_FIELD(type_name - one of the C types in fv-proto-types.h,
+ *                field_name)
+ * ...
+ * FV_PROTO_BLOB(field_name) - optional, the rest of the payload
+ * FV_PROTO_MESSAGE_END(name, NAME)
+ *
+ * Messages without a payload are described with
+ * FV_PROTO_EMPTY_MESSAGE(name, NAME, id).
+ */
+
+/* Messages to the server */
+
+FV_PROTO_EMPTY_MESSAGE(new_player, NEW_PLAYER, FV_PROTO_NEW_PLAYER)
+
+FV_PROTO_MESSAGE_BEGIN(reconnect, RECONNECT, FV_PROTO_RECONNECT)
+FV_PROTO_FIELD(uint64_t, player_id)
+FV_PROTO_MESSAGE_END(reconnect, RECONNECT)
+
+FV_PROTO_MESSAGE_BEGIN(update_position,
+                       UPDATE_POSITION,
+                       FV_PROTO_UPDATE_POSITION)
+FV_PROTO_FIELD(uint32_t, x_position)
+FV_PROTO_FIELD(uint32_t, y_position)
+FV_PROTO_FIELD(uint16_t, direction)
+FV_PROTO_MESSAGE_END(update_position, UPDATE_POSITION)
+
+FV_PROTO_EMPTY_MESSAGE(keep_alive, KEEP_ALIVE, FV_PROTO_KEEP_ALIVE)
+
+FV_PROTO_MESSAGE_BEGIN(speech, SPEECH, FV_PROTO_SPEECH)
+FV_PROTO_BLOB(packet)
+FV_PROTO_MESSAGE_END(speech, SPEECH)
+
+FV_PROTO_MESSAGE_BEGIN(update_appearance,
+                       UPDATE_APPEARANCE,
+                       FV_PROTO_UPDATE_APPEARANCE)
+FV_PROTO_FIELD(uint8_t, image)
+FV_PROTO_MESSAGE_END(update_appearance, UPDATE_APPEARANCE)
+
+FV_PROTO_MESSAGE_BEGIN(request_features,
+                       REQUEST_FEATURES,
+                       FV_PROTO_REQUEST_FEATURES)
+FV_PROTO_FIELD(uint32_t, features)
+FV_PROTO_MESSAGE_END(request_features, REQUEST_FEATURES)
+
+/* Messages to the client */
+
+FV_PROTO_MESSAGE_BEGIN(player_id, PLAYER_ID, FV_PROTO_PLAYER_ID)
+FV_PROTO_FIELD(uint64_t, player_id)
+FV_PROTO_MESSAGE_END(player_id, PLAYER_ID)
+
+FV_PROTO_EMPTY_MESSAGE(consistent, CONSISTENT, FV_PROTO_CONSISTENT)
+
+FV_PROTO_MESSAGE_BEGIN(n_players, N_PLAYERS, FV_PROTO_N_PLAYERS)
+FV_PROTO_FIELD(uint16_t, n_players)
+FV_PROTO_MESSAGE_END(n_players, N_PLAYERS)
+
+FV_PROTO_MESSAGE_BEGIN(player_position,
+                       PLAYER_POSITION,
+                       FV_PROTO_PLAYER_POSITION)
+FV_PROTO_FIELD(uint16_t, player_num)
+FV_PROTO_FIELD(uint32_t, x_position)
+FV_PROTO_FIELD(uint32_t, y_position)
+FV_PROTO_FIELD(uint16_t, direction)
+FV_PROTO_MESSAGE_END(player_position, PLAYER_POSITION)
+
+FV_PROTO_MESSAGE_BEGIN(player_position_compact,
+                       PLAYER_POSITION_COMPACT,
+                       FV_PROTO_PLAYER_POSITION_COMPACT)
+FV_PROTO_FIELD(uint16_t, player_num)
+FV_PROTO_FIELD(uint16_t, x_position)
+FV_PROTO_FIELD(uint16_t, y_position)
+FV_PROTO_FIELD(uint16_t, direction)
+FV_PROTO_MESSAGE_END(player_position_compact, PLAYER_POSITION_COMPACT)
+
+FV_PROTO_MESSAGE_BEGIN(player_speech, PLAYER_SPEECH, FV_PROTO_PLAYER_SPEECH)
+FV_PROTO_FIELD(uint16_t, player_num)
+FV_PROTO_BLOB(packet)
+FV_PROTO_MESSAGE_END(player_speech, PLAYER_SPEECH)
+
+/* PLAYER_SPEECH when the speech sequence numbers feature is enabled */
+FV_PROTO_MESSAGE_BEGIN(player_speech_sequence,
+                       PLAYER_SPEECH_SEQUENCE,
+                       FV_PROTO_PLAYER_SPEECH)
+FV_PROTO_FIELD(uint16_t, player_num)
+FV_PROTO_FIELD(uint16_t, sequence)
+FV_PROTO_FIELD(uint32_t, timestamp)
+FV_PROTO_BLOB(packet)
+FV_PROTO_MESSAGE_END(player_speech_sequence, PLAYER_SPEECH_SEQUENCE)
+
+FV_PROTO_MESSAGE_BEGIN(player_appearance,
+                       PLAYER_APPEARANCE,
+                       FV_PROTO_PLAYER_APPEARANCE)
+FV_PROTO_FIELD(uint16_t, player_num)
+FV_PROTO_FIELD(uint8_t, image)
+FV_PROTO_MESSAGE_END(player_appearance, PLAYER_APPEARANCE)
+
+FV_PROTO_MESSAGE_BEGIN(features, FEATURES, FV_PROTO_FEATURES)
+FV_PROTO_FIELD(uint32_t, features)
+FV_PROTO_MESSAGE_END(features, FEATURES)
+
+FV_PROTO_MESSAGE_BEGIN(player_num, PLAYER_NUM, FV_PROTO_PLAYER_NUM)
+FV_PROTO_FIELD(uint16_t, player_num)
+FV_PROTO_MESSAGE_END(player_num, PLAYER_NUM)
+
+FV_PROTO_MESSAGE_BEGIN(player_removed,
+                       PLAYER_REMOVED,
+                       FV_PROTO_PLAYER_REMOVED)
+FV_PROTO_FIELD(uint16_t, player_num)
+FV_PROTO_MESSAGE_END(player_removed, PLAYER_REMOVED)
+
+FV_PROTO_MESSAGE_BEGIN(mixed_speech, MIXED_SPEECH, FV_PROTO_MIXED_SPEECH)
+FV_PROTO_BLOB(packet)
+FV_PROTO_MESSAGE_END(mixed_speech, MIXED_SPEECH)
+
+/* MIXED_SPEECH when the speech sequence numbers feature is enabled */
+FV_PROTO_MESSAGE_BEGIN(mixed_speech_sequence,
+                       MIXED_SPEECH_SEQUENCE,
+                       FV_PROTO_MIXED_SPEECH)
+FV_PROTO_FIELD(uint16_t, sequence)
+FV_PROTO_FIELD(uint32_t, timestamp)
+FV_PROTO_BLOB(packet)
+FV_PROTO_MESSAGE_END(mixed_speech_sequence, MIXED_SPEECH_SEQUENCE)
@@ -98,6 +98,7 @@ fv_proto_write_command_v(uint8_t *buffer,
         int pos;
         size_t payload_length = 0;
         size_t frame_header_length;
+        uint64_t payload_length_be;
         size_t blob_length;
         const uint8_t *blob_data;
         va_list ap_copy;
@@ -119,12 +120,15 @@ fv_proto_write_command_v(uint8_t *buffer,
 
         /* opcode (2) (binary) with FIN bit set */
         buffer[0] = 0x82;
+        /* Unlike the messages, the extended lengths are big-endian */
         if (payload_length > 0xffff) {
                 buffer[1] = 127;
-                fv_proto_write_uint64_t(buffer + 2, payload_length);
+                payload_length_be = FV_UINT64_TO_BE(payload_length);
+                memcpy(buffer + 2, &payload_length_be, sizeof (uint64_t));
         } else if (payload_length >= 126) {
                 buffer[1] = 126;
-                fv_proto_write_uint16_t(buffer + 2, payload_length);
+                buffer[2] = payload_length >> 8;
+                buffer[3] = payload_length;
         } else {
                 buffer[1] = payload_length;
         }
@@ -39,8 +39,11 @@
 
 /* Maximum number of bytes allowed in an Opus packet. Considering that
  * each packet is 10ms, this allows 11.9kb/sec. 122 is chosen so that
- * the maximum frame payload size won't overflow 125 bytes. That way
- * the length can always be stored in a byte.
+ * a plain speech message with the largest packet still fits in a
+ * frame payload of 125 bytes, whose length is stored in a byte. A
+ * player speech message with the sequence fields is bigger than that
+ * and needs the 16-bit extended length. See
+ * FV_PROTO_EXTENDED_FRAME_HEADER_LENGTH.
  */
 #define FV_PROTO_MAX_SPEECH_SIZE 122
 
@@ -66,6 +69,7 @@
 #define FV_PROTO_SPEECH 0x84
 #define FV_PROTO_UPDATE_APPEARANCE 0x85
 #define FV_PROTO_UPDATE_FLAGS 0x86
+#define FV_PROTO_REQUEST_FEATURES 0x87
 
 #define FV_PROTO_PLAYER_ID 0x00
 #define FV_PROTO_CONSISTENT 0x01
@@ -74,9 +78,42 @@
 #define FV_PROTO_PLAYER_SPEECH 0x04
 #define FV_PROTO_PLAYER_APPEARANCE 0x05
 #define FV_PROTO_PLAYER_FLAGS 0x06
+#define FV_PROTO_FEATURES 0x07
+#define FV_PROTO_PLAYER_NUM 0x08
+#define FV_PROTO_PLAYER_REMOVED 0x09
+#define FV_PROTO_MIXED_SPEECH 0x0a
+#define FV_PROTO_BUNDLE 0x0b
+#define FV_PROTO_PLAYER_POSITION_COMPACT 0x0c
+
+/* Optional protocol features that can be negotiated with the
+ * REQUEST_FEATURES message.
+ */
+#define FV_PROTO_FEATURE_STABLE_PLAYER_NUMS (1 << 0)
+#define FV_PROTO_FEATURE_MIXED_SPEECH (1 << 1)
+#define FV_PROTO_FEATURE_SPEECH_SEQUENCE (1 << 2)
+#define FV_PROTO_FEATURE_BUNDLE (1 << 3)
+#define FV_PROTO_FEATURE_COMPACT_POSITIONS (1 << 4)
+
+/* Maximum size of the payload of a BUNDLE frame including the message
+ * ID. This keeps the frame small enough to fit in the read buffer of
+ * the native client.
+ */
+#define FV_PROTO_MAX_BUNDLE_SIZE 512
 
 #define FV_PROTO_MAX_FRAME_HEADER_LENGTH (1 + 1 + 8 + 4)
 
+/* Length of the header of an unmasked WebSocket frame with a payload
+ * of less than 126 bytes. Most of the messages are small enough for
+ * this.
+ */
+#define FV_PROTO_SHORT_FRAME_HEADER_LENGTH 2
+
+/* Length of the header of an unmasked WebSocket frame with a 16-bit
+ * extended payload length. A speech message with the sequence fields
+ * and a large packet needs this.
+ */
+#define FV_PROTO_EXTENDED_FRAME_HEADER_LENGTH 4
+
 enum fv_proto_type {
         FV_PROTO_TYPE_UINT8,
         FV_PROTO_TYPE_UINT16,
@@ -165,4 +202,207 @@ fv_proto_read_payload(const uint8_t *buffer,
                       size_t length,
                       ...);
 
+/* Generate a struct for each message in the schema */
+
+#define FV_PROTO_MESSAGE_BEGIN(name, NAME, id)  \
+        struct fv_proto_ ## name {
+#define FV_PROTO_FIELD(type_name, field_name)   \
+        type_name field_name;
+#define FV_PROTO_BLOB(field_name)               \
+        const uint8_t *field_name;              \
+        size_t field_name ## _size;
+#define FV_PROTO_MESSAGE_END(name, NAME)        \
+        };
+#define FV_PROTO_EMPTY_MESSAGE(name, NAME, id)
+
+#include "fv-proto-messages.h"
+
+#undef FV_PROTO_MESSAGE_BEGIN
+#undef FV_PROTO_FIELD
+#undef FV_PROTO_BLOB
+#undef FV_PROTO_MESSAGE_END
+#undef FV_PROTO_EMPTY_MESSAGE
+
+/* FV_PROTO_<NAME>_PAYLOAD_SIZE is the size of the fields after the
+ * message ID and FV_PROTO_<NAME>_SIZE is the size of the whole frame.
+ * Neither of them includes the blob if the message has one. Use
+ * FV_PROTO_BLOB_MESSAGE_SIZE to get the space needed to write a
+ * message with a blob.
+ */
+
+#define FV_PROTO_MESSAGE_BEGIN(name, NAME, id)                          \
+        enum {                                                          \
+                FV_PROTO_ ## NAME ## _PAYLOAD_SIZE = 0
+#define FV_PROTO_FIELD(type_name, field_name)                           \
+                + sizeof (type_name)
+#define FV_PROTO_BLOB(field_name)
+#define FV_PROTO_MESSAGE_END(name, NAME)                                \
+                ,                                                       \
+                FV_PROTO_ ## NAME ## _SIZE =                            \
+                (FV_PROTO_SHORT_FRAME_HEADER_LENGTH +                   \
+                 FV_PROTO_HEADER_SIZE +                                 \
+                 FV_PROTO_ ## NAME ## _PAYLOAD_SIZE)                    \
+        };
+#define FV_PROTO_EMPTY_MESSAGE(name, NAME, id)                          \
+        FV_PROTO_MESSAGE_BEGIN(name, NAME, id)                          \
+        FV_PROTO_MESSAGE_END(name, NAME)
+
+#include "fv-proto-messages.h"
+
+#undef FV_PROTO_MESSAGE_BEGIN
+#undef FV_PROTO_FIELD
+#undef FV_PROTO_BLOB
+#undef FV_PROTO_MESSAGE_END
+#undef FV_PROTO_EMPTY_MESSAGE
+
+/* The payload of a message with a blob might be too long for the
+ * short frame header so this leaves space for the extended one.
+ */
+#define FV_PROTO_BLOB_MESSAGE_SIZE(NAME, blob_size)                     \
+        (FV_PROTO_ ## NAME ## _SIZE +                                   \
+         (blob_size) +                                                  \
+         FV_PROTO_EXTENDED_FRAME_HEADER_LENGTH -                        \
+         FV_PROTO_SHORT_FRAME_HEADER_LENGTH)
+
+static inline size_t
+fv_proto_get_frame_header_length(size_t payload_length)
+{
+        if (payload_length < 126)
+                return FV_PROTO_SHORT_FRAME_HEADER_LENGTH;
+        else
+                return FV_PROTO_EXTENDED_FRAME_HEADER_LENGTH;
+}
+
+/* Writes the header for a binary frame. The payload must be shorter
+ * than 65536 bytes. Returns the length of the header.
+ */
+static inline size_t
+fv_proto_write_frame_header(uint8_t *buffer,
+                            size_t payload_length)
+{
+        /* opcode (2) (binary) with FIN bit set */
+        buffer[0] = 0x82;
+
+        if (payload_length < 126) {
+                buffer[1] = payload_length;
+                return FV_PROTO_SHORT_FRAME_HEADER_LENGTH;
+        }
+
+        /* Unlike the messages, the extended length is big-endian */
+        buffer[1] = 126;
+        buffer[2] = payload_length >> 8;
+        buffer[3] = payload_length;
+
+        return FV_PROTO_EXTENDED_FRAME_HEADER_LENGTH;
+}
+
+/* Adds the frame header to a message that was written after space
+ * for the short header and returns the size of the frame. If the
+ * payload is too long then it is moved along to make space for the
+ * extended header. The compiler can remove the check for the
+ * messages that don't have a blob.
+ */
+static inline size_t
+fv_proto_finish_frame(uint8_t *buffer,
+                      size_t payload_length)
+{
+        if (payload_length >= 126) {
+                memmove(buffer + FV_PROTO_EXTENDED_FRAME_HEADER_LENGTH,
+                        buffer + FV_PROTO_SHORT_FRAME_HEADER_LENGTH,
+                        payload_length);
+        }
+
+        return (fv_proto_write_frame_header(buffer, payload_length) +
+                payload_length);
+}
+
+/* Generate the fv_proto_write_<name> functions. These write the
+ * message including the frame header and return the number of bytes
+ * written. The buffer must have space for FV_PROTO_<NAME>_SIZE bytes,
+ * or FV_PROTO_BLOB_MESSAGE_SIZE if the message has a blob. Unlike
+ * fv_proto_write_command, the layout is known at compile time so the
+ * compiler can reduce them to a few stores.
+ */
+
+#define FV_PROTO_MESSAGE_BEGIN(name, NAME, id)                          \
+        static inline size_t                                            \
+        fv_proto_write_ ## name(uint8_t *buffer,                        \
+                                const struct fv_proto_ ## name *message) \
+        {                                                               \
+                uint8_t *p = buffer + FV_PROTO_SHORT_FRAME_HEADER_LENGTH; \
+                                                                        \
+                *(p++) = (id);
+#define FV_PROTO_FIELD(type_name, field_name)                           \
+                fv_proto_write_ ## type_name(p, message->field_name);   \
+                p += sizeof (type_name);
+#define FV_PROTO_BLOB(field_name)                                       \
+                memcpy(p,                                               \
+                       message->field_name,                             \
+                       message->field_name ## _size);                   \
+                p += message->field_name ## _size;
+#define FV_PROTO_MESSAGE_END(name, NAME)                                \
+                return fv_proto_finish_frame(                           \
+                        buffer,                                         \
+                        p - buffer - FV_PROTO_SHORT_FRAME_HEADER_LENGTH); \
+        }
+#define FV_PROTO_EMPTY_MESSAGE(name, NAME, id)                          \
+        static inline size_t                                            \
+        fv_proto_write_ ## name(uint8_t *buffer)                        \
+        {                                                               \
+                buffer[0] = 0x82;                                       \
+                buffer[1] = FV_PROTO_HEADER_SIZE;                       \
+                buffer[2] = (id);                                       \
+                                                                        \
+                return FV_PROTO_ ## NAME ## _SIZE;                      \
+        }
+
+#include "fv-proto-messages.h"
+
+#undef FV_PROTO_MESSAGE_BEGIN
+#undef FV_PROTO_FIELD
+#undef FV_PROTO_BLOB
+#undef FV_PROTO_MESSAGE_END
+#undef FV_PROTO_EMPTY_MESSAGE
+
+/* Generate the fv_proto_read_<name> functions. These take the payload
+ * after the message ID like fv_proto_read_payload and return false if
+ * it isn't the right size. A blob points into the buffer.
+ */
+
+#define FV_PROTO_MESSAGE_BEGIN(name, NAME, id)                          \
+        static inline bool                                              \
+        fv_proto_read_ ## name(const uint8_t *buffer,                   \
+                               size_t length,                           \
+                               struct fv_proto_ ## name *message)       \
+        {                                                               \
+                const uint8_t *end = buffer + length;                   \
+                                                                        \
+                if (length < FV_PROTO_ ## NAME ## _PAYLOAD_SIZE)        \
+                        return false;
+#define FV_PROTO_FIELD(type_name, field_name)                           \
+                message->field_name = fv_proto_read_ ## type_name(buffer); \
+                buffer += sizeof (type_name);
+#define FV_PROTO_BLOB(field_name)                                       \
+                message->field_name = buffer;                           \
+                message->field_name ## _size = end - buffer;            \
+                buffer = end;
+#define FV_PROTO_MESSAGE_END(name, NAME)                                \
+                return buffer == end;                                   \
+        }
+#define FV_PROTO_EMPTY_MESSAGE(name, NAME, id)                          \
+        static inline bool                                              \
+        fv_proto_read_ ## name(const uint8_t *buffer,                   \
+                               size_t length)                           \
+        {                                                               \
+                return length == 0;                                     \
+        }
+
+#include "fv-proto-messages.h"
+
+#undef FV_PROTO_MESSAGE_BEGIN
+#undef FV_PROTO_FIELD
+#undef FV_PROTO_BLOB
+#undef FV_PROTO_MESSAGE_END
+#undef FV_PROTO_EMPTY_MESSAGE
+
 #endif /* FV_PROTO_H */
@@ -0,0 +1,146 @@
+/*
+ * Babiling
+ * Copyright (C) 2026  Neil Roberts
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+
+/* Checks that the largest speech packet survives a round trip
+ * through the PLAYER_SPEECH message when the sequence numbers push
+ * it past the short WebSocket frame header.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "fv-proto.h"
+
+#define TEST_PLAYER_NUM 0x1234
+#define TEST_SEQUENCE 0xfffe
+#define TEST_TIMESTAMP 0x89abcdef
+
+static bool
+check_frame(const uint8_t *buf,
+            size_t length,
+            const uint8_t *packet,
+            size_t packet_size)
+{
+        struct fv_proto_player_speech_sequence message;
+        size_t payload_length;
+
+        payload_length = (FV_PROTO_HEADER_SIZE +
+                          FV_PROTO_PLAYER_SPEECH_SEQUENCE_PAYLOAD_SIZE +
+                          packet_size);
+
+        if (length != FV_PROTO_EXTENDED_FRAME_HEADER_LENGTH + payload_length) {
+                fprintf(stderr, "Unexpected frame length %zu\n", length);
+                return false;
+        }
+
+        if (buf[0] != 0x82 ||
+            buf[1] != 126 ||
+            buf[2] != payload_length >> 8 ||
+            buf[3] != (payload_length & 0xff) ||
+            buf[4] != FV_PROTO_PLAYER_SPEECH) {
+                fprintf(stderr, "Invalid frame header\n");
+                return false;
+        }
+
+        if (!fv_proto_read_player_speech_sequence(
+                    buf + FV_PROTO_EXTENDED_FRAME_HEADER_LENGTH +
+                    FV_PROTO_HEADER_SIZE,
+                    payload_length - FV_PROTO_HEADER_SIZE,
+                    &message)) {
+                fprintf(stderr, "Failed to read speech message\n");
+                return false;
+        }
+
+        if (message.player_num != TEST_PLAYER_NUM ||
+            message.sequence != TEST_SEQUENCE ||
+            message.timestamp != TEST_TIMESTAMP) {
+                fprintf(stderr, "Speech fields don't match\n");
+                return false;
+        }
+
+        if (message.packet_size != packet_size ||
+            memcmp(message.packet, packet, packet_size)) {
+                fprintf(stderr, "Speech packet doesn't match\n");
+                return false;
+        }
+
+        return true;
+}
+
+int
+main(int argc, char **argv)
+{
+        uint8_t packet[FV_PROTO_MAX_SPEECH_SIZE];
+        uint8_t buf[FV_PROTO_BLOB_MESSAGE_SIZE(PLAYER_SPEECH_SEQUENCE,
+                                               sizeof packet)];
+        struct fv_proto_player_speech_sequence message = {
+                .player_num = TEST_PLAYER_NUM,
+                .sequence = TEST_SEQUENCE,
+                .timestamp = TEST_TIMESTAMP,
+                .packet = packet,
+                .packet_size = sizeof packet
+        };
+        size_t length;
+        int i;
+
+        for (i = 0; i < sizeof packet; i++)
+                packet[i] = i * 7 + 3;
+
+        length = fv_proto_write_player_speech_sequence(buf, &message);
+
+        if (!check_frame(buf, length, packet, sizeof packet))
+                return EXIT_FAILURE;
+
+        /* The generic writer should build the same frame */
+        memset(buf, 0, sizeof buf);
+
+        length = fv_proto_write_command(buf,
+                                        sizeof buf,
+                                        FV_PROTO_PLAYER_SPEECH,
+
+                                        FV_PROTO_TYPE_UINT16,
+                                        (uint16_t) TEST_PLAYER_NUM,
+
+                                        FV_PROTO_TYPE_UINT16,
+                                        (uint16_t) TEST_SEQUENCE,
+
+                                        FV_PROTO_TYPE_UINT32,
+                                        (uint32_t) TEST_TIMESTAMP,
+
+                                        FV_PROTO_TYPE_BLOB,
+                                        sizeof packet,
+                                        packet,
+
+                                        FV_PROTO_TYPE_NONE);
+
+        if (!check_frame(buf, length, packet, sizeof packet))
+                return EXIT_FAILURE;
+
+        return EXIT_SUCCESS;
+}
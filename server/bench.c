@@ -0,0 +1,1239 @@
+/*
+ * Babiling
+ * Copyright (C) 2026  Neil Roberts
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "fv-proto.h"
+#include "fv-connection.h"
+#include "fv-main-context.h"
+#include "fv-playerbase.h"
+#include "fv-ws-parser.h"
+#include "fv-base64.h"
+#include "fv-socket.h"
+#include "fv-util.h"
+#include "sha1.h"
+
+#ifdef HAVE_IO_URING
+#include "fv-uring.h"
+#endif
+
+/* Each benchmark repeats its operation with a doubling number of
+ * iterations until one run takes at least this long */
+#define FV_BENCH_DEFAULT_MIN_TIME 200 /* ms */
+
+/* Number of frames that the process_frames benchmark writes to the
+ * connection at a time */
+#define FV_BENCH_FRAME_BATCH 1024
+
+/* The poll benchmark has this many sockets of which only a few are
+ * woken up in each iteration, like a server with lots of idle
+ * connections */
+#define FV_BENCH_N_POLL_SOURCES 1000
+#define FV_BENCH_N_ACTIVE_POLL_SOURCES 50
+
+/* Number of players in the playerbase for the lookup benchmarks */
+#define FV_BENCH_N_PLAYERS 10000
+
+struct fv_bench {
+        const char *name;
+        /* Returns the data passed to the other functions or NULL if
+         * the benchmark can't be run */
+        void *(* setup)(void);
+        void (* run)(void *data, uint64_t n_ops);
+        void (* teardown)(void *data);
+};
+
+/* The allocation functions are wrapped with the linker so that each
+ * benchmark can report how many allocations it does */
+static uint64_t n_allocations;
+
+void *
+__real_malloc(size_t size);
+void *
+__real_calloc(size_t nmemb, size_t size);
+void *
+__real_realloc(void *ptr, size_t size);
+
+void *
+__wrap_malloc(size_t size);
+void *
+__wrap_calloc(size_t nmemb, size_t size);
+void *
+__wrap_realloc(void *ptr, size_t size);
+
+void *
+__wrap_malloc(size_t size)
+{
+        n_allocations++;
+        return __real_malloc(size);
+}
+
+void *
+__wrap_calloc(size_t nmemb, size_t size)
+{
+        n_allocations++;
+        return __real_calloc(nmemb, size);
+}
+
+void *
+__wrap_realloc(void *ptr, size_t size)
+{
+        n_allocations++;
+        return __real_realloc(ptr, size);
+}
+
+/* The system calls that the main context uses to poll are also
+ * wrapped so that the poll benchmarks can show how many each backend
+ * needs */
+static uint64_t n_poll_syscalls;
+
+int
+__real_epoll_wait(int epfd,
+                  struct epoll_event *events,
+                  int maxevents,
+                  int timeout);
+int
+__real_epoll_ctl(int epfd,
+                 int op,
+                 int fd,
+                 struct epoll_event *event);
+
+int
+__wrap_epoll_wait(int epfd,
+                  struct epoll_event *events,
+                  int maxevents,
+                  int timeout);
+int
+__wrap_epoll_ctl(int epfd,
+                 int op,
+                 int fd,
+                 struct epoll_event *event);
+
+int
+__wrap_epoll_wait(int epfd,
+                  struct epoll_event *events,
+                  int maxevents,
+                  int timeout)
+{
+        n_poll_syscalls++;
+        return __real_epoll_wait(epfd, events, maxevents, timeout);
+}
+
+int
+__wrap_epoll_ctl(int epfd,
+                 int op,
+                 int fd,
+                 struct epoll_event *event)
+{
+        n_poll_syscalls++;
+        return __real_epoll_ctl(epfd, op, fd, event);
+}
+
+#ifdef HAVE_IO_URING
+
+/* If this is true then fv_uring_init fails so that the main context
+ * falls back to epoll even though io_uring is available */
+static bool force_epoll;
+
+long
+__real_syscall(long number, ...);
+bool
+__real_fv_uring_init(struct fv_uring *uring,
+                     unsigned entries,
+                     struct fv_error **error);
+
+long
+__wrap_syscall(long number, ...);
+bool
+__wrap_fv_uring_init(struct fv_uring *uring,
+                     unsigned entries,
+                     struct fv_error **error);
+
+long
+__wrap_syscall(long number, ...)
+{
+        long args[6];
+        va_list ap;
+        int i;
+
+        va_start(ap, number);
+        for (i = 0; i < FV_N_ELEMENTS(args); i++)
+                args[i] = va_arg(ap, long);
+        va_end(ap);
+
+        if (number == __NR_io_uring_enter)
+                n_poll_syscalls++;
+
+        return __real_syscall(number,
+                              args[0], args[1], args[2],
+                              args[3], args[4], args[5]);
+}
+
+bool
+__wrap_fv_uring_init(struct fv_uring *uring,
+                     unsigned entries,
+                     struct fv_error **error)
+{
+        if (force_epoll)
+                return false;
+
+        return __real_fv_uring_init(uring, entries, error);
+}
+
+#endif /* HAVE_IO_URING */
+
+/* Results are added to this so that the compiler can't remove the
+ * work */
+static volatile uint32_t sink;
+
+static int option_min_time = FV_BENCH_DEFAULT_MIN_TIME;
+
+static const uint8_t
+speech_packet[FV_PROTO_MAX_SPEECH_SIZE] = { 0x08, 0x42, 0x13 };
+
+static const char
+ws_request[] =
+        "GET /babiling HTTP/1.1\r\n"
+        "Host: example.com\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+        "Origin: http://example.com\r\n"
+        "Sec-WebSocket-Version: 13\r\n"
+        "\r\n";
+
+static uint64_t
+get_time(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec * UINT64_C(1000000000) + ts.tv_nsec;
+}
+
+static void
+run_write_command_position(void *data,
+                           uint64_t n_ops)
+{
+        uint8_t buf[FV_PROTO_MAX_FRAME_HEADER_LENGTH +
+                    FV_PROTO_MAX_MESSAGE_SIZE];
+        uint64_t i;
+
+        for (i = 0; i < n_ops; i++) {
+                sink += fv_proto_write_command(buf,
+                                               sizeof buf,
+                                               FV_PROTO_PLAYER_POSITION,
+
+                                               FV_PROTO_TYPE_UINT16,
+                                               (uint16_t) i,
+
+                                               FV_PROTO_TYPE_UINT32,
+                                               (uint32_t) i,
+
+                                               FV_PROTO_TYPE_UINT32,
+                                               UINT32_C(0x12345678),
+
+                                               FV_PROTO_TYPE_UINT16,
+                                               (uint16_t) 0x4000,
+
+                                               FV_PROTO_TYPE_NONE);
+        }
+}
+
+static void
+run_write_command_speech(void *data,
+                         uint64_t n_ops)
+{
+        uint8_t buf[FV_PROTO_MAX_FRAME_HEADER_LENGTH +
+                    FV_PROTO_MAX_MESSAGE_SIZE];
+        uint64_t i;
+
+        for (i = 0; i < n_ops; i++) {
+                sink += fv_proto_write_command(buf,
+                                               sizeof buf,
+                                               FV_PROTO_PLAYER_SPEECH,
+
+                                               FV_PROTO_TYPE_UINT16,
+                                               (uint16_t) i,
+
+                                               FV_PROTO_TYPE_UINT16,
+                                               (uint16_t) i,
+
+                                               FV_PROTO_TYPE_UINT32,
+                                               (uint32_t) i,
+
+                                               FV_PROTO_TYPE_BLOB,
+                                               sizeof speech_packet,
+                                               speech_packet,
+
+                                               FV_PROTO_TYPE_NONE);
+        }
+}
+
+static void
+run_read_payload_position(void *data,
+                          uint64_t n_ops)
+{
+        static const uint8_t payload[] = {
+                0x78, 0x56, 0x34, 0x12,
+                0x21, 0x43, 0x65, 0x87,
+                0x00, 0x40
+        };
+        uint32_t x, y;
+        uint16_t direction;
+        uint64_t i;
+
+        for (i = 0; i < n_ops; i++) {
+                fv_proto_read_payload(payload,
+                                      sizeof payload,
+
+                                      FV_PROTO_TYPE_UINT32,
+                                      &x,
+
+                                      FV_PROTO_TYPE_UINT32,
+                                      &y,
+
+                                      FV_PROTO_TYPE_UINT16,
+                                      &direction,
+
+                                      FV_PROTO_TYPE_NONE);
+                sink += x + y + direction;
+        }
+}
+
+static void
+run_write_player_position(void *data,
+                          uint64_t n_ops)
+{
+        uint8_t buf[FV_PROTO_PLAYER_POSITION_SIZE];
+        struct fv_proto_player_position message = {
+                .y_position = UINT32_C(0x12345678),
+                .direction = 0x4000
+        };
+        uint64_t i;
+
+        for (i = 0; i < n_ops; i++) {
+                message.player_num = i;
+                message.x_position = i;
+                sink += fv_proto_write_player_position(buf, &message);
+        }
+}
+
+static void
+run_write_player_speech_sequence(void *data,
+                                 uint64_t n_ops)
+{
+        uint8_t buf[FV_PROTO_BLOB_MESSAGE_SIZE(PLAYER_SPEECH_SEQUENCE,
+                                               sizeof speech_packet)];
+        struct fv_proto_player_speech_sequence message = {
+                .packet = speech_packet,
+                .packet_size = sizeof speech_packet
+        };
+        uint64_t i;
+
+        for (i = 0; i < n_ops; i++) {
+                message.player_num = i;
+                message.sequence = i;
+                message.timestamp = i;
+                sink += fv_proto_write_player_speech_sequence(buf, &message);
+        }
+}
+
+static void
+run_read_update_position(void *data,
+                         uint64_t n_ops)
+{
+        static const uint8_t payload[] = {
+                0x78, 0x56, 0x34, 0x12,
+                0x21, 0x43, 0x65, 0x87,
+                0x00, 0x40
+        };
+        struct fv_proto_update_position message;
+        uint64_t i;
+
+        for (i = 0; i < n_ops; i++) {
+                fv_proto_read_update_position(payload,
+                                              sizeof payload,
+                                              &message);
+                sink += (message.x_position +
+                         message.y_position +
+                         message.direction);
+        }
+}
+
+static void
+run_unmask_data(void *data,
+                uint64_t n_ops)
+{
+        uint8_t buf[1 + sizeof speech_packet];
+        uint64_t i;
+
+        memset(buf, 0x55, sizeof buf);
+
+        for (i = 0; i < n_ops; i++)
+                fv_connection_unmask_data(0x12345678, buf, sizeof buf);
+
+        sink += buf[0];
+}
+
+static bool
+request_line_received_cb(const char *method,
+                         const char *uri,
+                         void *user_data)
+{
+        return true;
+}
+
+static bool
+header_received_cb(const char *field_name,
+                   const char *value,
+                   void *user_data)
+{
+        sink += value[0];
+        return true;
+}
+
+static const struct fv_ws_parser_vtable
+ws_parser_vtable = {
+        .request_line_received = request_line_received_cb,
+        .header_received = header_received_cb
+};
+
+static void
+run_ws_parser(void *data,
+              uint64_t n_ops)
+{
+        struct fv_ws_parser *parser;
+        struct fv_error *error = NULL;
+        size_t consumed;
+        uint64_t i;
+
+        for (i = 0; i < n_ops; i++) {
+                parser = fv_ws_parser_new(&ws_parser_vtable, NULL);
+
+                if (fv_ws_parser_parse_data(parser,
+                                            (const uint8_t *) ws_request,
+                                            sizeof ws_request - 1,
+                                            &consumed,
+                                            &error) ==
+                    FV_WS_PARSER_RESULT_ERROR) {
+                        fprintf(stderr, "%s\n", error->message);
+                        fv_error_free(error);
+                        exit(EXIT_FAILURE);
+                }
+
+                fv_ws_parser_free(parser);
+        }
+}
+
+static void
+run_base64_encode(void *data,
+                  uint64_t n_ops)
+{
+        uint8_t digest[SHA1_DIGEST_LENGTH];
+        char encoded[FV_BASE64_ENCODED_SIZE(SHA1_DIGEST_LENGTH)];
+        uint64_t i;
+
+        memset(digest, 0xa5, sizeof digest);
+
+        for (i = 0; i < n_ops; i++) {
+                digest[0] = i;
+                sink += fv_base64_encode(digest, sizeof digest, encoded);
+        }
+}
+
+static void
+run_sha1_update(void *data,
+                uint64_t n_ops)
+{
+        uint8_t block[SHA1_BLOCK_LENGTH];
+        uint8_t digest[SHA1_DIGEST_LENGTH];
+        SHA1_CTX ctx;
+        uint64_t i;
+
+        memset(block, 0x5a, sizeof block);
+
+        SHA1Init(&ctx);
+
+        for (i = 0; i < n_ops; i++)
+                SHA1Update(&ctx, block, sizeof block);
+
+        SHA1Final(digest, &ctx);
+        sink += digest[0];
+}
+
+/* The frames are processed through a real connection on a loopback
+ * socket so this includes the cost of the reads and polling, shared
+ * between all of the frames that fit in the read buffer.
+ */
+struct frames_data {
+        struct fv_main_context *mc;
+        struct fv_playerbase *playerbase;
+        struct fv_connection *conn;
+        struct fv_listener listener;
+        struct fv_stats stats;
+        int client_sock;
+        bool had_error;
+        bool handshake_done;
+        uint64_t n_positions;
+        uint8_t frames[FV_BENCH_FRAME_BATCH * (2 + 4 + 1 + 10)];
+        size_t frame_size;
+};
+
+static bool
+frames_event_cb(struct fv_listener *listener,
+                void *data)
+{
+        struct frames_data *fd = fv_container_of(listener,
+                                                 struct frames_data,
+                                                 listener);
+        struct fv_connection_event *event = data;
+
+        switch (event->type) {
+        case FV_CONNECTION_EVENT_ERROR:
+                fd->had_error = true;
+                return false;
+
+        case FV_CONNECTION_EVENT_HANDSHAKE:
+                fv_playerbase_lock(fd->playerbase);
+                fv_connection_set_playerbase(fd->conn, fd->playerbase);
+                fv_playerbase_unlock(fd->playerbase);
+                fd->handshake_done = true;
+                break;
+
+        case FV_CONNECTION_EVENT_UPDATE_POSITION:
+                fd->n_positions++;
+                break;
+
+        default:
+                break;
+        }
+
+        return true;
+}
+
+static void
+drain_client(struct frames_data *fd)
+{
+        uint8_t buf[1024];
+
+        while (recv(fd->client_sock, buf, sizeof buf, MSG_DONTWAIT) > 0);
+}
+
+static bool
+write_all(int sock,
+          const uint8_t *data,
+          size_t length)
+{
+        ssize_t wrote;
+
+        while (length > 0) {
+                wrote = write(sock, data, length);
+
+                if (wrote == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        return false;
+                }
+
+                data += wrote;
+                length -= wrote;
+        }
+
+        return true;
+}
+
+static void
+make_frames(struct frames_data *fd)
+{
+        static const uint8_t mask[] = { 0x37, 0xfa, 0x21, 0x3d };
+        uint8_t *frame = fd->frames;
+        int i, j;
+
+        fd->frame_size = 2 + sizeof mask + 1 + 10;
+
+        for (i = 0; i < FV_BENCH_FRAME_BATCH; i++) {
+                frame[0] = 0x82;
+                frame[1] = 0x80 | 11;
+                memcpy(frame + 2, mask, sizeof mask);
+                frame[6] = FV_PROTO_UPDATE_POSITION;
+                for (j = 0; j < 10; j++)
+                        frame[7 + j] = i + j;
+                for (j = 0; j < 11; j++)
+                        frame[6 + j] ^= mask[j % 4];
+                frame += fd->frame_size;
+        }
+}
+
+static void
+free_frames_data(struct frames_data *fd)
+{
+        if (fd->conn)
+                fv_connection_free(fd->conn);
+        if (fd->client_sock != -1)
+                fv_close(fd->client_sock);
+        fv_playerbase_free(fd->playerbase);
+        fv_free(fd);
+}
+
+static void *
+setup_process_frames(void)
+{
+        struct frames_data *fd = fv_calloc(sizeof *fd);
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof addr;
+        struct fv_error *error = NULL;
+        int server_sock;
+
+        fd->client_sock = -1;
+        fd->playerbase = fv_playerbase_new();
+        fv_stats_init(&fd->stats);
+        make_frames(fd);
+
+        fd->mc = fv_main_context_get_default(&error);
+
+        if (fd->mc == NULL)
+                goto error;
+
+        server_sock = socket(PF_INET, SOCK_STREAM, 0);
+
+        if (server_sock == -1) {
+                fprintf(stderr, "socket: %s\n", strerror(errno));
+                goto error;
+        }
+
+        memset(&addr, 0, sizeof addr);
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        if (bind(server_sock, (struct sockaddr *) &addr, sizeof addr) == -1 ||
+            listen(server_sock, 1) == -1 ||
+            getsockname(server_sock,
+                        (struct sockaddr *) &addr,
+                        &addr_len) == -1) {
+                fprintf(stderr, "listen: %s\n", strerror(errno));
+                fv_close(server_sock);
+                goto error;
+        }
+
+        fd->client_sock = socket(PF_INET, SOCK_STREAM, 0);
+
+        if (fd->client_sock == -1 ||
+            connect(fd->client_sock,
+                    (struct sockaddr *) &addr,
+                    sizeof addr) == -1) {
+                fprintf(stderr, "connect: %s\n", strerror(errno));
+                fv_close(server_sock);
+                goto error;
+        }
+
+        fd->conn = fv_connection_accept(server_sock, &fd->stats, &error);
+
+        fv_close(server_sock);
+
+        if (fd->conn == NULL)
+                goto error;
+
+        fd->listener.notify = frames_event_cb;
+        fv_signal_add(fv_connection_get_event_signal(fd->conn),
+                      &fd->listener);
+
+        if (!write_all(fd->client_sock,
+                       (const uint8_t *) ws_request,
+                       sizeof ws_request - 1))
+                goto error;
+
+        while (!fd->handshake_done && !fd->had_error)
+                fv_main_context_poll(fd->mc);
+
+        if (fd->had_error)
+                goto error;
+
+        drain_client(fd);
+
+        return fd;
+
+error:
+        if (error) {
+                fprintf(stderr, "%s\n", error->message);
+                fv_error_free(error);
+        }
+        free_frames_data(fd);
+        return NULL;
+}
+
+static void
+run_process_frames(void *data,
+                   uint64_t n_ops)
+{
+        struct frames_data *fd = data;
+        uint64_t target = fd->n_positions + n_ops;
+        uint64_t n_frames;
+
+        while (fd->n_positions < target && !fd->had_error) {
+                n_frames = MIN(target - fd->n_positions,
+                               FV_BENCH_FRAME_BATCH);
+
+                if (!write_all(fd->client_sock,
+                               fd->frames,
+                               n_frames * fd->frame_size)) {
+                        fprintf(stderr, "write: %s\n", strerror(errno));
+                        exit(EXIT_FAILURE);
+                }
+
+                n_frames += fd->n_positions;
+
+                while (fd->n_positions < n_frames && !fd->had_error)
+                        fv_main_context_poll(fd->mc);
+
+                drain_client(fd);
+        }
+
+        if (fd->had_error) {
+                fprintf(stderr, "the connection failed\n");
+                exit(EXIT_FAILURE);
+        }
+}
+
+static void
+teardown_process_frames(void *data)
+{
+        struct frames_data *fd = data;
+        struct fv_main_context *mc = fd->mc;
+
+        free_frames_data(fd);
+        fv_main_context_free(mc);
+}
+
+/* The players get random IDs like the ones that the server
+ * generates. A reconnect looks up an ID that exists and a new player
+ * checks that its ID doesn't exist yet.
+ */
+struct players_data {
+        struct fv_playerbase *playerbase;
+        uint64_t random_state;
+        uint64_t ids[FV_BENCH_N_PLAYERS];
+};
+
+/* SplitMix64 */
+static uint64_t
+get_random_id(uint64_t *state)
+{
+        uint64_t z = (*state += UINT64_C(0x9e3779b97f4a7c15));
+
+        z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+        z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+
+        return z ^ (z >> 31);
+}
+
+static void *
+setup_players(void)
+{
+        struct players_data *pd = fv_alloc(sizeof *pd);
+        int i;
+
+        pd->playerbase = fv_playerbase_new();
+        pd->random_state = 42;
+
+        fv_playerbase_lock(pd->playerbase);
+
+        for (i = 0; i < FV_BENCH_N_PLAYERS; i++) {
+                pd->ids[i] = get_random_id(&pd->random_state);
+                fv_playerbase_add_player(pd->playerbase, pd->ids[i]);
+        }
+
+        fv_playerbase_unlock(pd->playerbase);
+
+        return pd;
+}
+
+static void
+run_get_player_by_id(void *data,
+                     uint64_t n_ops)
+{
+        struct players_data *pd = data;
+        struct fv_player *player;
+        uint64_t i;
+
+        fv_playerbase_lock(pd->playerbase);
+
+        for (i = 0; i < n_ops; i++) {
+                player = fv_playerbase_get_player_by_id(
+                        pd->playerbase,
+                        pd->ids[i % FV_BENCH_N_PLAYERS]);
+                sink += player->num;
+        }
+
+        fv_playerbase_unlock(pd->playerbase);
+}
+
+static void
+run_get_missing_player_by_id(void *data,
+                             uint64_t n_ops)
+{
+        struct players_data *pd = data;
+        struct fv_player *player;
+        uint64_t i;
+
+        fv_playerbase_lock(pd->playerbase);
+
+        for (i = 0; i < n_ops; i++) {
+                player = fv_playerbase_get_player_by_id(
+                        pd->playerbase,
+                        get_random_id(&pd->random_state));
+                sink += player == NULL;
+        }
+
+        fv_playerbase_unlock(pd->playerbase);
+}
+
+static void
+teardown_players(void *data)
+{
+        struct players_data *pd = data;
+
+        fv_playerbase_free(pd->playerbase);
+        fv_free(pd);
+}
+
+/* Each source is a socket pair. When the server end becomes readable
+ * it reads the byte and then waits for the socket to become writable
+ * to send a reply, in the same way that a connection changes its poll
+ * flags when it has something to write. This is what the io_uring
+ * backend was added for so when it is available the benchmark is
+ * run a second time with the main context forced to use epoll to
+ * compare the two backends. The replies are only
+ * written when the pending sources are flushed at the start of the
+ * next poll so each iteration reads the replies of the previous one.
+ */
+struct poll_source_data {
+        struct poll_data *pd;
+        struct fv_main_context_source *source;
+        int server_sock;
+        int client_sock;
+};
+
+struct poll_data {
+        struct fv_main_context *mc;
+        struct poll_source_data sources[FV_BENCH_N_POLL_SOURCES];
+        int next_source;
+        uint64_t n_reads;
+};
+
+static void
+poll_source_cb(struct fv_main_context_source *source,
+               int fd,
+               enum fv_main_context_poll_flags flags,
+               void *user_data)
+{
+        struct poll_source_data *psd = user_data;
+        uint8_t byte = 0;
+
+        if ((flags & FV_MAIN_CONTEXT_POLL_IN)) {
+                while (read(fd, &byte, 1) == 1)
+                        psd->pd->n_reads++;
+                fv_main_context_modify_poll(source,
+                                            FV_MAIN_CONTEXT_POLL_IN |
+                                            FV_MAIN_CONTEXT_POLL_OUT);
+        } else if ((flags & FV_MAIN_CONTEXT_POLL_OUT)) {
+                sink += write(fd, &byte, 1);
+                fv_main_context_modify_poll(source, FV_MAIN_CONTEXT_POLL_IN);
+        }
+}
+
+static void
+free_poll_data(struct poll_data *pd)
+{
+        struct poll_source_data *psd;
+        int i;
+
+        for (i = 0; i < FV_BENCH_N_POLL_SOURCES; i++) {
+                psd = pd->sources + i;
+                if (psd->source)
+                        fv_main_context_remove_source(psd->source);
+                if (psd->server_sock != -1)
+                        fv_close(psd->server_sock);
+                if (psd->client_sock != -1)
+                        fv_close(psd->client_sock);
+        }
+
+        if (pd->mc)
+                fv_main_context_free(pd->mc);
+
+        fv_free(pd);
+}
+
+static void *
+setup_main_context_poll(void)
+{
+        struct poll_data *pd = fv_calloc(sizeof *pd);
+        struct poll_source_data *psd;
+        struct fv_error *error = NULL;
+        int socks[2];
+        int i;
+
+        for (i = 0; i < FV_BENCH_N_POLL_SOURCES; i++) {
+                pd->sources[i].server_sock = -1;
+                pd->sources[i].client_sock = -1;
+        }
+
+        pd->mc = fv_main_context_new(&error);
+
+        if (pd->mc == NULL) {
+                fprintf(stderr, "%s\n", error->message);
+                fv_error_free(error);
+                goto error;
+        }
+
+        for (i = 0; i < FV_BENCH_N_POLL_SOURCES; i++) {
+                psd = pd->sources + i;
+
+                if (socketpair(AF_UNIX,
+                               SOCK_STREAM | SOCK_NONBLOCK,
+                               0, /* protocol */
+                               socks) == -1) {
+                        fprintf(stderr, "socketpair: %s\n", strerror(errno));
+                        goto error;
+                }
+
+                psd->pd = pd;
+                psd->server_sock = socks[0];
+                psd->client_sock = socks[1];
+                psd->source = fv_main_context_add_poll(pd->mc,
+                                                       psd->server_sock,
+                                                       FV_MAIN_CONTEXT_POLL_IN,
+                                                       poll_source_cb,
+                                                       psd);
+        }
+
+        return pd;
+
+error:
+        free_poll_data(pd);
+        return NULL;
+}
+
+#ifdef HAVE_IO_URING
+
+static void *
+setup_main_context_poll_epoll(void)
+{
+        void *data;
+
+        force_epoll = true;
+        data = setup_main_context_poll();
+        force_epoll = false;
+
+        return data;
+}
+
+#endif /* HAVE_IO_URING */
+
+static void
+run_main_context_poll(void *data,
+                      uint64_t n_ops)
+{
+        struct poll_data *pd = data;
+        struct poll_source_data *psd;
+        uint64_t target;
+        uint8_t buf[FV_BENCH_N_ACTIVE_POLL_SOURCES];
+        int first_source, last_source;
+        uint64_t i;
+        int j;
+
+        memset(buf, 0, sizeof buf);
+
+        for (i = 0; i < n_ops; i++) {
+                target = pd->n_reads + FV_BENCH_N_ACTIVE_POLL_SOURCES;
+                first_source = pd->next_source;
+
+                for (j = 0; j < FV_BENCH_N_ACTIVE_POLL_SOURCES; j++) {
+                        psd = (pd->sources +
+                               (first_source + j) % FV_BENCH_N_POLL_SOURCES);
+
+                        if (!write_all(psd->client_sock, buf, 1)) {
+                                fprintf(stderr,
+                                        "write: %s\n",
+                                        strerror(errno));
+                                exit(EXIT_FAILURE);
+                        }
+                }
+
+                pd->next_source = ((first_source +
+                                    FV_BENCH_N_ACTIVE_POLL_SOURCES) %
+                                   FV_BENCH_N_POLL_SOURCES);
+
+                while (pd->n_reads < target)
+                        fv_main_context_poll(pd->mc);
+
+                /* Read the replies of the previous iteration */
+                last_source = (first_source +
+                               FV_BENCH_N_POLL_SOURCES -
+                               FV_BENCH_N_ACTIVE_POLL_SOURCES);
+
+                for (j = 0; j < FV_BENCH_N_ACTIVE_POLL_SOURCES; j++) {
+                        psd = (pd->sources +
+                               (last_source + j) % FV_BENCH_N_POLL_SOURCES);
+                        sink += read(psd->client_sock, buf, sizeof buf);
+                }
+        }
+}
+
+static void
+teardown_main_context_poll(void *data)
+{
+        free_poll_data(data);
+}
+
+static const struct fv_bench
+benches[] = {
+        {
+                .name = "proto_write_command_position",
+                .run = run_write_command_position,
+        },
+        {
+                .name = "proto_write_command_speech",
+                .run = run_write_command_speech,
+        },
+        {
+                .name = "proto_read_payload_position",
+                .run = run_read_payload_position,
+        },
+        {
+                .name = "proto_write_player_position",
+                .run = run_write_player_position,
+        },
+        {
+                .name = "proto_write_player_speech_sequence",
+                .run = run_write_player_speech_sequence,
+        },
+        {
+                .name = "proto_read_update_position",
+                .run = run_read_update_position,
+        },
+        {
+                .name = "connection_unmask_data_123",
+                .run = run_unmask_data,
+        },
+        {
+                .name = "connection_process_frames_position",
+                .setup = setup_process_frames,
+                .run = run_process_frames,
+                .teardown = teardown_process_frames,
+        },
+        {
+                .name = "playerbase_get_player_by_id_10000",
+                .setup = setup_players,
+                .run = run_get_player_by_id,
+                .teardown = teardown_players,
+        },
+        {
+                .name = "playerbase_get_missing_player_by_id_10000",
+                .setup = setup_players,
+                .run = run_get_missing_player_by_id,
+                .teardown = teardown_players,
+        },
+        {
+                .name = "main_context_poll_1000_sources_50_active",
+                .setup = setup_main_context_poll,
+                .run = run_main_context_poll,
+                .teardown = teardown_main_context_poll,
+        },
+#ifdef HAVE_IO_URING
+        {
+                .name = "main_context_poll_epoll_1000_sources_50_active",
+                .setup = setup_main_context_poll_epoll,
+                .run = run_main_context_poll,
+                .teardown = teardown_main_context_poll,
+        },
+#endif
+        {
+                .name = "ws_parser_parse_data_handshake",
+                .run = run_ws_parser,
+        },
+        {
+                .name = "base64_encode_20",
+                .run = run_base64_encode,
+        },
+        {
+                .name = "sha1_update_64",
+                .run = run_sha1_update,
+        },
+};
+
+static bool
+run_bench(const struct fv_bench *bench)
+{
+        uint64_t min_time = option_min_time * UINT64_C(1000000);
+        uint64_t n_ops = 1;
+        uint64_t start_time, elapsed;
+        uint64_t start_allocations, allocations;
+        uint64_t start_poll_syscalls, poll_syscalls;
+        void *data = NULL;
+
+        if (bench->setup) {
+                data = bench->setup();
+                if (data == NULL) {
+                        fprintf(stderr,
+                                "couldn't set up benchmark %s\n",
+                                bench->name);
+                        return false;
+                }
+        }
+
+        /* The first run warms up the caches and any lazily
+         * allocated buffers */
+        bench->run(data, 1);
+
+        while (true) {
+                start_allocations = n_allocations;
+                start_poll_syscalls = n_poll_syscalls;
+                start_time = get_time();
+
+                bench->run(data, n_ops);
+
+                elapsed = get_time() - start_time;
+                allocations = n_allocations - start_allocations;
+                poll_syscalls = n_poll_syscalls - start_poll_syscalls;
+
+                if (elapsed >= min_time || n_ops >= UINT64_MAX / 2)
+                        break;
+
+                n_ops *= 2;
+        }
+
+        if (bench->teardown)
+                bench->teardown(data);
+
+        printf("babiling_bench_ops{name=\"%s\"} %" PRIu64 "\n"
+               "babiling_bench_ns_per_op{name=\"%s\"} %.2f\n"
+               "babiling_bench_allocs_per_op{name=\"%s\"} %.3f\n"
+               "babiling_bench_poll_syscalls_per_op{name=\"%s\"} %.3f\n",
+               bench->name,
+               n_ops,
+               bench->name,
+               elapsed / (double) n_ops,
+               bench->name,
+               allocations / (double) n_ops,
+               bench->name,
+               poll_syscalls / (double) n_ops);
+        fflush(stdout);
+
+        return true;
+}
+
+static void
+usage(void)
+{
+        int i;
+
+        printf("usage: babiling-bench [options] [benchmark]...\n"
+               " -h                    Show this help message\n"
+               " -t <ms>               Minimum time to run each benchmark\n"
+               "                       for. Defaults to "
+               FV_STRINGIFY(FV_BENCH_DEFAULT_MIN_TIME) ".\n"
+               "\n"
+               "If no benchmarks are named then all of them are run. The\n"
+               "available benchmarks are:\n");
+
+        for (i = 0; i < FV_N_ELEMENTS(benches); i++)
+                printf(" %s\n", benches[i].name);
+
+        exit(EXIT_FAILURE);
+}
+
+static bool
+is_selected(const struct fv_bench *bench,
+            int n_names,
+            char **names)
+{
+        int i;
+
+        if (n_names == 0)
+                return true;
+
+        for (i = 0; i < n_names; i++) {
+                if (!strcmp(bench->name, names[i]))
+                        return true;
+        }
+
+        return false;
+}
+
+int
+main(int argc, char **argv)
+{
+        int ret = EXIT_SUCCESS;
+        char *tail;
+        int opt;
+        int i;
+
+        while ((opt = getopt(argc, argv, "t:h")) != -1) {
+                switch (opt) {
+                case 't':
+                        errno = 0;
+                        option_min_time = strtol(optarg, &tail, 10);
+                        if (errno || *tail || option_min_time <= 0) {
+                                fprintf(stderr,
+                                        "invalid time \"%s\"\n",
+                                        optarg);
+                                return EXIT_FAILURE;
+                        }
+                        break;
+
+                case 'h':
+                case '?':
+                        usage();
+                        break;
+                }
+        }
+
+        for (i = 0; i < FV_N_ELEMENTS(benches); i++) {
+                if (!is_selected(benches + i, argc - optind, argv + optind))
+                        continue;
+
+                if (!run_bench(benches + i))
+                        ret = EXIT_FAILURE;
+        }
+
+        return ret;
+}
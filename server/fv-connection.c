@@ -32,6 +32,7 @@
 #include <inttypes.h>
 #include <assert.h>
 #include <stdarg.h>
+#include <sys/uio.h>
 #include <opus.h>
 
 #include "fv-connection.h"
@@ -39,22 +40,67 @@
 #include "fv-util.h"
 #include "fv-main-context.h"
 #include "fv-buffer.h"
+#include "fv-bitmask.h"
 #include "fv-log.h"
 #include "fv-file-error.h"
 #include "fv-socket.h"
 #include "fv-main-context.h"
 #include "fv-ws-parser.h"
 #include "fv-base64.h"
+#include "fv-frame.h"
 #include "sha1.h"
 
+/* The maximum size of an encoded message including the WebSocket
+ * frame header */
+#define FV_CONNECTION_MAX_ENCODED_SIZE (FV_PROTO_MAX_FRAME_HEADER_LENGTH + \
+                                        FV_PROTO_MAX_MESSAGE_SIZE)
+
+/* Maximum number of segments to pass to a single call to writev */
+#define FV_CONNECTION_MAX_IOVECS 64
+
+/* Number of microseconds that a connection can have data waiting
+ * without managing to write any of it before it is considered
+ * stalled */
+#define FV_CONNECTION_STALL_TIME ((uint64_t) 5 * 1000000)
+
+/* Extra dirty state flag to report that the player has been
+ * removed */
+#define FV_CONNECTION_STATE_REMOVED (1 << FV_PLAYER_N_STATES)
+
+/* Initial size of the hash table of the dirty queue. This must be a
+ * power of two. */
+#define FV_CONNECTION_MIN_DIRTY_INDEX_SIZE 64
+
+/* The state of a player that has something to write. Only the
+ * players in the dirty queue have one. */
 struct fv_connection_dirty_state {
         _Static_assert(FV_PLAYER_MAX_PENDING_SPEECHES <= 255,
                        "The maximum number of pending speeches is to big to "
                        "fit in a uint8_t");
+        int player_num;
         uint8_t pending_speeches;
         uint8_t flags;
 };
 
+/* A message whose latency will be counted once the connection has
+ * written everything up to the end of it */
+struct fv_connection_latency_sample {
+        /* The value of queue_end just after the message was queued */
+        uint64_t end;
+        /* The time when the data of the message was received */
+        uint64_t origin;
+        enum fv_stats_latency latency;
+};
+
+/* A piece of the data that is waiting to be written */
+struct fv_connection_segment {
+        /* The shared frame containing the data or NULL if the data
+         * is in the connection's local_buf */
+        struct fv_frame *frame;
+        size_t offset;
+        size_t length;
+};
+
 struct fv_connection {
         struct fv_netaddress remote_address;
         char *remote_address_string;
@@ -64,22 +110,118 @@ struct fv_connection {
         struct fv_playerbase *playerbase;
         struct fv_player *player;
 
+        /* The counters of the thread that is handling the connection */
+        struct fv_stats *stats;
+
         bool sent_player_id;
         bool consistent;
 
+        /* FV_PROTO_FEATURE_* bits that the client is allowed to
+         * enable and the ones that it has enabled */
+        uint32_t available_features;
+        uint32_t features;
+        /* Whether a FEATURES message needs to be sent in response to
+         * REQUEST_FEATURES */
+        bool features_queued;
+        /* The player number that we last told the client was its own
+         * when the stable player numbers are enabled */
+        int sent_player_num;
+
         /* Number of players that we last told the client about */
         int n_players;
 
-        /* An array of struct fv_connection_dirty_state, one for each
-         * player.
+        /* The value of n_mixed_speeches of the client's player when
+         * the last mixed speech was written */
+        unsigned int mixed_speech_pos;
+
+        /* Unless the client is using the stable player numbers it
+         * sees a list of players without any gaps that doesn't
+         * include its own player. This is an array of player
+         * numbers indexed by the client's number for the player.
+         */
+        struct fv_buffer client_players;
+        /* The reverse of client_players. This is an array of the
+         * client's numbers indexed by the player number, or -1 if
+         * the client hasn't been told about the player. It is only
+         * used without the stable player numbers.
+         */
+        struct fv_buffer client_nums;
+
+        /* An array of struct fv_connection_dirty_state for the
+         * players that might have something to write. Players that
+         * haven't changed since they were last written don't take
+         * up any space.
          */
-        struct fv_buffer dirty_players;
+        struct fv_buffer dirty_queue;
+        /* Bitmask with a bit for each player number that is in the
+         * dirty queue */
+        struct fv_buffer dirty_bits;
+        /* Open-addressing hash table of indices into dirty_queue
+         * keyed on the player number, or -1 for an empty slot. The
+         * size is a power of two and the table is kept at most half
+         * full. It is rebuilt whenever the queue is compacted.
+         */
+        int *dirty_index;
+        size_t dirty_index_size;
 
         uint8_t read_buf[1024];
         size_t read_buf_pos;
 
-        uint8_t write_buf[1024];
-        size_t write_buf_pos;
+        /* The data waiting to be written as an array of struct
+         * fv_connection_segment. The segments before first_segment
+         * have already been written. Messages that are shared with
+         * the other connections are referenced directly and
+         * everything else is encoded into local_buf.
+         */
+        struct fv_buffer segments;
+        size_t first_segment;
+        struct fv_buffer local_buf;
+        /* The number of bytes in the segments that haven't been
+         * written yet */
+        size_t queued_bytes;
+        /* The total number of bytes that have ever been queued */
+        uint64_t queue_end;
+        /* No more messages are added to the queue once it would grow
+         * beyond this */
+        size_t max_queued_bytes;
+
+        /* If the client has enabled the bundle feature then the
+         * messages that fill_write_buf writes are collected into a
+         * BUNDLE message after the end of local_buf. It is queued
+         * once it is full or fill_write_buf has finished.
+         * bundle_length is the size of its payload so far or zero if
+         * it is empty.
+         */
+        bool bundling;
+        size_t bundle_length;
+        int bundle_n_messages;
+        /* The length of latency_samples when the bundle was started */
+        size_t bundle_first_sample;
+
+        /* Monotonic clock time when some of the queue was last
+         * written or when the queue was last seen to be empty */
+        uint64_t last_write_time;
+        /* Number of microseconds that the connection can go without
+         * writing anything before it is closed, or zero to keep it
+         * open */
+        uint64_t max_stall_time;
+        enum fv_connection_backpressure backpressure;
+        /* While the connection is lagging, the position changes are
+         * held back until the next backpressure check so that they
+         * are sent at most once per check */
+        bool positions_held;
+
+        /* Whether to measure the latency of the messages sent to the
+         * client. The latency of the messages that were received
+         * before latency_start isn't counted so that the state that
+         * is sent to a new client doesn't count. */
+        bool record_latency;
+        uint64_t latency_start;
+        /* An array of struct fv_connection_latency_sample for the
+         * queued messages that haven't been completely written */
+        struct fv_buffer latency_samples;
+        /* The time that the last data was read */
+        uint64_t read_time;
 
         /* If pong_queued is non-zero then pong_data then we need to
          * send a pong control frame with the payload given payload.
@@ -110,6 +252,9 @@ struct fv_connection {
          * been parsed.
          */
         struct fv_ws_parser *ws_parser;
+        /* The URI from the WebSocket request line or NULL if it
+         * hasn't been received yet */
+        char *request_path;
         /* This is allocated temporarily between getting the WebSocket
          * key header and finishing all of the headers.
          */
@@ -188,12 +333,15 @@ handle_error(struct fv_connection *conn)
 static bool
 connection_is_ready_to_write(struct fv_connection *conn)
 {
-        if (conn->write_buf_pos > 0)
+        if (conn->queued_bytes > 0)
                 return true;
 
         if (conn->pong_queued)
                 return true;
 
+        if (conn->features_queued)
+                return true;
+
         if (conn->player) {
                 if (!conn->sent_player_id)
                         return true;
@@ -216,117 +364,838 @@ update_poll_flags(struct fv_connection *conn)
         fv_main_context_modify_poll(conn->socket_source, flags);
 }
 
+static struct fv_connection_segment *
+get_segments(struct fv_connection *conn)
+{
+        return (struct fv_connection_segment *) conn->segments.data;
+}
+
+static size_t
+get_n_segments(struct fv_connection *conn)
+{
+        return conn->segments.length / sizeof (struct fv_connection_segment);
+}
+
+static size_t
+get_queue_space(struct fv_connection *conn)
+{
+        size_t queued_bytes = conn->queued_bytes;
+
+        /* The open bundle will be queued too */
+        if (conn->bundle_length > 0) {
+                queued_bytes += (FV_PROTO_EXTENDED_FRAME_HEADER_LENGTH +
+                                 conn->bundle_length);
+        }
+
+        if (queued_bytes >= conn->max_queued_bytes)
+                return 0;
+
+        return conn->max_queued_bytes - queued_bytes;
+}
+
+/* Returns the position in local_buf of the payload of the open
+ * bundle. Space is left before it for the frame header. */
+static uint8_t *
+get_bundle_payload(struct fv_connection *conn)
+{
+        return (conn->local_buf.data +
+                conn->local_buf.length +
+                FV_PROTO_EXTENDED_FRAME_HEADER_LENGTH);
+}
+
+/* Returns a pointer to write length bytes of local data to. The data
+ * isn't added to the queue until queue_local_data is called. While
+ * bundling, the space is after the open bundle instead.
+ */
+static uint8_t *
+get_local_space(struct fv_connection *conn,
+                size_t length)
+{
+        size_t offset = conn->local_buf.length;
+
+        if (conn->bundling) {
+                offset += (FV_PROTO_EXTENDED_FRAME_HEADER_LENGTH +
+                           conn->bundle_length);
+        }
+
+        fv_buffer_ensure_size(&conn->local_buf, offset + length);
+
+        return conn->local_buf.data + offset;
+}
+
+static void
+queue_local_data(struct fv_connection *conn,
+                 size_t length)
+{
+        struct fv_connection_segment *segment = NULL;
+        size_t n_segments = get_n_segments(conn);
+
+        if (n_segments > conn->first_segment)
+                segment = get_segments(conn) + n_segments - 1;
+
+        /* Extend the last segment if it is also local data */
+        if (segment &&
+            segment->frame == NULL &&
+            segment->offset + segment->length == conn->local_buf.length) {
+                segment->length += length;
+        } else {
+                fv_buffer_set_length(&conn->segments,
+                                     conn->segments.length + sizeof *segment);
+                segment = get_segments(conn) + n_segments;
+                segment->frame = NULL;
+                segment->offset = conn->local_buf.length;
+                segment->length = length;
+        }
+
+        conn->local_buf.length += length;
+        conn->queued_bytes += length;
+        conn->queue_end += length;
+        fv_stats_add(conn->stats, FV_STATS_BYTES_QUEUED, length);
+}
+
+static void
+queue_frame(struct fv_connection *conn,
+            struct fv_frame *frame)
+{
+        struct fv_connection_segment *segment;
+
+        fv_buffer_set_length(&conn->segments,
+                             conn->segments.length + sizeof *segment);
+        segment = get_segments(conn) + get_n_segments(conn) - 1;
+        segment->frame = fv_frame_ref(frame);
+        segment->offset = 0;
+        segment->length = frame->length;
+
+        conn->queued_bytes += frame->length;
+        conn->queue_end += frame->length;
+        fv_stats_add(conn->stats, FV_STATS_BYTES_QUEUED, frame->length);
+}
+
+/* Removes the segments that have already been written and moves the
+ * remaining local data to the start of the buffer so that the queue
+ * doesn't keep growing if the client never quite catches up.
+ */
+static void
+compact_queue(struct fv_connection *conn)
+{
+        struct fv_connection_segment *segments = get_segments(conn);
+        size_t n_segments = get_n_segments(conn) - conn->first_segment;
+        size_t local_start = conn->local_buf.length;
+        size_t i;
+
+        if (conn->first_segment == 0)
+                return;
+
+        memmove(segments,
+                segments + conn->first_segment,
+                n_segments * sizeof *segments);
+        fv_buffer_set_length(&conn->segments, n_segments * sizeof *segments);
+        conn->first_segment = 0;
+
+        for (i = 0; i < n_segments; i++) {
+                if (segments[i].frame == NULL) {
+                        local_start = segments[i].offset;
+                        break;
+                }
+        }
+
+        if (local_start == 0)
+                return;
+
+        memmove(conn->local_buf.data,
+                conn->local_buf.data + local_start,
+                conn->local_buf.length - local_start);
+        conn->local_buf.length -= local_start;
+
+        for (; i < n_segments; i++) {
+                if (segments[i].frame == NULL)
+                        segments[i].offset -= local_start;
+        }
+}
+
+static void
+consume_queue(struct fv_connection *conn,
+              size_t length)
+{
+        struct fv_connection_segment *segment;
+
+        conn->queued_bytes -= length;
+
+        while (length > 0) {
+                segment = get_segments(conn) + conn->first_segment;
+
+                if (length < segment->length) {
+                        segment->offset += length;
+                        segment->length -= length;
+                        break;
+                }
+
+                length -= segment->length;
+
+                if (segment->frame)
+                        fv_frame_unref(segment->frame);
+
+                conn->first_segment++;
+        }
+
+        if (conn->first_segment >= get_n_segments(conn)) {
+                fv_buffer_set_length(&conn->segments, 0);
+                fv_buffer_set_length(&conn->local_buf, 0);
+                conn->first_segment = 0;
+        }
+}
+
+static void
+clear_queue(struct fv_connection *conn)
+{
+        fv_stats_add(conn->stats,
+                     FV_STATS_BYTES_DISCARDED,
+                     conn->queued_bytes);
+        consume_queue(conn, conn->queued_bytes);
+
+        /* The discarded messages don't count */
+        fv_buffer_set_length(&conn->latency_samples, 0);
+}
+
+/* Remembers that the message that was just queued carries data that
+ * was received at the origin time */
+static void
+add_latency_sample(struct fv_connection *conn,
+                   enum fv_stats_latency latency,
+                   uint64_t origin)
+{
+        struct fv_connection_latency_sample *sample;
+
+        if (!conn->record_latency || origin < conn->latency_start)
+                return;
+
+        fv_buffer_set_length(&conn->latency_samples,
+                             conn->latency_samples.length + sizeof *sample);
+        sample = ((struct fv_connection_latency_sample *)
+                  (conn->latency_samples.data +
+                   conn->latency_samples.length)) - 1;
+        sample->end = conn->queue_end;
+        sample->origin = origin;
+        sample->latency = latency;
+}
+
+/* Counts the latency of the messages that have been completely
+ * written */
+static void
+record_latencies(struct fv_connection *conn)
+{
+        struct fv_connection_latency_sample *samples =
+                (struct fv_connection_latency_sample *)
+                conn->latency_samples.data;
+        size_t n_samples = conn->latency_samples.length / sizeof *samples;
+        uint64_t written = conn->queue_end - conn->queued_bytes;
+        uint64_t now;
+        size_t i;
+
+        if (n_samples == 0 || samples[0].end > written)
+                return;
+
+        now = fv_stats_get_latency_clock();
+
+        for (i = 0; i < n_samples && samples[i].end <= written; i++) {
+                fv_stats_add_latency(conn->stats,
+                                     samples[i].latency,
+                                     now - samples[i].origin);
+        }
+
+        /* Move the remaining samples to the start so that the buffer
+         * doesn't keep growing if the client never quite catches
+         * up */
+        memmove(samples, samples + i, (n_samples - i) * sizeof *samples);
+        fv_buffer_set_length(&conn->latency_samples,
+                             (n_samples - i) * sizeof *samples);
+}
+
+/* Moves a frame that was written just after the open bundle into the
+ * bundle. This starts the bundle if it is empty. */
+static void
+add_to_bundle(struct fv_connection *conn,
+              size_t frame_length)
+{
+        uint8_t *frame = get_bundle_payload(conn) + conn->bundle_length;
+        size_t header_length = (frame[1] == 126 ?
+                                FV_PROTO_EXTENDED_FRAME_HEADER_LENGTH :
+                                FV_PROTO_SHORT_FRAME_HEADER_LENGTH);
+        size_t message_length = frame_length - header_length;
+        uint8_t *p = frame;
+
+        if (conn->bundle_length == 0) {
+                conn->bundle_first_sample = conn->latency_samples.length;
+                *(p++) = FV_PROTO_BUNDLE;
+        }
+
+        /* Each message is preceded by its length instead of a frame
+         * header. The header is at least two bytes so this moves the
+         * message backwards. */
+        memmove(p + 1, frame + header_length, message_length);
+        *p = message_length;
+
+        conn->bundle_length += p - frame + 1 + message_length;
+        conn->bundle_n_messages++;
+}
+
+/* Queues the open bundle. If there is only one message in it then the
+ * message is queued in its own frame instead.
+ */
+static void
+end_bundle(struct fv_connection *conn)
+{
+        struct fv_connection_latency_sample *samples;
+        uint8_t *start = conn->local_buf.data + conn->local_buf.length;
+        uint8_t *payload = get_bundle_payload(conn);
+        size_t payload_length = conn->bundle_length;
+        size_t frame_length;
+        uint8_t *frame;
+        size_t n_samples, i;
+
+        if (conn->bundle_n_messages == 0)
+                return;
+
+        if (conn->bundle_n_messages == 1) {
+                /* Skip the bundle ID and the length */
+                payload_length = payload[1];
+                payload += 2;
+        } else {
+                fv_stats_count_message_out(conn->stats, FV_PROTO_BUNDLE);
+        }
+
+        frame = payload - fv_proto_get_frame_header_length(payload_length);
+        frame_length = (fv_proto_write_frame_header(frame, payload_length) +
+                        payload_length);
+        memmove(start, frame, frame_length);
+
+        conn->bundle_length = 0;
+        conn->bundle_n_messages = 0;
+
+        queue_local_data(conn, frame_length);
+
+        /* The client can't use any of the messages until the whole
+         * bundle has arrived */
+        samples = (struct fv_connection_latency_sample *)
+                (conn->latency_samples.data + conn->bundle_first_sample);
+        n_samples = ((conn->latency_samples.length -
+                      conn->bundle_first_sample) /
+                     sizeof *samples);
+
+        for (i = 0; i < n_samples; i++)
+                samples[i].end = conn->queue_end;
+}
+
+/* Starts a new bundle if a message of the given size might not fit in
+ * the open one */
+static void
+make_bundle_space(struct fv_connection *conn,
+                  size_t size)
+{
+        if (conn->bundling &&
+            conn->bundle_length + size > FV_PROTO_MAX_BUNDLE_SIZE)
+                end_bundle(conn);
+}
+
 static int
 write_command(struct fv_connection *conn,
               uint16_t command,
               ...)
 {
+        size_t space;
         int ret;
         va_list ap;
 
+        /* The size of the message isn't known yet so this has to
+         * assume the worst */
+        make_bundle_space(conn, FV_CONNECTION_MAX_ENCODED_SIZE);
+
+        space = MIN(get_queue_space(conn), FV_CONNECTION_MAX_ENCODED_SIZE);
+
         va_start(ap, command);
 
-        ret = fv_proto_write_command_v(conn->write_buf +
-                                       conn->write_buf_pos,
-                                       sizeof conn->write_buf -
-                                       conn->write_buf_pos,
+        ret = fv_proto_write_command_v(get_local_space(conn, space),
+                                       space,
                                        command,
                                        ap);
 
         va_end(ap);
 
+        if (ret != -1)
+                fv_stats_count_message_out(conn->stats, command);
+
         return ret;
 }
 
+/* Returns a pointer to write a message of the given size to with one
+ * of the fv_proto_write_* functions or NULL if the queue is full. The
+ * message isn't queued until queue_local_message or queue_message is
+ * called.
+ */
+static uint8_t *
+get_message_space(struct fv_connection *conn,
+                  uint8_t command,
+                  size_t size)
+{
+        make_bundle_space(conn, size);
+
+        if (size > get_queue_space(conn))
+                return NULL;
+
+        fv_stats_count_message_out(conn->stats, command);
+
+        return get_local_space(conn, size);
+}
+
+/* Queues a message that was written to the space from
+ * get_message_space */
+static void
+queue_local_message(struct fv_connection *conn,
+                    size_t length)
+{
+        if (conn->bundling)
+                add_to_bundle(conn, length);
+        else
+                queue_local_data(conn, length);
+}
+
+static struct fv_connection_dirty_state *
+get_queued_state(struct fv_connection *conn,
+                 size_t index)
+{
+        return ((struct fv_connection_dirty_state *) conn->dirty_queue.data +
+                index);
+}
+
+static size_t
+get_dirty_queue_length(struct fv_connection *conn)
+{
+        return (conn->dirty_queue.length /
+                sizeof (struct fv_connection_dirty_state));
+}
+
+static bool
+has_dirty_bit(struct fv_connection *conn,
+              int player_num)
+{
+        return (FV_BITMASK_LONG(player_num) <
+                conn->dirty_bits.length / sizeof (unsigned long));
+}
+
+static bool
+is_player_queued(struct fv_connection *conn,
+                 int player_num)
+{
+        return (has_dirty_bit(conn, player_num) &&
+                fv_bitmask_get(&conn->dirty_bits, player_num));
+}
+
+static void
+insert_dirty_index(struct fv_connection *conn,
+                   size_t index)
+{
+        size_t mask = conn->dirty_index_size - 1;
+        /* The player numbers are allocated from zero without many
+         * gaps so they are already well spread out */
+        size_t pos = get_queued_state(conn, index)->player_num & mask;
+
+        while (conn->dirty_index[pos] != -1)
+                pos = (pos + 1) & mask;
+
+        conn->dirty_index[pos] = index;
+}
+
+static void
+rebuild_dirty_index(struct fv_connection *conn)
+{
+        size_t queue_length = get_dirty_queue_length(conn);
+        size_t size = FV_CONNECTION_MIN_DIRTY_INDEX_SIZE;
+        size_t i;
+
+        while (size < queue_length * 2)
+                size *= 2;
+
+        /* This can also shrink the table once a burst of changes
+         * has been written */
+        if (size != conn->dirty_index_size) {
+                fv_free(conn->dirty_index);
+                conn->dirty_index = fv_alloc(size * sizeof (int));
+                conn->dirty_index_size = size;
+        }
+
+        memset(conn->dirty_index, 0xff, size * sizeof (int));
+
+        for (i = 0; i < queue_length; i++)
+                insert_dirty_index(conn, i);
+}
+
+/* Returns the state of the player if it is in the dirty queue or
+ * NULL otherwise */
+static struct fv_connection_dirty_state *
+find_dirty_state(struct fv_connection *conn,
+                 int player_num)
+{
+        size_t mask = conn->dirty_index_size - 1;
+        size_t pos = player_num & mask;
+        struct fv_connection_dirty_state *state;
+
+        if (!is_player_queued(conn, player_num))
+                return NULL;
+
+        while (true) {
+                state = get_queued_state(conn, conn->dirty_index[pos]);
+
+                if (state->player_num == player_num)
+                        return state;
+
+                pos = (pos + 1) & mask;
+        }
+}
+
+static void
+reserve_dirty_player(struct fv_connection *conn,
+                     int player_num)
+{
+        size_t old_length = conn->dirty_bits.length;
+
+        if (has_dirty_bit(conn, player_num))
+                return;
+
+        fv_bitmask_set_length(&conn->dirty_bits, player_num + 1);
+        memset(conn->dirty_bits.data + old_length,
+               0,
+               conn->dirty_bits.length - old_length);
+}
+
+/* Returns the state of the player, adding it to the end of the dirty
+ * queue if it isn't already there. This can move the other states. */
+static struct fv_connection_dirty_state *
+queue_dirty_state(struct fv_connection *conn,
+                  int player_num)
+{
+        struct fv_connection_dirty_state *state;
+        size_t index;
+
+        state = find_dirty_state(conn, player_num);
+
+        if (state)
+                return state;
+
+        reserve_dirty_player(conn, player_num);
+
+        index = get_dirty_queue_length(conn);
+        fv_buffer_set_length(&conn->dirty_queue,
+                             (index + 1) * sizeof *state);
+        state = get_queued_state(conn, index);
+        state->player_num = player_num;
+        state->pending_speeches = 0;
+        state->flags = 0;
+
+        fv_bitmask_set(&conn->dirty_bits, player_num, true);
+
+        if ((index + 1) * 2 > conn->dirty_index_size)
+                rebuild_dirty_index(conn);
+        else
+                insert_dirty_index(conn, index);
+
+        return state;
+}
+
+static bool
+has_stable_player_nums(struct fv_connection *conn)
+{
+        return !!(conn->features & FV_PROTO_FEATURE_STABLE_PLAYER_NUMS);
+}
+
+static bool
+has_mixed_speech(struct fv_connection *conn)
+{
+        return !!(conn->features & FV_PROTO_FEATURE_MIXED_SPEECH);
+}
+
+static bool
+has_speech_sequence(struct fv_connection *conn)
+{
+        return !!(conn->features & FV_PROTO_FEATURE_SPEECH_SEQUENCE);
+}
+
+static bool
+has_bundles(struct fv_connection *conn)
+{
+        return !!(conn->features & FV_PROTO_FEATURE_BUNDLE);
+}
+
+static bool
+has_compact_positions(struct fv_connection *conn)
+{
+        return !!(conn->features & FV_PROTO_FEATURE_COMPACT_POSITIONS);
+}
+
+/* Returns the number to use for the player in messages to the client
+ * or -1 if the client doesn't know about the player */
+static int
+get_client_num(struct fv_connection *conn,
+               int player_num)
+{
+        if (has_stable_player_nums(conn))
+                return player_num;
+
+        if (player_num >= conn->client_nums.length / sizeof (int))
+                return -1;
+
+        return ((int *) conn->client_nums.data)[player_num];
+}
+
+/* Returns the encoded frame that can be copied instead of encoding
+ * the message again or NULL if the message needs to be encoded for
+ * this connection.
+ */
+static struct fv_frame *
+get_shared_frame(struct fv_connection *conn,
+                 struct fv_frame *frame)
+{
+        return has_stable_player_nums(conn) ? frame : NULL;
+}
+
+/* Returns the message ID after the WebSocket header of a frame that
+ * was encoded by the connection */
+static uint8_t
+get_frame_message_id(const struct fv_frame *frame)
+{
+        /* The top bit of the second byte would be the mask flag */
+        if (frame->data[1] == 126)
+                return frame->data[4];
+        else
+                return frame->data[2];
+}
+
+static bool
+write_shared_frame(struct fv_connection *conn,
+                   struct fv_frame *frame)
+{
+        uint8_t *buf;
+
+        /* The frame can't be referenced from inside a bundle so it
+         * is copied instead. The messages are small so this is
+         * cheaper than sending a separate frame. */
+        if (conn->bundling) {
+                buf = get_message_space(conn,
+                                        get_frame_message_id(frame),
+                                        frame->length);
+                if (buf == NULL)
+                        return false;
+
+                memcpy(buf, frame->data, frame->length);
+                add_to_bundle(conn, frame->length);
+
+                return true;
+        }
+
+        if (frame->length > get_queue_space(conn))
+                return false;
+
+        queue_frame(conn, frame);
+        fv_stats_count_message_out(conn->stats,
+                                   get_frame_message_id(frame));
+
+        return true;
+}
+
+/* Queues a message that has just been written to the local buffer. If
+ * the message uses the stable player numbers it is stored in a
+ * shared frame so that the other connections can use it too.
+ */
+static void
+queue_message(struct fv_connection *conn,
+              struct fv_frame **frame,
+              int length)
+{
+        if (conn->bundling) {
+                add_to_bundle(conn, length);
+        } else if (has_stable_player_nums(conn)) {
+                *frame = fv_frame_new(conn->local_buf.data +
+                                      conn->local_buf.length,
+                                      length);
+                queue_frame(conn, *frame);
+        } else {
+                queue_local_data(conn, length);
+        }
+}
+
+static bool
+write_player_removed(struct fv_connection *conn,
+                     int player_num)
+{
+        struct fv_proto_player_removed message = {
+                .player_num = player_num
+        };
+        uint8_t *buf;
+
+        buf = get_message_space(conn,
+                                FV_PROTO_PLAYER_REMOVED,
+                                FV_PROTO_PLAYER_REMOVED_SIZE);
+        if (buf == NULL)
+                return false;
+
+        queue_local_message(conn, fv_proto_write_player_removed(buf, &message));
+
+        return true;
+}
+
 static bool
 write_player_state(struct fv_connection *conn,
-                   int player_num)
+                   struct fv_connection_dirty_state *state)
 {
+        int player_num = state->player_num;
         struct fv_player *player =
                 fv_playerbase_get_player_by_num(conn->playerbase, player_num);
+        struct fv_frame **shared_frame;
+        struct fv_frame *frame;
+        uint8_t *buf;
         int wrote;
-        struct fv_connection_dirty_state *state =
-                (struct fv_connection_dirty_state *) conn->dirty_players.data +
-                player_num;
+
+        /* This is only left set for clients using the stable player
+         * numbers. The others have already had the gap filled by
+         * update_client_players. */
+        if (state->flags & FV_CONNECTION_STATE_REMOVED) {
+                if (!write_player_removed(conn, player_num))
+                        return false;
+                state->flags &= ~FV_CONNECTION_STATE_REMOVED;
+        }
 
         /* We don't send any information about the player belonging to
-         * this client
+         * this client. The player might also have been removed before
+         * the connection was told about it.
          */
-        if (player == conn->player) {
+        if (player == NULL || player == conn->player) {
                 state->flags = 0;
                 return true;
         }
 
-        /* The player numbers that are sent to the client are faked in
-         * order to exculde the client's own player
-         */
-        if (player_num >= conn->player->num)
-                player_num--;
-
-        if (state->flags & FV_PLAYER_STATE_APPEARANCE) {
-                wrote = write_command(conn,
+        player_num = get_client_num(conn, player_num);
 
-                                      FV_PROTO_PLAYER_APPEARANCE,
-
-                                      FV_PROTO_TYPE_UINT16,
-                                      (uint16_t) player_num,
-
-                                      FV_PROTO_TYPE_UINT8,
-                                      player->image,
+        if (player_num == -1) {
+                state->flags = 0;
+                return true;
+        }
 
-                                      FV_PROTO_TYPE_NONE);
+        if (state->flags & FV_PLAYER_STATE_APPEARANCE) {
+                shared_frame = (player->state_frames +
+                                FV_PLAYER_STATE_INDEX_APPEARANCE);
+                frame = get_shared_frame(conn, *shared_frame);
 
-                if (wrote == -1)
-                        return false;
+                if (frame) {
+                        if (!write_shared_frame(conn, frame))
+                                return false;
+                } else {
+                        struct fv_proto_player_appearance message = {
+                                .player_num = player_num,
+                                .image = player->image
+                        };
+
+                        buf = get_message_space(
+                                conn,
+                                FV_PROTO_PLAYER_APPEARANCE,
+                                FV_PROTO_PLAYER_APPEARANCE_SIZE);
+                        if (buf == NULL)
+                                return false;
+
+                        wrote = fv_proto_write_player_appearance(buf,
+                                                                 &message);
+                        queue_message(conn, shared_frame, wrote);
+                }
 
-                conn->write_buf_pos += wrote;
                 state->flags &= ~FV_PLAYER_STATE_APPEARANCE;
         }
 
         if (state->flags & FV_PLAYER_STATE_FLAGS) {
-                wrote = write_command(conn,
+                shared_frame = (player->state_frames +
+                                FV_PLAYER_STATE_INDEX_FLAGS);
+                frame = get_shared_frame(conn, *shared_frame);
 
-                                      FV_PROTO_PLAYER_FLAGS,
-
-                                      FV_PROTO_TYPE_UINT16,
-                                      (uint16_t) player_num,
-
-                                      FV_PROTO_TYPE_FLAGS,
-                                      player->n_flags,
-                                      &player->flags,
-
-                                      FV_PROTO_TYPE_NONE);
+                if (frame) {
+                        if (!write_shared_frame(conn, frame))
+                                return false;
+                } else {
+                        wrote = write_command(conn,
 
-                if (wrote == -1)
-                        return false;
+                                              FV_PROTO_PLAYER_FLAGS,
 
-                conn->write_buf_pos += wrote;
-                state->flags &= ~FV_PLAYER_STATE_FLAGS;
-        }
+                                              FV_PROTO_TYPE_UINT16,
+                                              (uint16_t) player_num,
 
-        if (state->flags & FV_PLAYER_STATE_POSITION) {
-                wrote = write_command(conn,
+                                              FV_PROTO_TYPE_FLAGS,
+                                              player->n_flags,
+                                              &player->flags,
 
-                                      FV_PROTO_PLAYER_POSITION,
+                                              FV_PROTO_TYPE_NONE);
 
-                                      FV_PROTO_TYPE_UINT16,
-                                      (uint16_t) player_num,
+                        if (wrote == -1)
+                                return false;
 
-                                      FV_PROTO_TYPE_UINT32,
-                                      player->x_position,
+                        queue_message(conn, shared_frame, wrote);
+                }
 
-                                      FV_PROTO_TYPE_UINT32,
-                                      player->y_position,
+                state->flags &= ~FV_PLAYER_STATE_FLAGS;
+        }
 
-                                      FV_PROTO_TYPE_UINT16,
-                                      player->direction,
+        if ((state->flags & FV_PLAYER_STATE_POSITION) &&
+            !conn->positions_held) {
+                if (has_compact_positions(conn)) {
+                        shared_frame = &player->compact_position_frame;
+                } else {
+                        shared_frame = (player->state_frames +
+                                        FV_PLAYER_STATE_INDEX_POSITION);
+                }
 
-                                      FV_PROTO_TYPE_NONE);
+                frame = get_shared_frame(conn, *shared_frame);
+
+                if (frame) {
+                        if (!write_shared_frame(conn, frame))
+                                return false;
+                } else if (has_compact_positions(conn)) {
+                        /* The top 16 bits of the fractions are still
+                         * far more precise than the client needs */
+                        struct fv_proto_player_position_compact message = {
+                                .player_num = player_num,
+                                .x_position = player->x_position >> 16,
+                                .y_position = player->y_position >> 16,
+                                .direction = player->direction
+                        };
+
+                        buf = get_message_space(
+                                conn,
+                                FV_PROTO_PLAYER_POSITION_COMPACT,
+                                FV_PROTO_PLAYER_POSITION_COMPACT_SIZE);
+                        if (buf == NULL)
+                                return false;
+
+                        wrote = fv_proto_write_player_position_compact(
+                                buf,
+                                &message);
+                        queue_message(conn, shared_frame, wrote);
+                } else {
+                        struct fv_proto_player_position message = {
+                                .player_num = player_num,
+                                .x_position = player->x_position,
+                                .y_position = player->y_position,
+                                .direction = player->direction
+                        };
+
+                        buf = get_message_space(conn,
+                                                FV_PROTO_PLAYER_POSITION,
+                                                FV_PROTO_PLAYER_POSITION_SIZE);
+                        if (buf == NULL)
+                                return false;
+
+                        wrote = fv_proto_write_player_position(buf, &message);
+                        queue_message(conn, shared_frame, wrote);
+                }
 
-                if (wrote == -1)
-                        return false;
+                add_latency_sample(conn,
+                                   FV_STATS_LATENCY_POSITION,
+                                   player->position_time);
 
-                conn->write_buf_pos += wrote;
                 state->flags &= ~FV_PLAYER_STATE_POSITION;
         }
 
@@ -335,107 +1204,419 @@ write_player_state(struct fv_connection *conn,
 
 static bool
 write_player_speech(struct fv_connection *conn,
-                    int player_num)
+                    struct fv_connection_dirty_state *state)
 {
+        int player_num = state->player_num;
         struct fv_player *player =
                 fv_playerbase_get_player_by_num(conn->playerbase, player_num);
+        uint8_t *buf;
         int wrote;
-        struct fv_connection_dirty_state *state =
-                (struct fv_connection_dirty_state *) conn->dirty_players.data +
-                player_num;
         unsigned int n_pending_speeches = state->pending_speeches;
-        unsigned int speech_num = ((player->next_speech +
-                                    FV_PLAYER_MAX_PENDING_SPEECHES -
-                                    n_pending_speeches) %
-                                   FV_PLAYER_MAX_PENDING_SPEECHES);
+        unsigned int speech_num;
+        struct fv_player_speech *speech;
+        struct fv_frame **shared_frame;
+        struct fv_frame *frame;
 
         /* We don't send any speeches belonging to this client */
-        if (player == conn->player) {
+        if (player == NULL || player == conn->player) {
                 state->pending_speeches = 0;
                 return true;
         }
 
-        /* The player numbers that are sent to the client are faked in
-         * order to exclude the client's own player
-         */
-        if (player_num >= conn->player->num)
-                player_num--;
+        player_num = get_client_num(conn, player_num);
 
-        wrote = write_command(conn,
+        if (player_num == -1) {
+                state->pending_speeches = 0;
+                return true;
+        }
 
-                              FV_PROTO_PLAYER_SPEECH,
+        /* The player's speech buffer might have been given back
+         * since the speeches were queued */
+        if (n_pending_speeches > player->n_speeches) {
+                fv_stats_add(conn->stats,
+                             FV_STATS_DROPPED_SPEECHES,
+                             n_pending_speeches - player->n_speeches);
+                n_pending_speeches = player->n_speeches;
 
-                              FV_PROTO_TYPE_UINT16,
-                              (uint16_t) player_num,
+                if (n_pending_speeches == 0) {
+                        state->pending_speeches = 0;
+                        return true;
+                }
+        }
 
-                              FV_PROTO_TYPE_BLOB,
-                              (size_t) player->speech_queue[speech_num].size,
-                              player->speech_queue[speech_num].packet,
+        speech_num = ((player->next_speech +
+                       FV_PLAYER_MAX_PENDING_SPEECHES -
+                       n_pending_speeches) %
+                      FV_PLAYER_MAX_PENDING_SPEECHES);
+        speech = fv_player_get_speech(player, speech_num);
 
-                              FV_PROTO_TYPE_NONE);
+        if (has_speech_sequence(conn))
+                shared_frame = &speech->sequenced_frame;
+        else
+                shared_frame = &speech->frame;
 
-        if (wrote == -1)
-                return false;
+        frame = get_shared_frame(conn, *shared_frame);
+
+        if (frame) {
+                if (!write_shared_frame(conn, frame))
+                        return false;
+        } else {
+                if (has_speech_sequence(conn)) {
+                        struct fv_proto_player_speech_sequence message = {
+                                .player_num = player_num,
+                                .sequence = speech->sequence,
+                                .timestamp = FV_PLAYER_SPEECH_TIMESTAMP(
+                                        speech->receive_time),
+                                .packet = speech->packet,
+                                .packet_size = speech->size
+                        };
+
+                        buf = get_message_space(
+                                conn,
+                                FV_PROTO_PLAYER_SPEECH,
+                                FV_PROTO_BLOB_MESSAGE_SIZE(
+                                        PLAYER_SPEECH_SEQUENCE,
+                                        speech->size));
+                        if (buf == NULL)
+                                return false;
+
+                        wrote = fv_proto_write_player_speech_sequence(buf,
+                                                                      &message);
+                } else {
+                        struct fv_proto_player_speech message = {
+                                .player_num = player_num,
+                                .packet = speech->packet,
+                                .packet_size = speech->size
+                        };
+
+                        buf = get_message_space(
+                                conn,
+                                FV_PROTO_PLAYER_SPEECH,
+                                FV_PROTO_BLOB_MESSAGE_SIZE(PLAYER_SPEECH,
+                                                           speech->size));
+                        if (buf == NULL)
+                                return false;
+
+                        wrote = fv_proto_write_player_speech(buf, &message);
+                }
+
+                queue_message(conn, shared_frame, wrote);
+        }
+
+        add_latency_sample(conn,
+                           FV_STATS_LATENCY_SPEECH,
+                           speech->receive_time);
 
-        conn->write_buf_pos += wrote;
         state->pending_speeches = n_pending_speeches - 1;
 
         return true;
 }
 
 static bool
-write_player_id(struct fv_connection *conn)
+write_mixed_speeches(struct fv_connection *conn)
 {
+        struct fv_player *player = conn->player;
+        struct fv_player_speech *speech;
+        uint8_t *buf;
         int wrote;
 
-        wrote = write_command(conn,
+        /* Skip the packets that have already been overwritten */
+        if (player->n_mixed_speeches - conn->mixed_speech_pos >
+            FV_PLAYER_MAX_MIXED_SPEECHES) {
+                fv_stats_add(conn->stats,
+                             FV_STATS_DROPPED_SPEECHES,
+                             player->n_mixed_speeches -
+                             conn->mixed_speech_pos -
+                             FV_PLAYER_MAX_MIXED_SPEECHES);
+                conn->mixed_speech_pos = (player->n_mixed_speeches -
+                                          FV_PLAYER_MAX_MIXED_SPEECHES);
+        }
 
-                              FV_PROTO_PLAYER_ID,
+        while (conn->mixed_speech_pos != player->n_mixed_speeches) {
+                speech = (player->mixed_speeches +
+                          conn->mixed_speech_pos %
+                          FV_PLAYER_MAX_MIXED_SPEECHES);
+
+                if (has_speech_sequence(conn)) {
+                        struct fv_proto_mixed_speech_sequence message = {
+                                .sequence = speech->sequence,
+                                .timestamp = FV_PLAYER_SPEECH_TIMESTAMP(
+                                        speech->receive_time),
+                                .packet = speech->packet,
+                                .packet_size = speech->size
+                        };
+
+                        buf = get_message_space(
+                                conn,
+                                FV_PROTO_MIXED_SPEECH,
+                                FV_PROTO_BLOB_MESSAGE_SIZE(
+                                        MIXED_SPEECH_SEQUENCE,
+                                        speech->size));
+                        if (buf == NULL)
+                                return false;
+
+                        wrote = fv_proto_write_mixed_speech_sequence(buf,
+                                                                     &message);
+                } else {
+                        struct fv_proto_mixed_speech message = {
+                                .packet = speech->packet,
+                                .packet_size = speech->size
+                        };
+
+                        buf = get_message_space(
+                                conn,
+                                FV_PROTO_MIXED_SPEECH,
+                                FV_PROTO_BLOB_MESSAGE_SIZE(MIXED_SPEECH,
+                                                           speech->size));
+                        if (buf == NULL)
+                                return false;
+
+                        wrote = fv_proto_write_mixed_speech(buf, &message);
+                }
 
-                              FV_PROTO_TYPE_UINT64,
-                              conn->player->id,
+                queue_local_message(conn, wrote);
+                add_latency_sample(conn,
+                                   FV_STATS_LATENCY_MIXED_SPEECH,
+                                   speech->receive_time);
+                conn->mixed_speech_pos++;
+        }
 
-                              FV_PROTO_TYPE_NONE);
+        return true;
+}
 
-        if (wrote == -1)
+static bool
+write_player_id(struct fv_connection *conn)
+{
+        struct fv_proto_player_id message = {
+                .player_id = conn->player->id
+        };
+        uint8_t *buf;
+
+        buf = get_message_space(conn,
+                                FV_PROTO_PLAYER_ID,
+                                FV_PROTO_PLAYER_ID_SIZE);
+        if (buf == NULL)
                 return false;
 
-        conn->write_buf_pos += wrote;
+        queue_local_message(conn, fv_proto_write_player_id(buf, &message));
         conn->sent_player_id = true;
 
         return true;
 }
 
+static bool
+write_features(struct fv_connection *conn)
+{
+        struct fv_proto_features message = {
+                .features = conn->features
+        };
+        uint8_t *buf;
+
+        buf = get_message_space(conn,
+                                FV_PROTO_FEATURES,
+                                FV_PROTO_FEATURES_SIZE);
+        if (buf == NULL)
+                return false;
+
+        queue_local_message(conn, fv_proto_write_features(buf, &message));
+        conn->features_queued = false;
+
+        return true;
+}
+
+static bool
+write_player_num(struct fv_connection *conn)
+{
+        struct fv_proto_player_num message = {
+                .player_num = conn->player->num
+        };
+        uint8_t *buf;
+
+        buf = get_message_space(conn,
+                                FV_PROTO_PLAYER_NUM,
+                                FV_PROTO_PLAYER_NUM_SIZE);
+        if (buf == NULL)
+                return false;
+
+        queue_local_message(conn, fv_proto_write_player_num(buf, &message));
+        conn->sent_player_num = conn->player->num;
+
+        return true;
+}
+
 static bool
 write_pong(struct fv_connection *conn)
 {
-        if (conn->write_buf_pos + conn->pong_data_length + 2 >
-            sizeof (conn->write_buf))
+        size_t length = conn->pong_data_length + 2;
+        uint8_t *buf;
+
+        if (length > get_queue_space(conn))
                 return false;
 
+        buf = get_local_space(conn, length);
+
         /* FIN bit + opcode 0xa (pong) */
-        conn->write_buf[conn->write_buf_pos++] = 0x8a;
-        conn->write_buf[conn->write_buf_pos++] = conn->pong_data_length;
-        memcpy(conn->write_buf + conn->write_buf_pos,
-               conn->pong_data,
-               conn->pong_data_length);
-        conn->write_buf_pos += conn->pong_data_length;
+        buf[0] = 0x8a;
+        buf[1] = conn->pong_data_length;
+        memcpy(buf + 2, conn->pong_data, conn->pong_data_length);
+
+        queue_local_data(conn, length);
         conn->pong_queued = false;
 
         return true;
 }
 
 static void
-fill_write_buf(struct fv_connection *conn)
+set_client_num(struct fv_connection *conn,
+               int player_num,
+               int client_num)
+{
+        size_t old_length = conn->client_nums.length / sizeof (int);
+        int *client_nums;
+        size_t i;
+
+        if (player_num >= old_length) {
+                fv_buffer_set_length(&conn->client_nums,
+                                     (player_num + 1) * sizeof (int));
+                client_nums = (int *) conn->client_nums.data;
+                for (i = old_length; i < player_num; i++)
+                        client_nums[i] = -1;
+        }
+
+        ((int *) conn->client_nums.data)[player_num] = client_num;
+}
+
+static void
+remove_client_player(struct fv_connection *conn,
+                     int player_num)
+{
+        int client_num = get_client_num(conn, player_num);
+        int *client_players = (int *) conn->client_players.data;
+        int n_client_players = (conn->client_players.length /
+                                sizeof *client_players);
+        int last_player = client_players[n_client_players - 1];
+
+        /* Move the last player into the gap so that we don't have to
+         * renumber any of the other players. The client needs the
+         * full state of the moved player under its new number.
+         */
+        if (last_player != player_num) {
+                set_client_num(conn, last_player, client_num);
+                client_players[client_num] = last_player;
+                queue_dirty_state(conn, last_player)->flags |=
+                        FV_PLAYER_STATE_ALL;
+        }
+
+        fv_buffer_set_length(&conn->client_players,
+                             (n_client_players - 1) * sizeof (int));
+        set_client_num(conn, player_num, -1);
+}
+
+static void
+add_client_player(struct fv_connection *conn,
+                  int player_num)
+{
+        set_client_num(conn,
+                       player_num,
+                       conn->client_players.length / sizeof (int));
+        fv_buffer_append(&conn->client_players,
+                         &player_num,
+                         sizeof player_num);
+}
+
+/* Updates the client's numbering of the players for the players that
+ * have been added or removed. This is only used for clients that
+ * aren't using the stable player numbers.
+ */
+static void
+update_client_players(struct fv_connection *conn)
 {
         struct fv_connection_dirty_state *state;
-        size_t new_dirty_size;
-        int n_players;
-        int wrote;
-        int i;
+        struct fv_player *player;
+        int player_num;
+        size_t i;
+
+        /* Removing a player can queue another one so the length of
+         * the queue needs to be checked on each iteration and the
+         * state needs to be looked up again afterwards */
+        for (i = 0; i < get_dirty_queue_length(conn); i++) {
+                state = get_queued_state(conn, i);
+                player_num = state->player_num;
+
+                if (state->flags & FV_CONNECTION_STATE_REMOVED) {
+                        state->flags &= ~FV_CONNECTION_STATE_REMOVED;
+                        if (get_client_num(conn, player_num) != -1) {
+                                remove_client_player(conn, player_num);
+                                state = get_queued_state(conn, i);
+                        }
+                }
 
-        if (conn->pong_queued && !write_pong(conn))
-                return;
+                if (get_client_num(conn, player_num) != -1 ||
+                    (state->flags & FV_PLAYER_STATE_ALL) == 0 ||
+                    player_num == conn->player->num)
+                        continue;
+
+                player = fv_playerbase_get_player_by_num(conn->playerbase,
+                                                         player_num);
+                if (player)
+                        add_client_player(conn, player_num);
+        }
+}
+
+/* Writes the pending speeches for the queued players and removes the
+ * players from the queue once they have nothing left to write.
+ * Returns false if the write buffer fills up.
+ */
+static bool
+flush_dirty_queue(struct fv_connection *conn)
+{
+        struct fv_connection_dirty_state *queue =
+                (struct fv_connection_dirty_state *) conn->dirty_queue.data;
+        size_t queue_length = get_dirty_queue_length(conn);
+        size_t i, dst = 0;
+        bool ret = true;
+
+        for (i = 0; i < queue_length; i++) {
+                while (ret && queue[i].pending_speeches > 0)
+                        ret = write_player_speech(conn, queue + i);
+
+                if (queue[i].pending_speeches > 0 || queue[i].flags) {
+                        queue[dst++] = queue[i];
+                } else {
+                        fv_bitmask_set(&conn->dirty_bits,
+                                       queue[i].player_num,
+                                       false);
+                }
+        }
+
+        if (dst < queue_length) {
+                fv_buffer_set_length(&conn->dirty_queue, dst * sizeof *queue);
+
+                /* Give back the memory from a big burst of changes,
+                 * such as the first update after joining */
+                if (dst == 0 &&
+                    conn->dirty_queue.size >
+                    FV_CONNECTION_MIN_DIRTY_INDEX_SIZE * sizeof *queue) {
+                        fv_buffer_destroy(&conn->dirty_queue);
+                        fv_buffer_init(&conn->dirty_queue);
+                }
+
+                rebuild_dirty_index(conn);
+        }
+
+        return ret;
+}
+
+/* Writes the messages about the game. These can be bundled */
+static void
+write_game_messages(struct fv_connection *conn)
+{
+        struct fv_connection_dirty_state *state;
+        size_t queue_length;
+        int state_mask;
+        int n_players;
+        uint8_t *buf;
+        size_t i;
 
         if (conn->player == NULL)
                 return;
@@ -447,63 +1628,87 @@ fill_write_buf(struct fv_connection *conn)
         if (conn->consistent)
                 return;
 
-        n_players = fv_playerbase_get_n_players(conn->playerbase);
+        if (has_stable_player_nums(conn)) {
+                if (conn->player->num != conn->sent_player_num &&
+                    !write_player_num(conn))
+                        return;
+
+                n_players = fv_playerbase_get_n_players(conn->playerbase);
+        } else {
+                update_client_players(conn);
+                n_players = conn->client_players.length / sizeof (int);
+        }
 
         if (n_players != conn->n_players) {
-                /* We don't send any information about the
-                 * connection's own player to the client so we don't
-                 * include it in the count.
-                 */
-                wrote = write_command(conn,
-                                      FV_PROTO_N_PLAYERS,
-                                      FV_PROTO_TYPE_UINT16,
-                                      (uint16_t) (n_players - 1),
-                                      FV_PROTO_TYPE_NONE);
-                if (wrote == -1)
+                struct fv_proto_n_players message = {
+                        .n_players = n_players
+                };
+
+                buf = get_message_space(conn,
+                                        FV_PROTO_N_PLAYERS,
+                                        FV_PROTO_N_PLAYERS_SIZE);
+                if (buf == NULL)
                         return;
 
-                conn->write_buf_pos += wrote;
+                queue_local_message(conn,
+                                    fv_proto_write_n_players(buf, &message));
                 conn->n_players = n_players;
         }
 
-        new_dirty_size = n_players * sizeof (struct fv_connection_dirty_state);
+        state_mask = FV_PLAYER_STATE_ALL | FV_CONNECTION_STATE_REMOVED;
+        if (conn->positions_held)
+                state_mask &= ~FV_PLAYER_STATE_POSITION;
 
-        if (conn->dirty_players.length > new_dirty_size)
-                fv_buffer_set_length(&conn->dirty_players, new_dirty_size);
+        queue_length = get_dirty_queue_length(conn);
 
-        for (i = 0;
-             i < (conn->dirty_players.length /
-                  sizeof (struct fv_connection_dirty_state));
-             i++) {
-                state = (struct fv_connection_dirty_state *)
-                        conn->dirty_players.data + i;
-                if (state->flags & FV_PLAYER_STATE_ALL) {
-                        if (!write_player_state(conn, i))
+        for (i = 0; i < queue_length; i++) {
+                state = get_queued_state(conn, i);
+                if (state->flags & state_mask) {
+                        if (!write_player_state(conn, state))
                                 return;
                 }
         }
 
         /* Write pending speeches after updating the player state */
-        for (i = 0;
-             i < (conn->dirty_players.length /
-                  sizeof (struct fv_connection_dirty_state));
-             i++) {
-                state = (struct fv_connection_dirty_state *)
-                        conn->dirty_players.data + i;
-                while (state->pending_speeches > 0) {
-                        if (!write_player_speech(conn, i))
-                                return;
-                }
-        }
+        if (!flush_dirty_queue(conn))
+                return;
 
-        wrote = write_command(conn,
-                              FV_PROTO_CONSISTENT,
-                              FV_PROTO_TYPE_NONE);
-        if (wrote == -1)
+        if (has_mixed_speech(conn) && !write_mixed_speeches(conn))
                 return;
 
-        conn->write_buf_pos += wrote;
+        buf = get_message_space(conn,
+                                FV_PROTO_CONSISTENT,
+                                FV_PROTO_CONSISTENT_SIZE);
+        if (buf == NULL)
+                return;
+
+        queue_local_message(conn, fv_proto_write_consistent(buf));
         conn->consistent = true;
+
+        if (conn->backpressure != FV_CONNECTION_BACKPRESSURE_HEALTHY)
+                conn->positions_held = true;
+}
+
+static void
+fill_write_buf(struct fv_connection *conn)
+{
+        /* A pong is a control frame so it can't be bundled */
+        if (conn->pong_queued && !write_pong(conn))
+                return;
+
+        /* The client doesn't know that the bundles are enabled until
+         * it gets this */
+        if (conn->features_queued && !write_features(conn))
+                return;
+
+        if (has_bundles(conn)) {
+                conn->bundling = true;
+                write_game_messages(conn);
+                end_bundle(conn);
+                conn->bundling = false;
+        } else {
+                write_game_messages(conn);
+        }
 }
 
 static bool
@@ -543,9 +1748,8 @@ handle_new_player(struct fv_connection *conn)
 {
         struct fv_connection_event event;
 
-        if (!fv_proto_read_payload(conn->message_data + 1,
-                                   conn->message_data_length - 1,
-                                   FV_PROTO_TYPE_NONE)) {
+        if (!fv_proto_read_new_player(conn->message_data + 1,
+                              conn->message_data_length - 1)) {
                 fv_log("Invalid new player command received from %s",
                        conn->remote_address_string);
                 set_error_state(conn);
@@ -561,20 +1765,19 @@ static bool
 handle_reconnect(struct fv_connection *conn)
 {
         struct fv_connection_reconnect_event event;
+        struct fv_proto_reconnect message;
 
-        if (!fv_proto_read_payload(conn->message_data + 1,
-                                   conn->message_data_length - 1,
-
-                                   FV_PROTO_TYPE_UINT64,
-                                   &event.player_id,
-
-                                   FV_PROTO_TYPE_NONE)) {
+        if (!fv_proto_read_reconnect(conn->message_data + 1,
+                                     conn->message_data_length - 1,
+                                     &message)) {
                 fv_log("Invalid reconnect command received from %s",
                        conn->remote_address_string);
                 set_error_state(conn);
                 return false;
         }
 
+        event.player_id = message.player_id;
+
         return emit_event(conn,
                           FV_CONNECTION_EVENT_RECONNECT,
                           &event.base);
@@ -584,26 +1787,23 @@ static bool
 handle_update_position(struct fv_connection *conn)
 {
         struct fv_connection_update_position_event event;
+        struct fv_proto_update_position message;
 
-        if (!fv_proto_read_payload(conn->message_data + 1,
-                                   conn->message_data_length - 1,
-
-                                   FV_PROTO_TYPE_UINT32,
-                                   &event.x_position,
-
-                                   FV_PROTO_TYPE_UINT32,
-                                   &event.y_position,
-
-                                   FV_PROTO_TYPE_UINT16,
-                                   &event.direction,
-
-                                   FV_PROTO_TYPE_NONE)) {
+        if (!fv_proto_read_update_position(conn->message_data + 1,
+                                           conn->message_data_length - 1,
+                                           &message)) {
                 fv_log("Invalid update position command received from %s",
                        conn->remote_address_string);
                 set_error_state(conn);
                 return false;
         }
 
+        event.x_position = message.x_position;
+        event.y_position = message.y_position;
+        event.direction = message.direction;
+
+        event.receive_time = conn->read_time;
+
         return emit_event(conn,
                           FV_CONNECTION_EVENT_UPDATE_POSITION,
                           &event.base);
@@ -613,20 +1813,19 @@ static bool
 handle_update_appearance(struct fv_connection *conn)
 {
         struct fv_connection_update_appearance_event event;
+        struct fv_proto_update_appearance message;
 
-        if (!fv_proto_read_payload(conn->message_data + 1,
-                                   conn->message_data_length - 1,
-
-                                   FV_PROTO_TYPE_UINT8,
-                                   &event.image,
-
-                                   FV_PROTO_TYPE_NONE)) {
+        if (!fv_proto_read_update_appearance(conn->message_data + 1,
+                                             conn->message_data_length - 1,
+                                             &message)) {
                 fv_log("Invalid update appearance command received from %s",
                        conn->remote_address_string);
                 set_error_state(conn);
                 return false;
         }
 
+        event.image = message.image;
+
         return emit_event(conn,
                           FV_CONNECTION_EVENT_UPDATE_APPEARANCE,
                           &event.base);
@@ -659,9 +1858,8 @@ handle_update_flags(struct fv_connection *conn)
 static bool
 handle_keep_alive(struct fv_connection *conn)
 {
-        if (!fv_proto_read_payload(conn->message_data + 1,
-                                   conn->message_data_length - 1,
-                                   FV_PROTO_TYPE_NONE)) {
+        if (!fv_proto_read_keep_alive(conn->message_data + 1,
+                              conn->message_data_length - 1)) {
                 fv_log("Invalid keep alive command received from %s",
                        conn->remote_address_string);
                 set_error_state(conn);
@@ -675,22 +1873,21 @@ static bool
 handle_speech(struct fv_connection *conn)
 {
         struct fv_connection_speech_event event;
+        struct fv_proto_speech message;
         int n_samples, n_channels;
 
-        if (!fv_proto_read_payload(conn->message_data + 1,
-                                   conn->message_data_length - 1,
-
-                                   FV_PROTO_TYPE_BLOB,
-                                   &event.packet_size,
-                                   &event.packet,
-
-                                   FV_PROTO_TYPE_NONE)) {
+        if (!fv_proto_read_speech(conn->message_data + 1,
+                                  conn->message_data_length - 1,
+                                  &message)) {
                 fv_log("Invalid speech command received from %s",
                        conn->remote_address_string);
                 set_error_state(conn);
                 return false;
         }
 
+        event.packet = message.packet;
+        event.packet_size = message.packet_size;
+
         if (event.packet_size > FV_PROTO_MAX_SPEECH_SIZE) {
                 fv_log("Client %s sent a speech packet that is too long %i",
                        conn->remote_address_string,
@@ -727,6 +1924,8 @@ handle_speech(struct fv_connection *conn)
                 return false;
         }
 
+        event.receive_time = conn->read_time;
+
         return emit_event(conn,
                           FV_CONNECTION_EVENT_SPEECH,
                           &event.base);
@@ -734,9 +1933,40 @@ handle_speech(struct fv_connection *conn)
         return true;
 }
 
+static bool
+handle_request_features(struct fv_connection *conn)
+{
+        struct fv_proto_request_features message;
+
+        if (!fv_proto_read_request_features(conn->message_data + 1,
+                                            conn->message_data_length - 1,
+                                            &message)) {
+                fv_log("Invalid request features command received from %s",
+                       conn->remote_address_string);
+                set_error_state(conn);
+                return false;
+        }
+
+        if (conn->player) {
+                fv_log("Client %s requested features after a hello message",
+                       conn->remote_address_string);
+                set_error_state(conn);
+                return false;
+        }
+
+        conn->features = message.features & conn->available_features;
+        conn->features_queued = true;
+
+        update_poll_flags(conn);
+
+        return true;
+}
+
 static bool
 process_message(struct fv_connection *conn)
 {
+        fv_stats_count_message_in(conn->stats, conn->message_data[0]);
+
         switch (conn->message_data[0]) {
         case FV_PROTO_NEW_PLAYER:
                 return handle_new_player(conn);
@@ -752,6 +1982,8 @@ process_message(struct fv_connection *conn)
                 return handle_keep_alive(conn);
         case FV_PROTO_SPEECH:
                 return handle_speech(conn);
+        case FV_PROTO_REQUEST_FEATURES:
+                return handle_request_features(conn);
         }
 
         fv_log("Client %s sent an unknown message ID (0x%u)",
@@ -762,10 +1994,10 @@ process_message(struct fv_connection *conn)
         return false;
 }
 
-static void
-unmask_data(uint32_t mask,
-            uint8_t *buffer,
-            size_t buffer_length)
+void
+fv_connection_unmask_data(uint32_t mask,
+                          uint8_t *buffer,
+                          size_t buffer_length)
 {
         uint32_t val;
         int i;
@@ -875,7 +2107,9 @@ process_frames(struct fv_connection *conn)
                         memcpy(&mask, data, sizeof mask);
                         data += sizeof mask;
                         length -= sizeof mask;
-                        unmask_data(mask, data, payload_length);
+                        fv_connection_unmask_data(mask,
+                                                  data,
+                                                  payload_length);
                 }
 
                 if (opcode & 0x8) {
@@ -943,6 +2177,10 @@ ws_request_line_received_cb(const char *method,
                             const char *uri,
                             void *user_data)
 {
+        struct fv_connection *conn = user_data;
+
+        conn->request_path = fv_strdup(uri);
+
         return true;
 }
 
@@ -974,8 +2212,11 @@ ws_header_received_cb(const char *field_name,
 static bool
 ws_headers_finished(struct fv_connection *conn)
 {
+        struct fv_connection_handshake_event event;
         uint8_t sha1_hash[SHA1_DIGEST_LENGTH];
         size_t encoded_size;
+        size_t reply_length;
+        uint8_t *reply;
 
         if (conn->sha1_ctx == NULL) {
                 fv_log("Client at %s sent a WebSocket header without a "
@@ -993,34 +2234,33 @@ ws_headers_finished(struct fv_connection *conn)
         conn->sha1_ctx = NULL;
 
         /* Send the WebSocket protocol response. This is the first
-         * thing we'll send to the client so there should always be
-         * enough space in the write buffer.
+         * thing we'll send to the client so it is queued regardless
+         * of the size limit.
          */
 
-        {
-                _Static_assert(FV_BASE64_ENCODED_SIZE(SHA1_DIGEST_LENGTH) +
-                               sizeof ws_header_prefix - 1 +
-                               sizeof ws_header_postfix - 1 <=
-                               sizeof conn->write_buf,
-                               "The write buffer is too small to contain the "
-                               "WebSocket protocol reply");
-        }
+        reply_length = (FV_BASE64_ENCODED_SIZE(SHA1_DIGEST_LENGTH) +
+                        sizeof ws_header_prefix - 1 +
+                        sizeof ws_header_postfix - 1);
+        reply = get_local_space(conn, reply_length);
 
-        memcpy(conn->write_buf,
+        memcpy(reply,
                ws_header_prefix,
                sizeof ws_header_prefix - 1);
         encoded_size = fv_base64_encode(sha1_hash,
                                         sizeof sha1_hash,
-                                        (char *) conn->write_buf +
+                                        (char *) reply +
                                         sizeof ws_header_prefix - 1);
         assert(encoded_size == FV_BASE64_ENCODED_SIZE(SHA1_DIGEST_LENGTH));
-        memcpy(conn->write_buf + sizeof ws_header_prefix - 1 + encoded_size,
+        memcpy(reply + sizeof ws_header_prefix - 1 + encoded_size,
                ws_header_postfix,
                sizeof ws_header_postfix - 1);
 
-        conn->write_buf_pos = (FV_BASE64_ENCODED_SIZE(SHA1_DIGEST_LENGTH) +
-                               sizeof ws_header_prefix - 1 +
-                               sizeof ws_header_postfix - 1);
+        queue_local_data(conn, reply_length);
+
+        event.path = conn->request_path ? conn->request_path : "";
+
+        if (!emit_event(conn, FV_CONNECTION_EVENT_HANDSHAKE, &event.base))
+                return false;
 
         update_poll_flags(conn);
 
@@ -1084,15 +2324,27 @@ handle_read(struct fv_connection *conn)
                           conn->read_buf + conn->read_buf_pos,
                           sizeof conn->read_buf - conn->read_buf_pos);
 
+        fv_stats_add(conn->stats, FV_STATS_READ_CALLS, 1);
+
         if (got <= 0) {
                 handle_read_error(conn, got);
         } else {
+                fv_stats_add(conn->stats, FV_STATS_BYTES_READ, got);
+
                 now = fv_main_context_get_monotonic_clock(NULL);
 
                 conn->last_update_time = now;
 
-                if (conn->player)
+                if (conn->record_latency)
+                        conn->read_time = fv_stats_get_latency_clock();
+                else
+                        conn->read_time = now;
+
+                if (conn->player) {
+                        fv_playerbase_lock(conn->playerbase);
                         conn->player->last_update_time = now;
+                        fv_playerbase_unlock(conn->playerbase);
+                }
 
                 if (conn->ws_parser) {
                         handle_ws_data(conn, got);
@@ -1107,31 +2359,78 @@ handle_read(struct fv_connection *conn)
 static void
 handle_write(struct fv_connection *conn)
 {
-        int wrote;
+        struct iovec iovecs[FV_CONNECTION_MAX_IOVECS];
+        const struct fv_connection_segment *segment;
+        size_t n_segments;
+        size_t total_length;
+        ssize_t wrote;
+        bool made_progress = false;
+        int n_iovecs;
+        int i;
 
+        fv_playerbase_lock(conn->playerbase);
+        compact_queue(conn);
         fill_write_buf(conn);
+        fv_playerbase_unlock(conn->playerbase);
+
+        n_segments = get_n_segments(conn);
+
+        /* This can be called optimistically by the main context
+         * before it knows whether there is anything to write */
+        while (conn->queued_bytes > 0) {
+                segment = get_segments(conn) + conn->first_segment;
+                n_iovecs = MIN(n_segments - conn->first_segment,
+                               FV_CONNECTION_MAX_IOVECS);
+                total_length = 0;
+
+                for (i = 0; i < n_iovecs; i++, segment++) {
+                        if (segment->frame) {
+                                iovecs[i].iov_base = (segment->frame->data +
+                                                      segment->offset);
+                        } else {
+                                iovecs[i].iov_base = (conn->local_buf.data +
+                                                      segment->offset);
+                        }
+                        iovecs[i].iov_len = segment->length;
+                        total_length += segment->length;
+                }
 
-        do {
-                wrote = write(conn->sock,
-                              conn->write_buf,
-                              conn->write_buf_pos);
-        } while (wrote == -1 && errno == EINTR);
+                do {
+                        wrote = writev(conn->sock, iovecs, n_iovecs);
+                } while (wrote == -1 && errno == EINTR);
+
+                fv_stats_add(conn->stats, FV_STATS_WRITE_CALLS, 1);
+
+                if (wrote == -1) {
+                        if (fv_file_error_from_errno(errno) ==
+                            FV_FILE_ERROR_AGAIN)
+                                break;
 
-        if (wrote == -1) {
-                if (fv_file_error_from_errno(errno) != FV_FILE_ERROR_AGAIN) {
                         fv_log("Error writing to socket for %s: %s",
-                                conn->remote_address_string,
-                                strerror(errno));
+                               conn->remote_address_string,
+                               strerror(errno));
                         set_error_state(conn);
+                        return;
                 }
-        } else {
-                memmove(conn->write_buf,
-                        conn->write_buf + wrote,
-                        conn->write_buf_pos - wrote);
-                conn->write_buf_pos -= wrote;
 
-                update_poll_flags(conn);
+                consume_queue(conn, wrote);
+                made_progress = true;
+                fv_stats_add(conn->stats, FV_STATS_BYTES_WRITTEN, wrote);
+
+                /* Stop if the socket buffer is full */
+                if (wrote < total_length) {
+                        fv_stats_add(conn->stats, FV_STATS_PARTIAL_WRITES, 1);
+                        break;
+                }
+        }
+
+        if (made_progress) {
+                conn->last_write_time =
+                        fv_main_context_get_monotonic_clock(NULL);
+                record_latencies(conn);
         }
+
+        update_poll_flags(conn);
 }
 
 static void
@@ -1157,7 +2456,16 @@ fv_connection_free(struct fv_connection *conn)
         fv_free(conn->remote_address_string);
         fv_close(conn->sock);
 
-        fv_buffer_destroy(&conn->dirty_players);
+        fv_buffer_destroy(&conn->dirty_queue);
+        fv_buffer_destroy(&conn->dirty_bits);
+        fv_free(conn->dirty_index);
+        fv_buffer_destroy(&conn->client_players);
+        fv_buffer_destroy(&conn->client_nums);
+
+        clear_queue(conn);
+        fv_buffer_destroy(&conn->segments);
+        fv_buffer_destroy(&conn->local_buf);
+        fv_buffer_destroy(&conn->latency_samples);
 
         if (conn->player)
                 conn->player->ref_count--;
@@ -1168,26 +2476,37 @@ fv_connection_free(struct fv_connection *conn)
         if (conn->sha1_ctx)
                 fv_free(conn->sha1_ctx);
 
+        fv_free(conn->request_path);
+
+        fv_stats_add(conn->stats, FV_STATS_CONNECTIONS_CLOSED, 1);
+
         fv_free(conn);
 }
 
+size_t
+fv_connection_get_base_size(void)
+{
+        return sizeof (struct fv_connection);
+}
+
 static struct fv_connection *
-fv_connection_new_for_socket(struct fv_playerbase *playerbase,
-                             int sock,
-                             const struct fv_netaddress *remote_address)
+fv_connection_new_for_socket(int sock,
+                             const struct fv_netaddress *remote_address,
+                             struct fv_stats *stats)
 {
         struct fv_connection *conn;
-        struct fv_connection_dirty_state *state;
-        int n_players;
-        int i;
 
         conn = fv_alloc(sizeof *conn);
 
+        conn->stats = stats;
+        fv_stats_add(stats, FV_STATS_CONNECTIONS_OPENED, 1);
+
         conn->sock = sock;
         conn->remote_address = *remote_address;
         conn->remote_address_string = fv_netaddress_to_string(remote_address);
-        conn->playerbase = playerbase;
+        conn->playerbase = NULL;
         conn->player = NULL;
+        conn->request_path = NULL;
         conn->ws_parser = NULL;
         conn->sha1_ctx = NULL;
         conn->pong_queued = false;
@@ -1204,26 +2523,94 @@ fv_connection_new_for_socket(struct fv_playerbase *playerbase,
                                           conn);
 
         conn->read_buf_pos = 0;
-        conn->write_buf_pos = 0;
-
-        fv_buffer_init(&conn->dirty_players);
+        fv_buffer_init(&conn->segments);
+        conn->first_segment = 0;
+        fv_buffer_init(&conn->local_buf);
+        conn->queued_bytes = 0;
+        conn->queue_end = 0;
+        conn->max_queued_bytes = FV_CONNECTION_DEFAULT_MAX_QUEUED_BYTES;
+        conn->bundling = false;
+        conn->bundle_length = 0;
+        conn->bundle_n_messages = 0;
+        conn->bundle_first_sample = 0;
+        conn->max_stall_time = FV_CONNECTION_DEFAULT_MAX_STALL_TIME;
+        conn->backpressure = FV_CONNECTION_BACKPRESSURE_HEALTHY;
+        conn->positions_held = false;
+        conn->record_latency = false;
+        conn->latency_start = 0;
+        fv_buffer_init(&conn->latency_samples);
+
+        fv_buffer_init(&conn->dirty_queue);
+        fv_buffer_init(&conn->dirty_bits);
+        conn->dirty_index_size = 0;
+        conn->dirty_index = NULL;
+        rebuild_dirty_index(conn);
+        fv_buffer_init(&conn->client_players);
+        fv_buffer_init(&conn->client_nums);
         conn->sent_player_id = false;
         conn->consistent = false;
+        conn->available_features = FV_CONNECTION_DEFAULT_AVAILABLE_FEATURES;
+        conn->features = 0;
+        conn->features_queued = false;
+        conn->sent_player_num = -1;
         conn->n_players = 0;
+        conn->mixed_speech_pos = 0;
         conn->last_update_time = fv_main_context_get_monotonic_clock(NULL);
+        conn->last_write_time = conn->last_update_time;
+        conn->read_time = conn->last_update_time;
+
+        return conn;
+}
+
+void
+fv_connection_set_playerbase(struct fv_connection *conn,
+                             struct fv_playerbase *playerbase)
+{
+        int n_players;
+        int i;
+
+        assert(conn->playerbase == NULL);
+
+        conn->playerbase = playerbase;
+
+        if (conn->record_latency)
+                conn->latency_start = fv_stats_get_latency_clock();
 
         n_players = fv_playerbase_get_n_players(playerbase);
-        fv_buffer_set_length(&conn->dirty_players,
-                             n_players *
-                             sizeof (struct fv_connection_dirty_state));
+
         for (i = 0; i < n_players; i++) {
-                state = (struct fv_connection_dirty_state *)
-                        conn->dirty_players.data + i;
-                state->flags = FV_PLAYER_STATE_ALL;
-                state->pending_speeches = 0;
+                if (fv_playerbase_get_player_by_num(playerbase, i))
+                        queue_dirty_state(conn, i)->flags = FV_PLAYER_STATE_ALL;
         }
+}
 
-        return conn;
+void
+fv_connection_detach(struct fv_connection *conn)
+{
+        remove_sources(conn);
+}
+
+void
+fv_connection_set_stats(struct fv_connection *conn,
+                        struct fv_stats *stats)
+{
+        conn->stats = stats;
+}
+
+void
+fv_connection_attach(struct fv_connection *conn)
+{
+        assert(conn->socket_source == NULL);
+
+        conn->socket_source =
+                fv_main_context_add_poll(NULL, /* context */
+                                          conn->sock,
+                                          FV_MAIN_CONTEXT_POLL_IN,
+                                          connection_poll_cb,
+                                          conn);
+        update_poll_flags(conn);
+
+        process_frames(conn);
 }
 
 struct fv_signal *
@@ -1245,8 +2632,8 @@ fv_connection_get_remote_address(struct fv_connection *conn)
 }
 
 struct fv_connection *
-fv_connection_accept(struct fv_playerbase *playerbase,
-                     int server_sock,
+fv_connection_accept(int server_sock,
+                     struct fv_stats *stats,
                      struct fv_error **error)
 {
         struct fv_netaddress address;
@@ -1277,7 +2664,7 @@ fv_connection_accept(struct fv_playerbase *playerbase,
 
         fv_netaddress_from_native(&address, &native_address);
 
-        conn = fv_connection_new_for_socket(playerbase, sock, &address);
+        conn = fv_connection_new_for_socket(sock, &address, stats);
 
         return conn;
 }
@@ -1297,6 +2684,10 @@ fv_connection_set_player(struct fv_connection *conn,
 
         conn->sent_player_id = from_reconnect;
 
+        /* Only the speech mixed from now on is sent */
+        if (player)
+                conn->mixed_speech_pos = player->n_mixed_speeches;
+
         update_poll_flags(conn);
 }
 
@@ -1306,22 +2697,6 @@ fv_connection_get_player(struct fv_connection *conn)
         return conn->player;
 }
 
-static void
-reserve_dirty_player(struct fv_connection *conn,
-                     int player_num)
-{
-        int old_length = conn->dirty_players.length;
-        int new_length = ((player_num + 1) *
-                          sizeof (struct fv_connection_dirty_state));
-
-        if (old_length < new_length) {
-                fv_buffer_set_length(&conn->dirty_players, new_length);
-                memset(conn->dirty_players.data + old_length,
-                       0,
-                       new_length - old_length);
-        }
-}
-
 void
 fv_connection_dirty_player(struct fv_connection *conn,
                            int player_num,
@@ -1335,12 +2710,14 @@ fv_connection_dirty_player(struct fv_connection *conn,
         if (conn->player && conn->player->num == player_num)
                 return;
 
-        reserve_dirty_player(conn, player_num);
-
-        state = ((struct fv_connection_dirty_state *) conn->dirty_players.data +
-                 player_num);
+        state = queue_dirty_state(conn, player_num);
         state->flags |= state_flags;
 
+        /* Held positions will be picked up by the next check */
+        if (conn->positions_held &&
+            (state_flags & ~FV_PLAYER_STATE_POSITION) == 0)
+                return;
+
         conn->consistent = false;
 
         update_poll_flags(conn);
@@ -1358,18 +2735,28 @@ fv_connection_queue_speech(struct fv_connection *conn,
         if (conn->player && conn->player->num == player_num)
                 return;
 
-        reserve_dirty_player(conn, player_num);
+        /* The client gets this speech in the mixed stream instead */
+        if (has_mixed_speech(conn))
+                return;
+
+        /* A stalled client would only receive the speech long after
+         * it is relevant */
+        if (conn->backpressure == FV_CONNECTION_BACKPRESSURE_STALLED) {
+                fv_stats_add(conn->stats, FV_STATS_DROPPED_SPEECHES, 1);
+                return;
+        }
 
-        state = ((struct fv_connection_dirty_state *) conn->dirty_players.data +
-                 player_num);
+        state = queue_dirty_state(conn, player_num);
 
         /* If the entire circular buffer is already pending then the
          * client is reading too slowly and we'll have to just drop
          * the earlier packets. This will automatically happen if we
          * just avoid changing the number of pending speeches.
          */
-        if (state->pending_speeches >= FV_PLAYER_MAX_PENDING_SPEECHES)
+        if (state->pending_speeches >= FV_PLAYER_MAX_PENDING_SPEECHES) {
+                fv_stats_add(conn->stats, FV_STATS_DROPPED_SPEECHES, 1);
                 return;
+        }
 
         state->pending_speeches++;
         conn->consistent = false;
@@ -1377,12 +2764,172 @@ fv_connection_queue_speech(struct fv_connection *conn,
         update_poll_flags(conn);
 }
 
+void
+fv_connection_queue_mixed_speech(struct fv_connection *conn)
+{
+        if (conn->player == NULL)
+                return;
+
+        if (conn->backpressure == FV_CONNECTION_BACKPRESSURE_STALLED) {
+                fv_stats_add(conn->stats,
+                             FV_STATS_DROPPED_SPEECHES,
+                             conn->player->n_mixed_speeches -
+                             conn->mixed_speech_pos);
+                conn->mixed_speech_pos = conn->player->n_mixed_speeches;
+                return;
+        }
+
+        conn->consistent = false;
+
+        update_poll_flags(conn);
+}
+
+void
+fv_connection_set_available_features(struct fv_connection *conn,
+                                     uint32_t features)
+{
+        conn->available_features = features;
+}
+
+uint32_t
+fv_connection_get_features(struct fv_connection *conn)
+{
+        return conn->features;
+}
+
+void
+fv_connection_set_max_queued_bytes(struct fv_connection *conn,
+                                   size_t max_queued_bytes)
+{
+        conn->max_queued_bytes = max_queued_bytes;
+}
+
 uint64_t
 fv_connection_get_last_update_time(struct fv_connection *conn)
 {
         return conn->last_update_time;
 }
 
+void
+fv_connection_set_max_stall_time(struct fv_connection *conn,
+                                 uint64_t max_stall_time)
+{
+        conn->max_stall_time = max_stall_time;
+}
+
+void
+fv_connection_set_record_latency(struct fv_connection *conn,
+                                 bool record_latency)
+{
+        conn->record_latency = record_latency;
+}
+
+static void
+drop_pending_speeches(struct fv_connection *conn)
+{
+        struct fv_connection_dirty_state *state;
+        size_t queue_length = get_dirty_queue_length(conn);
+        size_t i;
+
+        /* The entries will be removed from the queue the next time
+         * it is flushed */
+        for (i = 0; i < queue_length; i++) {
+                state = get_queued_state(conn, i);
+                fv_stats_add(conn->stats,
+                             FV_STATS_DROPPED_SPEECHES,
+                             state->pending_speeches);
+                state->pending_speeches = 0;
+        }
+
+        if (conn->player) {
+                fv_stats_add(conn->stats,
+                             FV_STATS_DROPPED_SPEECHES,
+                             conn->player->n_mixed_speeches -
+                             conn->mixed_speech_pos);
+                conn->mixed_speech_pos = conn->player->n_mixed_speeches;
+        }
+}
+
+bool
+fv_connection_check_backpressure(struct fv_connection *conn,
+                                 uint64_t now)
+{
+        enum fv_connection_backpressure backpressure;
+        uint64_t stall_time;
+
+        if (conn->queued_bytes == 0) {
+                /* The client has read everything so far */
+                conn->last_write_time = now;
+                backpressure = FV_CONNECTION_BACKPRESSURE_HEALTHY;
+        } else {
+                stall_time = now - conn->last_write_time;
+
+                if (conn->max_stall_time > 0 &&
+                    stall_time >= conn->max_stall_time) {
+                        fv_log("Removing connection from %s which hasn't "
+                               "read anything for %i seconds",
+                               conn->remote_address_string,
+                               (int) (stall_time / 1000000));
+                        return false;
+                }
+
+                if (stall_time >= FV_CONNECTION_STALL_TIME) {
+                        backpressure = FV_CONNECTION_BACKPRESSURE_STALLED;
+                } else if (conn->queued_bytes >=
+                           conn->max_queued_bytes / 2) {
+                        backpressure = FV_CONNECTION_BACKPRESSURE_LAGGING;
+                } else {
+                        backpressure = FV_CONNECTION_BACKPRESSURE_HEALTHY;
+                }
+        }
+
+        if (backpressure == FV_CONNECTION_BACKPRESSURE_STALLED &&
+            conn->backpressure != FV_CONNECTION_BACKPRESSURE_STALLED) {
+                fv_log("Connection from %s has stalled",
+                       conn->remote_address_string);
+                drop_pending_speeches(conn);
+        } else if (backpressure != FV_CONNECTION_BACKPRESSURE_STALLED &&
+                   conn->backpressure == FV_CONNECTION_BACKPRESSURE_STALLED) {
+                fv_log("Connection from %s has recovered",
+                       conn->remote_address_string);
+        }
+
+        conn->backpressure = backpressure;
+
+        /* Let the held back positions through. fill_write_buf will
+         * hold them again if the connection is still lagging. */
+        if (conn->positions_held) {
+                conn->positions_held = false;
+                conn->consistent = false;
+                update_poll_flags(conn);
+        }
+
+        return true;
+}
+
+enum fv_connection_backpressure
+fv_connection_get_backpressure(struct fv_connection *conn)
+{
+        return conn->backpressure;
+}
+
+void
+fv_connection_remove_player(struct fv_connection *conn,
+                            int player_num)
+{
+        struct fv_connection_dirty_state *state;
+
+        /* Anything that was pending for the player is no longer
+         * relevant */
+        state = queue_dirty_state(conn, player_num);
+        state->flags = FV_CONNECTION_STATE_REMOVED;
+        state->pending_speeches = 0;
+
+        conn->consistent = false;
+
+        update_poll_flags(conn);
+}
+
 void
 fv_connection_dirty_n_players(struct fv_connection *conn)
 {
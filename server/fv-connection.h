@@ -36,10 +36,12 @@
 #include "fv-proto.h"
 #include "fv-playerbase.h"
 #include "fv-flag.h"
+#include "fv-stats.h"
 
 enum fv_connection_event_type {
         FV_CONNECTION_EVENT_ERROR,
 
+        FV_CONNECTION_EVENT_HANDSHAKE,
         FV_CONNECTION_EVENT_NEW_PLAYER,
         FV_CONNECTION_EVENT_RECONNECT,
         FV_CONNECTION_EVENT_UPDATE_POSITION,
@@ -53,6 +55,18 @@ struct fv_connection_event {
         struct fv_connection *connection;
 };
 
+/* Emitted once all of the WebSocket headers have been received. The
+ * handler must either give the connection a playerbase with
+ * fv_connection_set_playerbase or return false after freeing or
+ * detaching the connection.
+ */
+struct fv_connection_handshake_event {
+        struct fv_connection_event base;
+
+        /* The URI from the request line */
+        const char *path;
+};
+
 struct fv_connection_reconnect_event {
         struct fv_connection_event base;
 
@@ -65,6 +79,8 @@ struct fv_connection_update_position_event {
         uint32_t x_position;
         uint32_t y_position;
         uint16_t direction;
+        /* The time that the message was read */
+        uint64_t receive_time;
 };
 
 struct fv_connection_update_appearance_event {
@@ -85,18 +101,83 @@ struct fv_connection_speech_event {
 
         const uint8_t *packet;
         size_t packet_size;
+        /* The time that the message was read */
+        uint64_t receive_time;
+};
+
+enum fv_connection_backpressure {
+        /* The client is reading the data as fast as it is queued */
+        FV_CONNECTION_BACKPRESSURE_HEALTHY,
+        /* At least half of the queue is full. Position changes are
+         * coalesced and only sent once per backpressure check. */
+        FV_CONNECTION_BACKPRESSURE_LAGGING,
+        /* Nothing has been written for a few seconds. Speech is
+         * dropped as well. */
+        FV_CONNECTION_BACKPRESSURE_STALLED,
 };
 
 struct fv_connection;
 
+#define FV_CONNECTION_DEFAULT_MAX_QUEUED_BYTES 65536
+
+/* The features that a client can enable with REQUEST_FEATURES
+ * unless fv_connection_set_available_features is called */
+#define FV_CONNECTION_DEFAULT_AVAILABLE_FEATURES \
+        (FV_PROTO_FEATURE_STABLE_PLAYER_NUMS | \
+         FV_PROTO_FEATURE_SPEECH_SEQUENCE | \
+         FV_PROTO_FEATURE_BUNDLE | \
+         FV_PROTO_FEATURE_COMPACT_POSITIONS)
+
+/* Number of seconds that a connection can be stalled before it is
+ * closed */
+#define FV_CONNECTION_DEFAULT_MAX_STALL_SECONDS 30
+#define FV_CONNECTION_DEFAULT_MAX_STALL_TIME \
+        ((uint64_t) FV_CONNECTION_DEFAULT_MAX_STALL_SECONDS * 1000000)
+
+/* The stats are the counters of the calling thread. If the
+ * connection is passed to another thread then that thread must give
+ * its own counters with fv_connection_set_stats.
+ */
 struct fv_connection *
-fv_connection_accept(struct fv_playerbase *playerbase,
-                     int server_sock,
+fv_connection_accept(int server_sock,
+                     struct fv_stats *stats,
                      struct fv_error **error);
 
+/* Sets the playerbase that the connection reports the players of.
+ * This must be called exactly once from the handshake event with the
+ * playerbase lock held.
+ */
+void
+fv_connection_set_playerbase(struct fv_connection *conn,
+                             struct fv_playerbase *playerbase);
+
+/* Stops polling the socket of the connection so that it can be
+ * passed to another thread. The other thread then calls
+ * fv_connection_attach to carry on with the handshake in its own
+ * main context. This can be called from the handshake event.
+ */
+void
+fv_connection_detach(struct fv_connection *conn);
+
+/* This may emit events for the messages that were received before
+ * the connection was detached so the connection might be freed by
+ * the time it returns.
+ */
+void
+fv_connection_attach(struct fv_connection *conn);
+
+void
+fv_connection_set_stats(struct fv_connection *conn,
+                        struct fv_stats *stats);
+
 void
 fv_connection_free(struct fv_connection *conn);
 
+/* Returns the size of the memory allocated for each connection, not
+ * counting its buffers */
+size_t
+fv_connection_get_base_size(void);
+
 struct fv_signal *
 fv_connection_get_event_signal(struct fv_connection *conn);
 
@@ -109,6 +190,64 @@ fv_connection_get_remote_address(struct fv_connection *conn);
 uint64_t
 fv_connection_get_last_update_time(struct fv_connection *conn);
 
+/* Sets the FV_PROTO_FEATURE_* bits that the client can enable with
+ * REQUEST_FEATURES. This must be called before the client sends it.
+ */
+void
+fv_connection_set_available_features(struct fv_connection *conn,
+                                     uint32_t features);
+
+/* Returns the features that the client has enabled. These can't
+ * change once the client has a player.
+ */
+uint32_t
+fv_connection_get_features(struct fv_connection *conn);
+
+/* Sets the maximum number of bytes that can be waiting to be written
+ * to the connection. Once the limit is reached no more messages are
+ * encoded until the client reads some of the data. In the meantime
+ * further changes to a player's state replace the earlier ones and
+ * only the last two seconds of speech are kept for each player.
+ */
+void
+fv_connection_set_max_queued_bytes(struct fv_connection *conn,
+                                   size_t max_queued_bytes);
+
+/* Sets the number of microseconds that the connection can have data
+ * waiting without writing any of it before it is closed. Zero means
+ * that the connection is never closed for this reason.
+ */
+void
+fv_connection_set_max_stall_time(struct fv_connection *conn,
+                                 uint64_t max_stall_time);
+
+/* Sets whether to count the time from when the position and speech
+ * messages were received until the messages made from them were
+ * written to this connection. The times are added to the latency
+ * histograms of the connection's stats. This must be called before
+ * the handshake is finished. The receive times in the events use the
+ * uncached clock of fv_stats_get_latency_clock when this is set.
+ */
+void
+fv_connection_set_record_latency(struct fv_connection *conn,
+                                 bool record_latency);
+
+/* Updates the backpressure state of the connection based on the
+ * amount of queued data and the time since anything was last
+ * written. This should be called about once a second because it also
+ * releases the position changes that have been held back while the
+ * connection is lagging. If the connection has been stalled for too
+ * long this will return false and the caller should remove it. The
+ * connection state is shared with the other threads so this must be
+ * called with the playerbase lock held.
+ */
+bool
+fv_connection_check_backpressure(struct fv_connection *conn,
+                                 uint64_t now);
+
+enum fv_connection_backpressure
+fv_connection_get_backpressure(struct fv_connection *conn);
+
 void
 fv_connection_set_player(struct fv_connection *conn,
                          struct fv_player *player,
@@ -122,11 +261,34 @@ fv_connection_dirty_player(struct fv_connection *conn,
                            int player_num,
                            int state_flags);
 
+/* Queues a speech packet of the given player. This does nothing if
+ * the client is using the mixed speech feature. */
 void
 fv_connection_queue_speech(struct fv_connection *conn,
                            int player_num);
 
+/* Tells the connection that there is new mixed speech for its
+ * player. Only the clients using the mixed speech feature send it. */
+void
+fv_connection_queue_mixed_speech(struct fv_connection *conn);
+
+/* Tells the connection that the player with the given number has
+ * been removed from the playerbase. The slot might be reused for a
+ * new player.
+ */
+void
+fv_connection_remove_player(struct fv_connection *conn,
+                            int player_num);
+
 void
 fv_connection_dirty_n_players(struct fv_connection *conn);
 
+/* XORs the payload of a WebSocket frame with its mask. This is only
+ * public so that the benchmarks can time it.
+ */
+void
+fv_connection_unmask_data(uint32_t mask,
+                          uint8_t *buffer,
+                          size_t buffer_length);
+
 #endif /* FV_CONNECTION_H */
@@ -0,0 +1,80 @@
+/*
+ * Babiling
+ * Copyright (C) 2026  Neil Roberts
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <string.h>
+#include <pthread.h>
+
+#include "fv-frame.h"
+#include "fv-util.h"
+
+#ifndef HAVE_SYNC_REF_COUNT
+static pthread_mutex_t
+ref_count_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
+static int
+add_ref_count(struct fv_frame *frame,
+              int amount)
+{
+#ifdef HAVE_SYNC_REF_COUNT
+        return __sync_add_and_fetch(&frame->ref_count, amount);
+#else
+        int ret;
+
+        pthread_mutex_lock(&ref_count_mutex);
+        ret = (frame->ref_count += amount);
+        pthread_mutex_unlock(&ref_count_mutex);
+
+        return ret;
+#endif
+}
+
+struct fv_frame *
+fv_frame_new(const uint8_t *data,
+             size_t length)
+{
+        struct fv_frame *frame = fv_alloc(sizeof *frame + length);
+
+        frame->ref_count = 1;
+        frame->length = length;
+        memcpy(frame->data, data, length);
+
+        return frame;
+}
+
+struct fv_frame *
+fv_frame_ref(struct fv_frame *frame)
+{
+        add_ref_count(frame, 1);
+
+        return frame;
+}
+
+void
+fv_frame_unref(struct fv_frame *frame)
+{
+        if (add_ref_count(frame, -1) <= 0)
+                fv_free(frame);
+}
@@ -0,0 +1,52 @@
+/*
+ * Babiling
+ * Copyright (C) 2026  Neil Roberts
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+#ifndef FV_FRAME_H
+#define FV_FRAME_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* An encoded WebSocket frame that can be shared between connections
+ * so that a message that is the same for every recipient only has to
+ * be encoded once. The data can't be modified after it is created.
+ * The reference count is atomic so that the connections can release
+ * the frames after writing them without taking any locks.
+ */
+struct fv_frame {
+        int ref_count;
+        size_t length;
+        uint8_t data[];
+};
+
+struct fv_frame *
+fv_frame_new(const uint8_t *data,
+             size_t length);
+
+struct fv_frame *
+fv_frame_ref(struct fv_frame *frame);
+
+void
+fv_frame_unref(struct fv_frame *frame);
+
+#endif /* FV_FRAME_H */
@@ -35,22 +35,77 @@
 #include <limits.h>
 #include <time.h>
 #include <pthread.h>
+#include <poll.h>
 
 #include "fv-main-context.h"
 #include "fv-list.h"
 #include "fv-util.h"
 #include "fv-slice.h"
+#ifdef HAVE_IO_URING
+#include "fv-uring.h"
+#endif
 
 /* This is a simple replacement for the GMainLoop which uses
    epoll. The hope is that it will scale to more connections easily
    because it doesn't use poll which needs to upload the set of file
    descriptors every time it blocks and it doesn't have to walk the
-   list of file descriptors to find out which object it belongs to */
+   list of file descriptors to find out which object it belongs to.
+
+   Changing the flags of a poll source doesn't immediately make a
+   system call. Instead the source is put in a list of pending sources
+   which is flushed once per iteration just before waiting for the
+   next events. If a source starts wanting to write then its callback
+   is first invoked optimistically with POLL_OUT. Usually the socket
+   buffer has space so the write succeeds and the source goes back to
+   only wanting to read without ever registering for EPOLLOUT. That
+   way broadcasting to many connections costs at most one system call
+   per connection per iteration.
+
+   If io_uring is available then it is used instead of epoll. Each
+   poll source then has a one-shot poll request in the ring which is
+   rearmed after it is dispatched. Flushing the pending sources only
+   queues requests in the submission queue so they are all submitted
+   in the same system call that waits for the next events. */
 
 struct fv_error_domain
 fv_main_context_error;
 
-struct fv_main_context_bucket;
+/* The timeouts are stored in a hierarchical timer wheel with a
+ * resolution of one millisecond. Each level has 64 slots and each
+ * slot in a level covers 64 times as much time as a slot in the level
+ * below. A timeout is stored in the lowest level where its expiry time
+ * only differs from the current time in the bits for that level.
+ * Whenever the current time crosses the boundary of a slot in a
+ * higher level the timeouts in that slot are moved down. Adding and
+ * removing a timeout is therefore O(1). With four levels the wheel
+ * covers about 4.5 hours. Longer timeouts are put in the furthest slot
+ * that can be reached and are moved again when it is cascaded.
+ */
+#define FV_MAIN_CONTEXT_WHEEL_BITS 6
+#define FV_MAIN_CONTEXT_WHEEL_SLOTS (1 << FV_MAIN_CONTEXT_WHEEL_BITS)
+#define FV_MAIN_CONTEXT_WHEEL_MASK (FV_MAIN_CONTEXT_WHEEL_SLOTS - 1)
+#define FV_MAIN_CONTEXT_WHEEL_LEVELS 4
+#define FV_MAIN_CONTEXT_WHEEL_RANGE                                     \
+        (UINT64_C(1) << (FV_MAIN_CONTEXT_WHEEL_BITS *                   \
+                         FV_MAIN_CONTEXT_WHEEL_LEVELS))
+/* The slots of the top level can wrap around to the next window so
+ * one slot is left out to make sure that a timeout is never put in
+ * the slot that is currently being processed */
+#define FV_MAIN_CONTEXT_WHEEL_MAX_DELTA                                 \
+        (FV_MAIN_CONTEXT_WHEEL_RANGE -                                  \
+         (FV_MAIN_CONTEXT_WHEEL_RANGE >> FV_MAIN_CONTEXT_WHEEL_BITS))
+
+struct fv_main_context_wheel_level {
+        /* Bitmask of the slots that have any timeouts */
+        uint64_t occupied;
+        struct fv_list slots[FV_MAIN_CONTEXT_WHEEL_SLOTS];
+};
+
+/* Size of the submission queue when using io_uring. There is always
+ * at most one poll request per source and at most one remove request
+ * so this just needs to be big enough to avoid having to submit in
+ * the middle of dispatching events */
+#define FV_MAIN_CONTEXT_URING_ENTRIES 4096
 
 struct fv_main_context {
         /* This mutex only guards access to n_sources, the
@@ -72,10 +127,23 @@ struct fv_main_context {
         unsigned int events_size;
         struct epoll_event *events;
 
+#ifdef HAVE_IO_URING
+        /* If this is true then the uring is used instead of epoll_fd */
+        bool use_uring;
+        struct fv_uring uring;
+#endif
+
+        /* List of poll sources whose flags have changed or which need
+         * to be rearmed before the next wait */
+        struct fv_list pending_sources;
+
         /* List of quit sources. All of these get invoked when a quit signal
            is received */
         struct fv_list quit_sources;
 
+        /* List of sources that get invoked when SIGUSR1 is received */
+        struct fv_list usr1_sources;
+
         struct fv_list idle_sources;
 
         struct fv_main_context_source *async_pipe_source;
@@ -84,6 +152,7 @@ struct fv_main_context {
 
         void (* old_int_handler)(int);
         void (* old_term_handler)(int);
+        void (* old_usr1_handler)(int);
 
         bool monotonic_time_valid;
         int64_t monotonic_time;
@@ -91,8 +160,17 @@ struct fv_main_context {
         bool wall_time_valid;
         int64_t wall_time;
 
-        struct fv_list buckets;
-        int64_t last_timer_time;
+        /* Number of times the thread has waited for events. Other
+         * threads can read this for the statistics. */
+        uint64_t n_polls;
+
+        /* The time in milliseconds of the next slot of the timer
+         * wheel to be processed. All timeouts before this have already
+         * been emitted */
+        uint64_t wheel_time;
+        int n_timeouts;
+        struct fv_main_context_wheel_level
+        wheel[FV_MAIN_CONTEXT_WHEEL_LEVELS];
 
         /* This allocator is protected by the idle_mutex */
         struct fv_slice_allocator source_allocator;
@@ -103,7 +181,8 @@ struct fv_main_context_source {
                 FV_MAIN_CONTEXT_POLL_SOURCE,
                 FV_MAIN_CONTEXT_TIMER_SOURCE,
                 FV_MAIN_CONTEXT_IDLE_SOURCE,
-                FV_MAIN_CONTEXT_QUIT_SOURCE
+                FV_MAIN_CONTEXT_QUIT_SOURCE,
+                FV_MAIN_CONTEXT_USR1_SOURCE
         } type;
 
         union {
@@ -111,7 +190,28 @@ struct fv_main_context_source {
                 struct {
                         int fd;
                         enum fv_main_context_poll_flags current_flags;
+                        /* The flags that epoll is currently waiting
+                         * for. This can lag behind current_flags
+                         * until the pending sources are flushed */
+                        enum fv_main_context_poll_flags registered_flags;
                         struct fv_main_context_source *idle_source;
+                        struct fv_list pending_link;
+                        bool pending;
+                        /* Set when the source starts wanting to write
+                         * so that the write can be attempted before
+                         * waiting for POLL_OUT */
+                        bool try_write;
+#ifdef HAVE_IO_URING
+                        /* The flags of the poll request that is
+                         * currently in the ring or zero if there
+                         * isn't one */
+                        enum fv_main_context_poll_flags armed_flags;
+                        bool poll_cancelling;
+                        /* Set if the source has been removed while
+                         * a request was still in the ring. The source
+                         * will be freed once the request completes */
+                        bool poll_removed;
+#endif
                 };
 
                 /* Quit sources */
@@ -119,6 +219,11 @@ struct fv_main_context_source {
                         struct fv_list quit_link;
                 };
 
+                /* SIGUSR1 sources */
+                struct {
+                        struct fv_list usr1_link;
+                };
+
                 /* Idle sources */
                 struct {
                         struct fv_list idle_link;
@@ -126,8 +231,15 @@ struct fv_main_context_source {
 
                 /* Timer sources */
                 struct {
-                        struct fv_main_context_bucket *bucket;
                         struct fv_list timer_link;
+                        uint64_t expiry;
+                        int interval;
+                        /* This is FV_MAIN_CONTEXT_WHEEL_LEVELS
+                         * while the timeout is in the list that
+                         * emit_slot is walking rather than in a slot
+                         * of the wheel */
+                        uint8_t timer_level;
+                        uint8_t timer_slot;
                 };
         };
 
@@ -137,25 +249,46 @@ struct fv_main_context_source {
         struct fv_main_context *mc;
 };
 
-struct fv_main_context_bucket {
-        struct fv_list link;
-        struct fv_list sources;
-        int minutes;
-        int minutes_passed;
-};
+/* Each thread can have its own default context which is used
+ * whenever NULL is passed to one of the functions */
+static pthread_once_t fv_main_context_key_once = PTHREAD_ONCE_INIT;
+static pthread_key_t fv_main_context_key;
 
-FV_SLICE_ALLOCATOR(struct fv_main_context_bucket,
-                    fv_main_context_bucket_allocator);
+/* The first context to be created handles SIGINT and SIGTERM and
+ * emits the quit sources. It also handles SIGUSR1. */
+static struct fv_main_context *fv_main_context_signal_context = NULL;
+
+static void
+create_key(void)
+{
+        pthread_key_create(&fv_main_context_key, NULL /* destructor */);
+}
+
+void
+fv_main_context_set_thread_default(struct fv_main_context *mc)
+{
+        pthread_once(&fv_main_context_key_once, create_key);
+        pthread_setspecific(fv_main_context_key, mc);
 
-static struct fv_main_context *fv_main_context_default = NULL;
+        if (mc)
+                mc->main_thread = pthread_self();
+}
 
 struct fv_main_context *
 fv_main_context_get_default(struct fv_error **error)
 {
-        if (fv_main_context_default == NULL)
-                fv_main_context_default = fv_main_context_new(error);
+        struct fv_main_context *mc;
 
-        return fv_main_context_default;
+        pthread_once(&fv_main_context_key_once, create_key);
+        mc = pthread_getspecific(fv_main_context_key);
+
+        if (mc == NULL) {
+                mc = fv_main_context_new(error);
+                if (mc)
+                        pthread_setspecific(fv_main_context_key, mc);
+        }
+
+        return mc;
 }
 
 static struct fv_main_context *
@@ -180,8 +313,9 @@ async_pipe_cb(struct fv_main_context_source *source,
               void *user_data)
 {
         struct fv_main_context *mc = user_data;
-        struct fv_main_context_source *quit_source;
+        struct fv_main_context_source *quit_source, *usr1_source;
         fv_main_context_quit_callback callback;
+        fv_main_context_usr1_callback usr1_callback;
         uint8_t byte;
 
         if (read(mc->async_pipe[0], &byte, sizeof(byte)) == -1) {
@@ -193,6 +327,11 @@ async_pipe_cb(struct fv_main_context_source *source,
                         callback = quit_source->callback;
                         callback(quit_source, quit_source->user_data);
                 }
+        } else if (byte == 'U') {
+                fv_list_for_each(usr1_source, &mc->usr1_sources, usr1_link) {
+                        usr1_callback = usr1_source->callback;
+                        usr1_callback(usr1_source, usr1_source->user_data);
+                }
         }
 }
 
@@ -206,9 +345,37 @@ send_async_byte(struct fv_main_context *mc,
 static void
 fv_main_context_quit_signal_cb(int signum)
 {
-        struct fv_main_context *mc = fv_main_context_get_default_or_abort();
+        send_async_byte(fv_main_context_signal_context, 'Q');
+}
+
+static void
+fv_main_context_usr1_signal_cb(int signum)
+{
+        send_async_byte(fv_main_context_signal_context, 'U');
+}
 
-        send_async_byte(mc, 'Q');
+static uint64_t
+get_wheel_now(struct fv_main_context *mc)
+{
+        return fv_main_context_get_monotonic_clock(mc) / 1000;
+}
+
+static void
+init_wheel(struct fv_main_context *mc)
+{
+        struct fv_main_context_wheel_level *level;
+        int i, j;
+
+        for (i = 0; i < FV_MAIN_CONTEXT_WHEEL_LEVELS; i++) {
+                level = mc->wheel + i;
+                level->occupied = 0;
+                for (j = 0; j < FV_MAIN_CONTEXT_WHEEL_SLOTS; j++)
+                        fv_list_init(level->slots + j);
+        }
+
+        mc->n_timeouts = 0;
+        mc->monotonic_time_valid = false;
+        mc->wheel_time = get_wheel_now(mc);
 }
 
 static void
@@ -225,13 +392,12 @@ init_main_context(struct fv_main_context *mc,
         mc->events_size = 0;
         mc->monotonic_time_valid = false;
         mc->wall_time_valid = false;
+        mc->n_polls = 0;
         fv_list_init(&mc->quit_sources);
+        fv_list_init(&mc->usr1_sources);
         fv_list_init(&mc->idle_sources);
-        fv_list_init(&mc->buckets);
-        mc->last_timer_time = fv_main_context_get_monotonic_clock(mc);
-
-        mc->old_int_handler = signal(SIGINT, fv_main_context_quit_signal_cb);
-        mc->old_term_handler = signal(SIGTERM, fv_main_context_quit_signal_cb);
+        init_wheel(mc);
+        fv_list_init(&mc->pending_sources);
 
         if (pipe(mc->async_pipe) == -1) {
                 fv_warning("Failed to create pipe: %s",
@@ -245,13 +411,42 @@ init_main_context(struct fv_main_context *mc,
         }
 
         mc->main_thread = pthread_self();
+
+        if (fv_main_context_signal_context == NULL) {
+                fv_main_context_signal_context = mc;
+                mc->old_int_handler =
+                        signal(SIGINT, fv_main_context_quit_signal_cb);
+                mc->old_term_handler =
+                        signal(SIGTERM, fv_main_context_quit_signal_cb);
+                mc->old_usr1_handler =
+                        signal(SIGUSR1, fv_main_context_usr1_signal_cb);
+        }
 }
 
 struct fv_main_context *
 fv_main_context_new(struct fv_error **error)
 {
+        struct fv_main_context *mc;
         int fd;
 
+#ifdef HAVE_IO_URING
+        struct fv_uring uring;
+
+        /* If io_uring isn't supported by the kernel then we'll
+         * silently fall back to epoll */
+        if (fv_uring_init(&uring,
+                          FV_MAIN_CONTEXT_URING_ENTRIES,
+                          NULL /* error */)) {
+                mc = fv_alloc(sizeof *mc);
+                mc->use_uring = true;
+                mc->uring = uring;
+
+                init_main_context(mc, -1 /* epoll_fd */);
+
+                return mc;
+        }
+#endif
+
         fd = epoll_create(16);
 
         if (fd == -1) {
@@ -270,7 +465,11 @@ fv_main_context_new(struct fv_error **error)
 
                 return NULL;
         } else {
-                struct fv_main_context *mc = fv_alloc(sizeof *mc);
+                mc = fv_alloc(sizeof *mc);
+
+#ifdef HAVE_IO_URING
+                mc->use_uring = false;
+#endif
 
                 init_main_context(mc, fd);
 
@@ -291,6 +490,168 @@ get_epoll_events(enum fv_main_context_poll_flags flags)
         return events;
 }
 
+static void
+queue_pending(struct fv_main_context_source *source)
+{
+        if (source->pending)
+                return;
+
+        fv_list_insert(&source->mc->pending_sources, &source->pending_link);
+        source->pending = true;
+}
+
+static void
+unqueue_pending(struct fv_main_context_source *source)
+{
+        if (!source->pending)
+                return;
+
+        fv_list_remove(&source->pending_link);
+        source->pending = false;
+}
+
+#ifdef HAVE_IO_URING
+
+static void
+cancel_poll(struct fv_main_context_source *source)
+{
+        struct io_uring_sqe *sqe;
+
+        if (source->poll_cancelling)
+                return;
+
+        /* The completion for the cancelled request will cause the
+         * source to be rearmed with its current flags. The completion
+         * of the remove request itself is ignored because it has no
+         * user data */
+        sqe = fv_uring_get_sqe(&source->mc->uring);
+        sqe->opcode = IORING_OP_POLL_REMOVE;
+        sqe->fd = -1;
+        sqe->addr = (uintptr_t) source;
+
+        source->poll_cancelling = true;
+}
+
+static uint32_t
+get_poll_events(enum fv_main_context_poll_flags flags)
+{
+        uint32_t events = 0;
+
+        if (flags & FV_MAIN_CONTEXT_POLL_IN)
+                events |= POLLIN | POLLRDHUP;
+        if (flags & FV_MAIN_CONTEXT_POLL_OUT)
+                events |= POLLOUT;
+
+#ifdef HAVE_BIG_ENDIAN
+        /* The kernel expects the two halves to be swapped */
+        events = (events << 16) | (events >> 16);
+#endif
+
+        return events;
+}
+
+static void
+register_source_uring(struct fv_main_context_source *source)
+{
+        struct io_uring_sqe *sqe;
+
+        if (source->armed_flags) {
+                /* If the request in the ring is waiting for a subset
+                 * of the new flags then it needs to be replaced.
+                 * Otherwise the extra flags will just be ignored when
+                 * it completes */
+                if ((source->current_flags & ~source->armed_flags))
+                        cancel_poll(source);
+                return;
+        }
+
+        if (source->current_flags == 0)
+                return;
+
+        sqe = fv_uring_get_sqe(&source->mc->uring);
+        sqe->opcode = IORING_OP_POLL_ADD;
+        sqe->fd = source->fd;
+        sqe->poll32_events = get_poll_events(source->current_flags);
+        sqe->user_data = (uintptr_t) source;
+
+        source->armed_flags = source->current_flags;
+}
+
+static void
+free_source(struct fv_main_context *mc,
+            struct fv_main_context_source *source)
+{
+        pthread_mutex_lock(&mc->idle_mutex);
+        fv_slice_free(&mc->source_allocator, source);
+        pthread_mutex_unlock(&mc->idle_mutex);
+}
+
+static void
+handle_completion(struct fv_main_context *mc,
+                  uint64_t user_data,
+                  int32_t res)
+{
+        struct fv_main_context_source *source =
+                (struct fv_main_context_source *) (uintptr_t) user_data;
+        fv_main_context_poll_callback callback;
+        enum fv_main_context_poll_flags flags;
+
+        /* Completions for the remove requests have no user data */
+        if (source == NULL)
+                return;
+
+        source->armed_flags = 0;
+        source->poll_cancelling = false;
+
+        if (source->poll_removed) {
+                free_source(mc, source);
+                return;
+        }
+
+        /* Poll requests are one-shot so the source needs to be
+         * rearmed. This is done before invoking the callback because
+         * it might remove the source */
+        queue_pending(source);
+
+        if (res < 0) {
+                if (res != -ECANCELED)
+                        fv_warning("io_uring poll failed: %s",
+                                   strerror(-res));
+                return;
+        }
+
+        flags = 0;
+
+        if (res & POLLOUT)
+                flags |= FV_MAIN_CONTEXT_POLL_OUT;
+        if (res & (POLLIN | POLLRDHUP))
+                flags |= FV_MAIN_CONTEXT_POLL_IN;
+        if (res & POLLHUP) {
+                /* This is handled in the same way as for epoll */
+                if ((source->current_flags & FV_MAIN_CONTEXT_POLL_IN))
+                        flags |= FV_MAIN_CONTEXT_POLL_IN;
+                else
+                        flags |= FV_MAIN_CONTEXT_POLL_ERROR;
+        }
+        if (res & POLLERR)
+                flags |= FV_MAIN_CONTEXT_POLL_ERROR;
+
+        /* The flags may have been reduced since the request was
+         * submitted */
+        flags &= source->current_flags | FV_MAIN_CONTEXT_POLL_ERROR;
+
+        if (flags == 0)
+                return;
+
+        if ((flags & FV_MAIN_CONTEXT_POLL_OUT))
+                source->try_write = false;
+
+        callback = source->callback;
+        callback(source, source->fd, flags, source->user_data);
+}
+
+#endif /* HAVE_IO_URING */
+
 static void
 poll_idle_cb(struct fv_main_context_source *source,
              void *user_data)
@@ -338,6 +699,20 @@ fv_main_context_add_poll(struct fv_main_context *mc,
         source->type = FV_MAIN_CONTEXT_POLL_SOURCE;
         source->user_data = user_data;
         source->idle_source = NULL;
+        source->current_flags = flags;
+        source->registered_flags = flags;
+        source->pending = false;
+        source->try_write = false;
+
+#ifdef HAVE_IO_URING
+        if (mc->use_uring) {
+                source->armed_flags = 0;
+                source->poll_cancelling = false;
+                source->poll_removed = false;
+                queue_pending(source);
+                return source;
+        }
+#endif
 
         event.events = get_epoll_events(flags);
         event.data.ptr = source;
@@ -360,8 +735,6 @@ fv_main_context_add_poll(struct fv_main_context *mc,
                 }
         }
 
-        source->current_flags = flags;
-
         return source;
 }
 
@@ -369,26 +742,93 @@ void
 fv_main_context_modify_poll(struct fv_main_context_source *source,
                              enum fv_main_context_poll_flags flags)
 {
-        struct epoll_event event;
-
         fv_return_if_fail(source->type == FV_MAIN_CONTEXT_POLL_SOURCE);
 
         if (source->current_flags == flags)
                 return;
 
-        if (source->idle_source == NULL) {
-                event.events = get_epoll_events(flags);
-                event.data.ptr = source;
+        if ((flags & FV_MAIN_CONTEXT_POLL_OUT) &&
+            !(source->current_flags & FV_MAIN_CONTEXT_POLL_OUT))
+                source->try_write = true;
 
-                if (epoll_ctl(source->mc->epoll_fd,
-                              EPOLL_CTL_MOD,
-                              source->fd,
-                              &event) == -1)
-                        fv_warning("EPOLL_CTL_MOD failed: %s",
-                                    strerror(errno));
+        source->current_flags = flags;
+
+        /* The change will be applied when the pending sources are
+         * flushed before the next wait */
+        queue_pending(source);
+}
+
+static void
+register_source_epoll(struct fv_main_context_source *source)
+{
+        struct epoll_event event;
+
+        if (source->idle_source ||
+            source->registered_flags == source->current_flags)
+                return;
+
+        event.events = get_epoll_events(source->current_flags);
+        event.data.ptr = source;
+
+        if (epoll_ctl(source->mc->epoll_fd,
+                      EPOLL_CTL_MOD,
+                      source->fd,
+                      &event) == -1)
+                fv_warning("EPOLL_CTL_MOD failed: %s",
+                            strerror(errno));
+
+        source->registered_flags = source->current_flags;
+}
+
+static void
+flush_pending_sources(struct fv_main_context *mc)
+{
+        struct fv_main_context_source *source;
+        fv_main_context_poll_callback callback;
+        struct fv_list flushed_sources;
+
+        fv_list_init(&flushed_sources);
+
+        /* The callbacks can modify or remove any source, including
+         * adding more pending sources, so each source is moved to a
+         * separate list before its callback is invoked */
+        while (!fv_list_empty(&mc->pending_sources)) {
+                source = fv_container_of(mc->pending_sources.next,
+                                         struct fv_main_context_source,
+                                         pending_link);
+                fv_list_remove(&source->pending_link);
+                fv_list_insert(&flushed_sources, &source->pending_link);
+
+                if (!source->try_write ||
+                    !(source->current_flags & FV_MAIN_CONTEXT_POLL_OUT))
+                        continue;
+
+                source->try_write = false;
+
+                callback = source->callback;
+                callback(source,
+                         source->fd,
+                         FV_MAIN_CONTEXT_POLL_OUT,
+                         source->user_data);
         }
 
-        source->current_flags = flags;
+        /* Anything that still wants to write now needs to wait for
+         * the socket to become writable */
+        while (!fv_list_empty(&flushed_sources)) {
+                source = fv_container_of(flushed_sources.next,
+                                         struct fv_main_context_source,
+                                         pending_link);
+                unqueue_pending(source);
+
+#ifdef HAVE_IO_URING
+                if (mc->use_uring) {
+                        register_source_uring(source);
+                        continue;
+                }
+#endif
+
+                register_source_epoll(source);
+        }
 }
 
 struct fv_main_context_source *
@@ -416,30 +856,92 @@ fv_main_context_add_quit(struct fv_main_context *mc,
         return source;
 }
 
-static struct fv_main_context_bucket *
-get_bucket(struct fv_main_context *mc, int minutes)
+struct fv_main_context_source *
+fv_main_context_add_usr1(struct fv_main_context *mc,
+                          fv_main_context_usr1_callback callback,
+                          void *user_data)
 {
-        struct fv_main_context_bucket *bucket;
+        struct fv_main_context_source *source;
+
+        if (mc == NULL)
+                mc = fv_main_context_get_default_or_abort();
 
-        fv_list_for_each(bucket, &mc->buckets, link) {
-                if (bucket->minutes == minutes)
-                        return bucket;
+        pthread_mutex_lock(&mc->idle_mutex);
+        source = fv_slice_alloc(&mc->source_allocator);
+        mc->n_sources++;
+        pthread_mutex_unlock(&mc->idle_mutex);
+
+        source->mc = mc;
+        source->callback = callback;
+        source->type = FV_MAIN_CONTEXT_USR1_SOURCE;
+        source->user_data = user_data;
+
+        fv_list_insert(&mc->usr1_sources, &source->usr1_link);
+
+        return source;
+}
+
+static void
+insert_timeout(struct fv_main_context_source *source)
+{
+        struct fv_main_context *mc = source->mc;
+        struct fv_main_context_wheel_level *level;
+        uint64_t expiry = source->expiry;
+        int level_num, shift, slot;
+
+        /* Timeouts that have already expired go in the next slot */
+        if (expiry < mc->wheel_time)
+                expiry = mc->wheel_time;
+        /* Timeouts that are beyond the range of the wheel go in the
+         * furthest slot and will be reinserted when it is cascaded */
+        if (expiry - mc->wheel_time >= FV_MAIN_CONTEXT_WHEEL_MAX_DELTA)
+                expiry = mc->wheel_time + FV_MAIN_CONTEXT_WHEEL_MAX_DELTA - 1;
+
+        for (level_num = 0;
+             level_num < FV_MAIN_CONTEXT_WHEEL_LEVELS - 1;
+             level_num++) {
+                shift = (level_num + 1) * FV_MAIN_CONTEXT_WHEEL_BITS;
+                if ((expiry >> shift) == (mc->wheel_time >> shift))
+                        break;
         }
 
-        bucket = fv_slice_alloc(&fv_main_context_bucket_allocator);
-        fv_list_init(&bucket->sources);
-        bucket->minutes = minutes;
-        bucket->minutes_passed = 0;
-        fv_list_insert(&mc->buckets, &bucket->link);
+        shift = level_num * FV_MAIN_CONTEXT_WHEEL_BITS;
+        slot = (expiry >> shift) & FV_MAIN_CONTEXT_WHEEL_MASK;
+        level = mc->wheel + level_num;
 
-        return bucket;
+        fv_list_insert(level->slots[slot].prev, &source->timer_link);
+        level->occupied |= UINT64_C(1) << slot;
+
+        source->timer_level = level_num;
+        source->timer_slot = slot;
+}
+
+static void
+unlink_timeout(struct fv_main_context_source *source)
+{
+        struct fv_main_context_wheel_level *level;
+        struct fv_list *slot;
+
+        fv_list_remove(&source->timer_link);
+
+        /* If the timeout was waiting to be emitted then its old slot
+         * is no longer the list it was in and may have newer
+         * timeouts in it */
+        if (source->timer_level >= FV_MAIN_CONTEXT_WHEEL_LEVELS)
+                return;
+
+        level = source->mc->wheel + source->timer_level;
+        slot = level->slots + source->timer_slot;
+
+        if (fv_list_empty(slot))
+                level->occupied &= ~(UINT64_C(1) << source->timer_slot);
 }
 
 struct fv_main_context_source *
-fv_main_context_add_timer(struct fv_main_context *mc,
-                           int minutes,
-                           fv_main_context_timer_callback callback,
-                           void *user_data)
+fv_main_context_add_timeout(struct fv_main_context *mc,
+                             int ms,
+                             fv_main_context_timer_callback callback,
+                             void *user_data)
 {
         struct fv_main_context_source *source;
 
@@ -452,16 +954,35 @@ fv_main_context_add_timer(struct fv_main_context *mc,
         pthread_mutex_unlock(&mc->idle_mutex);
 
         source->mc = mc;
-        source->bucket = get_bucket(mc, minutes);
         source->callback = callback;
         source->type = FV_MAIN_CONTEXT_TIMER_SOURCE;
         source->user_data = user_data;
+        /* A zero interval would make the timeout fire forever
+         * without ever getting back to the poll */
+        source->interval = MAX(ms, 1);
+        source->expiry = get_wheel_now(mc) + source->interval;
+
+        insert_timeout(source);
 
-        fv_list_insert(&source->bucket->sources, &source->timer_link);
+        mc->n_timeouts++;
 
         return source;
 }
 
+void
+fv_main_context_modify_timeout(struct fv_main_context_source *source,
+                                int ms)
+{
+        fv_return_if_fail(source->type == FV_MAIN_CONTEXT_TIMER_SOURCE);
+
+        unlink_timeout(source);
+
+        source->interval = MAX(ms, 1);
+        source->expiry = get_wheel_now(source->mc) + source->interval;
+
+        insert_timeout(source);
+}
+
 static void
 wakeup_main_loop(struct fv_main_context *mc)
 {
@@ -501,11 +1022,29 @@ void
 fv_main_context_remove_source(struct fv_main_context_source *source)
 {
         struct fv_main_context *mc = source->mc;
-        struct fv_main_context_bucket *bucket;
         struct epoll_event event;
 
         switch (source->type) {
         case FV_MAIN_CONTEXT_POLL_SOURCE:
+                unqueue_pending(source);
+
+#ifdef HAVE_IO_URING
+                if (mc->use_uring) {
+
+                        if (source->armed_flags) {
+                                cancel_poll(source);
+                                source->poll_removed = true;
+
+                                pthread_mutex_lock(&mc->idle_mutex);
+                                mc->n_sources--;
+                                pthread_mutex_unlock(&mc->idle_mutex);
+
+                                return;
+                        }
+
+                        break;
+                }
+#endif
                 if (source->idle_source)
                         fv_main_context_remove_source(source->idle_source);
                 else if (epoll_ctl(mc->epoll_fd,
@@ -520,6 +1059,10 @@ fv_main_context_remove_source(struct fv_main_context_source *source)
                 fv_list_remove(&source->quit_link);
                 break;
 
+        case FV_MAIN_CONTEXT_USR1_SOURCE:
+                fv_list_remove(&source->usr1_link);
+                break;
+
         case FV_MAIN_CONTEXT_IDLE_SOURCE:
                 pthread_mutex_lock(&mc->idle_mutex);
                 fv_list_remove(&source->idle_link);
@@ -527,14 +1070,8 @@ fv_main_context_remove_source(struct fv_main_context_source *source)
                 break;
 
         case FV_MAIN_CONTEXT_TIMER_SOURCE:
-                bucket = source->bucket;
-                fv_list_remove(&source->timer_link);
-
-                if (fv_list_empty(&bucket->sources)) {
-                        fv_list_remove(&bucket->link);
-                        fv_slice_free(&fv_main_context_bucket_allocator,
-                                       bucket);
-                }
+                unlink_timeout(source);
+                mc->n_timeouts--;
                 break;
         }
 
@@ -544,82 +1081,189 @@ fv_main_context_remove_source(struct fv_main_context_source *source)
         pthread_mutex_unlock(&mc->idle_mutex);
 }
 
+static int
+find_first_bit(uint64_t value)
+{
+        int pos = fv_util_ffs((int) (value & 0xffffffff));
+
+        if (pos)
+                return pos - 1;
+
+        return fv_util_ffs((int) (value >> 32)) + 31;
+}
+
+static uint64_t
+get_next_wheel_event(struct fv_main_context *mc)
+{
+        struct fv_main_context_wheel_level *level;
+        uint64_t best = UINT64_MAX, event_time;
+        uint64_t occupied;
+        int i, shift, current_slot;
+
+        for (i = 0; i < FV_MAIN_CONTEXT_WHEEL_LEVELS; i++) {
+                level = mc->wheel + i;
+                shift = i * FV_MAIN_CONTEXT_WHEEL_BITS;
+                current_slot = (mc->wheel_time >> shift) &
+                        FV_MAIN_CONTEXT_WHEEL_MASK;
+
+                /* Rotate the bits so that they are relative to the
+                 * current slot. Only the top level can wrap around */
+                occupied = level->occupied >> current_slot;
+                if (current_slot > 0)
+                        occupied |= (level->occupied <<
+                                     (FV_MAIN_CONTEXT_WHEEL_SLOTS -
+                                      current_slot));
+                if (occupied == 0)
+                        continue;
+
+                /* For the higher levels this is the time that the
+                 * slot will be cascaded rather than the time that the
+                 * timeouts actually expire */
+                event_time = (((mc->wheel_time >> shift) +
+                               find_first_bit(occupied)) << shift);
+
+                if (event_time < best)
+                        best = event_time;
+        }
+
+        return best;
+}
+
 static int
 get_timeout(struct fv_main_context *mc)
 {
-        struct fv_main_context_bucket *bucket;
-        int min_minutes, minutes_to_wait;
-        int64_t elapsed, elapsed_minutes;
+        uint64_t next_event, now;
 
         if (!fv_list_empty(&mc->idle_sources))
                 return 0;
 
-        if (fv_list_empty(&mc->buckets))
+        if (mc->n_timeouts == 0)
                 return -1;
 
-        min_minutes = INT_MAX;
+        next_event = get_next_wheel_event(mc);
+        now = get_wheel_now(mc);
 
-        fv_list_for_each(bucket, &mc->buckets, link) {
-                minutes_to_wait = bucket->minutes - bucket->minutes_passed;
+        if (next_event <= now)
+                return 0;
 
-                if (minutes_to_wait < min_minutes)
-                        min_minutes = minutes_to_wait;
-        }
+        if (next_event - now > INT_MAX)
+                return INT_MAX;
 
-        elapsed =
-            fv_main_context_get_monotonic_clock(mc) - mc->last_timer_time;
-        elapsed_minutes = elapsed / 60000000;
+        return next_event - now;
+}
 
-        /* If we've already waited enough time then don't wait any
-         * further time */
-        if (elapsed_minutes >= min_minutes)
-                return 0;
+static void
+cascade_slot(struct fv_main_context *mc,
+             int level_num,
+             int slot_num)
+{
+        struct fv_main_context_wheel_level *level = mc->wheel + level_num;
+        struct fv_list *slot = level->slots + slot_num;
+        struct fv_list sources;
+        struct fv_main_context_source *source, *tmp;
+
+        if (!(level->occupied & (UINT64_C(1) << slot_num)))
+                return;
 
-        /* Subtract the number of minutes we've already waited */
-        min_minutes -= (int) elapsed_minutes;
+        /* Steal the list so that the sources can be reinserted at a
+         * lower level */
+        fv_list_init(&sources);
+        fv_list_insert_list(&sources, slot);
+        fv_list_init(slot);
+        level->occupied &= ~(UINT64_C(1) << slot_num);
 
-        return (60000 - (elapsed / 1000 % 60000) + (min_minutes - 1) * 60000);
+        fv_list_for_each_safe(source, tmp, &sources, timer_link)
+                insert_timeout(source);
 }
 
 static void
-emit_bucket(struct fv_main_context_bucket *bucket)
+emit_slot(struct fv_main_context *mc,
+          int slot_num)
 {
-        struct fv_main_context_source *source, *tmp_source;
+        struct fv_main_context_wheel_level *level = mc->wheel;
+        struct fv_list *slot = level->slots + slot_num;
+        struct fv_main_context_source *source;
         fv_main_context_timer_callback callback;
+        struct fv_list sources;
+        uint64_t now = get_wheel_now(mc);
+
+        /* Steal the list because the rescheduled timeouts can end up
+         * in the same slot if the wheel has moved into the next
+         * window */
+        fv_list_init(&sources);
+        fv_list_insert_list(&sources, slot);
+        fv_list_init(slot);
+        level->occupied &= ~(UINT64_C(1) << slot_num);
+
+        fv_list_for_each(source, &sources, timer_link)
+                source->timer_level = FV_MAIN_CONTEXT_WHEEL_LEVELS;
+
+        /* The callbacks can remove any timeout so the first source
+         * is taken from the list each time */
+        while (!fv_list_empty(&sources)) {
+                source = fv_container_of(sources.next,
+                                         struct fv_main_context_source,
+                                         timer_link);
+
+                fv_list_remove(&source->timer_link);
+                source->expiry = now + source->interval;
+                insert_timeout(source);
 
-        fv_list_for_each_safe(source,
-                               tmp_source,
-                               &bucket->sources,
-                               timer_link) {
                 callback = source->callback;
                 callback(source, source->user_data);
         }
-
-        bucket->minutes_passed = 0;
 }
 
 static void
 check_timer_sources(struct fv_main_context *mc)
 {
-        struct fv_main_context_bucket *bucket, *tmp_bucket;
-        int64_t now;
-        int64_t elapsed_minutes;
+        uint64_t now = get_wheel_now(mc);
+        uint64_t window_end, occupied;
+        int level, shift, slot;
+
+        while (mc->wheel_time <= now) {
+                /* Move down the timeouts from any higher level slots
+                 * that start at the current time */
+                for (level = FV_MAIN_CONTEXT_WHEEL_LEVELS - 1;
+                     level > 0;
+                     level--) {
+                        shift = level * FV_MAIN_CONTEXT_WHEEL_BITS;
+
+                        if ((mc->wheel_time &
+                             ((UINT64_C(1) << shift) - 1)) != 0)
+                                continue;
+
+                        cascade_slot(mc,
+                                     level,
+                                     (mc->wheel_time >> shift) &
+                                     FV_MAIN_CONTEXT_WHEEL_MASK);
+                }
 
-        if (fv_list_empty(&mc->buckets))
-                return;
+                /* Skip to the next occupied slot in the first level
+                 * without going beyond the end of its window, because
+                 * the next level would need to be cascaded there */
+                slot = mc->wheel_time & FV_MAIN_CONTEXT_WHEEL_MASK;
+                window_end = ((mc->wheel_time | FV_MAIN_CONTEXT_WHEEL_MASK) +
+                              1);
+                occupied = mc->wheel[0].occupied >> slot;
+
+                if (occupied == 0) {
+                        mc->wheel_time = MIN(window_end, now + 1);
+                        continue;
+                }
 
-        now = fv_main_context_get_monotonic_clock(mc);
-        elapsed_minutes = (now - mc->last_timer_time) / 60000000;
-        mc->last_timer_time += elapsed_minutes * 60000000;
+                slot += find_first_bit(occupied);
+                mc->wheel_time = (mc->wheel_time & ~(uint64_t)
+                                  FV_MAIN_CONTEXT_WHEEL_MASK) + slot;
 
-        if (elapsed_minutes < 1)
-                return;
+                if (mc->wheel_time > now) {
+                        mc->wheel_time = now + 1;
+                        break;
+                }
 
-        fv_list_for_each_safe(bucket, tmp_bucket, &mc->buckets, link) {
-                if (bucket->minutes_passed + elapsed_minutes >= bucket->minutes)
-                        emit_bucket(bucket);
-                else
-                        bucket->minutes_passed += elapsed_minutes;
+                mc->wheel_time++;
+
+                emit_slot(mc, slot);
         }
 }
 
@@ -681,10 +1325,21 @@ handle_epoll_event(struct fv_main_context *mc,
                 if (event->events & EPOLLERR)
                         flags |= FV_MAIN_CONTEXT_POLL_ERROR;
 
+                /* The flags may have been reduced since they were
+                 * registered with epoll */
+                flags &= source->current_flags | FV_MAIN_CONTEXT_POLL_ERROR;
+
+                if (flags == 0)
+                        break;
+
+                if ((flags & FV_MAIN_CONTEXT_POLL_OUT))
+                        source->try_write = false;
+
                 callback(source, source->fd, flags, source->user_data);
                 break;
 
         case FV_MAIN_CONTEXT_QUIT_SOURCE:
+        case FV_MAIN_CONTEXT_USR1_SOURCE:
         case FV_MAIN_CONTEXT_TIMER_SOURCE:
         case FV_MAIN_CONTEXT_IDLE_SOURCE:
                 fv_warn_if_reached();
@@ -692,6 +1347,48 @@ handle_epoll_event(struct fv_main_context *mc,
         }
 }
 
+#ifdef HAVE_IO_URING
+
+static void
+poll_uring(struct fv_main_context *mc)
+{
+        struct io_uring_cqe *cqe;
+        uint64_t user_data;
+        int32_t res;
+        int ret;
+
+        ret = fv_uring_submit_and_wait(&mc->uring, get_timeout(mc));
+
+        /* Once we've polled we can assume that some time has passed so our
+           cached values of the clocks are no longer valid */
+        mc->monotonic_time_valid = false;
+        mc->wall_time_valid = false;
+
+        /* EAGAIN and EBUSY mean that the kernel couldn't take all of
+         * the submissions yet. The unsubmitted entries stay in the
+         * queue for the next poll and the completions still need to
+         * be reaped so that it can make progress.
+         */
+        if (ret == -1 &&
+            errno != EINTR &&
+            errno != EAGAIN &&
+            errno != EBUSY)
+                fv_warning("io_uring_enter failed: %s", strerror(errno));
+
+        while ((cqe = fv_uring_peek_cqe(&mc->uring))) {
+                user_data = cqe->user_data;
+                res = cqe->res;
+                fv_uring_cqe_seen(&mc->uring);
+
+                handle_completion(mc, user_data, res);
+        }
+
+        check_timer_sources(mc);
+        emit_idle_sources(mc);
+}
+
+#endif /* HAVE_IO_URING */
+
 void
 fv_main_context_poll(struct fv_main_context *mc)
 {
@@ -701,6 +1398,17 @@ fv_main_context_poll(struct fv_main_context *mc)
         if (mc == NULL)
                 mc = fv_main_context_get_default_or_abort();
 
+        flush_pending_sources(mc);
+
+        __atomic_store_n(&mc->n_polls, mc->n_polls + 1, __ATOMIC_RELAXED);
+
+#ifdef HAVE_IO_URING
+        if (mc->use_uring) {
+                poll_uring(mc);
+                return;
+        }
+#endif
+
         pthread_mutex_lock(&mc->idle_mutex);
         n_sources = mc->n_sources;
         pthread_mutex_unlock(&mc->idle_mutex);
@@ -736,6 +1444,12 @@ fv_main_context_poll(struct fv_main_context *mc)
         }
 }
 
+uint64_t
+fv_main_context_get_n_polls(struct fv_main_context *mc)
+{
+        return __atomic_load_n(&mc->n_polls, __ATOMIC_RELAXED);
+}
+
 uint64_t
 fv_main_context_get_monotonic_clock(struct fv_main_context *mc)
 {
@@ -785,8 +1499,12 @@ fv_main_context_free(struct fv_main_context *mc)
 {
         fv_return_if_fail(mc != NULL);
 
-        signal(SIGINT, mc->old_int_handler);
-        signal(SIGTERM, mc->old_term_handler);
+        if (mc == fv_main_context_signal_context) {
+                signal(SIGINT, mc->old_int_handler);
+                signal(SIGTERM, mc->old_term_handler);
+                signal(SIGUSR1, mc->old_usr1_handler);
+                fv_main_context_signal_context = NULL;
+        }
         fv_main_context_remove_source(mc->async_pipe_source);
         fv_close(mc->async_pipe[0]);
         fv_close(mc->async_pipe[1]);
@@ -797,12 +1515,21 @@ fv_main_context_free(struct fv_main_context *mc)
 
         fv_free(mc->events);
         pthread_mutex_destroy(&mc->idle_mutex);
-        fv_close(mc->epoll_fd);
+
+#ifdef HAVE_IO_URING
+        /* Any sources that are waiting for their poll request to
+         * complete will be freed along with the slice allocator */
+        if (mc->use_uring)
+                fv_uring_destroy(&mc->uring);
+        else
+#endif
+                fv_close(mc->epoll_fd);
 
         fv_slice_allocator_destroy(&mc->source_allocator);
 
-        fv_free(mc);
+        pthread_once(&fv_main_context_key_once, create_key);
+        if (mc == pthread_getspecific(fv_main_context_key))
+                pthread_setspecific(fv_main_context_key, NULL);
 
-        if (mc == fv_main_context_default)
-                fv_main_context_default = NULL;
+        fv_free(mc);
 }
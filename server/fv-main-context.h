@@ -64,12 +64,27 @@ typedef void
 (* fv_main_context_quit_callback) (struct fv_main_context_source *source,
                                     void *user_data);
 
+typedef void
+(* fv_main_context_usr1_callback) (struct fv_main_context_source *source,
+                                    void *user_data);
+
 struct fv_main_context *
 fv_main_context_new(struct fv_error **error);
 
+/* Returns the default context for the calling thread, creating it if
+ * necessary. Only the first context that is created will handle the
+ * quit signals.
+ */
 struct fv_main_context *
 fv_main_context_get_default(struct fv_error **error);
 
+/* Makes the given context be the default for the calling thread. The
+ * calling thread will also be the one that is expected to poll the
+ * context.
+ */
+void
+fv_main_context_set_thread_default(struct fv_main_context *mc);
+
 struct fv_main_context_source *
 fv_main_context_add_poll(struct fv_main_context *mc,
                           int fd,
@@ -86,11 +101,31 @@ fv_main_context_add_quit(struct fv_main_context *mc,
                           fv_main_context_quit_callback callback,
                           void *user_data);
 
+/* Adds a source that is invoked whenever the process receives
+ * SIGUSR1. Like the quit sources, this only works on the first
+ * context that was created.
+ */
 struct fv_main_context_source *
-fv_main_context_add_timer(struct fv_main_context *mc,
-                           int minutes,
-                           fv_main_context_timer_callback callback,
-                           void *user_data);
+fv_main_context_add_usr1(struct fv_main_context *mc,
+                          fv_main_context_usr1_callback callback,
+                          void *user_data);
+
+/* Adds a timeout that will be invoked repeatedly every ms
+ * milliseconds until the source is removed. Adding and removing
+ * timeouts is O(1) so it is fine to have one per connection.
+ */
+struct fv_main_context_source *
+fv_main_context_add_timeout(struct fv_main_context *mc,
+                             int ms,
+                             fv_main_context_timer_callback callback,
+                             void *user_data);
+
+/* Changes the interval of a timeout and restarts it so that it will
+ * next fire ms milliseconds from now.
+ */
+void
+fv_main_context_modify_timeout(struct fv_main_context_source *source,
+                                int ms);
 
 struct fv_main_context_source *
 fv_main_context_add_idle(struct fv_main_context *mc,
@@ -103,6 +138,11 @@ fv_main_context_remove_source(struct fv_main_context_source *source);
 void
 fv_main_context_poll(struct fv_main_context *mc);
 
+/* Returns the number of times that fv_main_context_poll has waited
+ * for events. This can be called from any thread. */
+uint64_t
+fv_main_context_get_n_polls(struct fv_main_context *mc);
+
 /* Returns the number of microseconds since some epoch */
 uint64_t
 fv_main_context_get_monotonic_clock(struct fv_main_context *mc);
@@ -0,0 +1,563 @@
+/*
+ * Babiling
+ * Copyright (C) 2026  Neil Roberts
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <pthread.h>
+#include <stddef.h>
+#include <string.h>
+#include <opus.h>
+
+#include "fv-mixer.h"
+#include "fv-buffer.h"
+#include "fv-list.h"
+#include "fv-util.h"
+#include "fv-thread.h"
+
+#define FV_MIXER_SAMPLE_RATE 48000
+#define FV_MIXER_FRAME_SIZE (FV_MIXER_SAMPLE_RATE * FV_PROTO_SPEECH_TIME / 1000)
+
+enum fv_mixer_group_state {
+        /* Voices and listeners can be added */
+        FV_MIXER_GROUP_STATE_IDLE,
+        /* Waiting in the queue for a thread */
+        FV_MIXER_GROUP_STATE_QUEUED,
+        FV_MIXER_GROUP_STATE_RUNNING,
+        /* Waiting for the idle source to report the outputs */
+        FV_MIXER_GROUP_STATE_DONE,
+};
+
+struct fv_mixer_voice {
+        int player_num;
+        uint64_t player_id;
+
+        uint8_t size;
+        uint8_t packet[FV_PROTO_MAX_SPEECH_SIZE];
+
+        /* Whether the packet has been decoded into the group's pcm
+         * buffer yet. It is only decoded if some listener needs it
+         * mixed with another voice. */
+        bool decoded;
+};
+
+struct fv_mixer_listener {
+        int player_num;
+        uint64_t player_id;
+
+        /* The range of indices in the group's audible array */
+        int first_voice;
+        int n_voices;
+};
+
+/* The codec state for one player number. The decoder and encoder are
+ * only created once they are needed. */
+struct fv_mixer_stream {
+        uint64_t player_id;
+        OpusDecoder *decoder;
+        OpusEncoder *encoder;
+};
+
+struct fv_mixer_group {
+        struct fv_list link;
+        struct fv_mixer *mixer;
+
+        struct fv_main_context *mc;
+        fv_mixer_callback callback;
+        void *user_data;
+
+        /* Protected by the mixer's mutex */
+        enum fv_mixer_group_state state;
+        struct fv_main_context_source *done_source;
+
+        /* The rest of the members are only touched from the thread
+         * that the state gives the group to */
+
+        /* Arrays of struct fv_mixer_voice, struct fv_mixer_listener,
+         * int and struct fv_mixer_output */
+        struct fv_buffer voices;
+        struct fv_buffer listeners;
+        struct fv_buffer audible;
+        struct fv_buffer outputs;
+
+        /* Array of struct fv_mixer_stream indexed by player number */
+        struct fv_buffer streams;
+
+        /* The decoded frame for each voice */
+        struct fv_buffer pcm;
+};
+
+struct fv_mixer {
+        pthread_mutex_t mutex;
+        /* Signalled when a group is queued or the threads should
+         * quit */
+        pthread_cond_t queue_cond;
+        /* Signalled when a mix finishes */
+        pthread_cond_t done_cond;
+
+        struct fv_list queue;
+        bool quit;
+
+        int n_threads;
+        pthread_t *threads;
+};
+
+static void
+destroy_stream(struct fv_mixer_stream *stream)
+{
+        if (stream->decoder) {
+                opus_decoder_destroy(stream->decoder);
+                stream->decoder = NULL;
+        }
+        if (stream->encoder) {
+                opus_encoder_destroy(stream->encoder);
+                stream->encoder = NULL;
+        }
+}
+
+static struct fv_mixer_stream *
+get_stream(struct fv_mixer_group *group,
+           int player_num,
+           uint64_t player_id)
+{
+        struct fv_mixer_stream *stream;
+        size_t n_streams;
+
+        n_streams = group->streams.length / sizeof *stream;
+
+        if (player_num >= n_streams) {
+                fv_buffer_set_length(&group->streams,
+                                     (player_num + 1) *
+                                     sizeof (struct fv_mixer_stream));
+                memset(group->streams.data +
+                       n_streams * sizeof (struct fv_mixer_stream),
+                       0,
+                       (player_num + 1 - n_streams) *
+                       sizeof (struct fv_mixer_stream));
+        }
+
+        stream = (struct fv_mixer_stream *) group->streams.data + player_num;
+
+        /* The number has been reused for a new player */
+        if (stream->player_id != player_id) {
+                destroy_stream(stream);
+                stream->player_id = player_id;
+        }
+
+        return stream;
+}
+
+static int16_t *
+decode_voice(struct fv_mixer_group *group,
+             int voice_num)
+{
+        struct fv_mixer_voice *voice =
+                (struct fv_mixer_voice *) group->voices.data + voice_num;
+        int16_t *pcm = (int16_t *) group->pcm.data +
+                voice_num * FV_MIXER_FRAME_SIZE;
+        struct fv_mixer_stream *stream;
+        int n_samples = 0;
+        int error;
+
+        if (voice->decoded)
+                return pcm;
+
+        voice->decoded = true;
+
+        stream = get_stream(group, voice->player_num, voice->player_id);
+
+        if (stream->decoder == NULL) {
+                stream->decoder = opus_decoder_create(FV_MIXER_SAMPLE_RATE,
+                                                      1, /* channels */
+                                                      &error);
+                if (error != OPUS_OK)
+                        stream->decoder = NULL;
+        }
+
+        if (stream->decoder) {
+                n_samples = opus_decode(stream->decoder,
+                                        voice->packet,
+                                        voice->size,
+                                        pcm,
+                                        FV_MIXER_FRAME_SIZE,
+                                        0 /* decode_fec */);
+                if (n_samples < 0)
+                        n_samples = 0;
+        }
+
+        memset(pcm + n_samples,
+               0,
+               (FV_MIXER_FRAME_SIZE - n_samples) * sizeof (int16_t));
+
+        return pcm;
+}
+
+static struct fv_mixer_output *
+add_output(struct fv_mixer_group *group,
+           const struct fv_mixer_listener *listener)
+{
+        struct fv_mixer_output *output;
+
+        fv_buffer_set_length(&group->outputs,
+                             group->outputs.length + sizeof *output);
+        output = ((struct fv_mixer_output *)
+                  (group->outputs.data + group->outputs.length) - 1);
+
+        output->player_num = listener->player_num;
+        output->player_id = listener->player_id;
+
+        return output;
+}
+
+static void
+mix_listener(struct fv_mixer_group *group,
+             const struct fv_mixer_listener *listener)
+{
+        const int *audible = (const int *) group->audible.data +
+                listener->first_voice;
+        const struct fv_mixer_voice *voice;
+        struct fv_mixer_output *output;
+        struct fv_mixer_stream *stream;
+        int32_t sum[FV_MIXER_FRAME_SIZE];
+        int16_t pcm[FV_MIXER_FRAME_SIZE];
+        const int16_t *voice_pcm;
+        int error, ret;
+        int i, j;
+
+        if (listener->n_voices == 0)
+                return;
+
+        /* A single voice doesn't need mixing so the packet is passed
+         * on as it is */
+        if (listener->n_voices == 1) {
+                voice = (const struct fv_mixer_voice *) group->voices.data +
+                        audible[0];
+                output = add_output(group, listener);
+                output->size = voice->size;
+                memcpy(output->packet, voice->packet, voice->size);
+                return;
+        }
+
+        memset(sum, 0, sizeof sum);
+
+        for (i = 0; i < listener->n_voices; i++) {
+                voice_pcm = decode_voice(group, audible[i]);
+                for (j = 0; j < FV_MIXER_FRAME_SIZE; j++)
+                        sum[j] += voice_pcm[j];
+        }
+
+        for (j = 0; j < FV_MIXER_FRAME_SIZE; j++) {
+                if (sum[j] > INT16_MAX)
+                        pcm[j] = INT16_MAX;
+                else if (sum[j] < INT16_MIN)
+                        pcm[j] = INT16_MIN;
+                else
+                        pcm[j] = sum[j];
+        }
+
+        stream = get_stream(group,
+                            listener->player_num,
+                            listener->player_id);
+
+        if (stream->encoder == NULL) {
+                stream->encoder = opus_encoder_create(FV_MIXER_SAMPLE_RATE,
+                                                      1, /* channels */
+                                                      OPUS_APPLICATION_VOIP,
+                                                      &error);
+                if (error != OPUS_OK) {
+                        stream->encoder = NULL;
+                        return;
+                }
+        }
+
+        output = add_output(group, listener);
+
+        ret = opus_encode(stream->encoder,
+                          pcm,
+                          FV_MIXER_FRAME_SIZE,
+                          output->packet,
+                          FV_PROTO_MAX_SPEECH_SIZE);
+
+        if (ret <= 0) {
+                /* Drop the output again */
+                group->outputs.length -= sizeof *output;
+                return;
+        }
+
+        output->size = ret;
+}
+
+static void
+run_mix(struct fv_mixer_group *group)
+{
+        const struct fv_mixer_listener *listeners =
+                (const struct fv_mixer_listener *) group->listeners.data;
+        size_t n_listeners = group->listeners.length / sizeof *listeners;
+        size_t n_voices = group->voices.length / sizeof (struct fv_mixer_voice);
+        size_t i;
+
+        fv_buffer_ensure_size(&group->pcm,
+                              n_voices * FV_MIXER_FRAME_SIZE *
+                              sizeof (int16_t));
+
+        for (i = 0; i < n_listeners; i++)
+                mix_listener(group, listeners + i);
+}
+
+static void
+done_cb(struct fv_main_context_source *source,
+        void *user_data)
+{
+        struct fv_mixer_group *group = user_data;
+        struct fv_mixer *mixer = group->mixer;
+
+        group->callback((const struct fv_mixer_output *) group->outputs.data,
+                        group->outputs.length /
+                        sizeof (struct fv_mixer_output),
+                        group->user_data);
+
+        fv_buffer_set_length(&group->voices, 0);
+        fv_buffer_set_length(&group->listeners, 0);
+        fv_buffer_set_length(&group->audible, 0);
+        fv_buffer_set_length(&group->outputs, 0);
+
+        pthread_mutex_lock(&mixer->mutex);
+        fv_main_context_remove_source(source);
+        group->done_source = NULL;
+        group->state = FV_MIXER_GROUP_STATE_IDLE;
+        pthread_mutex_unlock(&mixer->mutex);
+}
+
+static void *
+thread_func(void *user_data)
+{
+        struct fv_mixer *mixer = user_data;
+        struct fv_mixer_group *group;
+
+        pthread_mutex_lock(&mixer->mutex);
+
+        while (!mixer->quit) {
+                if (fv_list_empty(&mixer->queue)) {
+                        pthread_cond_wait(&mixer->queue_cond, &mixer->mutex);
+                        continue;
+                }
+
+                group = fv_container_of(mixer->queue.next,
+                                        struct fv_mixer_group,
+                                        link);
+                fv_list_remove(&group->link);
+                group->state = FV_MIXER_GROUP_STATE_RUNNING;
+
+                pthread_mutex_unlock(&mixer->mutex);
+
+                run_mix(group);
+
+                pthread_mutex_lock(&mixer->mutex);
+
+                group->state = FV_MIXER_GROUP_STATE_DONE;
+                group->done_source = fv_main_context_add_idle(group->mc,
+                                                              done_cb,
+                                                              group);
+                pthread_cond_broadcast(&mixer->done_cond);
+        }
+
+        pthread_mutex_unlock(&mixer->mutex);
+
+        return NULL;
+}
+
+struct fv_mixer *
+fv_mixer_new(int n_threads)
+{
+        struct fv_mixer *mixer = fv_alloc(sizeof *mixer);
+        int i;
+
+        pthread_mutex_init(&mixer->mutex, NULL /* attrs */);
+        pthread_cond_init(&mixer->queue_cond, NULL /* attrs */);
+        pthread_cond_init(&mixer->done_cond, NULL /* attrs */);
+        fv_list_init(&mixer->queue);
+        mixer->quit = false;
+
+        mixer->n_threads = n_threads;
+        mixer->threads = fv_alloc(sizeof (pthread_t) * n_threads);
+
+        for (i = 0; i < n_threads; i++)
+                mixer->threads[i] = fv_thread_create(thread_func, mixer);
+
+        return mixer;
+}
+
+struct fv_mixer_group *
+fv_mixer_group_new(struct fv_mixer *mixer,
+                   struct fv_main_context *mc,
+                   fv_mixer_callback callback,
+                   void *user_data)
+{
+        struct fv_mixer_group *group = fv_alloc(sizeof *group);
+
+        group->mixer = mixer;
+        group->mc = mc;
+        group->callback = callback;
+        group->user_data = user_data;
+
+        group->state = FV_MIXER_GROUP_STATE_IDLE;
+        group->done_source = NULL;
+
+        fv_buffer_init(&group->voices);
+        fv_buffer_init(&group->listeners);
+        fv_buffer_init(&group->audible);
+        fv_buffer_init(&group->outputs);
+        fv_buffer_init(&group->streams);
+        fv_buffer_init(&group->pcm);
+
+        return group;
+}
+
+bool
+fv_mixer_group_is_busy(struct fv_mixer_group *group)
+{
+        bool ret;
+
+        pthread_mutex_lock(&group->mixer->mutex);
+        ret = group->state != FV_MIXER_GROUP_STATE_IDLE;
+        pthread_mutex_unlock(&group->mixer->mutex);
+
+        return ret;
+}
+
+int
+fv_mixer_group_add_voice(struct fv_mixer_group *group,
+                         int player_num,
+                         uint64_t player_id,
+                         const uint8_t *packet,
+                         size_t packet_size)
+{
+        struct fv_mixer_voice *voice;
+        int voice_num = group->voices.length / sizeof *voice;
+
+        fv_buffer_set_length(&group->voices,
+                             group->voices.length + sizeof *voice);
+        voice = (struct fv_mixer_voice *) group->voices.data + voice_num;
+
+        voice->player_num = player_num;
+        voice->player_id = player_id;
+        voice->size = packet_size;
+        memcpy(voice->packet, packet, packet_size);
+        voice->decoded = false;
+
+        return voice_num;
+}
+
+void
+fv_mixer_group_add_listener(struct fv_mixer_group *group,
+                            int player_num,
+                            uint64_t player_id,
+                            const int *voices,
+                            int n_voices)
+{
+        struct fv_mixer_listener listener;
+
+        listener.player_num = player_num;
+        listener.player_id = player_id;
+        listener.first_voice = group->audible.length / sizeof (int);
+        listener.n_voices = n_voices;
+
+        fv_buffer_append(&group->audible, voices, n_voices * sizeof (int));
+        fv_buffer_append(&group->listeners, &listener, sizeof listener);
+}
+
+void
+fv_mixer_group_start(struct fv_mixer_group *group)
+{
+        struct fv_mixer *mixer = group->mixer;
+
+        if (group->listeners.length == 0) {
+                fv_buffer_set_length(&group->voices, 0);
+                fv_buffer_set_length(&group->audible, 0);
+                return;
+        }
+
+        pthread_mutex_lock(&mixer->mutex);
+        group->state = FV_MIXER_GROUP_STATE_QUEUED;
+        fv_list_insert(mixer->queue.prev, &group->link);
+        pthread_cond_signal(&mixer->queue_cond);
+        pthread_mutex_unlock(&mixer->mutex);
+}
+
+void
+fv_mixer_group_free(struct fv_mixer_group *group)
+{
+        struct fv_mixer *mixer = group->mixer;
+        struct fv_mixer_stream *streams;
+        size_t n_streams, i;
+
+        pthread_mutex_lock(&mixer->mutex);
+
+        if (group->state == FV_MIXER_GROUP_STATE_QUEUED)
+                fv_list_remove(&group->link);
+
+        while (group->state == FV_MIXER_GROUP_STATE_RUNNING)
+                pthread_cond_wait(&mixer->done_cond, &mixer->mutex);
+
+        if (group->done_source)
+                fv_main_context_remove_source(group->done_source);
+
+        pthread_mutex_unlock(&mixer->mutex);
+
+        streams = (struct fv_mixer_stream *) group->streams.data;
+        n_streams = group->streams.length / sizeof *streams;
+
+        for (i = 0; i < n_streams; i++)
+                destroy_stream(streams + i);
+
+        fv_buffer_destroy(&group->voices);
+        fv_buffer_destroy(&group->listeners);
+        fv_buffer_destroy(&group->audible);
+        fv_buffer_destroy(&group->outputs);
+        fv_buffer_destroy(&group->streams);
+        fv_buffer_destroy(&group->pcm);
+
+        fv_free(group);
+}
+
+void
+fv_mixer_free(struct fv_mixer *mixer)
+{
+        int i;
+
+        pthread_mutex_lock(&mixer->mutex);
+        mixer->quit = true;
+        pthread_cond_broadcast(&mixer->queue_cond);
+        pthread_mutex_unlock(&mixer->mutex);
+
+        for (i = 0; i < mixer->n_threads; i++)
+                pthread_join(mixer->threads[i], NULL /* retval */);
+
+        fv_free(mixer->threads);
+
+        pthread_cond_destroy(&mixer->queue_cond);
+        pthread_cond_destroy(&mixer->done_cond);
+        pthread_mutex_destroy(&mixer->mutex);
+
+        fv_free(mixer);
+}
@@ -0,0 +1,112 @@
+/*
+ * Babiling
+ * Copyright (C) 2026  Neil Roberts
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+#ifndef FV_MIXER_H
+#define FV_MIXER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "fv-main-context.h"
+#include "fv-proto.h"
+
+/* The mixer decodes the speech of several players, adds it together
+ * for each listener and encodes the result as a single Opus stream.
+ * The codec work is done on a pool of threads so that the workers of
+ * the network never have to wait for it.
+ *
+ * The mixes are made in groups. A group keeps the codec state of the
+ * players between mixes and only one mix of a group runs at a time.
+ * The players are identified by their number and ID so that the
+ * state is reset when a number is reused.
+ */
+
+struct fv_mixer_output {
+        int player_num;
+        uint64_t player_id;
+
+        uint8_t size;
+        uint8_t packet[FV_PROTO_MAX_SPEECH_SIZE];
+};
+
+/* Called from an idle source in the main context of the group once a
+ * mix has finished. There is no output for a listener that couldn't
+ * hear anyone.
+ */
+typedef void
+(* fv_mixer_callback)(const struct fv_mixer_output *outputs,
+                      int n_outputs,
+                      void *user_data);
+
+struct fv_mixer;
+struct fv_mixer_group;
+
+struct fv_mixer *
+fv_mixer_new(int n_threads);
+
+struct fv_mixer_group *
+fv_mixer_group_new(struct fv_mixer *mixer,
+                   struct fv_main_context *mc,
+                   fv_mixer_callback callback,
+                   void *user_data);
+
+/* Returns true if the last mix of the group hasn't finished yet. The
+ * voices and listeners of the next mix can only be added once it
+ * has.
+ */
+bool
+fv_mixer_group_is_busy(struct fv_mixer_group *group);
+
+/* Adds a 10ms packet of speech to the next mix and returns its index
+ * for fv_mixer_group_add_listener.
+ */
+int
+fv_mixer_group_add_voice(struct fv_mixer_group *group,
+                         int player_num,
+                         uint64_t player_id,
+                         const uint8_t *packet,
+                         size_t packet_size);
+
+/* Adds a listener that hears the voices with the given indices */
+void
+fv_mixer_group_add_listener(struct fv_mixer_group *group,
+                            int player_num,
+                            uint64_t player_id,
+                            const int *voices,
+                            int n_voices);
+
+/* Queues the voices and listeners that have been added to be mixed
+ * by one of the threads */
+void
+fv_mixer_group_start(struct fv_mixer_group *group);
+
+/* Waits for any mix that is running. This must be called from the
+ * thread of the group's main context. */
+void
+fv_mixer_group_free(struct fv_mixer_group *group);
+
+/* All of the groups must be freed first */
+void
+fv_mixer_free(struct fv_mixer *mixer);
+
+#endif /* FV_MIXER_H */
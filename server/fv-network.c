@@ -43,39 +43,331 @@
 #include "fv-file-error.h"
 #include "fv-socket.h"
 #include "fv-netaddress.h"
+#include "fv-thread.h"
+#include "fv-relay.h"
+#include "fv-mixer.h"
+#include "fv-stats.h"
 
 struct fv_error_domain
 fv_network_error;
 
+/* The map is divided into a grid of cells for the area-of-interest
+ * filtering. The cell is taken from the top bits of the position.
+ */
+#define FV_NETWORK_GRID_BITS 3
+#define FV_NETWORK_GRID_SIZE (1 << FV_NETWORK_GRID_BITS)
+#define FV_NETWORK_N_CELLS (FV_NETWORK_GRID_SIZE * FV_NETWORK_GRID_SIZE)
+
+/* Number of milliseconds between updates for the players that are
+ * outside of a client's area of interest.
+ */
+#define FV_NETWORK_FAR_UPDATE_INTERVAL 1000
+
+/* Size of the map in the units that the hearing radius is given in.
+ * This needs to match FV_MAP_WIDTH and FV_MAP_HEIGHT in the client.
+ */
+#define FV_NETWORK_MAP_WIDTH 40
+#define FV_NETWORK_MAP_HEIGHT 48
+
+/* Longest request path that can be used as a room name */
+#define FV_NETWORK_MAX_ROOM_NAME_LENGTH 64
+
+/* Number of milliseconds between sending the accumulated changes to
+ * the other processes of the relay */
+#define FV_NETWORK_RELAY_INTERVAL 50
+
+/* Maximum number of packets of a talker that can be waiting to be
+ * mixed. If the talker gets further ahead than this then the older
+ * packets are skipped. */
+#define FV_NETWORK_MAX_MIX_BACKLOG 10
+
+struct fv_network_subscription {
+        struct fv_list link;
+        struct fv_network_client *client;
+};
+
 struct fv_network_client {
         struct fv_list link;
         struct fv_connection *connection;
         struct fv_listener event_listener;
-        struct fv_network *network;
+        struct fv_network_worker *worker;
+
+        /* The part of the room that the client joined for its
+         * worker, or NULL if the handshake hasn't finished yet */
+        struct fv_network_room_worker *room_worker;
+        struct fv_list room_link;
+
+        /* The cell that the client's player was in when the
+         * subscriptions were last updated or -1 if it isn't known
+         * yet. The client is subscribed to every cell within the
+         * interest radius of this cell.
+         */
+        int cell;
+        int n_subscriptions;
+        struct fv_network_subscription *subscriptions;
 };
 
 struct fv_network_listen_socket {
+        struct fv_list link;
+        int sock;
+        struct fv_main_context_source *source;
+        struct fv_network_worker *worker;
+};
+
+/* A socket that answers HTTP requests with the statistics. These
+ * run on the first worker. */
+struct fv_network_stats_socket {
         struct fv_list link;
         int sock;
         struct fv_main_context_source *source;
         struct fv_network *nw;
 };
 
-struct fv_network {
-        struct fv_list listen_sockets;
+/* A connection to a stats socket. The request is read until the
+ * blank line that ends the headers and then the response is written
+ * and the connection is closed. */
+struct fv_network_stats_client {
+        struct fv_list link;
+        int sock;
+        struct fv_main_context_source *source;
+        struct fv_network *nw;
+        struct fv_buffer buf;
+        /* Position of the next byte of the response to write or -1
+         * if the request is still being read */
+        ssize_t write_pos;
+};
 
-        struct fv_playerbase *playerbase;
+enum fv_network_handoff_type {
+        FV_NETWORK_HANDOFF_DIRTY_PLAYER,
+        FV_NETWORK_HANDOFF_NEAR_PLAYER,
+        FV_NETWORK_HANDOFF_FAR_PLAYER,
+        FV_NETWORK_HANDOFF_SPEECH,
+        FV_NETWORK_HANDOFF_REMOVE_PLAYER,
+        FV_NETWORK_HANDOFF_MIXED_SPEECH
+};
+
+/* A change to the shared state that was made by one worker and that
+ * needs to be passed on to the clients of another worker.
+ */
+struct fv_network_handoff {
+        enum fv_network_handoff_type type;
+        int player_num;
+        int dirty_state;
+        /* The cell that the player was in and the cell that it was
+         * previously published in for the area-of-interest
+         * handoffs */
+        int cell;
+        int old_cell;
+};
+
+/* A connection that has finished its handshake on one worker and
+ * that is being passed to the worker that its room is pinned to.
+ */
+struct fv_network_migration {
+        struct fv_connection *connection;
+        char *room_name;
+};
+
+/* A player that has been removed since the last relay tick */
+struct fv_network_relay_removal {
+        int player_num;
+        /* The link that the player came from */
+        struct fv_relay_link *relay_link;
+};
+
+/* The players that a relay peer has sent for one of the rooms */
+struct fv_network_peer_room {
+        struct fv_list link;
+        struct fv_network_room *room;
+        /* Array of ints indexed by the peer's player number to get
+         * the local player number, or -1 if there isn't a player */
+        struct fv_buffer players;
+};
+
+/* Another server process that is linked through the relay. The peers
+ * are only touched from the thread of the first worker, apart from
+ * the rooms that are detached when a room is released. Both happen
+ * with the rooms mutex held.
+ */
+struct fv_network_peer {
+        struct fv_list link;
+        struct fv_relay_link *relay_link;
+
+        /* Whether the peer has been sent the whole state of the
+         * rooms. Until then it doesn't get any removals or speech. */
+        bool synced;
+
+        /* The name of the peer's last ROOM message, or NULL if the
+         * room couldn't be created. The peer doesn't repeat the
+         * message so the room is looked up again by name if it has
+         * been released in the meantime. */
+        char *room_name;
+        /* The room of the peer's last ROOM message, or NULL if it
+         * hasn't been looked up since the room was released */
+        struct fv_network_peer_room *room;
+        struct fv_list rooms;
+};
+
+/* The clients of a room that are handled by one of the workers. The
+ * lists are only touched from the worker's thread. The rest of the
+ * members are protected by the room's playerbase lock.
+ */
+struct fv_network_room_worker {
+        struct fv_network_room *room;
+        struct fv_network_worker *worker;
 
         int n_clients;
         struct fv_list clients;
 
+        /* List of struct fv_network_subscription for each cell of
+         * the grid */
+        struct fv_list cells[FV_NETWORK_N_CELLS];
+
+        /* Array of struct fv_network_handoff */
+        struct fv_buffer handoffs;
+        bool pending_n_players_handoff;
+        /* Idle source to process the handoffs. This will be NULL if
+         * there are no handoffs queued.
+         */
+        struct fv_main_context_source *handoff_source;
+};
+
+/* Each room has its own players. The changes are only sent to the
+ * clients in the same room. The timers of the room run on the worker
+ * that created it so only that worker can release the room once it
+ * is empty.
+ */
+struct fv_network_room {
+        struct fv_list link;
+        struct fv_network *nw;
+        struct fv_network_worker *worker;
+        char *name;
+
+        struct fv_playerbase *playerbase;
         struct fv_listener dirty_listener;
 
+        /* Timeout to publish the player state changes when a tick
+         * rate is set. Otherwise this is NULL and the changes are
+         * published immediately. */
+        struct fv_main_context_source *tick_source;
+        /* Timeout to send the accumulated changes to the clients
+         * that aren't interested in the player's cell */
+        struct fv_main_context_source *far_source;
+
+        /* Protected by the playerbase lock */
+        uint64_t n_suppressed_speeches;
+        /* Array of struct fv_network_relay_removal. This is only
+         * used if the network has a relay. */
+        struct fv_buffer relay_removals;
+
+        /* The mix group and the timeout to start a mix of the
+         * speech for each 10ms packet. These are only created if the
+         * network has a mixer. */
+        struct fv_mixer_group *mix_group;
+        struct fv_main_context_source *mix_source;
+        /* Protected by the playerbase lock. The number of
+         * connections in the room that are using the mixed speech
+         * feature. */
+        int n_mixed_listeners;
+        /* Temporary array of the voice numbers of the talkers,
+         * indexed by player number. Only used in mix_cb. */
+        struct fv_buffer mix_voices;
+
+        /* One for each worker of the network */
+        struct fv_network_room_worker *workers;
+};
+
+/* Each worker has its own main context, listen sockets and clients.
+ * Only the first worker runs in the main thread. The clients of a
+ * worker are only touched from that worker's thread. Changes to the
+ * players are passed to the other workers by queuing handoffs.
+ */
+struct fv_network_worker {
+        struct fv_network *nw;
+
+        struct fv_main_context *mc;
+        pthread_t thread;
+
+        struct fv_list listen_sockets;
+
+        /* All of the clients of the worker, including the ones that
+         * haven't joined a room yet */
+        int n_clients;
+        struct fv_list clients;
+
+        struct fv_slice_allocator client_allocator;
+
         struct fv_main_context_source *gc_source;
+        struct fv_main_context_source *backpressure_source;
+
+        /* Only written from the worker's thread */
+        struct fv_stats stats;
+
+        /* Only accessed from the worker's thread */
+        bool running;
+
+        /* The following members are protected by the mutex */
+        pthread_mutex_t mutex;
+        /* Array of struct fv_network_migration */
+        struct fv_buffer migrations;
+        bool quit;
+        /* Idle source to process the migrations and the quit
+         * request. NULL if there is nothing to process. */
+        struct fv_main_context_source *wakeup_source;
 };
 
-FV_SLICE_ALLOCATOR(struct fv_network_client,
-                   fv_network_client_allocator);
+struct fv_network {
+        int n_workers;
+        struct fv_network_worker *workers;
+
+        /* Protects the list of rooms. This is never locked while a
+         * playerbase lock is held. */
+        pthread_mutex_t rooms_mutex;
+        struct fv_list rooms;
+        int n_rooms;
+        int max_rooms;
+        /* The suppressed speeches of the rooms that have been
+         * released */
+        uint64_t n_released_suppressed_speeches;
+        /* Whether all of the clients of a room are moved to the same
+         * worker */
+        bool pin_rooms;
+
+        int tick_rate;
+
+        /* The number of cells around a client's own cell that it
+         * receives immediate updates for, or -1 if the updates
+         * aren't filtered. */
+        int interest_radius;
+        int max_subscriptions;
+
+        /* Speech packets are only sent to the players within this
+         * distance of the speaker. Zero if speech isn't filtered.
+         */
+        float hearing_radius;
+
+        size_t max_queued_bytes;
+        uint64_t max_stall_time;
+
+        /* Whether the connections measure the latency of the messages
+         * that they send */
+        bool record_latency;
+
+        /* The relay to share the rooms with other processes or NULL.
+         * It runs on the first worker. */
+        struct fv_relay *relay;
+        struct fv_listener relay_listener;
+        struct fv_main_context_source *relay_source;
+        struct fv_list peers;
+
+        /* The thread pool to mix the speech for the clients that ask
+         * for it, or NULL if mixing is disabled */
+        int n_mixer_threads;
+        struct fv_mixer *mixer;
+
+        struct fv_list stats_sockets;
+        struct fv_list stats_clients;
+};
 
 #define FV_NETWORK_MAX_CLIENTS 1024
 
@@ -84,179 +376,937 @@ FV_SLICE_ALLOCATOR(struct fv_network_client,
  */
 #define FV_NETWORK_MAX_CLIENT_AGE ((uint64_t) 2 * 60 * 1000000)
 
+/* Number of milliseconds between checks for slow clients. This is
+ * also the rate at which position changes are sent to them. */
+#define FV_NETWORK_BACKPRESSURE_INTERVAL 1000
+
 static void
-update_all_listen_socket_sources(struct fv_network *nw);
+update_all_listen_socket_sources(struct fv_network_worker *worker);
 
 static bool
 connection_event_cb(struct fv_listener *listener,
                     void *data);
 
+static int
+get_player_cell(const struct fv_player *player)
+{
+        int x = player->x_position >> (32 - FV_NETWORK_GRID_BITS);
+        int y = player->y_position >> (32 - FV_NETWORK_GRID_BITS);
+
+        return y * FV_NETWORK_GRID_SIZE + x;
+}
+
+static bool
+cell_is_near(struct fv_network *nw,
+             int cell_a,
+             int cell_b)
+{
+        if (cell_a == -1 || cell_b == -1)
+                return false;
+
+        return (abs(cell_a % FV_NETWORK_GRID_SIZE -
+                    cell_b % FV_NETWORK_GRID_SIZE) <= nw->interest_radius &&
+                abs(cell_a / FV_NETWORK_GRID_SIZE -
+                    cell_b / FV_NETWORK_GRID_SIZE) <= nw->interest_radius);
+}
+
+static struct fv_network_room *
+get_client_room(struct fv_network_client *client)
+{
+        if (client->room_worker == NULL)
+                return NULL;
+
+        return client->room_worker->room;
+}
+
 static void
-remove_client(struct fv_network *nw,
-              struct fv_network_client *client)
+unsubscribe_client(struct fv_network_client *client)
 {
-        fv_connection_free(client->connection);
+        int i;
+
+        for (i = 0; i < client->n_subscriptions; i++)
+                fv_list_remove(&client->subscriptions[i].link);
 
-        nw->n_clients--;
+        client->n_subscriptions = 0;
+}
+
+/* Must be called from the client's worker with the playerbase lock
+ * held */
+static void
+set_client_cell(struct fv_network_client *client,
+                int cell)
+{
+        struct fv_network_room_worker *room_worker = client->room_worker;
+        struct fv_network_room *room = room_worker->room;
+        struct fv_network *nw = room->nw;
+        struct fv_network_subscription *subscription;
+        struct fv_player *player;
+        int old_cell = client->cell;
+        int n_players, i;
+
+        if (cell == old_cell)
+                return;
+
+        unsubscribe_client(client);
+
+        for (i = 0; i < FV_NETWORK_N_CELLS; i++) {
+                if (!cell_is_near(nw, cell, i))
+                        continue;
+
+                subscription = client->subscriptions +
+                        client->n_subscriptions++;
+                subscription->client = client;
+                fv_list_insert(&room_worker->cells[i], &subscription->link);
+        }
+
+        client->cell = cell;
+
+        /* The client has only been getting the throttled updates for
+         * the players that have just come into its area so it needs
+         * their full state now.
+         */
+        n_players = fv_playerbase_get_n_players(room->playerbase);
+
+        for (i = 0; i < n_players; i++) {
+                player = fv_playerbase_get_player_by_num(room->playerbase, i);
+
+                if (player == NULL)
+                        continue;
+
+                if (cell_is_near(nw, cell, player->published_cell) &&
+                    !cell_is_near(nw, old_cell, player->published_cell)) {
+                        fv_connection_dirty_player(client->connection,
+                                                   i,
+                                                   FV_PLAYER_STATE_ALL);
+                }
+        }
+}
+
+/* Removes the client from the worker without touching its
+ * connection */
+static void
+release_client(struct fv_network_worker *worker,
+               struct fv_network_client *client)
+{
+        if (client->room_worker) {
+                unsubscribe_client(client);
+                fv_list_remove(&client->room_link);
+                client->room_worker->n_clients--;
+        }
+
+        fv_free(client->subscriptions);
+
+        worker->n_clients--;
 
         fv_list_remove(&client->link);
-        fv_slice_free(&fv_network_client_allocator, client);
+        fv_slice_free(&worker->client_allocator, client);
+
+        update_all_listen_socket_sources(worker);
+}
+
+static bool
+client_has_mixed_speech(struct fv_network_client *client)
+{
+        uint32_t features = fv_connection_get_features(client->connection);
+
+        return !!(features & FV_PROTO_FEATURE_MIXED_SPEECH);
+}
+
+/* Counts the client as a listener of the mixed speech if it is using
+ * the feature. Must be called with the playerbase lock held once the
+ * client has a player. */
+static void
+add_mixed_listener(struct fv_network_room *room,
+                   struct fv_network_client *client,
+                   int count)
+{
+        struct fv_player *player =
+                fv_connection_get_player(client->connection);
+
+        if (!client_has_mixed_speech(client))
+                return;
+
+        player->n_mixed_listeners += count;
+        room->n_mixed_listeners += count;
+}
 
-        update_all_listen_socket_sources(nw);
+/* If the client has joined a room then this must be called with the
+ * room's playerbase lock held */
+static void
+remove_client(struct fv_network_worker *worker,
+              struct fv_network_client *client)
+{
+        if (client->room_worker &&
+            fv_connection_get_player(client->connection)) {
+                add_mixed_listener(client->room_worker->room,
+                                   client,
+                                   -1);
+        }
+
+        fv_connection_free(client->connection);
+        release_client(worker, client);
 }
 
 static struct fv_network_client *
-add_client(struct fv_network *nw,
+add_client(struct fv_network_worker *worker,
            struct fv_connection *conn)
 {
         struct fv_network_client *client;
         struct fv_signal *command_signal;
 
-        client = fv_slice_alloc(&fv_network_client_allocator);
+        client = fv_slice_alloc(&worker->client_allocator);
 
         command_signal = fv_connection_get_event_signal(conn);
         fv_signal_add(command_signal, &client->event_listener);
 
         client->event_listener.notify = connection_event_cb;
-        client->network = nw;
+        client->worker = worker;
         client->connection = conn;
+        client->room_worker = NULL;
+
+        client->cell = -1;
+        client->n_subscriptions = 0;
+        if (worker->nw->interest_radius >= 0) {
+                client->subscriptions =
+                        fv_alloc(sizeof (struct fv_network_subscription) *
+                                 worker->nw->max_subscriptions);
+        } else {
+                client->subscriptions = NULL;
+        }
 
-        fv_list_insert(&nw->clients, &client->link);
+        fv_list_insert(&worker->clients, &client->link);
+        worker->n_clients++;
 
-        update_all_listen_socket_sources(nw);
+        update_all_listen_socket_sources(worker);
 
         return client;
 }
 
+static bool
+worker_is_current(struct fv_network_worker *worker)
+{
+        return pthread_equal(worker->thread, pthread_self());
+}
+
 static void
-dirty_player(struct fv_network *nw,
-             struct fv_player *player,
-             int state)
+worker_dirty_player(struct fv_network_room_worker *room_worker,
+                    int player_num,
+                    int state)
 {
         struct fv_network_client *client;
 
-        fv_list_for_each(client, &nw->clients, link)
+        fv_list_for_each(client, &room_worker->clients, room_link)
                 fv_connection_dirty_player(client->connection,
-                                           player->num,
+                                           player_num,
                                            state);
 }
 
 static void
-dirty_n_players(struct fv_network *nw)
+worker_near_player(struct fv_network_room_worker *room_worker,
+                   const struct fv_network_handoff *handoff)
+{
+        struct fv_network *nw = room_worker->room->nw;
+        struct fv_network_subscription *subscription;
+        struct fv_connection *conn;
+        int state;
+
+        fv_list_for_each(subscription,
+                         &room_worker->cells[handoff->cell],
+                         link) {
+                conn = subscription->client->connection;
+
+                /* If the player has just entered the client's area
+                 * then the client might have missed some throttled
+                 * changes so it gets the full state */
+                if (cell_is_near(nw,
+                                 subscription->client->cell,
+                                 handoff->old_cell))
+                        state = handoff->dirty_state;
+                else
+                        state = FV_PLAYER_STATE_ALL;
+
+                fv_connection_dirty_player(conn, handoff->player_num, state);
+        }
+
+        if (handoff->old_cell == -1 || handoff->old_cell == handoff->cell)
+                return;
+
+        /* Give the clients that the player has just left a final
+         * update so that they see where it went */
+        fv_list_for_each(subscription,
+                         &room_worker->cells[handoff->old_cell],
+                         link) {
+                if (cell_is_near(nw,
+                                 subscription->client->cell,
+                                 handoff->cell))
+                        continue;
+
+                fv_connection_dirty_player(subscription->client->connection,
+                                           handoff->player_num,
+                                           handoff->dirty_state);
+        }
+}
+
+static void
+worker_far_player(struct fv_network_room_worker *room_worker,
+                  const struct fv_network_handoff *handoff)
 {
+        struct fv_network *nw = room_worker->room->nw;
         struct fv_network_client *client;
 
-        fv_list_for_each(client, &nw->clients, link)
-                fv_connection_dirty_n_players(client->connection);
+        fv_list_for_each(client, &room_worker->clients, room_link) {
+                /* The nearby clients have already had the changes */
+                if (cell_is_near(nw, client->cell, handoff->cell))
+                        continue;
+
+                fv_connection_dirty_player(client->connection,
+                                           handoff->player_num,
+                                           handoff->dirty_state);
+        }
 }
 
 static bool
-dirty_cb(struct fv_listener *listener,
-         void *data)
+can_hear(struct fv_network *nw,
+         const struct fv_player *speaker,
+         const struct fv_player *listener)
 {
-        struct fv_playerbase_dirty_event *event = data;
-        struct fv_network *nw = fv_container_of(listener,
-                                                struct fv_network,
-                                                dirty_listener);
+        float dx, dy;
 
-        if (event->n_players_changed)
-                dirty_n_players(nw);
+        /* The client doesn't do anything with speech before it has a
+         * player so it doesn't matter whether it is queued */
+        if (listener == NULL)
+                return true;
 
-        if (event->dirty_state)
-                dirty_player(nw, event->player, event->dirty_state);
+        dx = (((float) listener->x_position - speaker->x_position) *
+              (FV_NETWORK_MAP_WIDTH / 4294967296.0f));
+        dy = (((float) listener->y_position - speaker->y_position) *
+              (FV_NETWORK_MAP_HEIGHT / 4294967296.0f));
 
-        return true;
+        return dx * dx + dy * dy <= nw->hearing_radius * nw->hearing_radius;
 }
 
-static bool
-handle_update_position(struct fv_network *nw,
-                       struct fv_network_client *client,
-                       struct fv_connection_update_position_event *event)
+static void
+worker_queue_speech(struct fv_network_room_worker *room_worker,
+                    int player_num)
 {
-        const char *remote_address_string =
-                fv_connection_get_remote_address_string(client->connection);
-        struct fv_player *player = fv_connection_get_player(client->connection);
+        struct fv_network_room *room = room_worker->room;
+        struct fv_network *nw = room->nw;
+        struct fv_network_client *client;
+        struct fv_player *speaker, *listener;
 
-        if (player == NULL) {
-                fv_log("Client %s sent a position update before a hello "
-                       "message",
-                       remote_address_string);
-                remove_client(nw, client);
-                return false;
+        if (nw->hearing_radius <= 0.0f) {
+                fv_list_for_each(client, &room_worker->clients, room_link) {
+                        fv_connection_queue_speech(client->connection,
+                                                   player_num);
+                }
+                return;
         }
 
-        player->x_position = event->x_position;
-        player->y_position = event->y_position;
-        player->direction = event->direction;
+        speaker = fv_playerbase_get_player_by_num(room->playerbase,
+                                                  player_num);
+
+        /* The speaker might have been removed before the handoff was
+         * processed */
+        if (speaker == NULL)
+                return;
 
-        dirty_player(nw, player, FV_PLAYER_STATE_POSITION);
+        fv_list_for_each(client, &room_worker->clients, room_link) {
+                listener = fv_connection_get_player(client->connection);
 
-        return true;
+                if (can_hear(nw, speaker, listener)) {
+                        fv_connection_queue_speech(client->connection,
+                                                   player_num);
+                } else {
+                        room->n_suppressed_speeches++;
+                }
+        }
 }
 
-static bool
-handle_update_appearance(struct fv_network *nw,
-                         struct fv_network_client *client,
-                         struct fv_connection_update_appearance_event *event)
+static void
+worker_remove_player(struct fv_network_room_worker *room_worker,
+                     int player_num)
 {
-        const char *remote_address_string =
-                fv_connection_get_remote_address_string(client->connection);
-        struct fv_player *player = fv_connection_get_player(client->connection);
+        struct fv_network_client *client;
 
-        if (player == NULL) {
-                fv_log("Client %s sent an appearance update before a hello "
-                       "message",
-                       remote_address_string);
-                remove_client(nw, client);
-                return false;
+        fv_list_for_each(client, &room_worker->clients, room_link)
+                fv_connection_remove_player(client->connection, player_num);
+}
+
+static void
+worker_queue_mixed_speech(struct fv_network_room_worker *room_worker)
+{
+        struct fv_network_client *client;
+
+        fv_list_for_each(client, &room_worker->clients, room_link) {
+                if (client_has_mixed_speech(client))
+                        fv_connection_queue_mixed_speech(client->connection);
         }
+}
 
-        player->image = event->image;
+static void
+worker_dirty_n_players(struct fv_network_room_worker *room_worker)
+{
+        struct fv_network_client *client;
 
-        dirty_player(nw, player, FV_PLAYER_STATE_APPEARANCE);
+        fv_list_for_each(client, &room_worker->clients, room_link)
+                fv_connection_dirty_n_players(client->connection);
+}
 
-        return true;
+static void
+worker_apply_handoff(struct fv_network_room_worker *room_worker,
+                     const struct fv_network_handoff *handoff)
+{
+        switch (handoff->type) {
+        case FV_NETWORK_HANDOFF_DIRTY_PLAYER:
+                worker_dirty_player(room_worker,
+                                    handoff->player_num,
+                                    handoff->dirty_state);
+                break;
+        case FV_NETWORK_HANDOFF_NEAR_PLAYER:
+                worker_near_player(room_worker, handoff);
+                break;
+        case FV_NETWORK_HANDOFF_FAR_PLAYER:
+                worker_far_player(room_worker, handoff);
+                break;
+        case FV_NETWORK_HANDOFF_SPEECH:
+                worker_queue_speech(room_worker, handoff->player_num);
+                break;
+        case FV_NETWORK_HANDOFF_REMOVE_PLAYER:
+                worker_remove_player(room_worker, handoff->player_num);
+                break;
+        case FV_NETWORK_HANDOFF_MIXED_SPEECH:
+                worker_queue_mixed_speech(room_worker);
+                break;
+        }
 }
 
-static bool
-handle_update_flags(struct fv_network *nw,
-                    struct fv_network_client *client,
-                    struct fv_connection_update_flags_event *event)
+static void
+handoff_cb(struct fv_main_context_source *source,
+           void *user_data)
 {
-        const char *remote_address_string =
-                fv_connection_get_remote_address_string(client->connection);
-        struct fv_player *player = fv_connection_get_player(client->connection);
+        struct fv_network_room_worker *room_worker = user_data;
+        struct fv_playerbase *playerbase = room_worker->room->playerbase;
+        const struct fv_network_handoff *handoff;
+        size_t n_handoffs;
+        size_t i;
 
-        if (player == NULL) {
-                fv_log("Client %s sent a flags update before a hello "
-                       "message",
-                       remote_address_string);
-                remove_client(nw, client);
-                return false;
-        }
+        fv_playerbase_lock(playerbase);
 
-        player->n_flags = event->n_flags;
-        memcpy(player->flags,
-               event->flags,
-               sizeof (player->flags[0]) * event->n_flags);
+        n_handoffs = room_worker->handoffs.length / sizeof *handoff;
+        handoff = (const struct fv_network_handoff *)
+                room_worker->handoffs.data;
 
-        dirty_player(nw, player, FV_PLAYER_STATE_FLAGS);
+        for (i = 0; i < n_handoffs; i++, handoff++)
+                worker_apply_handoff(room_worker, handoff);
 
-        return true;
+        fv_buffer_set_length(&room_worker->handoffs, 0);
+
+        if (room_worker->pending_n_players_handoff) {
+                worker_dirty_n_players(room_worker);
+                room_worker->pending_n_players_handoff = false;
+        }
+
+        fv_main_context_remove_source(source);
+        room_worker->handoff_source = NULL;
+
+        fv_playerbase_unlock(playerbase);
 }
 
+/* Must be called with the playerbase lock held */
 static void
-xor_bytes(uint64_t *id,
-          const uint8_t *data,
-          size_t data_length)
+wakeup_room_worker(struct fv_network_room_worker *room_worker)
 {
-        uint8_t *id_bytes = (uint8_t *) id;
-        int data_pos = 0;
-        int i;
-
-        for (i = 0; i < sizeof (*id); i++) {
-                id_bytes[i] ^= data[data_pos];
-                data_pos = (data_pos + 1) % data_length;
+        if (room_worker->handoff_source == NULL) {
+                room_worker->handoff_source =
+                        fv_main_context_add_idle(room_worker->worker->mc,
+                                                 handoff_cb,
+                                                 room_worker);
+        }
+}
+
+/* Applies the handoff immediately for the current worker and queues
+ * it for the others. The workers that don't have any clients in the
+ * room are skipped. */
+static void
+send_handoff(struct fv_network_room *room,
+             const struct fv_network_handoff *handoff)
+{
+        struct fv_network_room_worker *room_worker;
+        int i;
+
+        for (i = 0; i < room->nw->n_workers; i++) {
+                room_worker = room->workers + i;
+
+                if (room_worker->n_clients == 0)
+                        continue;
+
+                if (worker_is_current(room_worker->worker)) {
+                        worker_apply_handoff(room_worker, handoff);
+                } else {
+                        fv_buffer_append(&room_worker->handoffs,
+                                         handoff,
+                                         sizeof *handoff);
+                        wakeup_room_worker(room_worker);
+                }
+        }
+}
+
+static void
+dirty_player(struct fv_network_room *room,
+             struct fv_player *player,
+             int state)
+{
+        struct fv_network_handoff handoff = {
+                .type = FV_NETWORK_HANDOFF_DIRTY_PLAYER,
+                .player_num = player->num,
+                .dirty_state = state
+        };
+
+        send_handoff(room, &handoff);
+}
+
+static void
+queue_speech(struct fv_network_room *room,
+             struct fv_player *player)
+{
+        struct fv_network_handoff handoff = {
+                .type = FV_NETWORK_HANDOFF_SPEECH,
+                .player_num = player->num
+        };
+
+        send_handoff(room, &handoff);
+
+        /* The packet is picked up by the next mix */
+        if (room->n_mixed_listeners > 0)
+                player->mix_speeches++;
+}
+
+/* Sends a change to a player's state to the clients that are
+ * interested in it. When the updates are filtered by area of
+ * interest the rest of the clients get the change later from far_cb.
+ */
+static void
+send_player_state(struct fv_network_room *room,
+                  struct fv_player *player,
+                  int state)
+{
+        struct fv_network_handoff handoff;
+
+        if (room->nw->interest_radius < 0) {
+                dirty_player(room, player, state);
+                return;
+        }
+
+        handoff.type = FV_NETWORK_HANDOFF_NEAR_PLAYER;
+        handoff.player_num = player->num;
+        handoff.dirty_state = state;
+        handoff.cell = get_player_cell(player);
+        handoff.old_cell = player->published_cell;
+
+        send_handoff(room, &handoff);
+
+        player->published_cell = handoff.cell;
+        player->far_state |= state;
+}
+
+static void
+far_cb(struct fv_main_context_source *source,
+       void *user_data)
+{
+        struct fv_network_room *room = user_data;
+        struct fv_network_handoff handoff;
+        struct fv_player *player;
+        int n_players, i;
+
+        fv_playerbase_lock(room->playerbase);
+
+        n_players = fv_playerbase_get_n_players(room->playerbase);
+
+        for (i = 0; i < n_players; i++) {
+                player = fv_playerbase_get_player_by_num(room->playerbase, i);
+
+                if (player == NULL || player->far_state == 0)
+                        continue;
+
+                handoff.type = FV_NETWORK_HANDOFF_FAR_PLAYER;
+                handoff.player_num = i;
+                handoff.dirty_state = player->far_state;
+                handoff.cell = player->published_cell;
+                handoff.old_cell = -1;
+
+                send_handoff(room, &handoff);
+
+                player->far_state = 0;
+        }
+
+        fv_playerbase_unlock(room->playerbase);
+}
+
+static void
+dirty_n_players(struct fv_network_room *room)
+{
+        struct fv_network_room_worker *room_worker;
+        int i;
+
+        for (i = 0; i < room->nw->n_workers; i++) {
+                room_worker = room->workers + i;
+
+                if (room_worker->n_clients == 0)
+                        continue;
+
+                if (worker_is_current(room_worker->worker)) {
+                        worker_dirty_n_players(room_worker);
+                } else {
+                        room_worker->pending_n_players_handoff = true;
+                        wakeup_room_worker(room_worker);
+                }
+        }
+}
+
+static void
+publish_player_state(struct fv_network_room *room,
+                     struct fv_player *player,
+                     int state)
+{
+        if (room->nw->relay)
+                player->relay_state |= state;
+
+        if (room->tick_source)
+                player->unpublished_state |= state;
+        else
+                send_player_state(room, player, state);
+}
+
+static void
+tick_cb(struct fv_main_context_source *source,
+        void *user_data)
+{
+        struct fv_network_room *room = user_data;
+        struct fv_player *player;
+        int n_players, i;
+
+        fv_playerbase_lock(room->playerbase);
+
+        n_players = fv_playerbase_get_n_players(room->playerbase);
+
+        for (i = 0; i < n_players; i++) {
+                player = fv_playerbase_get_player_by_num(room->playerbase, i);
+
+                if (player == NULL || player->unpublished_state == 0)
+                        continue;
+
+                send_player_state(room, player, player->unpublished_state);
+                player->unpublished_state = 0;
+        }
+
+        fv_playerbase_unlock(room->playerbase);
+}
+
+/* Adds the oldest packet that hasn't been mixed yet of each talker to
+ * the next mix. The first n_players ints of mix_voices are set to the
+ * voice number of each player or -1 if it isn't talking. Returns the
+ * number of voices added. */
+static int
+add_mix_voices(struct fv_network_room *room,
+               int n_players)
+{
+        struct fv_player *player;
+        struct fv_player_speech *speech;
+        int *voices;
+        int n_voices = 0;
+        int speech_num, i;
+
+        fv_buffer_set_length(&room->mix_voices, n_players * 2 * sizeof *voices);
+        voices = (int *) room->mix_voices.data;
+
+        for (i = 0; i < n_players; i++) {
+                voices[i] = -1;
+
+                player = fv_playerbase_get_player_by_num(room->playerbase, i);
+
+                if (player == NULL || player->mix_speeches <= 0)
+                        continue;
+
+                /* The speech buffer may have been released or wrapped
+                 * around. If the talker has got too far ahead of the
+                 * mixing then the older packets are skipped to keep
+                 * the latency down. */
+                player->mix_speeches = MIN(player->mix_speeches,
+                                           player->n_speeches);
+                player->mix_speeches = MIN(player->mix_speeches,
+                                           FV_NETWORK_MAX_MIX_BACKLOG);
+
+                if (player->mix_speeches == 0)
+                        continue;
+
+                speech_num = ((player->next_speech - player->mix_speeches +
+                               FV_PLAYER_MAX_PENDING_SPEECHES) %
+                              FV_PLAYER_MAX_PENDING_SPEECHES);
+                speech = fv_player_get_speech(player, speech_num);
+
+                voices[i] = fv_mixer_group_add_voice(room->mix_group,
+                                                     player->num,
+                                                     player->id,
+                                                     speech->packet,
+                                                     speech->size);
+                player->mix_speeches--;
+                n_voices++;
+        }
+
+        return n_voices;
+}
+
+static void
+add_mix_listeners(struct fv_network_room *room,
+                  int n_players)
+{
+        struct fv_network *nw = room->nw;
+        struct fv_player *listener, *talker;
+        int *voices = (int *) room->mix_voices.data;
+        int *audible = voices + n_players;
+        int n_audible;
+        int i, j;
+
+        for (i = 0; i < n_players; i++) {
+                listener = fv_playerbase_get_player_by_num(room->playerbase,
+                                                           i);
+
+                if (listener == NULL || listener->n_mixed_listeners <= 0)
+                        continue;
+
+                n_audible = 0;
+
+                for (j = 0; j < n_players; j++) {
+                        /* Players don't hear themselves */
+                        if (j == i || voices[j] == -1)
+                                continue;
+
+                        if (nw->hearing_radius > 0.0f) {
+                                talker = fv_playerbase_get_player_by_num(
+                                        room->playerbase,
+                                        j);
+                                if (!can_hear(nw, talker, listener)) {
+                                        room->n_suppressed_speeches++;
+                                        continue;
+                                }
+                        }
+
+                        audible[n_audible++] = voices[j];
+                }
+
+                if (n_audible > 0) {
+                        fv_mixer_group_add_listener(room->mix_group,
+                                                    listener->num,
+                                                    listener->id,
+                                                    audible,
+                                                    n_audible);
+                }
+        }
+}
+
+static void
+mix_cb(struct fv_main_context_source *source,
+       void *user_data)
+{
+        struct fv_network_room *room = user_data;
+        int n_players;
+
+        fv_playerbase_lock(room->playerbase);
+
+        /* If the last mix hasn't finished yet then the packets will
+         * be picked up by the next one instead */
+        if (room->n_mixed_listeners > 0 &&
+            !fv_mixer_group_is_busy(room->mix_group)) {
+                n_players = fv_playerbase_get_n_players(room->playerbase);
+
+                if (add_mix_voices(room, n_players) > 0) {
+                        add_mix_listeners(room, n_players);
+                        fv_mixer_group_start(room->mix_group);
+                }
+        }
+
+        fv_playerbase_unlock(room->playerbase);
+}
+
+static void
+mix_done_cb(const struct fv_mixer_output *outputs,
+            int n_outputs,
+            void *user_data)
+{
+        struct fv_network_room *room = user_data;
+        struct fv_network_handoff handoff = {
+                .type = FV_NETWORK_HANDOFF_MIXED_SPEECH,
+                .player_num = -1
+        };
+        struct fv_player *player;
+        uint64_t mix_time;
+        bool added = false;
+        int i;
+
+        if (room->nw->record_latency)
+                mix_time = fv_stats_get_latency_clock();
+        else
+                mix_time = fv_main_context_get_monotonic_clock(NULL);
+
+        fv_playerbase_lock(room->playerbase);
+
+        for (i = 0; i < n_outputs; i++) {
+                player = fv_playerbase_get_player_by_num(room->playerbase,
+                                                         outputs[i].player_num);
+
+                /* The listener might have gone while it was mixing */
+                if (player == NULL ||
+                    player->id != outputs[i].player_id ||
+                    player->n_mixed_listeners <= 0)
+                        continue;
+
+                fv_player_add_mixed_speech(player,
+                                           outputs[i].packet,
+                                           outputs[i].size,
+                                           mix_time);
+                added = true;
+        }
+
+        if (added)
+                send_handoff(room, &handoff);
+
+        fv_playerbase_unlock(room->playerbase);
+}
+
+static bool
+dirty_cb(struct fv_listener *listener,
+         void *data)
+{
+        struct fv_playerbase_dirty_event *event = data;
+        struct fv_network_room *room = fv_container_of(listener,
+                                                       struct fv_network_room,
+                                                       dirty_listener);
+
+        if (event->n_players_changed)
+                dirty_n_players(room);
+
+        if (event->dirty_state)
+                dirty_player(room, event->player, event->dirty_state);
+
+        if (event->removed_player_num != -1) {
+                struct fv_network_handoff handoff = {
+                        .type = FV_NETWORK_HANDOFF_REMOVE_PLAYER,
+                        .player_num = event->removed_player_num
+                };
+
+                send_handoff(room, &handoff);
+
+                if (room->nw->relay) {
+                        struct fv_network_relay_removal removal = {
+                                .player_num = event->removed_player_num,
+                                .relay_link = event->removed_relay_link
+                        };
+
+                        fv_buffer_append(&room->relay_removals,
+                                         &removal,
+                                         sizeof removal);
+                }
+        }
+
+        return true;
+}
+
+static bool
+handle_update_position(struct fv_network_room *room,
+                       struct fv_network_client *client,
+                       struct fv_connection_update_position_event *event)
+{
+        const char *remote_address_string =
+                fv_connection_get_remote_address_string(client->connection);
+        struct fv_player *player = fv_connection_get_player(client->connection);
+
+        if (player == NULL) {
+                fv_log("Client %s sent a position update before a hello "
+                       "message",
+                       remote_address_string);
+                remove_client(client->worker, client);
+                return false;
+        }
+
+        player->x_position = event->x_position;
+        player->y_position = event->y_position;
+        player->direction = event->direction;
+        player->position_time = event->receive_time;
+        fv_player_clear_state_frames(player, FV_PLAYER_STATE_POSITION);
+
+        if (room->nw->interest_radius >= 0)
+                set_client_cell(client, get_player_cell(player));
+
+        publish_player_state(room, player, FV_PLAYER_STATE_POSITION);
+
+        return true;
+}
+
+static bool
+handle_update_appearance(struct fv_network_room *room,
+                         struct fv_network_client *client,
+                         struct fv_connection_update_appearance_event *event)
+{
+        const char *remote_address_string =
+                fv_connection_get_remote_address_string(client->connection);
+        struct fv_player *player = fv_connection_get_player(client->connection);
+
+        if (player == NULL) {
+                fv_log("Client %s sent an appearance update before a hello "
+                       "message",
+                       remote_address_string);
+                remove_client(client->worker, client);
+                return false;
+        }
+
+        player->image = event->image;
+        fv_player_clear_state_frames(player, FV_PLAYER_STATE_APPEARANCE);
+
+        publish_player_state(room, player, FV_PLAYER_STATE_APPEARANCE);
+
+        return true;
+}
+
+static bool
+handle_update_flags(struct fv_network_room *room,
+                    struct fv_network_client *client,
+                    struct fv_connection_update_flags_event *event)
+{
+        const char *remote_address_string =
+                fv_connection_get_remote_address_string(client->connection);
+        struct fv_player *player = fv_connection_get_player(client->connection);
+
+        if (player == NULL) {
+                fv_log("Client %s sent a flags update before a hello "
+                       "message",
+                       remote_address_string);
+                remove_client(client->worker, client);
+                return false;
+        }
+
+        player->n_flags = event->n_flags;
+        memcpy(player->flags,
+               event->flags,
+               sizeof (player->flags[0]) * event->n_flags);
+        fv_player_clear_state_frames(player, FV_PLAYER_STATE_FLAGS);
+
+        publish_player_state(room, player, FV_PLAYER_STATE_FLAGS);
+
+        return true;
+}
+
+static void
+xor_bytes(uint64_t *id,
+          const uint8_t *data,
+          size_t data_length)
+{
+        uint8_t *id_bytes = (uint8_t *) id;
+        int data_pos = 0;
+        int i;
+
+        for (i = 0; i < sizeof (*id); i++) {
+                id_bytes[i] ^= data[data_pos];
+                data_pos = (data_pos + 1) % data_length;
         }
 }
 
@@ -294,7 +1344,7 @@ generate_id(const struct fv_netaddress *remote_address)
 }
 
 static bool
-handle_new_player(struct fv_network *nw,
+handle_new_player(struct fv_network_room *room,
                   struct fv_network_client *client,
                   struct fv_connection_event *event)
 {
@@ -309,27 +1359,29 @@ handle_new_player(struct fv_network *nw,
         if (player != NULL) {
                 fv_log("Client %s sent multiple hello messages",
                        remote_address_string);
-                remove_client(nw, client);
+                remove_client(client->worker, client);
                 return false;
         }
 
         do {
                 id = generate_id(remote_address);
-        } while (fv_playerbase_get_player_by_id(nw->playerbase, id));
+        } while (fv_playerbase_get_player_by_id(room->playerbase, id));
 
-        player = fv_playerbase_add_player(nw->playerbase, id);
+        player = fv_playerbase_add_player(room->playerbase, id);
 
         fv_connection_set_player(client->connection,
                                  player,
                                  false /* from_reconnect */);
-        dirty_player(nw, player, FV_PLAYER_STATE_ALL);
-        dirty_n_players(nw);
+        dirty_player(room, player, FV_PLAYER_STATE_ALL);
+        dirty_n_players(room);
+
+        add_mixed_listener(room, client, 1);
 
         return true;
 }
 
 static bool
-handle_reconnect(struct fv_network *nw,
+handle_reconnect(struct fv_network_room *room,
                  struct fv_network_client *client,
                  struct fv_connection_reconnect_event *event)
 {
@@ -341,28 +1393,33 @@ handle_reconnect(struct fv_network *nw,
         if (player != NULL) {
                 fv_log("Client %s sent multiple hello messages",
                        remote_address_string);
-                remove_client(nw, client);
+                remove_client(client->worker, client);
                 return false;
         }
 
-        player = fv_playerbase_get_player_by_id(nw->playerbase,
+        player = fv_playerbase_get_player_by_id(room->playerbase,
                                                 event->player_id);
 
         /* If the client requested a player that doesn't exist then
          * divert it to a new player instead.
          */
         if (player == NULL)
-                return handle_new_player(nw, client, &event->base);
+                return handle_new_player(room, client, &event->base);
 
         fv_connection_set_player(client->connection,
                                  player,
                                  true /* from_reconnect */);
 
+        add_mixed_listener(room, client, 1);
+
+        if (room->nw->interest_radius >= 0)
+                set_client_cell(client, player->published_cell);
+
         return true;
 }
 
 static bool
-handle_speech(struct fv_network *nw,
+handle_speech(struct fv_network_room *room,
               struct fv_network_client *client,
               struct fv_connection_speech_event *event)
 {
@@ -371,201 +1428,1660 @@ handle_speech(struct fv_network *nw,
         struct fv_player *player =
                 fv_connection_get_player(client->connection);
         struct fv_player_speech *player_speech;
-        struct fv_network_client *other_client;
-
 
         if (player == NULL) {
                 fv_log("Client %s sent a speech before a hello "
                        "message",
                        remote_address_string);
-                remove_client(nw, client);
+                remove_client(client->worker, client);
+                return false;
+        }
+
+        player_speech = fv_playerbase_add_speech(room->playerbase, player);
+        memcpy(player_speech->packet, event->packet, event->packet_size);
+        player_speech->size = event->packet_size;
+        player_speech->receive_time = event->receive_time;
+
+        queue_speech(room, player);
+
+        if (room->nw->relay)
+                player->relay_speeches++;
+
+        return true;
+}
+
+static bool
+handle_connection_event(struct fv_network_room *room,
+                        struct fv_network_client *client,
+                        struct fv_connection_event *event)
+{
+        switch (event->type) {
+        case FV_CONNECTION_EVENT_ERROR:
+                remove_client(client->worker, client);
                 return false;
+
+        case FV_CONNECTION_EVENT_UPDATE_POSITION: {
+                struct fv_connection_update_position_event *de = (void *) event;
+                return handle_update_position(room, client, de);
+        }
+
+        case FV_CONNECTION_EVENT_UPDATE_APPEARANCE: {
+                struct fv_connection_update_appearance_event *de =
+                        (void *) event;
+                return handle_update_appearance(room, client, de);
+        }
+
+        case FV_CONNECTION_EVENT_UPDATE_FLAGS: {
+                struct fv_connection_update_flags_event *de =
+                        (void *) event;
+                return handle_update_flags(room, client, de);
+        }
+
+        case FV_CONNECTION_EVENT_RECONNECT: {
+                struct fv_connection_reconnect_event *de = (void *) event;
+                return handle_reconnect(room, client, de);
+        }
+
+        case FV_CONNECTION_EVENT_SPEECH: {
+                struct fv_connection_speech_event *de = (void *) event;
+                return handle_speech(room, client, de);
         }
 
-        player_speech = player->speech_queue + player->next_speech;
-        memcpy(player_speech->packet, event->packet, event->packet_size);
-        player_speech->size = event->packet_size;
-        player->next_speech = ((player->next_speech + 1) %
-                               FV_PLAYER_MAX_PENDING_SPEECHES);
+        case FV_CONNECTION_EVENT_NEW_PLAYER:
+                return handle_new_player(room, client, event);
+
+        case FV_CONNECTION_EVENT_HANDSHAKE:
+                /* This is handled before the client has a room */
+                break;
+
+        }
+
+        return true;
+}
+
+static uint32_t
+hash_room_name(const char *name)
+{
+        uint32_t hash = 2166136261u;
+
+        /* FNV-1a */
+        while (*name) {
+                hash ^= (uint8_t) *(name++);
+                hash *= 16777619u;
+        }
+
+        return hash;
+}
+
+/* Returns a copy of the request path without the query string, or
+ * NULL if it can't be used as a room name */
+static char *
+get_room_name(const char *path)
+{
+        size_t length;
+        char *name;
+
+        if (path[0] != '/')
+                return NULL;
+
+        for (length = 0; path[length] && path[length] != '?'; length++) {
+                if (length >= FV_NETWORK_MAX_ROOM_NAME_LENGTH)
+                        return NULL;
+
+                /* The name is written to the log so it is limited
+                 * to printable ASCII */
+                if ((uint8_t) path[length] <= ' ' ||
+                    (uint8_t) path[length] >= 0x7f)
+                        return NULL;
+        }
+
+        name = fv_alloc(length + 1);
+        memcpy(name, path, length);
+        name[length] = '\0';
+
+        return name;
+}
+
+static void
+init_room_worker(struct fv_network_room *room,
+                 struct fv_network_room_worker *room_worker,
+                 struct fv_network_worker *worker)
+{
+        int i;
+
+        room_worker->room = room;
+        room_worker->worker = worker;
+
+        room_worker->n_clients = 0;
+        fv_list_init(&room_worker->clients);
+
+        for (i = 0; i < FV_NETWORK_N_CELLS; i++)
+                fv_list_init(room_worker->cells + i);
+
+        fv_buffer_init(&room_worker->handoffs);
+        room_worker->pending_n_players_handoff = false;
+        room_worker->handoff_source = NULL;
+}
+
+/* Must be called from the thread of the worker with the rooms mutex
+ * held */
+static struct fv_network_room *
+create_room(struct fv_network_worker *worker,
+            const char *name)
+{
+        struct fv_network *nw = worker->nw;
+        struct fv_network_room *room = fv_alloc(sizeof *room);
+        int i;
+
+        room->nw = nw;
+        room->worker = worker;
+        room->name = fv_strdup(name);
+
+        /* The playerbase adds its timers to the default main context
+         * of the thread so they will also run on this worker */
+        room->playerbase = fv_playerbase_new();
+        room->dirty_listener.notify = dirty_cb;
+        fv_signal_add(fv_playerbase_get_dirty_signal(room->playerbase),
+                      &room->dirty_listener);
+
+        if (nw->tick_rate > 0) {
+                room->tick_source =
+                        fv_main_context_add_timeout(worker->mc,
+                                                    1000 / nw->tick_rate,
+                                                    tick_cb,
+                                                    room);
+        } else {
+                room->tick_source = NULL;
+        }
+
+        if (nw->interest_radius >= 0) {
+                room->far_source =
+                        fv_main_context_add_timeout(worker->mc,
+                                                    FV_NETWORK_FAR_UPDATE_INTERVAL,
+                                                    far_cb,
+                                                    room);
+        } else {
+                room->far_source = NULL;
+        }
+
+        room->n_suppressed_speeches = 0;
+        fv_buffer_init(&room->relay_removals);
+
+        if (nw->mixer) {
+                room->mix_group = fv_mixer_group_new(nw->mixer,
+                                                     worker->mc,
+                                                     mix_done_cb,
+                                                     room);
+                room->mix_source =
+                        fv_main_context_add_timeout(worker->mc,
+                                                    FV_PROTO_SPEECH_TIME,
+                                                    mix_cb,
+                                                    room);
+        } else {
+                room->mix_group = NULL;
+                room->mix_source = NULL;
+        }
+        room->n_mixed_listeners = 0;
+        fv_buffer_init(&room->mix_voices);
+
+        room->workers = fv_alloc(sizeof (struct fv_network_room_worker) *
+                                 nw->n_workers);
+        for (i = 0; i < nw->n_workers; i++)
+                init_room_worker(room, room->workers + i, nw->workers + i);
+
+        fv_list_insert(&nw->rooms, &room->link);
+        nw->n_rooms++;
+
+        fv_log("Created room %s", name);
+
+        return room;
+}
+
+static void
+free_room(struct fv_network_room *room)
+{
+        struct fv_network_room_worker *room_worker;
+        int i;
+
+        if (room->tick_source)
+                fv_main_context_remove_source(room->tick_source);
+        if (room->far_source)
+                fv_main_context_remove_source(room->far_source);
+        if (room->mix_source)
+                fv_main_context_remove_source(room->mix_source);
+        if (room->mix_group)
+                fv_mixer_group_free(room->mix_group);
+        fv_buffer_destroy(&room->mix_voices);
+
+        for (i = 0; i < room->nw->n_workers; i++) {
+                room_worker = room->workers + i;
+
+                assert(room_worker->n_clients == 0);
+
+                if (room_worker->handoff_source)
+                        fv_main_context_remove_source(room_worker->
+                                                      handoff_source);
+                fv_buffer_destroy(&room_worker->handoffs);
+        }
+
+        fv_free(room->workers);
+
+        fv_playerbase_free(room->playerbase);
+        fv_buffer_destroy(&room->relay_removals);
+
+        fv_list_remove(&room->link);
+        room->nw->n_rooms--;
+        fv_free(room->name);
+        fv_free(room);
+}
+
+/* Must be called with the playerbase lock held */
+static bool
+room_is_empty(struct fv_network_room *room)
+{
+        struct fv_network_room_worker *room_worker;
+        int i;
+
+        if (!fv_playerbase_is_empty(room->playerbase))
+                return false;
+
+        /* The peers still need to be told about the removed players */
+        if (room->relay_removals.length > 0)
+                return false;
+
+        for (i = 0; i < room->nw->n_workers; i++) {
+                room_worker = room->workers + i;
+
+                /* An idle source that is already queued on another
+                 * worker might be about to run so the room has to
+                 * wait until it is done */
+                if (room_worker->n_clients > 0 ||
+                    room_worker->handoff_source)
+                        return false;
+        }
+
+        return true;
+}
+
+/* Frees the relay peers' records of a room that is being released.
+ * The room is empty so the peers don't have any players left in it.
+ * Must be called with the rooms mutex held. */
+static void
+detach_peer_rooms(struct fv_network_room *room)
+{
+        struct fv_network_peer_room *peer_room, *tmp;
+        struct fv_network_peer *peer;
+
+        fv_list_for_each(peer, &room->nw->peers, link) {
+                fv_list_for_each_safe(peer_room, tmp, &peer->rooms, link) {
+                        if (peer_room->room != room)
+                                continue;
+
+                        if (peer->room == peer_room)
+                                peer->room = NULL;
+
+                        fv_list_remove(&peer_room->link);
+                        fv_buffer_destroy(&peer_room->players);
+                        fv_free(peer_room);
+                }
+        }
+}
+
+/* Frees the room if it doesn't have any clients or players left so
+ * that it no longer counts towards the maximum number of rooms. Must
+ * be called from the thread of the worker that created the room with
+ * the rooms mutex held. No clients can join the room while the mutex
+ * is held and the relay events are also handled with it held. */
+static void
+release_room_if_empty_locked(struct fv_network_room *room)
+{
+        struct fv_network *nw = room->nw;
+        bool empty;
+
+        fv_playerbase_lock(room->playerbase);
+        empty = room_is_empty(room);
+        if (empty) {
+                nw->n_released_suppressed_speeches +=
+                        room->n_suppressed_speeches;
+        }
+        fv_playerbase_unlock(room->playerbase);
+
+        if (!empty)
+                return;
+
+        fv_log("Released room %s", room->name);
+
+        detach_peer_rooms(room);
+        free_room(room);
+}
+
+/* Must be called from the thread of the worker that created the room
+ * without any playerbase lock held */
+static void
+release_room_if_empty(struct fv_network_room *room)
+{
+        struct fv_network *nw = room->nw;
+
+        pthread_mutex_lock(&nw->rooms_mutex);
+        release_room_if_empty_locked(room);
+        pthread_mutex_unlock(&nw->rooms_mutex);
+}
+
+static void
+release_empty_rooms(struct fv_network_worker *worker)
+{
+        struct fv_network *nw = worker->nw;
+        struct fv_network_room *room, *tmp;
+
+        pthread_mutex_lock(&nw->rooms_mutex);
+
+        fv_list_for_each_safe(room, tmp, &nw->rooms, link) {
+                if (room->worker == worker)
+                        release_room_if_empty_locked(room);
+        }
+
+        pthread_mutex_unlock(&nw->rooms_mutex);
+}
+
+/* Returns the room with the given name, creating it on the current
+ * worker if it doesn't exist yet. Returns NULL if the room would be
+ * new but there are already too many rooms. Must be called with the
+ * rooms mutex held and the room can be released as soon as it is
+ * unlocked unless something has been added to it. */
+static struct fv_network_room *
+get_room(struct fv_network_worker *worker,
+         const char *name)
+{
+        struct fv_network *nw = worker->nw;
+        struct fv_network_room *room;
+
+        fv_list_for_each(room, &nw->rooms, link) {
+                if (!strcmp(room->name, name))
+                        return room;
+        }
+
+        if (nw->n_rooms < nw->max_rooms)
+                return create_room(worker, name);
+
+        return NULL;
+}
+
+static bool
+join_room(struct fv_network_client *client,
+          const char *name)
+{
+        struct fv_network_worker *worker = client->worker;
+        struct fv_network *nw = worker->nw;
+        struct fv_network_room_worker *room_worker;
+        struct fv_network_room *room;
+
+        pthread_mutex_lock(&nw->rooms_mutex);
+
+        room = get_room(worker, name);
+
+        if (room == NULL) {
+                pthread_mutex_unlock(&nw->rooms_mutex);
+                fv_log("Rejecting client %s for room %s because there are "
+                       "too many rooms",
+                       fv_connection_get_remote_address_string(client->
+                                                               connection),
+                       name);
+                remove_client(worker, client);
+                return false;
+        }
+
+        room_worker = room->workers + (worker - nw->workers);
+
+        fv_playerbase_lock(room->playerbase);
+
+        fv_connection_set_playerbase(client->connection, room->playerbase);
+
+        client->room_worker = room_worker;
+        fv_list_insert(&room_worker->clients, &client->room_link);
+        room_worker->n_clients++;
+
+        fv_playerbase_unlock(room->playerbase);
+
+        /* The room can't be released now that it has a client */
+        pthread_mutex_unlock(&nw->rooms_mutex);
+
+        return true;
+}
+
+static void
+wakeup_cb(struct fv_main_context_source *source,
+          void *user_data)
+{
+        struct fv_network_worker *worker = user_data;
+        const struct fv_network_migration *migration;
+        struct fv_network_client *client;
+        struct fv_buffer migrations;
+        size_t n_migrations;
+        size_t i;
+
+        pthread_mutex_lock(&worker->mutex);
+
+        /* Take the whole queue so that the connections can be
+         * attached without holding the mutex */
+        migrations = worker->migrations;
+        fv_buffer_init(&worker->migrations);
+
+        if (worker->quit)
+                worker->running = false;
+
+        fv_main_context_remove_source(source);
+        worker->wakeup_source = NULL;
+
+        pthread_mutex_unlock(&worker->mutex);
+
+        n_migrations = migrations.length / sizeof *migration;
+        migration = (const struct fv_network_migration *) migrations.data;
+
+        for (i = 0; i < n_migrations; i++, migration++) {
+                fv_connection_set_stats(migration->connection,
+                                        &worker->stats);
+
+                client = add_client(worker, migration->connection);
+
+                if (join_room(client, migration->room_name))
+                        fv_connection_attach(migration->connection);
+
+                fv_free(migration->room_name);
+        }
+
+        fv_buffer_destroy(&migrations);
+}
+
+/* Must be called with the worker's mutex held */
+static void
+wakeup_worker(struct fv_network_worker *worker)
+{
+        if (worker->wakeup_source == NULL) {
+                worker->wakeup_source =
+                        fv_main_context_add_idle(worker->mc,
+                                                 wakeup_cb,
+                                                 worker);
+        }
+}
+
+/* Passes a client that has finished its handshake to the worker that
+ * its room is pinned to. The other worker takes ownership of the room
+ * name. */
+static void
+migrate_client(struct fv_network_client *client,
+               struct fv_network_worker *target,
+               char *room_name)
+{
+        struct fv_network_migration migration = {
+                .connection = client->connection,
+                .room_name = room_name
+        };
+
+        fv_connection_detach(client->connection);
+        fv_list_remove(&client->event_listener.link);
+        release_client(client->worker, client);
+
+        pthread_mutex_lock(&target->mutex);
+        fv_buffer_append(&target->migrations, &migration, sizeof migration);
+        wakeup_worker(target);
+        pthread_mutex_unlock(&target->mutex);
+}
+
+static bool
+handle_handshake(struct fv_network_client *client,
+                 struct fv_connection_handshake_event *event)
+{
+        struct fv_network_worker *worker = client->worker;
+        struct fv_network *nw = worker->nw;
+        struct fv_network_worker *target;
+        char *room_name;
+        bool ret;
+
+        room_name = get_room_name(event->path);
+
+        if (room_name == NULL) {
+                fv_log("Client %s requested an invalid room",
+                       fv_connection_get_remote_address_string(client->
+                                                               connection));
+                remove_client(worker, client);
+                return false;
+        }
+
+        if (nw->pin_rooms) {
+                target = (nw->workers +
+                          hash_room_name(room_name) % nw->n_workers);
+
+                if (target != worker) {
+                        migrate_client(client, target, room_name);
+                        return false;
+                }
+        }
+
+        ret = join_room(client, room_name);
+
+        fv_free(room_name);
+
+        return ret;
+}
+
+static bool
+connection_event_cb(struct fv_listener *listener,
+                    void *data)
+{
+        struct fv_network_client *client =
+                fv_container_of(listener,
+                                struct fv_network_client,
+                                event_listener);
+        struct fv_connection_event *event = data;
+        struct fv_network_room *room;
+        bool owned, ret;
+
+        if (event->type == FV_CONNECTION_EVENT_HANDSHAKE)
+                return handle_handshake(client, data);
+
+        room = get_client_room(client);
+
+        /* Nothing but an error can happen before the handshake */
+        if (room == NULL) {
+                remove_client(client->worker, client);
+                return false;
+        }
+
+        /* The client might be freed by the event */
+        owned = room->worker == client->worker;
+
+        fv_playerbase_lock(room->playerbase);
+        ret = handle_connection_event(room, client, event);
+        fv_playerbase_unlock(room->playerbase);
+
+        /* The client has been removed if the event returns false */
+        if (!ret && owned)
+                release_room_if_empty(room);
+
+        return ret;
+}
+
+/* Removes the client while holding the lock of its room if it has
+ * joined one */
+static void
+lock_and_remove_client(struct fv_network_worker *worker,
+                       struct fv_network_client *client)
+{
+        struct fv_network_room *room = get_client_room(client);
+        bool owned;
+
+        if (room == NULL) {
+                remove_client(worker, client);
+                return;
+        }
+
+        /* Only the worker that created the room can release it.
+         * Otherwise it is left for the garbage collection of that
+         * worker, which might free it as soon as it is unlocked. */
+        owned = room->worker == worker;
+
+        fv_playerbase_lock(room->playerbase);
+        remove_client(worker, client);
+        fv_playerbase_unlock(room->playerbase);
+
+        if (owned)
+                release_room_if_empty(room);
+}
+
+static void
+relay_player(struct fv_network_room *room,
+             struct fv_network_peer *peer,
+             struct fv_player *player)
+{
+        int state = peer->synced ? player->relay_state : FV_PLAYER_STATE_ALL;
+        int n_speeches, speech_num, i;
+
+        if (state) {
+                fv_relay_link_send_player(peer->relay_link,
+                                          room->name,
+                                          player,
+                                          state);
+        }
+
+        /* A new peer isn't sent the old speech */
+        if (!peer->synced)
+                return;
+
+        /* The speech buffer may have been released or wrapped around
+         * since the last tick */
+        n_speeches = MIN(player->relay_speeches, player->n_speeches);
+
+        for (i = 0; i < n_speeches; i++) {
+                speech_num = ((player->next_speech - n_speeches + i +
+                               FV_PLAYER_MAX_PENDING_SPEECHES) %
+                              FV_PLAYER_MAX_PENDING_SPEECHES);
+                fv_relay_link_send_speech(peer->relay_link,
+                                          room->name,
+                                          player->num,
+                                          fv_player_get_speech(player,
+                                                               speech_num));
+        }
+}
+
+/* Sends the changes since the last tick to every peer except the one
+ * that they came from. Must be called with the playerbase lock
+ * held. */
+static void
+relay_room(struct fv_network_room *room)
+{
+        struct fv_network *nw = room->nw;
+        const struct fv_network_relay_removal *removal;
+        struct fv_network_peer *peer;
+        struct fv_player *player;
+        size_t n_removals, i;
+        int n_players, num;
+
+        n_removals = room->relay_removals.length / sizeof *removal;
+        removal = (const struct fv_network_relay_removal *)
+                room->relay_removals.data;
+
+        /* The removals are sent first in case the numbers have been
+         * reused for a new player */
+        for (i = 0; i < n_removals; i++, removal++) {
+                fv_list_for_each(peer, &nw->peers, link) {
+                        if (!peer->synced ||
+                            peer->relay_link == removal->relay_link)
+                                continue;
+
+                        fv_relay_link_send_player_removed(peer->relay_link,
+                                                          room->name,
+                                                          removal->player_num);
+                }
+        }
+
+        fv_buffer_set_length(&room->relay_removals, 0);
+
+        n_players = fv_playerbase_get_n_players(room->playerbase);
+
+        for (num = 0; num < n_players; num++) {
+                player = fv_playerbase_get_player_by_num(room->playerbase,
+                                                         num);
+                if (player == NULL)
+                        continue;
+
+                fv_list_for_each(peer, &nw->peers, link) {
+                        if (peer->relay_link != player->relay_link)
+                                relay_player(room, peer, player);
+                }
+
+                player->relay_state = 0;
+                player->relay_speeches = 0;
+        }
+}
+
+static void
+relay_cb(struct fv_main_context_source *source,
+         void *user_data)
+{
+        struct fv_network *nw = user_data;
+        struct fv_network_room *room;
+        struct fv_network_peer *peer;
+
+        pthread_mutex_lock(&nw->rooms_mutex);
+
+        fv_list_for_each(room, &nw->rooms, link) {
+                fv_playerbase_lock(room->playerbase);
+                relay_room(room);
+                fv_playerbase_unlock(room->playerbase);
+        }
+
+        pthread_mutex_unlock(&nw->rooms_mutex);
+
+        fv_list_for_each(peer, &nw->peers, link)
+                peer->synced = true;
+}
+
+static struct fv_network_peer *
+get_peer(struct fv_network *nw,
+         struct fv_relay_link *relay_link)
+{
+        struct fv_network_peer *peer;
+
+        fv_list_for_each(peer, &nw->peers, link) {
+                if (peer->relay_link == relay_link)
+                        return peer;
+        }
+
+        return NULL;
+}
+
+static void
+add_peer(struct fv_network *nw,
+         struct fv_relay_link *relay_link)
+{
+        struct fv_network_peer *peer = fv_alloc(sizeof *peer);
+
+        peer->relay_link = relay_link;
+        peer->synced = false;
+        peer->room_name = NULL;
+        peer->room = NULL;
+        fv_list_init(&peer->rooms);
+
+        fv_list_insert(nw->peers.prev, &peer->link);
+}
+
+/* Frees the peer. If remove_players is true then the players that it
+ * sent are removed from the rooms. */
+static void
+free_peer(struct fv_network_peer *peer,
+          bool remove_players)
+{
+        struct fv_network_peer_room *peer_room, *tmp;
+        struct fv_playerbase *playerbase;
+        struct fv_player *player;
+        const int *slots;
+        size_t n_slots, i;
+
+        fv_list_for_each_safe(peer_room, tmp, &peer->rooms, link) {
+                playerbase = peer_room->room->playerbase;
+                n_slots = peer_room->players.length / sizeof (int);
+                slots = (const int *) peer_room->players.data;
+
+                if (remove_players) {
+                        fv_playerbase_lock(playerbase);
+
+                        for (i = 0; i < n_slots; i++) {
+                                if (slots[i] == -1)
+                                        continue;
+                                player = fv_playerbase_get_player_by_num(
+                                        playerbase,
+                                        slots[i]);
+                                player->ref_count--;
+                                fv_playerbase_remove_player(playerbase,
+                                                            player);
+                        }
+
+                        fv_playerbase_unlock(playerbase);
+                }
+
+                fv_buffer_destroy(&peer_room->players);
+                fv_free(peer_room);
+        }
+
+        fv_free(peer->room_name);
+        fv_list_remove(&peer->link);
+        fv_free(peer);
+}
+
+/* Looks up the room of the peer's last ROOM message. Must be called
+ * with the rooms mutex held. */
+static void
+set_peer_room(struct fv_network *nw,
+              struct fv_network_peer *peer)
+{
+        struct fv_network_peer_room *peer_room;
+        struct fv_network_room *room;
+
+        peer->room = NULL;
+
+        room = get_room(nw->workers, peer->room_name);
+
+        if (room == NULL) {
+                fv_log("Ignoring players from a relay peer for room %s "
+                       "because there are too many rooms",
+                       peer->room_name);
+                fv_free(peer->room_name);
+                peer->room_name = NULL;
+                return;
+        }
+
+        fv_list_for_each(peer_room, &peer->rooms, link) {
+                if (peer_room->room == room) {
+                        peer->room = peer_room;
+                        return;
+                }
+        }
+
+        peer_room = fv_alloc(sizeof *peer_room);
+        peer_room->room = room;
+        fv_buffer_init(&peer_room->players);
+        fv_list_insert(&peer->rooms, &peer_room->link);
+
+        peer->room = peer_room;
+}
+
+/* Returns a pointer to the local player number for the peer's player
+ * number */
+static int *
+get_peer_player_slot(struct fv_network_peer_room *peer_room,
+                     int peer_num)
+{
+        size_t n_slots = peer_room->players.length / sizeof (int);
+        int *slots;
+        size_t i;
+
+        if (peer_num >= n_slots) {
+                fv_buffer_set_length(&peer_room->players,
+                                     (peer_num + 1) * sizeof (int));
+                slots = (int *) peer_room->players.data;
+                for (i = n_slots; i <= peer_num; i++)
+                        slots[i] = -1;
+        }
+
+        return (int *) peer_room->players.data + peer_num;
+}
+
+/* Must be called with the playerbase lock held */
+static void
+handle_relay_player_event(struct fv_network_peer *peer,
+                          struct fv_relay_player_event *event)
+{
+        struct fv_network_room *room = peer->room->room;
+        struct fv_playerbase *playerbase = room->playerbase;
+        struct fv_player_speech *player_speech;
+        struct fv_player *player;
+        int *slot;
+        int state;
+
+        slot = get_peer_player_slot(peer->room, event->player_num);
+
+        if (*slot != -1) {
+                player = fv_playerbase_get_player_by_num(playerbase, *slot);
+        } else if (event->base.type == FV_RELAY_EVENT_PLAYER_REMOVED) {
+                return;
+        } else {
+                player = fv_playerbase_add_remote_player(playerbase,
+                                                         peer->relay_link);
+                /* The peer keeps a reference so that the player isn't
+                 * garbage collected */
+                player->ref_count++;
+                *slot = player->num;
+                dirty_n_players(room);
+        }
+
+        switch (event->base.type) {
+        case FV_RELAY_EVENT_PLAYER_POSITION:
+                player->x_position = event->x_position;
+                player->y_position = event->y_position;
+                player->direction = event->direction;
+                player->position_time =
+                        fv_main_context_get_monotonic_clock(NULL);
+                state = FV_PLAYER_STATE_POSITION;
+                break;
+
+        case FV_RELAY_EVENT_PLAYER_APPEARANCE:
+                player->image = event->image;
+                state = FV_PLAYER_STATE_APPEARANCE;
+                break;
+
+        case FV_RELAY_EVENT_PLAYER_FLAGS:
+                player->n_flags = event->n_flags;
+                memcpy(player->flags,
+                       event->flags,
+                       sizeof (player->flags[0]) * event->n_flags);
+                state = FV_PLAYER_STATE_FLAGS;
+                break;
+
+        case FV_RELAY_EVENT_PLAYER_REMOVED:
+                *slot = -1;
+                player->ref_count--;
+                fv_playerbase_remove_player(playerbase, player);
+                return;
+
+        case FV_RELAY_EVENT_SPEECH:
+                player_speech = fv_playerbase_add_speech(playerbase, player);
+                memcpy(player_speech->packet,
+                       event->packet,
+                       event->packet_size);
+                player_speech->size = event->packet_size;
+                queue_speech(room, player);
+                player->relay_speeches++;
+                return;
+
+        default:
+                return;
+        }
+
+        fv_player_clear_state_frames(player, state);
+        publish_player_state(room, player, state);
+}
+
+static bool
+relay_event_cb(struct fv_listener *listener,
+               void *data)
+{
+        struct fv_network *nw = fv_container_of(listener,
+                                                struct fv_network,
+                                                relay_listener);
+        struct fv_relay_event *event = data;
+        struct fv_network_peer *peer;
+        struct fv_playerbase *playerbase;
+
+        /* The rooms can be released by the other workers so the
+         * mutex keeps them alive while the event is handled */
+        pthread_mutex_lock(&nw->rooms_mutex);
+
+        if (event->type == FV_RELAY_EVENT_LINK_ADDED) {
+                add_peer(nw, event->link);
+                goto out;
+        }
+
+        peer = get_peer(nw, event->link);
+
+        switch (event->type) {
+        case FV_RELAY_EVENT_LINK_REMOVED:
+                free_peer(peer, true /* remove_players */);
+                break;
+
+        case FV_RELAY_EVENT_ROOM:
+                fv_free(peer->room_name);
+                peer->room_name =
+                        fv_strdup(((struct fv_relay_room_event *)
+                                   event)->name);
+                set_peer_room(nw, peer);
+                break;
+
+        default:
+                /* The room might have been released since the ROOM
+                 * message */
+                if (peer->room == NULL && peer->room_name)
+                        set_peer_room(nw, peer);
+
+                if (peer->room == NULL)
+                        break;
+
+                playerbase = peer->room->room->playerbase;
+                fv_playerbase_lock(playerbase);
+                handle_relay_player_event(peer, data);
+                fv_playerbase_unlock(playerbase);
+                break;
+        }
+
+out:
+        pthread_mutex_unlock(&nw->rooms_mutex);
+
+        return true;
+}
+
+static void
+ensure_relay(struct fv_network *nw)
+{
+        if (nw->relay)
+                return;
+
+        nw->relay = fv_relay_new();
+        nw->relay_listener.notify = relay_event_cb;
+        fv_signal_add(fv_relay_get_event_signal(nw->relay),
+                      &nw->relay_listener);
+
+        nw->relay_source = fv_main_context_add_timeout(nw->workers->mc,
+                                                       FV_NETWORK_RELAY_INTERVAL,
+                                                       relay_cb,
+                                                       nw);
+}
+
+static void
+free_relay(struct fv_network *nw)
+{
+        struct fv_network_peer *peer, *tmp;
+
+        if (nw->relay == NULL)
+                return;
+
+        fv_main_context_remove_source(nw->relay_source);
+        fv_relay_free(nw->relay);
+
+        /* The players of the peers are freed with the rooms */
+        fv_list_for_each_safe(peer, tmp, &nw->peers, link)
+                free_peer(peer, false /* remove_players */);
+}
+
+static void
+remove_listen_socket(struct fv_network_listen_socket *listen_socket)
+{
+        if (listen_socket->source)
+                fv_main_context_remove_source(listen_socket->source);
+        fv_list_remove(&listen_socket->link);
+        fv_close(listen_socket->sock);
+        free(listen_socket);
+}
+
+
+static void
+listen_socket_source_cb(struct fv_main_context_source *source,
+                        int fd,
+                        enum fv_main_context_poll_flags flags,
+                        void *user_data)
+{
+        struct fv_network_listen_socket *listen_socket = user_data;
+        struct fv_network_worker *worker = listen_socket->worker;
+        struct fv_connection *conn;
+        struct fv_error *error = NULL;
+
+        conn = fv_connection_accept(fd, &worker->stats, &error);
+
+        if (conn == NULL) {
+                if (error->domain != &fv_file_error ||
+                    error->code != FV_FILE_ERROR_AGAIN) {
+                        fv_log("%s", error->message);
+                        remove_listen_socket(listen_socket);
+                }
+                fv_error_free(error);
+                return;
+        }
+
+        fv_log("Accepted connection from %s",
+               fv_connection_get_remote_address_string(conn));
+
+        fv_connection_set_max_queued_bytes(conn, worker->nw->max_queued_bytes);
+        fv_connection_set_max_stall_time(conn, worker->nw->max_stall_time);
+        fv_connection_set_record_latency(conn, worker->nw->record_latency);
+
+        if (worker->nw->mixer) {
+                fv_connection_set_available_features(
+                        conn,
+                        FV_CONNECTION_DEFAULT_AVAILABLE_FEATURES |
+                        FV_PROTO_FEATURE_MIXED_SPEECH);
+        }
+
+        add_client(worker, conn);
+}
+
+static void
+update_listen_socket_source(struct fv_network_worker *worker,
+                            struct fv_network_listen_socket *listen_socket)
+{
+        if (worker->n_clients >= FV_NETWORK_MAX_CLIENTS) {
+                if (listen_socket->source) {
+                        fv_main_context_remove_source(listen_socket->source);
+                        listen_socket->source = NULL;
+                }
+        } else if (listen_socket->source == NULL) {
+                listen_socket->source =
+                        fv_main_context_add_poll(worker->mc,
+                                                  listen_socket->sock,
+                                                  FV_MAIN_CONTEXT_POLL_IN,
+                                                  listen_socket_source_cb,
+                                                  listen_socket);
+        }
+}
+
+static void
+update_all_listen_socket_sources(struct fv_network_worker *worker)
+{
+        struct fv_network_listen_socket *listen_socket;
+
+        fv_list_for_each(listen_socket, &worker->listen_sockets, link)
+                update_listen_socket_source(worker, listen_socket);
+}
+
+static void
+gc_cb(struct fv_main_context_source *source,
+      void *user_data)
+{
+        struct fv_network_worker *worker = user_data;
+        struct fv_network_client *client, *tmp;
+        struct fv_connection *conn;
+        uint64_t now = fv_main_context_get_monotonic_clock(worker->mc);
+        uint64_t last_update_time;
+
+        fv_list_for_each_safe(client, tmp, &worker->clients, link) {
+                conn = client->connection;
+                last_update_time = fv_connection_get_last_update_time(conn);
+                if (now - last_update_time >= FV_NETWORK_MAX_CLIENT_AGE) {
+                        fv_log("Removing connection from %s which has been "
+                               "idle for %i seconds",
+                               fv_connection_get_remote_address_string(conn),
+                               (int) ((now - last_update_time) / 1000000));
+                        lock_and_remove_client(worker, client);
+                }
+        }
+
+        /* This catches the rooms whose last clients were on other
+         * workers and the ones whose players have only just been
+         * garbage collected */
+        release_empty_rooms(worker);
+}
+
+static void
+backpressure_cb(struct fv_main_context_source *source,
+                void *user_data)
+{
+        struct fv_network_worker *worker = user_data;
+        struct fv_network_client *client, *tmp;
+        struct fv_network_room *room;
+        uint64_t now = fv_main_context_get_monotonic_clock(worker->mc);
+
+        fv_list_for_each_safe(client, tmp, &worker->clients, link) {
+                room = get_client_room(client);
+
+                /* The mixer and the other workers touch the dirty
+                 * state and the mixed speech count of the connection
+                 * with the lock of the room held */
+                if (room)
+                        fv_playerbase_lock(room->playerbase);
+
+                if (!fv_connection_check_backpressure(client->connection,
+                                                      now))
+                        remove_client(worker, client);
+
+                if (room)
+                        fv_playerbase_unlock(room->playerbase);
+        }
+}
+
+static void
+init_worker(struct fv_network *nw,
+            struct fv_network_worker *worker,
+            struct fv_main_context *mc)
+{
+        worker->nw = nw;
+        worker->mc = mc;
+        worker->thread = pthread_self();
+        worker->running = true;
+
+        fv_list_init(&worker->listen_sockets);
+        fv_list_init(&worker->clients);
+        worker->n_clients = 0;
+
+        fv_stats_init(&worker->stats);
+
+        fv_slice_allocator_init(&worker->client_allocator,
+                                sizeof (struct fv_network_client),
+                                FV_ALIGNOF(struct fv_network_client));
+
+        pthread_mutex_init(&worker->mutex, NULL /* attrs */);
+        fv_buffer_init(&worker->migrations);
+        worker->quit = false;
+        worker->wakeup_source = NULL;
+
+        worker->gc_source = fv_main_context_add_timeout(mc,
+                                                        60 * 1000, /* ms */
+                                                        gc_cb,
+                                                        worker);
+        worker->backpressure_source =
+                fv_main_context_add_timeout(mc,
+                                            FV_NETWORK_BACKPRESSURE_INTERVAL,
+                                            backpressure_cb,
+                                            worker);
+}
+
+struct fv_network *
+fv_network_new(int n_workers,
+               struct fv_error **error)
+{
+        struct fv_network *nw = fv_alloc(sizeof *nw);
+        struct fv_main_context *mc;
+        int i;
+
+        nw->workers = fv_alloc(sizeof (struct fv_network_worker) * n_workers);
+        nw->n_workers = 0;
+
+        pthread_mutex_init(&nw->rooms_mutex, NULL /* attrs */);
+        fv_list_init(&nw->rooms);
+        nw->n_rooms = 0;
+        nw->max_rooms = FV_NETWORK_DEFAULT_MAX_ROOMS;
+        nw->n_released_suppressed_speeches = 0;
+        nw->pin_rooms = false;
+
+        nw->tick_rate = 0;
+
+        nw->interest_radius = -1;
+        nw->max_subscriptions = 0;
+
+        nw->hearing_radius = 0.0f;
+
+        nw->max_queued_bytes = FV_CONNECTION_DEFAULT_MAX_QUEUED_BYTES;
+        nw->max_stall_time = FV_CONNECTION_DEFAULT_MAX_STALL_TIME;
+
+        nw->record_latency = false;
+
+        nw->relay = NULL;
+        fv_list_init(&nw->peers);
+
+        nw->n_mixer_threads = 0;
+        nw->mixer = NULL;
+
+        fv_list_init(&nw->stats_sockets);
+        fv_list_init(&nw->stats_clients);
+
+        /* The first worker uses the main thread */
+        for (i = 0; i < n_workers; i++) {
+                if (i == 0)
+                        mc = fv_main_context_get_default(error);
+                else
+                        mc = fv_main_context_new(error);
+
+                if (mc == NULL) {
+                        fv_network_free(nw);
+                        return NULL;
+                }
+
+                init_worker(nw, nw->workers + i, mc);
+                nw->n_workers++;
+        }
+
+        return nw;
+}
+
+static void *
+worker_thread_func(void *user_data)
+{
+        struct fv_network_worker *worker = user_data;
+        struct fv_network *nw = worker->nw;
+
+        /* Wait until fv_network_start has finished setting up the
+         * threads */
+        pthread_mutex_lock(&nw->rooms_mutex);
+        fv_main_context_set_thread_default(worker->mc);
+        pthread_mutex_unlock(&nw->rooms_mutex);
+
+        while (worker->running)
+                fv_main_context_poll(worker->mc);
+
+        return NULL;
+}
+
+void
+fv_network_start(struct fv_network *nw)
+{
+        struct fv_network_worker *worker;
+        int i;
+
+        pthread_mutex_lock(&nw->rooms_mutex);
+
+        if (nw->n_mixer_threads > 0)
+                nw->mixer = fv_mixer_new(nw->n_mixer_threads);
+
+        for (i = 1; i < nw->n_workers; i++) {
+                worker = nw->workers + i;
+                worker->thread = fv_thread_create(worker_thread_func, worker);
+        }
+
+        pthread_mutex_unlock(&nw->rooms_mutex);
+}
+
+void
+fv_network_set_tick_rate(struct fv_network *nw,
+                         int tick_rate)
+{
+        nw->tick_rate = tick_rate;
+}
+
+void
+fv_network_set_interest_radius(struct fv_network *nw,
+                               int radius)
+{
+        int side;
+
+        nw->interest_radius = radius;
+
+        if (radius < 0) {
+                nw->max_subscriptions = 0;
+        } else {
+                side = MIN(radius * 2 + 1, FV_NETWORK_GRID_SIZE);
+                nw->max_subscriptions = side * side;
+        }
+}
+
+void
+fv_network_set_hearing_radius(struct fv_network *nw,
+                              float radius)
+{
+        nw->hearing_radius = radius;
+}
+
+void
+fv_network_set_max_queued_bytes(struct fv_network *nw,
+                                size_t max_queued_bytes)
+{
+        nw->max_queued_bytes = max_queued_bytes;
+}
+
+void
+fv_network_set_max_stall_time(struct fv_network *nw,
+                              uint64_t max_stall_time)
+{
+        nw->max_stall_time = max_stall_time;
+}
+
+void
+fv_network_set_record_latency(struct fv_network *nw,
+                              bool record_latency)
+{
+        nw->record_latency = record_latency;
+}
+
+void
+fv_network_set_mixer_threads(struct fv_network *nw,
+                             int n_threads)
+{
+        nw->n_mixer_threads = n_threads;
+}
+
+void
+fv_network_set_max_rooms(struct fv_network *nw,
+                         int max_rooms)
+{
+        nw->max_rooms = max_rooms;
+}
+
+void
+fv_network_set_pin_rooms(struct fv_network *nw,
+                         bool pin_rooms)
+{
+        nw->pin_rooms = pin_rooms;
+}
+
+bool
+fv_network_listen_relay(struct fv_network *nw,
+                        const char *path,
+                        struct fv_error **error)
+{
+        ensure_relay(nw);
+
+        return fv_relay_listen(nw->relay, path, error);
+}
+
+void
+fv_network_connect_relay(struct fv_network *nw,
+                         const char *path)
+{
+        ensure_relay(nw);
+
+        fv_relay_connect(nw->relay, path);
+}
+
+uint64_t
+fv_network_get_n_suppressed_speeches(struct fv_network *nw)
+{
+        struct fv_network_room *room;
+        uint64_t ret;
+
+        pthread_mutex_lock(&nw->rooms_mutex);
+
+        ret = nw->n_released_suppressed_speeches;
 
-        fv_list_for_each(other_client, &nw->clients, link) {
-                fv_connection_queue_speech(other_client->connection,
-                                           player->num);
+        fv_list_for_each(room, &nw->rooms, link) {
+                fv_playerbase_lock(room->playerbase);
+                ret += room->n_suppressed_speeches;
+                fv_playerbase_unlock(room->playerbase);
         }
 
-        return true;
+        pthread_mutex_unlock(&nw->rooms_mutex);
+
+        return ret;
 }
 
-static bool
-connection_event_cb(struct fv_listener *listener,
-                    void *data)
+void
+fv_network_log_latency(struct fv_network *nw)
 {
-        struct fv_connection_event *event = data;
-        struct fv_network_client *client =
-                fv_container_of(listener,
-                                struct fv_network_client,
-                                event_listener);
-        struct fv_network *nw = client->network;
+        struct fv_stats total;
+        int i;
 
-        switch (event->type) {
-        case FV_CONNECTION_EVENT_ERROR:
-                remove_client(nw, client);
-                return false;
+        fv_stats_init(&total);
 
-        case FV_CONNECTION_EVENT_UPDATE_POSITION: {
-                struct fv_connection_update_position_event *de = (void *) event;
-                return handle_update_position(nw, client, de);
-        }
+        for (i = 0; i < nw->n_workers; i++)
+                fv_stats_accumulate(&total, &nw->workers[i].stats);
 
-        case FV_CONNECTION_EVENT_UPDATE_APPEARANCE: {
-                struct fv_connection_update_appearance_event *de =
-                        (void *) event;
-                return handle_update_appearance(nw, client, de);
-        }
+        fv_stats_log_latencies(&total);
+}
 
-        case FV_CONNECTION_EVENT_UPDATE_FLAGS: {
-                struct fv_connection_update_flags_event *de =
-                        (void *) event;
-                return handle_update_flags(nw, client, de);
-        }
+static void
+append_room_stats(struct fv_network_room *room,
+                  uint64_t *n_players,
+                  uint64_t *speech_memory)
+{
+        struct fv_player *player;
+        int n_slots, num, i;
 
-        case FV_CONNECTION_EVENT_RECONNECT: {
-                struct fv_connection_reconnect_event *de = (void *) event;
-                return handle_reconnect(nw, client, de);
+        n_slots = fv_playerbase_get_n_players(room->playerbase);
+
+        for (num = 0; num < n_slots; num++) {
+                player = fv_playerbase_get_player_by_num(room->playerbase,
+                                                         num);
+                if (player == NULL)
+                        continue;
+
+                (*n_players)++;
+
+                for (i = 0; i < FV_PLAYER_N_SPEECH_BLOCKS; i++) {
+                        if (player->speech_blocks[i]) {
+                                *speech_memory +=
+                                        sizeof (struct fv_player_speech_block);
+                        }
+                }
+
+                if (player->mixed_speeches) {
+                        *speech_memory += (sizeof (struct fv_player_speech) *
+                                           FV_PLAYER_MAX_MIXED_SPEECHES);
+                }
         }
+}
 
-        case FV_CONNECTION_EVENT_SPEECH: {
-                struct fv_connection_speech_event *de = (void *) event;
-                return handle_speech(nw, client, de);
+/* Writes the statistics as lines of text with a name and a value.
+ * This can be called from any thread. */
+static void
+append_stats(struct fv_network *nw,
+             struct fv_buffer *buf)
+{
+        struct fv_network_room *room;
+        struct fv_stats total;
+        uint64_t n_polls = 0;
+        uint64_t n_players = 0, speech_memory = 0, suppressed;
+        uint64_t n_connections;
+        int n_rooms, i;
+
+        fv_stats_init(&total);
+
+        for (i = 0; i < nw->n_workers; i++) {
+                fv_stats_accumulate(&total, &nw->workers[i].stats);
+                n_polls += fv_main_context_get_n_polls(nw->workers[i].mc);
         }
 
-        case FV_CONNECTION_EVENT_NEW_PLAYER:
-                return handle_new_player(nw, client, event);
+        pthread_mutex_lock(&nw->rooms_mutex);
+
+        n_rooms = nw->n_rooms;
+        suppressed = nw->n_released_suppressed_speeches;
 
+        fv_list_for_each(room, &nw->rooms, link) {
+                fv_playerbase_lock(room->playerbase);
+                append_room_stats(room, &n_players, &speech_memory);
+                suppressed += room->n_suppressed_speeches;
+                fv_playerbase_unlock(room->playerbase);
         }
 
-        return true;
+        pthread_mutex_unlock(&nw->rooms_mutex);
+
+        n_connections = (total.counters[FV_STATS_CONNECTIONS_OPENED] -
+                         total.counters[FV_STATS_CONNECTIONS_CLOSED]);
+
+        fv_stats_append_value(buf, "connections", n_connections);
+        fv_stats_append_value(buf, "rooms", n_rooms);
+        fv_stats_append_value(buf, "players", n_players);
+        fv_stats_append_value(buf, "polls", n_polls);
+        fv_stats_append_value(buf, "suppressed_speeches", suppressed);
+        fv_stats_append_value(buf,
+                              "pending_output_bytes",
+                              total.counters[FV_STATS_BYTES_QUEUED] -
+                              total.counters[FV_STATS_BYTES_WRITTEN] -
+                              total.counters[FV_STATS_BYTES_DISCARDED]);
+        fv_stats_append_value(buf,
+                              "player_memory_bytes",
+                              n_players * sizeof (struct fv_player));
+        fv_stats_append_value(buf, "speech_memory_bytes", speech_memory);
+        fv_stats_append_value(buf,
+                              "connection_memory_bytes",
+                              n_connections * fv_connection_get_base_size());
+
+        fv_stats_append(buf, &total);
+
+        if (nw->record_latency)
+                fv_stats_append_latencies(buf, &total);
 }
 
 static void
-remove_listen_socket(struct fv_network_listen_socket *listen_socket)
+free_stats_client(struct fv_network_stats_client *client)
 {
-        if (listen_socket->source)
-                fv_main_context_remove_source(listen_socket->source);
-        fv_list_remove(&listen_socket->link);
-        fv_close(listen_socket->sock);
-        free(listen_socket);
+        fv_main_context_remove_source(client->source);
+        fv_list_remove(&client->link);
+        fv_close(client->sock);
+        fv_buffer_destroy(&client->buf);
+        fv_free(client);
 }
 
 static void
-listen_socket_source_cb(struct fv_main_context_source *source,
-                        int fd,
-                        enum fv_main_context_poll_flags flags,
-                        void *user_data)
+start_stats_response(struct fv_network_stats_client *client)
 {
-        struct fv_network_listen_socket *listen_socket = user_data;
-        struct fv_network *nw = listen_socket->nw;
-        struct fv_connection *conn;
-        struct fv_error *error = NULL;
+        struct fv_buffer body;
+
+        fv_buffer_init(&body);
+        append_stats(client->nw, &body);
+
+        fv_buffer_set_length(&client->buf, 0);
+        fv_buffer_append_printf(&client->buf,
+                                "HTTP/1.0 200 OK\r\n"
+                                "Content-Type: text/plain\r\n"
+                                "Content-Length: %zu\r\n"
+                                "Connection: close\r\n"
+                                "\r\n",
+                                body.length);
+        fv_buffer_append(&client->buf, body.data, body.length);
+        fv_buffer_destroy(&body);
+
+        client->write_pos = 0;
+        fv_main_context_modify_poll(client->source, FV_MAIN_CONTEXT_POLL_OUT);
+}
+
+static void
+handle_stats_client_read(struct fv_network_stats_client *client)
+{
+        ssize_t got;
 
-        conn = fv_connection_accept(nw->playerbase, fd, &error);
+        fv_buffer_ensure_size(&client->buf, client->buf.length + 512);
 
-        if (conn == NULL) {
-                if (error->domain != &fv_file_error ||
-                    error->code != FV_FILE_ERROR_AGAIN) {
-                        fv_log("%s", error->message);
-                        remove_listen_socket(listen_socket);
-                }
-                fv_error_free(error);
+        do {
+                got = read(client->sock,
+                           client->buf.data + client->buf.length,
+                           client->buf.size - client->buf.length);
+        } while (got == -1 && errno == EINTR);
+
+        if (got == -1 && fv_file_error_from_errno(errno) ==
+            FV_FILE_ERROR_AGAIN)
                 return;
-        }
 
-        fv_log("Accepted connection from %s",
-               fv_connection_get_remote_address_string(conn));
+        if (got <= 0) {
+                free_stats_client(client);
+                return;
+        }
 
-        add_client(nw, conn);
+        client->buf.length += got;
 
-        nw->n_clients++;
+        /* The request itself is ignored so it's enough to wait for
+         * the end of the headers */
+        if (memmem(client->buf.data, client->buf.length, "\r\n\r\n", 4) ||
+            memmem(client->buf.data, client->buf.length, "\n\n", 2)) {
+                start_stats_response(client);
+        } else if (client->buf.length >= 8192) {
+                free_stats_client(client);
+        }
 }
 
 static void
-update_listen_socket_source(struct fv_network *nw,
-                            struct fv_network_listen_socket *listen_socket)
+handle_stats_client_write(struct fv_network_stats_client *client)
 {
-        if (nw->n_clients >= FV_NETWORK_MAX_CLIENTS) {
-                if (listen_socket->source) {
-                        fv_main_context_remove_source(listen_socket->source);
-                        listen_socket->source = NULL;
-                }
-        } else if (listen_socket->source == NULL) {
-                listen_socket->source =
-                        fv_main_context_add_poll(NULL,
-                                                  listen_socket->sock,
-                                                  FV_MAIN_CONTEXT_POLL_IN,
-                                                  listen_socket_source_cb,
-                                                  listen_socket);
+        ssize_t wrote;
+
+        do {
+                wrote = write(client->sock,
+                              client->buf.data + client->write_pos,
+                              client->buf.length - client->write_pos);
+        } while (wrote == -1 && errno == EINTR);
+
+        if (wrote == -1) {
+                if (fv_file_error_from_errno(errno) != FV_FILE_ERROR_AGAIN)
+                        free_stats_client(client);
+                return;
         }
-}
 
-static void
-update_all_listen_socket_sources(struct fv_network *nw)
-{
-        struct fv_network_listen_socket *listen_socket;
+        client->write_pos += wrote;
 
-        fv_list_for_each(listen_socket, &nw->listen_sockets, link)
-                update_listen_socket_source(nw, listen_socket);
+        if (client->write_pos >= client->buf.length)
+                free_stats_client(client);
 }
 
 static void
-gc_cb(struct fv_main_context_source *source,
-      void *user_data)
+stats_client_cb(struct fv_main_context_source *source,
+                int fd,
+                enum fv_main_context_poll_flags flags,
+                void *user_data)
 {
-        struct fv_network *nw = user_data;
-        struct fv_network_client *client, *tmp;
-        struct fv_connection *conn;
-        uint64_t now = fv_main_context_get_monotonic_clock(NULL);
-        uint64_t last_update_time;
+        struct fv_network_stats_client *client = user_data;
 
-        fv_list_for_each_safe(client, tmp, &nw->clients, link) {
-                conn = client->connection;
-                last_update_time = fv_connection_get_last_update_time(conn);
-                if (now - last_update_time >= FV_NETWORK_MAX_CLIENT_AGE) {
-                        fv_log("Removing connection from %s which has been "
-                               "idle for %i seconds",
-                               fv_connection_get_remote_address_string(conn),
-                               (int) ((now - last_update_time) / 1000000));
-                        remove_client(nw, client);
-                }
-        }
+        if (flags & FV_MAIN_CONTEXT_POLL_ERROR)
+                free_stats_client(client);
+        else if (client->write_pos == -1)
+                handle_stats_client_read(client);
+        else
+                handle_stats_client_write(client);
 }
 
-struct fv_network *
-fv_network_new(void)
+static void
+stats_socket_cb(struct fv_main_context_source *source,
+                int fd,
+                enum fv_main_context_poll_flags flags,
+                void *user_data)
 {
-        struct fv_network *nw = fv_alloc(sizeof *nw);
+        struct fv_network_stats_socket *stats_socket = user_data;
+        struct fv_network_stats_client *client;
+        struct fv_error *error = NULL;
+        int sock;
 
-        nw->playerbase = fv_playerbase_new();
-        nw->dirty_listener.notify = dirty_cb;
-        fv_signal_add(fv_playerbase_get_dirty_signal(nw->playerbase),
-                      &nw->dirty_listener);
+        do {
+                sock = accept(fd, NULL, NULL);
+        } while (sock == -1 && errno == EINTR);
 
-        fv_list_init(&nw->listen_sockets);
-        fv_list_init(&nw->clients);
+        if (sock == -1)
+                return;
 
-        nw->n_clients = 0;
+        if (!fv_socket_set_nonblock(sock, &error)) {
+                fv_log("%s", error->message);
+                fv_error_free(error);
+                fv_close(sock);
+                return;
+        }
 
-        nw->gc_source = fv_main_context_add_timer(NULL,
-                                                  1, /* minutes */
-                                                  gc_cb,
-                                                  nw);
+        client = fv_alloc(sizeof *client);
+        client->sock = sock;
+        client->nw = stats_socket->nw;
+        fv_buffer_init(&client->buf);
+        client->write_pos = -1;
+        client->source = fv_main_context_add_poll(stats_socket->nw->workers->mc,
+                                                  sock,
+                                                  FV_MAIN_CONTEXT_POLL_IN,
+                                                  stats_client_cb,
+                                                  client);
+        fv_list_insert(&stats_socket->nw->stats_clients, &client->link);
+}
 
-        return nw;
+static void
+free_stats_sockets(struct fv_network *nw)
+{
+        struct fv_network_stats_socket *stats_socket, *tmp_socket;
+        struct fv_network_stats_client *client, *tmp_client;
+
+        fv_list_for_each_safe(client, tmp_client, &nw->stats_clients, link)
+                free_stats_client(client);
+
+        fv_list_for_each_safe(stats_socket, tmp_socket,
+                              &nw->stats_sockets,
+                              link) {
+                fv_main_context_remove_source(stats_socket->source);
+                fv_list_remove(&stats_socket->link);
+                fv_close(stats_socket->sock);
+                fv_free(stats_socket);
+        }
 }
 
-bool
-fv_network_add_listen_socket(struct fv_network *nw,
-                             int sock,
-                             struct fv_error **error)
+static bool
+add_listen_socket_to_worker(struct fv_network_worker *worker,
+                            int sock,
+                            struct fv_error **error)
 {
         struct fv_network_listen_socket *listen_socket;
 
@@ -574,56 +3090,85 @@ fv_network_add_listen_socket(struct fv_network *nw,
 
         listen_socket = fv_alloc(sizeof *listen_socket);
         listen_socket->sock = sock;
-        listen_socket->nw = nw;
-        fv_list_insert(&nw->listen_sockets, &listen_socket->link);
+        listen_socket->worker = worker;
+        fv_list_insert(&worker->listen_sockets, &listen_socket->link);
 
         listen_socket->source = NULL;
 
-        update_listen_socket_source(nw, listen_socket);
+        update_listen_socket_source(worker, listen_socket);
 
         return true;
 }
 
 bool
-fv_network_add_listen_address(struct fv_network *nw,
-                              const char *address,
-                              struct fv_error **error)
+fv_network_add_listen_socket(struct fv_network *nw,
+                             int sock,
+                             struct fv_error **error)
 {
-        struct fv_netaddress netaddress;
-        struct fv_netaddress_native native_address;
-        const int true_value = true;
-        int sock;
+        int i, dup_sock;
+
+        /* All of the workers will accept from the same socket */
+        for (i = 1; i < nw->n_workers; i++) {
+                dup_sock = dup(sock);
+
+                if (dup_sock == -1) {
+                        fv_file_error_set(error,
+                                          errno,
+                                          "Failed to duplicate socket: %s",
+                                          strerror(errno));
+                        return false;
+                }
 
-        if (!fv_netaddress_from_string(&netaddress,
-                                       address,
-                                       FV_PROTO_DEFAULT_PORT)) {
-                fv_set_error(error,
-                             &fv_network_error,
-                             FV_NETWORK_ERROR_INVALID_ADDRESS,
-                             "The listen address %s is invalid", address);
-                return false;
+                if (!add_listen_socket_to_worker(nw->workers + i,
+                                                 dup_sock,
+                                                 error)) {
+                        fv_close(dup_sock);
+                        return false;
+                }
         }
 
-        fv_netaddress_to_native(&netaddress, &native_address);
+        return add_listen_socket_to_worker(nw->workers, sock, error);
+}
+
+static int
+create_listen_socket(const struct fv_netaddress_native *native_address,
+                     bool reuse_port,
+                     struct fv_error **error)
+{
+        const int true_value = true;
+        int sock;
 
-        sock = socket(native_address.sockaddr.sa_family == AF_INET6 ?
+        sock = socket(native_address->sockaddr.sa_family == AF_INET6 ?
                       PF_INET6 : PF_INET, SOCK_STREAM, 0);
         if (sock == -1) {
                 fv_file_error_set(error,
                                    errno,
                                    "Failed to create socket: %s",
                                    strerror(errno));
-                return false;
+                return -1;
         }
 
         setsockopt(sock,
                    SOL_SOCKET, SO_REUSEADDR,
                    &true_value, sizeof true_value);
 
-        if (!fv_socket_set_nonblock(sock, error))
+        /* Each worker gets its own socket bound to the same address
+         * so that the kernel can distribute the connections between
+         * them */
+        if (reuse_port &&
+            setsockopt(sock,
+                       SOL_SOCKET, SO_REUSEPORT,
+                       &true_value, sizeof true_value) == -1) {
+                fv_file_error_set(error,
+                                   errno,
+                                   "Failed to set SO_REUSEPORT: %s",
+                                   strerror(errno));
                 goto error;
+        }
 
-        if (bind(sock, &native_address.sockaddr, native_address.length) == -1) {
+        if (bind(sock,
+                 &native_address->sockaddr,
+                 native_address->length) == -1) {
                 fv_file_error_set(error,
                                    errno,
                                    "Failed to bind socket: %s",
@@ -639,45 +3184,213 @@ fv_network_add_listen_address(struct fv_network *nw,
                 goto error;
         }
 
-        if (!fv_network_add_listen_socket(nw, sock, error))
-                goto error;
-
-        return true;
+        return sock;
 
 error:
         fv_close(sock);
-        return false;
+        return -1;
+}
+
+bool
+fv_network_add_listen_address(struct fv_network *nw,
+                              const char *address,
+                              struct fv_error **error)
+{
+        struct fv_netaddress netaddress;
+        struct fv_netaddress_native native_address;
+        int sock;
+        int i;
+
+        if (!fv_netaddress_from_string(&netaddress,
+                                       address,
+                                       FV_PROTO_DEFAULT_PORT)) {
+                fv_set_error(error,
+                             &fv_network_error,
+                             FV_NETWORK_ERROR_INVALID_ADDRESS,
+                             "The listen address %s is invalid", address);
+                return false;
+        }
+
+        fv_netaddress_to_native(&netaddress, &native_address);
+
+        for (i = 0; i < nw->n_workers; i++) {
+                sock = create_listen_socket(&native_address,
+                                            nw->n_workers > 1,
+                                            error);
+                if (sock == -1)
+                        return false;
+
+                if (!add_listen_socket_to_worker(nw->workers + i,
+                                                 sock,
+                                                 error)) {
+                        fv_close(sock);
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+bool
+fv_network_add_stats_address(struct fv_network *nw,
+                             const char *address,
+                             struct fv_error **error)
+{
+        struct fv_network_stats_socket *stats_socket;
+        struct fv_netaddress netaddress;
+        struct fv_netaddress_native native_address;
+        int sock;
+
+        if (!fv_netaddress_from_string(&netaddress,
+                                       address,
+                                       FV_NETWORK_DEFAULT_STATS_PORT)) {
+                fv_set_error(error,
+                             &fv_network_error,
+                             FV_NETWORK_ERROR_INVALID_ADDRESS,
+                             "The stats address %s is invalid", address);
+                return false;
+        }
+
+        fv_netaddress_to_native(&netaddress, &native_address);
+
+        sock = create_listen_socket(&native_address,
+                                    false, /* reuse_port */
+                                    error);
+        if (sock == -1)
+                return false;
+
+        if (!fv_socket_set_nonblock(sock, error)) {
+                fv_close(sock);
+                return false;
+        }
+
+        stats_socket = fv_alloc(sizeof *stats_socket);
+        stats_socket->sock = sock;
+        stats_socket->nw = nw;
+        stats_socket->source =
+                fv_main_context_add_poll(nw->workers->mc,
+                                         sock,
+                                         FV_MAIN_CONTEXT_POLL_IN,
+                                         stats_socket_cb,
+                                         stats_socket);
+        fv_list_insert(&nw->stats_sockets, &stats_socket->link);
+
+        return true;
 }
 
 static void
-free_listen_sockets(struct fv_network *nw)
+free_listen_sockets(struct fv_network_worker *worker)
 {
         struct fv_network_listen_socket *listen_socket, *tmp;
 
-        fv_list_for_each_safe(listen_socket, tmp, &nw->listen_sockets, link)
+        fv_list_for_each_safe(listen_socket, tmp,
+                              &worker->listen_sockets,
+                              link)
                 remove_listen_socket(listen_socket);
 }
 
 static void
-free_clients(struct fv_network *nw)
+free_clients(struct fv_network_worker *worker)
 {
         struct fv_network_client *client, *tmp;
 
-        fv_list_for_each_safe(client, tmp, &nw->clients, link)
-                remove_client(nw, client);
+        fv_list_for_each_safe(client, tmp, &worker->clients, link)
+                lock_and_remove_client(worker, client);
+}
+
+static void
+free_migrations(struct fv_network_worker *worker)
+{
+        const struct fv_network_migration *migration;
+        size_t n_migrations;
+        size_t i;
+
+        n_migrations = worker->migrations.length / sizeof *migration;
+        migration = (const struct fv_network_migration *)
+                worker->migrations.data;
+
+        for (i = 0; i < n_migrations; i++, migration++) {
+                fv_connection_free(migration->connection);
+                fv_free(migration->room_name);
+        }
+
+        fv_buffer_destroy(&worker->migrations);
+}
+
+static void
+stop_worker(struct fv_network_worker *worker)
+{
+        pthread_mutex_lock(&worker->mutex);
+        worker->quit = true;
+        wakeup_worker(worker);
+        pthread_mutex_unlock(&worker->mutex);
+
+        pthread_join(worker->thread, NULL /* retval */);
+}
+
+/* Closes all of the connections of the worker. This has to be done
+ * for every worker before the rooms can be freed. */
+static void
+close_worker(struct fv_network_worker *worker)
+{
+        free_listen_sockets(worker);
+        free_clients(worker);
+        free_migrations(worker);
+
+        assert(worker->n_clients == 0);
+}
+
+static void
+destroy_worker(struct fv_network_worker *worker)
+{
+        if (worker->wakeup_source)
+                fv_main_context_remove_source(worker->wakeup_source);
+        pthread_mutex_destroy(&worker->mutex);
+
+        fv_main_context_remove_source(worker->gc_source);
+        fv_main_context_remove_source(worker->backpressure_source);
+
+        fv_slice_allocator_destroy(&worker->client_allocator);
+
+        /* The first worker uses the default main context which isn't
+         * owned by the network */
+        if (worker != worker->nw->workers)
+                fv_main_context_free(worker->mc);
 }
 
 void
 fv_network_free(struct fv_network *nw)
 {
-        free_clients(nw);
-        free_listen_sockets(nw);
+        struct fv_network_worker *worker;
+        struct fv_network_room *room, *tmp;
+        int i;
+
+        /* If the network was never started then the thread of the
+         * workers will still be the current thread */
+        for (i = 1; i < nw->n_workers; i++) {
+                worker = nw->workers + i;
+                if (!worker_is_current(worker))
+                        stop_worker(worker);
+        }
+
+        free_relay(nw);
+        free_stats_sockets(nw);
+
+        for (i = 0; i < nw->n_workers; i++)
+                close_worker(nw->workers + i);
+
+        fv_list_for_each_safe(room, tmp, &nw->rooms, link)
+                free_room(room);
+
+        if (nw->mixer)
+                fv_mixer_free(nw->mixer);
 
-        assert(nw->n_clients == 0);
+        for (i = 0; i < nw->n_workers; i++)
+                destroy_worker(nw->workers + i);
 
-        fv_playerbase_free(nw->playerbase);
+        fv_free(nw->workers);
 
-        fv_main_context_remove_source(nw->gc_source);
+        pthread_mutex_destroy(&nw->rooms_mutex);
 
         free(nw);
 }
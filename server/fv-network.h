@@ -25,6 +25,8 @@
 #define FV_NETWORK_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
 
 #include "fv-error.h"
 #include "fv-signal.h"
@@ -38,14 +40,152 @@ enum fv_network_error {
 
 struct fv_network;
 
+#define FV_NETWORK_DEFAULT_MAX_ROOMS 64
+
+/* The port for the stats address if it doesn't specify one */
+#define FV_NETWORK_DEFAULT_STATS_PORT 3469
+
+/* Creates a network that handles its connections with n_workers
+ * threads. The first worker uses the default main context of the
+ * calling thread and the rest are given their own context. The other
+ * threads aren't started until fv_network_start is called so that
+ * the process can be forked before then.
+ *
+ * Each connection joins the room named by the path in its WebSocket
+ * request. The rooms are created on demand and each one has its own
+ * players so the clients only get the changes from their own room.
+ * The settings below must be made before the network is started.
+ */
 struct fv_network *
-fv_network_new(void);
+fv_network_new(int n_workers,
+               struct fv_error **error);
+
+void
+fv_network_start(struct fv_network *nw);
+
+/* Sets the number of times per second that changes to the position,
+ * appearance and flags of the players are sent to the connections.
+ * If it is zero then the changes are sent immediately. Speech is
+ * always sent immediately.
+ */
+void
+fv_network_set_tick_rate(struct fv_network *nw,
+                         int tick_rate);
+
+/* Divides the map into a grid and only sends the changes to a
+ * player's state immediately to the connections whose own player is
+ * within radius cells of it. The other connections get the changes
+ * batched once a second. A negative radius sends all of the changes
+ * to every connection.
+ */
+void
+fv_network_set_interest_radius(struct fv_network *nw,
+                               int radius);
+
+/* Only sends speech packets to the connections whose player is
+ * within radius map units of the speaker. If the radius is zero the
+ * speech is sent to everyone.
+ */
+void
+fv_network_set_hearing_radius(struct fv_network *nw,
+                              float radius);
+
+/* Sets the maximum number of bytes that can be queued for each new
+ * connection. See fv_connection_set_max_queued_bytes.
+ */
+void
+fv_network_set_max_queued_bytes(struct fv_network *nw,
+                                size_t max_queued_bytes);
+
+/* Sets the number of microseconds that a new connection can go
+ * without reading anything before it is closed. See
+ * fv_connection_set_max_stall_time.
+ */
+void
+fv_network_set_max_stall_time(struct fv_network *nw,
+                              uint64_t max_stall_time);
+
+/* Makes the connections measure the time from when each position and
+ * speech message is received until the messages made from it are
+ * written to each of the other clients. The times are reported by the
+ * stats address and fv_network_log_latency.
+ */
+void
+fv_network_set_record_latency(struct fv_network *nw,
+                              bool record_latency);
+
+/* Sets the number of threads used to mix the speech for the clients
+ * that enable the mixed speech feature. If this is zero, which is the
+ * default, the feature isn't offered. This must be called before
+ * fv_network_start.
+ */
+void
+fv_network_set_mixer_threads(struct fv_network *nw,
+                             int n_threads);
+
+/* Sets the maximum number of rooms. Connections asking for a new
+ * room beyond this are closed. The rooms are kept until the network
+ * is freed.
+ */
+void
+fv_network_set_max_rooms(struct fv_network *nw,
+                         int max_rooms);
+
+/* If set, all of the connections of a room are handled by the same
+ * worker. The worker is picked from a hash of the room name and the
+ * connections are moved there once their handshake is finished. The
+ * changes in a room then never need to be passed between threads.
+ */
+void
+fv_network_set_pin_rooms(struct fv_network *nw,
+                         bool pin_rooms);
+
+/* Shares the rooms with other server processes through a relay of
+ * UNIX domain sockets. This process listens for the other processes
+ * at the given path. See fv-relay.h for how the links should be
+ * arranged. The players of the other processes appear in the rooms
+ * as if they were local and the changes are sent between the
+ * processes in batches every few milliseconds.
+ */
+bool
+fv_network_listen_relay(struct fv_network *nw,
+                        const char *path,
+                        struct fv_error **error);
+
+/* Links to another server process that is listening at the given
+ * path. If the process isn't running yet then it keeps retrying.
+ */
+void
+fv_network_connect_relay(struct fv_network *nw,
+                         const char *path);
+
+/* Returns the number of speech packets that weren't sent to a
+ * connection because it was out of the hearing radius.
+ */
+uint64_t
+fv_network_get_n_suppressed_speeches(struct fv_network *nw);
+
+/* Writes a summary of the latencies measured so far to the log. This
+ * can be called from any thread.
+ */
+void
+fv_network_log_latency(struct fv_network *nw);
 
 bool
 fv_network_add_listen_address(struct fv_network *nw,
                               const char *address,
                               struct fv_error **error);
 
+/* Listens on another address for plain HTTP requests. Any request
+ * gets the statistics of the server as a response, with one line per
+ * value in the form "babiling_<name> <value>". The requests are
+ * handled on the first worker.
+ */
+bool
+fv_network_add_stats_address(struct fv_network *nw,
+                             const char *address,
+                             struct fv_error **error);
+
 bool
 fv_network_add_listen_socket(struct fv_network *nw,
                              int sock,
@@ -23,6 +23,8 @@
 
 #include "config.h"
 
+#include <string.h>
+
 #include "fv-player.h"
 #include "fv-main-context.h"
 
@@ -30,18 +32,141 @@ struct fv_player *
 fv_player_new(uint64_t id)
 {
         struct fv_player *player = fv_alloc(sizeof *player);
+        int i;
 
         player->id = id;
         player->ref_count = 0;
         player->last_update_time = fv_main_context_get_monotonic_clock(NULL);
         player->next_speech = 0;
+        player->n_speeches = 0;
+        player->last_speech_time = 0;
+        player->speech_sequence = 0;
+        player->x_position = 0;
+        player->y_position = 0;
+        player->direction = 0;
+        player->position_time = 0;
+        player->image = 0;
         player->n_flags = 0;
+        player->unpublished_state = 0;
+        player->published_cell = -1;
+        player->far_state = 0;
+        player->relay_link = NULL;
+        player->relay_state = FV_PLAYER_STATE_ALL;
+        player->relay_speeches = 0;
+        player->mix_speeches = 0;
+        player->n_mixed_listeners = 0;
+        player->mixed_speeches = NULL;
+        player->n_mixed_speeches = 0;
+
+        for (i = 0; i < FV_PLAYER_N_STATES; i++)
+                player->state_frames[i] = NULL;
+        player->compact_position_frame = NULL;
+        for (i = 0; i < FV_PLAYER_N_SPEECH_BLOCKS; i++)
+                player->speech_blocks[i] = NULL;
 
         return player;
 }
 
+void
+fv_player_clear_state_frames(struct fv_player *player,
+                             int state_flags)
+{
+        int i;
+
+        for (i = 0; i < FV_PLAYER_N_STATES; i++) {
+                if ((state_flags & (1 << i)) && player->state_frames[i]) {
+                        fv_frame_unref(player->state_frames[i]);
+                        player->state_frames[i] = NULL;
+                }
+        }
+
+        if ((state_flags & FV_PLAYER_STATE_POSITION) &&
+            player->compact_position_frame) {
+                fv_frame_unref(player->compact_position_frame);
+                player->compact_position_frame = NULL;
+        }
+}
+
+struct fv_player_speech *
+fv_player_get_speech(struct fv_player *player,
+                     int speech_num)
+{
+        struct fv_player_speech_block *block =
+                player->speech_blocks[speech_num /
+                                      FV_PLAYER_SPEECHES_PER_BLOCK];
+
+        return block->speeches + speech_num % FV_PLAYER_SPEECHES_PER_BLOCK;
+}
+
+void
+fv_player_speech_clear_frames(struct fv_player_speech *speech)
+{
+        if (speech->frame) {
+                fv_frame_unref(speech->frame);
+                speech->frame = NULL;
+        }
+        if (speech->sequenced_frame) {
+                fv_frame_unref(speech->sequenced_frame);
+                speech->sequenced_frame = NULL;
+        }
+}
+
+void
+fv_player_clear_speech_frames(struct fv_player *player)
+{
+        struct fv_player_speech_block *block;
+        int i, j;
+
+        for (i = 0; i < FV_PLAYER_N_SPEECH_BLOCKS; i++) {
+                block = player->speech_blocks[i];
+
+                if (block == NULL)
+                        continue;
+
+                for (j = 0; j < FV_PLAYER_SPEECHES_PER_BLOCK; j++)
+                        fv_player_speech_clear_frames(block->speeches + j);
+        }
+}
+
+void
+fv_player_add_mixed_speech(struct fv_player *player,
+                           const uint8_t *packet,
+                           size_t packet_size,
+                           uint64_t mix_time)
+{
+        struct fv_player_speech *speech;
+
+        if (player->mixed_speeches == NULL) {
+                player->mixed_speeches =
+                        fv_alloc(sizeof (struct fv_player_speech) *
+                                 FV_PLAYER_MAX_MIXED_SPEECHES);
+        }
+
+        speech = (player->mixed_speeches +
+                  player->n_mixed_speeches % FV_PLAYER_MAX_MIXED_SPEECHES);
+        speech->size = packet_size;
+        memcpy(speech->packet, packet, packet_size);
+        speech->sequence = player->n_mixed_speeches;
+        speech->receive_time = mix_time;
+        /* The mixed speech is only for one player so it is never
+         * shared */
+        speech->frame = NULL;
+        speech->sequenced_frame = NULL;
+
+        player->n_mixed_speeches++;
+}
+
+void
+fv_player_clear_frames(struct fv_player *player)
+{
+        fv_player_clear_state_frames(player, FV_PLAYER_STATE_ALL);
+        fv_player_clear_speech_frames(player);
+}
+
 void
 fv_player_free(struct fv_player *player)
 {
+        fv_player_clear_frames(player);
+        fv_free(player->mixed_speeches);
         fv_free(player);
 }
@@ -28,17 +28,66 @@
 
 #include "fv-proto.h"
 #include "fv-flag.h"
+#include "fv-frame.h"
+#include "fv-list.h"
+
+enum fv_player_state_index {
+        FV_PLAYER_STATE_INDEX_POSITION,
+        FV_PLAYER_STATE_INDEX_APPEARANCE,
+        FV_PLAYER_STATE_INDEX_FLAGS,
+        FV_PLAYER_N_STATES
+};
+
+#define FV_PLAYER_STATE_POSITION (1 << FV_PLAYER_STATE_INDEX_POSITION)
+#define FV_PLAYER_STATE_APPEARANCE (1 << FV_PLAYER_STATE_INDEX_APPEARANCE)
+#define FV_PLAYER_STATE_FLAGS (1 << FV_PLAYER_STATE_INDEX_FLAGS)
+#define FV_PLAYER_STATE_ALL ((1 << FV_PLAYER_N_STATES) - 1)
 
 /* Buffer enough speech data for 2 seconds */
 #define FV_PLAYER_MAX_PENDING_SPEECHES (2000 / FV_PROTO_SPEECH_TIME)
 
+/* Converts a time from the monotonic clock to the units of the speech
+ * timestamps */
+#define FV_PLAYER_SPEECH_TIMESTAMP(time) \
+        ((uint32_t) ((time) / (FV_PROTO_SPEECH_TIME * 1000)))
+
 struct fv_player_speech {
         _Static_assert(FV_PROTO_MAX_SPEECH_SIZE <= 255,
                        "The maximum speech size is too big for a uint8_t");
         uint8_t size;
         uint8_t packet[FV_PROTO_MAX_SPEECH_SIZE];
+        /* The talker's count of packets when this one was added. This
+         * is allowed to wrap around. */
+        uint16_t sequence;
+        /* The monotonic clock time when the packet was read from the
+         * client. The timestamp in the messages is derived from this
+         * with FV_PLAYER_SPEECH_TIMESTAMP. */
+        uint64_t receive_time;
+        /* The PLAYER_SPEECH message for the connections using the
+         * stable player numbering, with and without the speech
+         * sequence feature, or NULL if it hasn't been encoded yet */
+        struct fv_frame *frame;
+        struct fv_frame *sequenced_frame;
+};
+
+/* The speech buffer is split into blocks that are allocated from a
+ * pool in the playerbase so that the players that aren't talking
+ * don't need any memory for it */
+#define FV_PLAYER_SPEECHES_PER_BLOCK 12
+#define FV_PLAYER_N_SPEECH_BLOCKS ((FV_PLAYER_MAX_PENDING_SPEECHES + \
+                                    FV_PLAYER_SPEECHES_PER_BLOCK - 1) / \
+                                   FV_PLAYER_SPEECHES_PER_BLOCK)
+
+/* Number of packets of mixed speech to keep for the connections of a
+ * player that are using the mixed speech feature */
+#define FV_PLAYER_MAX_MIXED_SPEECHES (100 / FV_PROTO_SPEECH_TIME)
+
+struct fv_player_speech_block {
+        struct fv_player_speech speeches[FV_PLAYER_SPEECHES_PER_BLOCK];
 };
 
+struct fv_relay_link;
+
 struct fv_player {
         /* This is the randomly generated globally unique ID for the
          * player that is used like a password for the clients.
@@ -58,6 +107,9 @@ struct fv_player {
         /* FV_PLAYER_STATE_POSITION */
         uint32_t x_position, y_position;
         uint16_t direction;
+        /* The monotonic clock time when the last position was read
+         * from the client */
+        uint64_t position_time;
 
         /* FV_PLAYER_STATE_APPEARANCE */
         uint8_t image;
@@ -72,20 +124,111 @@ struct fv_player {
          */
         uint64_t last_update_time;
 
-        /* A rotating buffer of speech packets */
-        struct fv_player_speech speech_queue[FV_PLAYER_MAX_PENDING_SPEECHES];
+        /* FV_PLAYER_STATE_* flags for changes that haven't been sent
+         * to the connections yet. This is only used when the network
+         * is publishing the state at a fixed tick rate.
+         */
+        int unpublished_state;
+
+        /* The grid cell that the network last published the player's
+         * state for or -1 if it hasn't been published yet, and
+         * FV_PLAYER_STATE_* flags for changes that have only been
+         * sent to the connections that are interested in that cell so
+         * far. These are only used when the network filters the
+         * updates by area of interest.
+         */
+        int published_cell;
+        int far_state;
+
+        /* The encoded state messages for the connections using the
+         * stable player numbering, indexed by
+         * fv_player_state_index. These are NULL until a connection
+         * first needs to write them.
+         */
+        struct fv_frame *state_frames[FV_PLAYER_N_STATES];
+        /* The encoded PLAYER_POSITION_COMPACT message. This is
+         * cleared along with the position state frame. */
+        struct fv_frame *compact_position_frame;
+
+        /* A rotating buffer of speech packets. The blocks are only
+         * allocated when the player talks and they are given back
+         * once the player has been quiet for a while. */
+        struct fv_player_speech_block *speech_blocks[FV_PLAYER_N_SPEECH_BLOCKS];
         /* The slot to use when the next speech packet is added */
         int next_speech;
+        /* The number of packets in the buffer. This is zero if no
+         * blocks are allocated. */
+        int n_speeches;
+        uint64_t last_speech_time;
+        /* The sequence number to give to the next packet */
+        uint16_t speech_sequence;
+        /* Link in the playerbase's list of players that have some
+         * speech blocks */
+        struct fv_list speaking_link;
+
+        /* The relay link that the player came from or NULL if the
+         * player belongs to a connection of this process. Remote
+         * players don't have an ID.
+         */
+        struct fv_relay_link *relay_link;
+        /* FV_PLAYER_STATE_* flags for the changes and the number of
+         * speech packets that haven't been forwarded to the relay
+         * yet. The whole state of a new player is forwarded.
+         */
+        int relay_state;
+        int relay_speeches;
+
+        /* The number of packets at the end of the speech buffer that
+         * haven't been mixed for the other players yet */
+        int mix_speeches;
+        /* The number of connections of this player that get the
+         * speech of the other players mixed into a single stream */
+        int n_mixed_listeners;
+        /* A rotating buffer of the mixed speech for this player's
+         * connections. It is allocated when the first packet is
+         * added. n_mixed_speeches is the total number of packets
+         * ever added and the last one is at the index before
+         * n_mixed_speeches modulo FV_PLAYER_MAX_MIXED_SPEECHES.
+         */
+        struct fv_player_speech *mixed_speeches;
+        unsigned int n_mixed_speeches;
 };
 
-#define FV_PLAYER_STATE_POSITION (1 << 0)
-#define FV_PLAYER_STATE_APPEARANCE (1 << 1)
-#define FV_PLAYER_STATE_FLAGS (1 << 2)
-#define FV_PLAYER_STATE_ALL ((1 << 3) - 1)
-
 struct fv_player *
 fv_player_new(uint64_t id);
 
+/* Discards the encoded messages for the parts of the state given by
+ * state_flags. This must be called whenever the state changes.
+ */
+void
+fv_player_clear_state_frames(struct fv_player *player,
+                             int state_flags);
+
+/* Returns the speech packet in the given slot of the rotating
+ * buffer. The slot must be one of the last n_speeches slots before
+ * next_speech.
+ */
+struct fv_player_speech *
+fv_player_get_speech(struct fv_player *player,
+                     int speech_num);
+
+/* Discards the encoded messages of one speech packet */
+void
+fv_player_speech_clear_frames(struct fv_player_speech *speech);
+
+void
+fv_player_clear_speech_frames(struct fv_player *player);
+
+void
+fv_player_add_mixed_speech(struct fv_player *player,
+                           const uint8_t *packet,
+                           size_t packet_size,
+                           uint64_t mix_time);
+
+/* Discards all of the encoded messages */
+void
+fv_player_clear_frames(struct fv_player *player);
+
 void
 fv_player_free(struct fv_player *player);
 
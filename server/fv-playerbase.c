@@ -23,58 +23,222 @@
 
 #include "config.h"
 
+#include <pthread.h>
+
 #include "fv-playerbase.h"
 #include "fv-pointer-array.h"
 #include "fv-util.h"
 #include "fv-main-context.h"
+#include "fv-slice.h"
 
 /* Number of microseconds of inactivity before a player will be
  * considered for garbage collection.
  */
 #define FV_PLAYERBASE_MAX_PLAYER_AGE ((uint64_t) 2 * 60 * 1000000)
 
+/* Initial size of the ID hash table. This must be a power of two. */
+#define FV_PLAYERBASE_MIN_ID_TABLE_SIZE 64
+
+/* Number of microseconds that a player has to be quiet for before its
+ * speech blocks are given back to the pool. This is longer than the
+ * speech buffer so that the connections will normally have already
+ * sent everything.
+ */
+#define FV_PLAYERBASE_SPEECH_RELEASE_TIME ((uint64_t) 5 * 1000000)
+
+/* Number of milliseconds between checks for quiet players */
+#define FV_PLAYERBASE_SPEECH_CHECK_INTERVAL 1000
+
+/* The slab header is a single pointer */
+_Static_assert(sizeof (struct fv_player_speech_block) <=
+               FV_SLAB_SIZE - sizeof (void *),
+               "A speech block doesn't fit in a slab");
+
 struct fv_playerbase {
+        /* The playerbase can be shared between the threads of the
+         * server so this mutex guards all of the state including the
+         * players themselves */
+        pthread_mutex_t mutex;
+
+        /* The number of players that haven't been removed */
         int n_players;
 
+        /* Array of pointers to the players indexed by the player
+         * number. The number of a player never changes so the slots
+         * of the players that have been removed are NULL until they
+         * are reused.
+         */
         struct fv_buffer players;
+        /* Array of ints for the numbers of the empty slots */
+        struct fv_buffer free_slots;
+
+        /* Open-addressing hash table of the players keyed on their
+         * ID. Collisions are resolved by linear probing. The size is
+         * a power of two and the table is kept at most half full.
+         */
+        struct fv_player **id_table;
+        size_t id_table_size;
+        size_t n_ids;
+
+        /* Pool of struct fv_player_speech_block */
+        struct fv_slice_allocator speech_allocator;
+        /* List of players that have some speech blocks */
+        struct fv_list speaking_players;
 
         struct fv_signal dirty_signal;
 
         struct fv_main_context_source *gc_source;
+        struct fv_main_context_source *speech_source;
 };
 
+static size_t
+hash_id(uint64_t id)
+{
+        /* The IDs in a reconnect come from the clients so they are
+         * mixed to make it harder to pick IDs that collide. This is
+         * the finalizer from SplitMix64. */
+        id ^= id >> 30;
+        id *= UINT64_C(0xbf58476d1ce4e5b9);
+        id ^= id >> 27;
+        id *= UINT64_C(0x94d049bb133111eb);
+        id ^= id >> 31;
+
+        return id;
+}
+
+static void
+insert_id(struct fv_player **table,
+          size_t table_size,
+          struct fv_player *player)
+{
+        size_t mask = table_size - 1;
+        size_t pos = hash_id(player->id) & mask;
+
+        while (table[pos])
+                pos = (pos + 1) & mask;
+
+        table[pos] = player;
+}
+
+static void
+add_id(struct fv_playerbase *playerbase,
+       struct fv_player *player)
+{
+        struct fv_player **old_table = playerbase->id_table;
+        size_t old_size = playerbase->id_table_size;
+        size_t i;
+
+        if ((playerbase->n_ids + 1) * 2 > old_size) {
+                playerbase->id_table_size = old_size * 2;
+                playerbase->id_table =
+                        fv_calloc(playerbase->id_table_size *
+                                  sizeof (struct fv_player *));
+
+                for (i = 0; i < old_size; i++) {
+                        if (old_table[i]) {
+                                insert_id(playerbase->id_table,
+                                          playerbase->id_table_size,
+                                          old_table[i]);
+                        }
+                }
+
+                fv_free(old_table);
+        }
+
+        insert_id(playerbase->id_table, playerbase->id_table_size, player);
+        playerbase->n_ids++;
+}
+
+static void
+remove_id(struct fv_playerbase *playerbase,
+          struct fv_player *player)
+{
+        struct fv_player **table = playerbase->id_table;
+        size_t mask = playerbase->id_table_size - 1;
+        size_t pos = hash_id(player->id) & mask;
+        size_t next, home;
+
+        while (table[pos] != player)
+                pos = (pos + 1) & mask;
+
+        /* Instead of leaving a tombstone, move back any later
+         * entries in the run that would no longer be reachable
+         * across the gap */
+        next = pos;
+
+        while (true) {
+                next = (next + 1) & mask;
+
+                if (table[next] == NULL)
+                        break;
+
+                home = hash_id(table[next]->id) & mask;
+
+                /* Leave the entry if its home position is cyclically
+                 * within (pos, next] */
+                if (pos <= next ?
+                    pos < home && home <= next :
+                    pos < home || home <= next)
+                        continue;
+
+                table[pos] = table[next];
+                pos = next;
+        }
+
+        table[pos] = NULL;
+        playerbase->n_ids--;
+}
+
+static void
+release_speech(struct fv_playerbase *playerbase,
+               struct fv_player *player)
+{
+        int i;
+
+        fv_player_clear_speech_frames(player);
+
+        for (i = 0; i < FV_PLAYER_N_SPEECH_BLOCKS; i++) {
+                if (player->speech_blocks[i]) {
+                        fv_slice_free(&playerbase->speech_allocator,
+                                      player->speech_blocks[i]);
+                        player->speech_blocks[i] = NULL;
+                }
+        }
+
+        /* Any speeches that the connections haven't sent yet are
+         * dropped */
+        player->n_speeches = 0;
+        player->next_speech = 0;
+        fv_list_remove(&player->speaking_link);
+}
+
 static void
 remove_player(struct fv_playerbase *playerbase,
               struct fv_player *player)
 {
-        size_t length = fv_pointer_array_length(&playerbase->players);
-        struct fv_player *last_player;
         struct fv_playerbase_dirty_event event;
+        struct fv_relay_link *relay_link = player->relay_link;
+        int num = player->num;
 
-        last_player = fv_pointer_array_get(&playerbase->players, length - 1);
-        fv_pointer_array_set_length(&playerbase->players, --length);
-
-        /* Move the last player into the position that the removed
-         * player had so that we don't have to reorder any of the
-         * other players
-         */
-        if (player->num < length) {
-                fv_pointer_array_set(&playerbase->players,
-                                     player->num,
-                                     last_player);
-                last_player->num = player->num;
+        /* The other players keep their numbers so the clients only
+         * need to be told about the one that has gone */
+        fv_pointer_array_set(&playerbase->players, num, NULL);
+        fv_buffer_append(&playerbase->free_slots, &num, sizeof num);
+        playerbase->n_players--;
+        if (relay_link == NULL)
+                remove_id(playerbase, player);
 
-                event.player = last_player;
-                event.dirty_state = FV_PLAYER_STATE_ALL;
-        } else {
-                event.player = NULL;
-                event.dirty_state = 0;
-        }
+        if (player->n_speeches > 0)
+                release_speech(playerbase, player);
 
         fv_player_free(player);
 
         event.playerbase = playerbase;
-        event.n_players_changed = true;
+        event.player = NULL;
+        event.dirty_state = 0;
+        event.n_players_changed = false;
+        event.removed_player_num = num;
+        event.removed_relay_link = relay_link;
 
         fv_signal_emit(&playerbase->dirty_signal, &event);
 }
@@ -87,17 +251,42 @@ gc_cb(struct fv_main_context_source *source,
         uint64_t now = fv_main_context_get_monotonic_clock(NULL);
         int i;
 
+        fv_playerbase_lock(playerbase);
+
         for (i = 0; i < fv_pointer_array_length(&playerbase->players); i++) {
                 struct fv_player *player =
                         fv_pointer_array_get(&playerbase->players, i);
 
-                if (player->ref_count == 0 &&
+                if (player &&
+                    player->ref_count == 0 &&
                     now - player->last_update_time >=
-                    FV_PLAYERBASE_MAX_PLAYER_AGE) {
+                    FV_PLAYERBASE_MAX_PLAYER_AGE)
                         remove_player(playerbase, player);
-                        i--;
-                }
         }
+
+        fv_playerbase_unlock(playerbase);
+}
+
+static void
+speech_cb(struct fv_main_context_source *source,
+          void *user_data)
+{
+        struct fv_playerbase *playerbase = user_data;
+        uint64_t now = fv_main_context_get_monotonic_clock(NULL);
+        struct fv_player *player, *tmp;
+
+        fv_playerbase_lock(playerbase);
+
+        fv_list_for_each_safe(player,
+                              tmp,
+                              &playerbase->speaking_players,
+                              speaking_link) {
+                if (now - player->last_speech_time >=
+                    FV_PLAYERBASE_SPEECH_RELEASE_TIME)
+                        release_speech(playerbase, player);
+        }
+
+        fv_playerbase_unlock(playerbase);
 }
 
 struct fv_playerbase *
@@ -105,32 +294,59 @@ fv_playerbase_new(void)
 {
         struct fv_playerbase *playerbase = fv_alloc(sizeof *playerbase);
 
+        pthread_mutex_init(&playerbase->mutex, NULL /* attrs */);
         fv_buffer_init(&playerbase->players);
+        fv_buffer_init(&playerbase->free_slots);
+        playerbase->id_table_size = FV_PLAYERBASE_MIN_ID_TABLE_SIZE;
+        playerbase->id_table = fv_calloc(playerbase->id_table_size *
+                                         sizeof (struct fv_player *));
+        playerbase->n_ids = 0;
+        fv_slice_allocator_init(&playerbase->speech_allocator,
+                                sizeof (struct fv_player_speech_block),
+                                FV_ALIGNOF(struct fv_player_speech_block));
+        fv_list_init(&playerbase->speaking_players);
         fv_signal_init(&playerbase->dirty_signal);
         playerbase->n_players = 0;
 
-        playerbase->gc_source = fv_main_context_add_timer(NULL,
-                                                          1, /* minutes */
-                                                          gc_cb,
-                                                          playerbase);
+        playerbase->gc_source =
+                fv_main_context_add_timeout(NULL,
+                                            60 * 1000, /* ms */
+                                            gc_cb,
+                                            playerbase);
+        playerbase->speech_source =
+                fv_main_context_add_timeout(NULL,
+                                            FV_PLAYERBASE_SPEECH_CHECK_INTERVAL,
+                                            speech_cb,
+                                            playerbase);
 
         return playerbase;
 }
 
+void
+fv_playerbase_lock(struct fv_playerbase *playerbase)
+{
+        pthread_mutex_lock(&playerbase->mutex);
+}
+
+void
+fv_playerbase_unlock(struct fv_playerbase *playerbase)
+{
+        pthread_mutex_unlock(&playerbase->mutex);
+}
+
 struct fv_player *
 fv_playerbase_get_player_by_id(struct fv_playerbase *playerbase,
                                uint64_t id)
 {
-        struct fv_player *player;
-        int i;
+        struct fv_player **table = playerbase->id_table;
+        size_t mask = playerbase->id_table_size - 1;
+        size_t pos = hash_id(id) & mask;
 
-        /* FIXME: This should probably use a hash table or something */
+        while (table[pos]) {
+                if (table[pos]->id == id)
+                        return table[pos];
 
-        for (i = 0; i < fv_pointer_array_length(&playerbase->players); i++) {
-                player = fv_pointer_array_get(&playerbase->players, i);
-
-                if (player->id == id)
-                        return player;
+                pos = (pos + 1) & mask;
         }
 
         return NULL;
@@ -149,18 +365,107 @@ fv_playerbase_get_n_players(struct fv_playerbase *playerbase)
         return fv_pointer_array_length(&playerbase->players);
 }
 
+bool
+fv_playerbase_is_empty(struct fv_playerbase *playerbase)
+{
+        return playerbase->n_players == 0;
+}
+
+static void
+add_to_slot(struct fv_playerbase *playerbase,
+            struct fv_player *player)
+{
+        int n_free_slots = playerbase->free_slots.length / sizeof (int);
+
+        if (n_free_slots > 0) {
+                player->num = ((int *) playerbase->free_slots.data)
+                        [n_free_slots - 1];
+                fv_buffer_set_length(&playerbase->free_slots,
+                                     (n_free_slots - 1) * sizeof (int));
+                fv_pointer_array_set(&playerbase->players,
+                                     player->num,
+                                     player);
+        } else {
+                player->num = fv_pointer_array_length(&playerbase->players);
+                fv_pointer_array_append(&playerbase->players, player);
+        }
+
+        playerbase->n_players++;
+}
+
 struct fv_player *
 fv_playerbase_add_player(struct fv_playerbase *playerbase,
                          uint64_t id)
 {
         struct fv_player *player = fv_player_new(id);
 
-        player->num = fv_pointer_array_length(&playerbase->players);
-        fv_pointer_array_append(&playerbase->players, player);
+        add_to_slot(playerbase, player);
+        add_id(playerbase, player);
 
         return player;
 }
 
+struct fv_player *
+fv_playerbase_add_remote_player(struct fv_playerbase *playerbase,
+                                struct fv_relay_link *link)
+{
+        struct fv_player *player = fv_player_new(0 /* id */);
+
+        player->relay_link = link;
+        add_to_slot(playerbase, player);
+
+        return player;
+}
+
+void
+fv_playerbase_remove_player(struct fv_playerbase *playerbase,
+                            struct fv_player *player)
+{
+        remove_player(playerbase, player);
+}
+
+struct fv_player_speech *
+fv_playerbase_add_speech(struct fv_playerbase *playerbase,
+                         struct fv_player *player)
+{
+        int block_num = player->next_speech / FV_PLAYER_SPEECHES_PER_BLOCK;
+        struct fv_player_speech_block *block;
+        struct fv_player_speech *speech;
+        int i;
+
+        if (player->n_speeches == 0) {
+                fv_list_insert(&playerbase->speaking_players,
+                               &player->speaking_link);
+        }
+
+        block = player->speech_blocks[block_num];
+
+        if (block == NULL) {
+                block = fv_slice_alloc(&playerbase->speech_allocator);
+                for (i = 0; i < FV_PLAYER_SPEECHES_PER_BLOCK; i++) {
+                        block->speeches[i].frame = NULL;
+                        block->speeches[i].sequenced_frame = NULL;
+                }
+                player->speech_blocks[block_num] = block;
+        }
+
+        speech = block->speeches + (player->next_speech %
+                                    FV_PLAYER_SPEECHES_PER_BLOCK);
+
+        fv_player_speech_clear_frames(speech);
+
+        player->next_speech = ((player->next_speech + 1) %
+                               FV_PLAYER_MAX_PENDING_SPEECHES);
+        if (player->n_speeches < FV_PLAYER_MAX_PENDING_SPEECHES)
+                player->n_speeches++;
+        player->last_speech_time = fv_main_context_get_monotonic_clock(NULL);
+
+        speech->sequence = player->speech_sequence++;
+        speech->receive_time = player->last_speech_time;
+
+        return speech;
+}
+
 struct fv_signal *
 fv_playerbase_get_dirty_signal(struct fv_playerbase *playerbase)
 {
@@ -170,14 +475,24 @@ fv_playerbase_get_dirty_signal(struct fv_playerbase *playerbase)
 void
 fv_playerbase_free(struct fv_playerbase *playerbase)
 {
+        struct fv_player *player;
         int i;
 
-        for (i = 0; i < fv_pointer_array_length(&playerbase->players); i++)
-                fv_player_free(fv_pointer_array_get(&playerbase->players, i));
+        for (i = 0; i < fv_pointer_array_length(&playerbase->players); i++) {
+                player = fv_pointer_array_get(&playerbase->players, i);
+                if (player)
+                        fv_player_free(player);
+        }
 
         fv_buffer_destroy(&playerbase->players);
+        fv_buffer_destroy(&playerbase->free_slots);
+        fv_free(playerbase->id_table);
+        fv_slice_allocator_destroy(&playerbase->speech_allocator);
 
         fv_main_context_remove_source(playerbase->gc_source);
+        fv_main_context_remove_source(playerbase->speech_source);
+
+        pthread_mutex_destroy(&playerbase->mutex);
 
         fv_free(playerbase);
 }
@@ -36,15 +36,33 @@ struct fv_playerbase_dirty_event {
         struct fv_player *player;
 
         bool n_players_changed;
+
+        /* The number of a player that has been removed or -1 */
+        int removed_player_num;
+        /* The relay link that the removed player came from */
+        struct fv_relay_link *removed_relay_link;
 };
 
 struct fv_playerbase *
 fv_playerbase_new(void);
 
+/* The playerbase may be shared between multiple threads. The lock
+ * must be held while accessing any of the other functions or any of
+ * the players. The dirty signal is always emitted with the lock held.
+ */
+void
+fv_playerbase_lock(struct fv_playerbase *playerbase);
+
+void
+fv_playerbase_unlock(struct fv_playerbase *playerbase);
+
 struct fv_player *
 fv_playerbase_get_player_by_id(struct fv_playerbase *playerbase,
                                uint64_t id);
 
+/* Returns NULL if the player with the given number has been removed
+ * and its slot hasn't been reused yet.
+ */
 struct fv_player *
 fv_playerbase_get_player_by_num(struct fv_playerbase *playerbase,
                                 int num);
@@ -53,9 +71,41 @@ struct fv_player *
 fv_playerbase_add_player(struct fv_playerbase *playerbase,
                          uint64_t id);
 
+/* Adds a player that belongs to another process and that is updated
+ * through the given relay link. The player isn't given an ID so it
+ * can't be found with fv_playerbase_get_player_by_id.
+ */
+struct fv_player *
+fv_playerbase_add_remote_player(struct fv_playerbase *playerbase,
+                                struct fv_relay_link *link);
+
+/* Removes the player immediately and frees it. The dirty signal is
+ * emitted to report the removal.
+ */
+void
+fv_playerbase_remove_player(struct fv_playerbase *playerbase,
+                            struct fv_player *player);
+
+/* Returns the number of player slots. This never decreases because
+ * removing a player only leaves its slot empty.
+ */
 int
 fv_playerbase_get_n_players(struct fv_playerbase *playerbase);
 
+/* Returns true if there are no players left, including the remote
+ * ones */
+bool
+fv_playerbase_is_empty(struct fv_playerbase *playerbase);
+
+/* Returns the slot in the player's speech buffer to store the next
+ * packet in. The buffer memory is taken from a pool shared by all of
+ * the players and it is given back after the player has been quiet
+ * for a few seconds.
+ */
+struct fv_player_speech *
+fv_playerbase_add_speech(struct fv_playerbase *playerbase,
+                         struct fv_player *player);
+
 struct fv_signal *
 fv_playerbase_get_dirty_signal(struct fv_playerbase *playerbase);
 
@@ -0,0 +1,785 @@
+/*
+ * Babiling
+ * Copyright (C) 2026  Neil Roberts
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "fv-relay.h"
+#include "fv-main-context.h"
+#include "fv-buffer.h"
+#include "fv-list.h"
+#include "fv-log.h"
+#include "fv-util.h"
+#include "fv-socket.h"
+#include "fv-file-error.h"
+#include "fv-proto.h"
+
+/* Each message on a link has a header with a uint16_t for the length
+ * of the payload followed by a uint8_t for the message type */
+#define FV_RELAY_HEADER_SIZE 3
+
+#define FV_RELAY_ROOM 0x01
+#define FV_RELAY_PLAYER_POSITION 0x02
+#define FV_RELAY_PLAYER_APPEARANCE 0x03
+#define FV_RELAY_PLAYER_FLAGS 0x04
+#define FV_RELAY_PLAYER_REMOVED 0x05
+#define FV_RELAY_SPEECH 0x06
+
+/* The link is closed if the other process lets this much data build
+ * up without reading it */
+#define FV_RELAY_MAX_QUEUED_BYTES (4 * 1024 * 1024)
+
+/* Number of milliseconds between attempts to connect */
+#define FV_RELAY_RECONNECT_INTERVAL 2000
+
+struct fv_relay_link {
+        struct fv_list link;
+        struct fv_relay *relay;
+
+        int sock;
+        struct fv_main_context_source *source;
+
+        /* Whether this process made the link by connecting */
+        bool outgoing;
+
+        struct fv_buffer in_buf;
+
+        /* Data waiting to be written. The bytes before out_pos have
+         * already been written. */
+        struct fv_buffer out_buf;
+        size_t out_pos;
+        /* Set when the queue grows too big. Nothing more is queued
+         * and the link is closed the next time it is polled. */
+        bool overflowed;
+
+        /* A copy of the name of the room that the last queued message
+         * was for, or NULL if nothing has been queued yet */
+        char *sent_room;
+};
+
+struct fv_relay {
+        struct fv_list links;
+
+        int listen_sock;
+        char *listen_path;
+        struct fv_main_context_source *listen_source;
+
+        char *connect_path;
+        struct fv_main_context_source *reconnect_source;
+
+        struct fv_signal event_signal;
+};
+
+static void
+start_reconnect(struct fv_relay *relay);
+
+static void
+emit_event(struct fv_relay_link *link,
+           enum fv_relay_event_type type,
+           struct fv_relay_event *event)
+{
+        event->type = type;
+        event->link = link;
+        fv_signal_emit(&link->relay->event_signal, event);
+}
+
+static void
+free_link(struct fv_relay_link *link)
+{
+        fv_main_context_remove_source(link->source);
+        fv_close(link->sock);
+        fv_buffer_destroy(&link->in_buf);
+        fv_buffer_destroy(&link->out_buf);
+        fv_free(link->sent_room);
+        fv_list_remove(&link->link);
+        fv_free(link);
+}
+
+static void
+close_link(struct fv_relay_link *link)
+{
+        struct fv_relay *relay = link->relay;
+        struct fv_relay_event event;
+        bool outgoing = link->outgoing;
+
+        emit_event(link, FV_RELAY_EVENT_LINK_REMOVED, &event);
+
+        free_link(link);
+
+        if (outgoing)
+                start_reconnect(relay);
+}
+
+static void
+update_poll_flags(struct fv_relay_link *link)
+{
+        enum fv_main_context_poll_flags flags = FV_MAIN_CONTEXT_POLL_IN;
+
+        if (link->out_buf.length > link->out_pos || link->overflowed)
+                flags |= FV_MAIN_CONTEXT_POLL_OUT;
+
+        fv_main_context_modify_poll(link->source, flags);
+}
+
+static bool
+emit_message_event(struct fv_relay_link *link,
+                   uint8_t type,
+                   const uint8_t *payload,
+                   size_t length)
+{
+        struct fv_relay_player_event player_event;
+        struct fv_relay_room_event room_event;
+        uint16_t player_num;
+        char *name;
+
+        if (type == FV_RELAY_ROOM) {
+                name = fv_alloc(length + 1);
+                memcpy(name, payload, length);
+                name[length] = '\0';
+                room_event.name = name;
+                emit_event(link, FV_RELAY_EVENT_ROOM, &room_event.base);
+                fv_free(name);
+                return true;
+        }
+
+        switch (type) {
+        case FV_RELAY_PLAYER_POSITION:
+                if (!fv_proto_read_payload(payload, length,
+                                           FV_PROTO_TYPE_UINT16,
+                                           &player_num,
+                                           FV_PROTO_TYPE_UINT32,
+                                           &player_event.x_position,
+                                           FV_PROTO_TYPE_UINT32,
+                                           &player_event.y_position,
+                                           FV_PROTO_TYPE_UINT16,
+                                           &player_event.direction,
+                                           FV_PROTO_TYPE_NONE))
+                        return false;
+                player_event.player_num = player_num;
+                emit_event(link,
+                           FV_RELAY_EVENT_PLAYER_POSITION,
+                           &player_event.base);
+                return true;
+
+        case FV_RELAY_PLAYER_APPEARANCE:
+                if (!fv_proto_read_payload(payload, length,
+                                           FV_PROTO_TYPE_UINT16,
+                                           &player_num,
+                                           FV_PROTO_TYPE_UINT8,
+                                           &player_event.image,
+                                           FV_PROTO_TYPE_NONE))
+                        return false;
+                player_event.player_num = player_num;
+                emit_event(link,
+                           FV_RELAY_EVENT_PLAYER_APPEARANCE,
+                           &player_event.base);
+                return true;
+
+        case FV_RELAY_PLAYER_FLAGS:
+                if (!fv_proto_read_payload(payload, length,
+                                           FV_PROTO_TYPE_UINT16,
+                                           &player_num,
+                                           FV_PROTO_TYPE_FLAGS,
+                                           &player_event.n_flags,
+                                           player_event.flags,
+                                           FV_PROTO_TYPE_NONE))
+                        return false;
+                player_event.player_num = player_num;
+                emit_event(link,
+                           FV_RELAY_EVENT_PLAYER_FLAGS,
+                           &player_event.base);
+                return true;
+
+        case FV_RELAY_PLAYER_REMOVED:
+                if (!fv_proto_read_payload(payload, length,
+                                           FV_PROTO_TYPE_UINT16,
+                                           &player_num,
+                                           FV_PROTO_TYPE_NONE))
+                        return false;
+                player_event.player_num = player_num;
+                emit_event(link,
+                           FV_RELAY_EVENT_PLAYER_REMOVED,
+                           &player_event.base);
+                return true;
+
+        case FV_RELAY_SPEECH:
+                if (!fv_proto_read_payload(payload, length,
+                                           FV_PROTO_TYPE_UINT16,
+                                           &player_num,
+                                           FV_PROTO_TYPE_BLOB,
+                                           &player_event.packet_size,
+                                           &player_event.packet,
+                                           FV_PROTO_TYPE_NONE) ||
+                    player_event.packet_size > FV_PROTO_MAX_SPEECH_SIZE)
+                        return false;
+                player_event.player_num = player_num;
+                emit_event(link,
+                           FV_RELAY_EVENT_SPEECH,
+                           &player_event.base);
+                return true;
+        }
+
+        /* Unknown messages are ignored so that newer processes can
+         * add messages */
+        return true;
+}
+
+static bool
+process_messages(struct fv_relay_link *link)
+{
+        const uint8_t *data = link->in_buf.data;
+        size_t length = link->in_buf.length;
+        size_t payload_length;
+
+        while (length >= FV_RELAY_HEADER_SIZE) {
+                payload_length = fv_proto_read_uint16_t(data);
+
+                if (length < FV_RELAY_HEADER_SIZE + payload_length)
+                        break;
+
+                if (!emit_message_event(link,
+                                        data[2],
+                                        data + FV_RELAY_HEADER_SIZE,
+                                        payload_length)) {
+                        fv_log("Invalid message received on a relay link");
+                        return false;
+                }
+
+                data += FV_RELAY_HEADER_SIZE + payload_length;
+                length -= FV_RELAY_HEADER_SIZE + payload_length;
+        }
+
+        memmove(link->in_buf.data, data, length);
+        link->in_buf.length = length;
+
+        return true;
+}
+
+static void
+handle_read(struct fv_relay_link *link)
+{
+        ssize_t got;
+
+        fv_buffer_ensure_size(&link->in_buf, link->in_buf.length + 4096);
+
+        do {
+                got = read(link->sock,
+                           link->in_buf.data + link->in_buf.length,
+                           link->in_buf.size - link->in_buf.length);
+        } while (got == -1 && errno == EINTR);
+
+        if (got == 0) {
+                fv_log("Relay link closed");
+                close_link(link);
+        } else if (got == -1) {
+                if (fv_file_error_from_errno(errno) != FV_FILE_ERROR_AGAIN) {
+                        fv_log("Error reading from relay link: %s",
+                               strerror(errno));
+                        close_link(link);
+                }
+        } else {
+                link->in_buf.length += got;
+
+                if (!process_messages(link))
+                        close_link(link);
+        }
+}
+
+static void
+handle_write(struct fv_relay_link *link)
+{
+        ssize_t wrote;
+
+        if (link->overflowed) {
+                fv_log("Closing relay link because the other end isn't "
+                       "reading");
+                close_link(link);
+                return;
+        }
+
+        do {
+                wrote = write(link->sock,
+                              link->out_buf.data + link->out_pos,
+                              link->out_buf.length - link->out_pos);
+        } while (wrote == -1 && errno == EINTR);
+
+        if (wrote == -1) {
+                if (fv_file_error_from_errno(errno) != FV_FILE_ERROR_AGAIN) {
+                        fv_log("Error writing to relay link: %s",
+                               strerror(errno));
+                        close_link(link);
+                }
+                return;
+        }
+
+        link->out_pos += wrote;
+
+        if (link->out_pos >= link->out_buf.length) {
+                fv_buffer_set_length(&link->out_buf, 0);
+                link->out_pos = 0;
+        }
+
+        update_poll_flags(link);
+}
+
+static void
+link_poll_cb(struct fv_main_context_source *source,
+             int fd,
+             enum fv_main_context_poll_flags flags,
+             void *user_data)
+{
+        struct fv_relay_link *link = user_data;
+
+        if (flags & FV_MAIN_CONTEXT_POLL_ERROR) {
+                fv_log("Error on relay link");
+                close_link(link);
+        } else if (flags & FV_MAIN_CONTEXT_POLL_IN) {
+                handle_read(link);
+        } else if (flags & FV_MAIN_CONTEXT_POLL_OUT) {
+                handle_write(link);
+        }
+}
+
+static void
+add_link(struct fv_relay *relay,
+         int sock,
+         bool outgoing)
+{
+        struct fv_relay_link *link = fv_alloc(sizeof *link);
+        struct fv_relay_event event;
+
+        link->relay = relay;
+        link->sock = sock;
+        link->outgoing = outgoing;
+        fv_buffer_init(&link->in_buf);
+        fv_buffer_init(&link->out_buf);
+        link->out_pos = 0;
+        link->overflowed = false;
+        link->sent_room = NULL;
+
+        link->source = fv_main_context_add_poll(NULL, /* context */
+                                                sock,
+                                                FV_MAIN_CONTEXT_POLL_IN,
+                                                link_poll_cb,
+                                                link);
+
+        fv_list_insert(relay->links.prev, &link->link);
+
+        emit_event(link, FV_RELAY_EVENT_LINK_ADDED, &event);
+}
+
+static bool
+make_address(struct sockaddr_un *address,
+             const char *path,
+             struct fv_error **error)
+{
+        if (strlen(path) >= sizeof address->sun_path) {
+                fv_file_error_set(error,
+                                  ENAMETOOLONG,
+                                  "The relay socket path %s is too long",
+                                  path);
+                return false;
+        }
+
+        memset(address, 0, sizeof *address);
+        address->sun_family = AF_UNIX;
+        strcpy(address->sun_path, path);
+
+        return true;
+}
+
+static int
+create_socket(struct fv_error **error)
+{
+        int sock = socket(PF_UNIX, SOCK_STREAM, 0);
+
+        if (sock == -1) {
+                fv_file_error_set(error,
+                                  errno,
+                                  "Failed to create relay socket: %s",
+                                  strerror(errno));
+                return -1;
+        }
+
+        if (!fv_socket_set_nonblock(sock, error)) {
+                fv_close(sock);
+                return -1;
+        }
+
+        return sock;
+}
+
+static bool
+try_connect(struct fv_relay *relay,
+            struct fv_error **error)
+{
+        struct sockaddr_un address;
+        int sock;
+
+        if (!make_address(&address, relay->connect_path, error))
+                return false;
+
+        sock = create_socket(error);
+        if (sock == -1)
+                return false;
+
+        if (connect(sock,
+                    (struct sockaddr *) &address,
+                    sizeof address) == -1) {
+                fv_file_error_set(error,
+                                  errno,
+                                  "Failed to connect to relay at %s: %s",
+                                  relay->connect_path,
+                                  strerror(errno));
+                fv_close(sock);
+                return false;
+        }
+
+        fv_log("Connected to relay at %s", relay->connect_path);
+
+        add_link(relay, sock, true /* outgoing */);
+
+        return true;
+}
+
+static void
+reconnect_cb(struct fv_main_context_source *source,
+             void *user_data)
+{
+        struct fv_relay *relay = user_data;
+        struct fv_error *error = NULL;
+
+        if (try_connect(relay, &error)) {
+                fv_main_context_remove_source(source);
+                relay->reconnect_source = NULL;
+        } else {
+                fv_error_free(error);
+        }
+}
+
+static void
+start_reconnect(struct fv_relay *relay)
+{
+        if (relay->reconnect_source)
+                return;
+
+        relay->reconnect_source =
+                fv_main_context_add_timeout(NULL,
+                                            FV_RELAY_RECONNECT_INTERVAL,
+                                            reconnect_cb,
+                                            relay);
+}
+
+static void
+listen_cb(struct fv_main_context_source *source,
+          int fd,
+          enum fv_main_context_poll_flags flags,
+          void *user_data)
+{
+        struct fv_relay *relay = user_data;
+        struct fv_error *error = NULL;
+        int sock;
+
+        do {
+                sock = accept(fd, NULL, NULL);
+        } while (sock == -1 && errno == EINTR);
+
+        if (sock == -1) {
+                if (fv_file_error_from_errno(errno) != FV_FILE_ERROR_AGAIN)
+                        fv_log("Error accepting relay link: %s",
+                               strerror(errno));
+                return;
+        }
+
+        if (!fv_socket_set_nonblock(sock, &error)) {
+                fv_log("%s", error->message);
+                fv_error_free(error);
+                fv_close(sock);
+                return;
+        }
+
+        fv_log("Accepted relay link");
+
+        add_link(relay, sock, false /* outgoing */);
+}
+
+struct fv_relay *
+fv_relay_new(void)
+{
+        struct fv_relay *relay = fv_alloc(sizeof *relay);
+
+        fv_list_init(&relay->links);
+
+        relay->listen_sock = -1;
+        relay->listen_path = NULL;
+        relay->listen_source = NULL;
+
+        relay->connect_path = NULL;
+        relay->reconnect_source = NULL;
+
+        fv_signal_init(&relay->event_signal);
+
+        return relay;
+}
+
+bool
+fv_relay_listen(struct fv_relay *relay,
+                const char *path,
+                struct fv_error **error)
+{
+        struct sockaddr_un address;
+        int sock;
+
+        if (!make_address(&address, path, error))
+                return false;
+
+        sock = create_socket(error);
+        if (sock == -1)
+                return false;
+
+        /* Remove a socket left behind by a previous process */
+        unlink(path);
+
+        if (bind(sock, (struct sockaddr *) &address, sizeof address) == -1) {
+                fv_file_error_set(error,
+                                  errno,
+                                  "Failed to bind relay socket %s: %s",
+                                  path,
+                                  strerror(errno));
+                fv_close(sock);
+                return false;
+        }
+
+        if (listen(sock, 10) == -1) {
+                fv_file_error_set(error,
+                                  errno,
+                                  "Failed to make relay socket listen: %s",
+                                  strerror(errno));
+                fv_close(sock);
+                unlink(path);
+                return false;
+        }
+
+        relay->listen_sock = sock;
+        relay->listen_path = fv_strdup(path);
+        relay->listen_source =
+                fv_main_context_add_poll(NULL, /* context */
+                                         sock,
+                                         FV_MAIN_CONTEXT_POLL_IN,
+                                         listen_cb,
+                                         relay);
+
+        return true;
+}
+
+void
+fv_relay_connect(struct fv_relay *relay,
+                 const char *path)
+{
+        struct fv_error *error = NULL;
+
+        fv_free(relay->connect_path);
+        relay->connect_path = fv_strdup(path);
+
+        if (!try_connect(relay, &error)) {
+                fv_log("%s", error->message);
+                fv_error_free(error);
+                start_reconnect(relay);
+        }
+}
+
+struct fv_signal *
+fv_relay_get_event_signal(struct fv_relay *relay)
+{
+        return &relay->event_signal;
+}
+
+/* Returns space for a message with the given payload length after
+ * writing its header, or NULL if the link has too much queued */
+static uint8_t *
+add_message(struct fv_relay_link *link,
+            uint8_t type,
+            size_t payload_length)
+{
+        size_t length = FV_RELAY_HEADER_SIZE + payload_length;
+        uint8_t *data;
+
+        if (link->overflowed)
+                return NULL;
+
+        if (link->out_buf.length - link->out_pos + length >
+            FV_RELAY_MAX_QUEUED_BYTES) {
+                link->overflowed = true;
+                update_poll_flags(link);
+                return NULL;
+        }
+
+        fv_buffer_set_length(&link->out_buf, link->out_buf.length + length);
+        data = link->out_buf.data + link->out_buf.length - length;
+
+        fv_proto_write_uint16_t(data, payload_length);
+        fv_proto_write_uint8_t(data + 2, type);
+
+        update_poll_flags(link);
+
+        return data + FV_RELAY_HEADER_SIZE;
+}
+
+static bool
+set_room(struct fv_relay_link *link,
+         const char *room_name)
+{
+        size_t length;
+        uint8_t *data;
+
+        if (link->sent_room && !strcmp(link->sent_room, room_name))
+                return true;
+
+        length = strlen(room_name);
+        data = add_message(link, FV_RELAY_ROOM, length);
+        if (data == NULL)
+                return false;
+
+        memcpy(data, room_name, length);
+        fv_free(link->sent_room);
+        link->sent_room = fv_strdup(room_name);
+
+        return true;
+}
+
+void
+fv_relay_link_send_player(struct fv_relay_link *link,
+                          const char *room_name,
+                          const struct fv_player *player,
+                          int state)
+{
+        uint8_t *data;
+        int i;
+
+        if (!set_room(link, room_name))
+                return;
+
+        if ((state & FV_PLAYER_STATE_POSITION) &&
+            (data = add_message(link,
+                                FV_RELAY_PLAYER_POSITION,
+                                sizeof (uint16_t) * 2 +
+                                sizeof (uint32_t) * 2))) {
+                fv_proto_write_uint16_t(data, player->num);
+                fv_proto_write_uint32_t(data + 2, player->x_position);
+                fv_proto_write_uint32_t(data + 6, player->y_position);
+                fv_proto_write_uint16_t(data + 10, player->direction);
+        }
+
+        if ((state & FV_PLAYER_STATE_APPEARANCE) &&
+            (data = add_message(link,
+                                FV_RELAY_PLAYER_APPEARANCE,
+                                sizeof (uint16_t) + sizeof (uint8_t)))) {
+                fv_proto_write_uint16_t(data, player->num);
+                fv_proto_write_uint8_t(data + 2, player->image);
+        }
+
+        if ((state & FV_PLAYER_STATE_FLAGS) &&
+            (data = add_message(link,
+                                FV_RELAY_PLAYER_FLAGS,
+                                sizeof (uint16_t) +
+                                sizeof (uint32_t) * player->n_flags))) {
+                fv_proto_write_uint16_t(data, player->num);
+                for (i = 0; i < player->n_flags; i++) {
+                        fv_proto_write_uint32_t(data + 2 + i * 4,
+                                                player->flags[i]);
+                }
+        }
+}
+
+void
+fv_relay_link_send_speech(struct fv_relay_link *link,
+                          const char *room_name,
+                          int player_num,
+                          const struct fv_player_speech *speech)
+{
+        uint8_t *data;
+
+        if (!set_room(link, room_name))
+                return;
+
+        data = add_message(link,
+                           FV_RELAY_SPEECH,
+                           sizeof (uint16_t) + speech->size);
+        if (data == NULL)
+                return;
+
+        fv_proto_write_uint16_t(data, player_num);
+        memcpy(data + 2, speech->packet, speech->size);
+}
+
+void
+fv_relay_link_send_player_removed(struct fv_relay_link *link,
+                                  const char *room_name,
+                                  int player_num)
+{
+        uint8_t *data;
+
+        if (!set_room(link, room_name))
+                return;
+
+        data = add_message(link,
+                           FV_RELAY_PLAYER_REMOVED,
+                           sizeof (uint16_t));
+        if (data == NULL)
+                return;
+
+        fv_proto_write_uint16_t(data, player_num);
+}
+
+void
+fv_relay_free(struct fv_relay *relay)
+{
+        struct fv_relay_link *link, *tmp;
+
+        fv_list_for_each_safe(link, tmp, &relay->links, link)
+                free_link(link);
+
+        if (relay->listen_source)
+                fv_main_context_remove_source(relay->listen_source);
+
+        if (relay->listen_sock != -1) {
+                fv_close(relay->listen_sock);
+                unlink(relay->listen_path);
+        }
+
+        fv_free(relay->listen_path);
+
+        if (relay->reconnect_source)
+                fv_main_context_remove_source(relay->reconnect_source);
+
+        fv_free(relay->connect_path);
+
+        fv_free(relay);
+}
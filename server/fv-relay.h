@@ -0,0 +1,146 @@
+/*
+ * Babiling
+ * Copyright (C) 2026  Neil Roberts
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+#ifndef FV_RELAY_H
+#define FV_RELAY_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "fv-error.h"
+#include "fv-signal.h"
+#include "fv-player.h"
+
+/* The relay passes the players of the rooms between several server
+ * processes over UNIX domain sockets. Each process either listens
+ * for the other processes or connects to one of them. The links must
+ * form a tree, for example with one process listening and all of the
+ * others connecting to it. A process forwards the changes that it
+ * gets from one link to all of the others so every process sees
+ * every player.
+ *
+ * The messages on a link refer to the players by the player number of
+ * the process that sent them. They are for the room given by the last
+ * ROOM message.
+ */
+
+enum fv_relay_event_type {
+        FV_RELAY_EVENT_LINK_ADDED,
+        FV_RELAY_EVENT_LINK_REMOVED,
+
+        FV_RELAY_EVENT_ROOM,
+        FV_RELAY_EVENT_PLAYER_POSITION,
+        FV_RELAY_EVENT_PLAYER_APPEARANCE,
+        FV_RELAY_EVENT_PLAYER_FLAGS,
+        FV_RELAY_EVENT_PLAYER_REMOVED,
+        FV_RELAY_EVENT_SPEECH,
+};
+
+struct fv_relay_event {
+        enum fv_relay_event_type type;
+        struct fv_relay_link *link;
+};
+
+struct fv_relay_room_event {
+        struct fv_relay_event base;
+
+        const char *name;
+};
+
+/* This is used for all of the events about a player */
+struct fv_relay_player_event {
+        struct fv_relay_event base;
+
+        int player_num;
+
+        /* FV_RELAY_EVENT_PLAYER_POSITION */
+        uint32_t x_position;
+        uint32_t y_position;
+        uint16_t direction;
+
+        /* FV_RELAY_EVENT_PLAYER_APPEARANCE */
+        uint8_t image;
+
+        /* FV_RELAY_EVENT_PLAYER_FLAGS */
+        int n_flags;
+        enum fv_flag flags[FV_PROTO_MAX_FLAGS];
+
+        /* FV_RELAY_EVENT_SPEECH */
+        const uint8_t *packet;
+        size_t packet_size;
+};
+
+struct fv_relay;
+struct fv_relay_link;
+
+/* The relay uses the default main context of the calling thread and
+ * the event signal is always emitted from that thread.
+ */
+struct fv_relay *
+fv_relay_new(void);
+
+/* Accepts links from other processes on a UNIX domain socket at the
+ * given path. Any existing file at the path is replaced.
+ */
+bool
+fv_relay_listen(struct fv_relay *relay,
+                const char *path,
+                struct fv_error **error);
+
+/* Makes a link to the process listening at the given path. If it
+ * can't connect or the link is lost then it keeps retrying every
+ * few seconds.
+ */
+void
+fv_relay_connect(struct fv_relay *relay,
+                 const char *path);
+
+struct fv_signal *
+fv_relay_get_event_signal(struct fv_relay *relay);
+
+/* Queues messages about a player in the given room. The ROOM message
+ * is only queued when the name differs from the last one sent on the
+ * link.
+ */
+void
+fv_relay_link_send_player(struct fv_relay_link *link,
+                          const char *room_name,
+                          const struct fv_player *player,
+                          int state);
+
+void
+fv_relay_link_send_speech(struct fv_relay_link *link,
+                          const char *room_name,
+                          int player_num,
+                          const struct fv_player_speech *speech);
+
+void
+fv_relay_link_send_player_removed(struct fv_relay_link *link,
+                                  const char *room_name,
+                                  int player_num);
+
+void
+fv_relay_free(struct fv_relay *relay);
+
+#endif /* FV_RELAY_H */
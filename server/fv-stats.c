@@ -0,0 +1,272 @@
+/*
+ * Babiling
+ * Copyright (C) 2026  Neil Roberts
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <string.h>
+#include <inttypes.h>
+#include <time.h>
+
+#include "fv-stats.h"
+#include "fv-util.h"
+#include "fv-log.h"
+
+static const char * const
+counter_names[] = {
+        [FV_STATS_CONNECTIONS_OPENED] = "connections_opened",
+        [FV_STATS_CONNECTIONS_CLOSED] = "connections_closed",
+        [FV_STATS_BYTES_READ] = "bytes_read",
+        [FV_STATS_READ_CALLS] = "read_calls",
+        [FV_STATS_BYTES_QUEUED] = "bytes_queued",
+        [FV_STATS_BYTES_WRITTEN] = "bytes_written",
+        [FV_STATS_BYTES_DISCARDED] = "bytes_discarded",
+        [FV_STATS_WRITE_CALLS] = "write_calls",
+        [FV_STATS_PARTIAL_WRITES] = "partial_writes",
+        [FV_STATS_DROPPED_SPEECHES] = "dropped_speeches",
+};
+
+_Static_assert(FV_N_ELEMENTS(counter_names) == FV_STATS_N_COUNTERS,
+               "Every counter needs a name");
+
+static const char * const
+latency_names[] = {
+        [FV_STATS_LATENCY_POSITION] = "position",
+        [FV_STATS_LATENCY_SPEECH] = "speech",
+        [FV_STATS_LATENCY_MIXED_SPEECH] = "mixed_speech",
+};
+
+_Static_assert(FV_N_ELEMENTS(latency_names) == FV_STATS_N_LATENCIES,
+               "Every latency needs a name");
+
+/* The percentiles of the summary in parts per thousand */
+static const int
+summary_quantiles[] = { 500, 990, 999, 1000 };
+
+static const char * const
+summary_quantile_names[] = { "0.5", "0.99", "0.999", "1" };
+
+void
+fv_stats_init(struct fv_stats *stats)
+{
+        memset(stats, 0, sizeof *stats);
+}
+
+static void
+accumulate_values(uint64_t *total,
+                  const uint64_t *values,
+                  int n_values)
+{
+        int i;
+
+        for (i = 0; i < n_values; i++)
+                total[i] += __atomic_load_n(values + i, __ATOMIC_RELAXED);
+}
+
+void
+fv_stats_accumulate(struct fv_stats *total,
+                    const struct fv_stats *stats)
+{
+        int i;
+
+        accumulate_values(total->counters,
+                          stats->counters,
+                          FV_STATS_N_COUNTERS);
+        accumulate_values(total->messages_in,
+                          stats->messages_in,
+                          FV_STATS_N_MESSAGE_IDS);
+        accumulate_values(total->messages_out,
+                          stats->messages_out,
+                          FV_STATS_N_MESSAGE_IDS);
+
+        for (i = 0; i < FV_STATS_N_LATENCIES; i++) {
+                accumulate_values(total->latencies[i],
+                                  stats->latencies[i],
+                                  FV_STATS_LATENCY_N_BUCKETS);
+        }
+}
+
+uint64_t
+fv_stats_get_latency_clock(void)
+{
+        struct timespec ts;
+
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+
+        return ts.tv_sec * UINT64_C(1000000) + ts.tv_nsec / UINT64_C(1000);
+}
+
+void
+fv_stats_append_value(struct fv_buffer *buf,
+                      const char *name,
+                      uint64_t value)
+{
+        fv_buffer_append_printf(buf, "babiling_%s %" PRIu64 "\n", name, value);
+}
+
+static void
+append_messages(struct fv_buffer *buf,
+                const char *name,
+                uint8_t id_flag,
+                const uint64_t *values)
+{
+        int i;
+
+        /* Message types that have never been seen are left out */
+        for (i = 0; i < FV_STATS_N_MESSAGE_IDS; i++) {
+                if (values[i] == 0)
+                        continue;
+
+                fv_buffer_append_printf(buf,
+                                        "babiling_%s{id=\"0x%02x\"} "
+                                        "%" PRIu64 "\n",
+                                        name,
+                                        i | id_flag,
+                                        values[i]);
+        }
+}
+
+void
+fv_stats_append(struct fv_buffer *buf,
+                const struct fv_stats *stats)
+{
+        int i;
+
+        for (i = 0; i < FV_STATS_N_COUNTERS; i++) {
+                fv_stats_append_value(buf,
+                                      counter_names[i],
+                                      stats->counters[i]);
+        }
+
+        append_messages(buf, "messages_in", 0x80, stats->messages_in);
+        append_messages(buf, "messages_out", 0x00, stats->messages_out);
+}
+
+/* Returns the largest value that is counted in the bucket */
+static uint64_t
+get_bucket_limit(int bucket)
+{
+        int shift, sub_bucket;
+
+        if (bucket < FV_STATS_LATENCY_SUB_BUCKETS)
+                return bucket;
+
+        shift = bucket / FV_STATS_LATENCY_SUB_BUCKETS - 1;
+        sub_bucket = bucket % FV_STATS_LATENCY_SUB_BUCKETS;
+
+        return (((uint64_t) (FV_STATS_LATENCY_SUB_BUCKETS + sub_bucket + 1) <<
+                 shift) -
+                1);
+}
+
+void
+fv_stats_summarize_latency(const struct fv_stats *stats,
+                           enum fv_stats_latency latency,
+                           struct fv_stats_latency_summary *summary)
+{
+        const uint64_t *buckets = stats->latencies[latency];
+        uint64_t *values[] = {
+                &summary->p50, &summary->p99, &summary->p999, &summary->max
+        };
+        uint64_t rank, sum = 0;
+        int bucket = 0;
+        int i;
+
+        summary->count = 0;
+
+        for (i = 0; i < FV_STATS_LATENCY_N_BUCKETS; i++)
+                summary->count += buckets[i];
+
+        for (i = 0; i < FV_N_ELEMENTS(summary_quantiles); i++) {
+                /* The rank of the value starting from 1, rounded up */
+                rank = ((summary->count * summary_quantiles[i] + 999) /
+                        1000);
+
+                while (bucket < FV_STATS_LATENCY_N_BUCKETS - 1 &&
+                       sum + buckets[bucket] < rank)
+                        sum += buckets[bucket++];
+
+                *values[i] = get_bucket_limit(bucket);
+        }
+}
+
+void
+fv_stats_append_latencies(struct fv_buffer *buf,
+                          const struct fv_stats *stats)
+{
+        struct fv_stats_latency_summary summary;
+        uint64_t values[FV_N_ELEMENTS(summary_quantiles)];
+        int i, j;
+
+        for (i = 0; i < FV_STATS_N_LATENCIES; i++) {
+                fv_stats_summarize_latency(stats, i, &summary);
+
+                if (summary.count == 0)
+                        continue;
+
+                values[0] = summary.p50;
+                values[1] = summary.p99;
+                values[2] = summary.p999;
+                values[3] = summary.max;
+
+                for (j = 0; j < FV_N_ELEMENTS(values); j++) {
+                        fv_buffer_append_printf(buf,
+                                                "babiling_latency_us"
+                                                "{type=\"%s\","
+                                                "quantile=\"%s\"} "
+                                                "%" PRIu64 "\n",
+                                                latency_names[i],
+                                                summary_quantile_names[j],
+                                                values[j]);
+                }
+
+                fv_buffer_append_printf(buf,
+                                        "babiling_latency_us_count"
+                                        "{type=\"%s\"} %" PRIu64 "\n",
+                                        latency_names[i],
+                                        summary.count);
+        }
+}
+
+void
+fv_stats_log_latencies(const struct fv_stats *stats)
+{
+        struct fv_stats_latency_summary summary;
+        int i;
+
+        for (i = 0; i < FV_STATS_N_LATENCIES; i++) {
+                fv_stats_summarize_latency(stats, i, &summary);
+
+                fv_log("Latency of %s: %" PRIu64 " messages, "
+                       "p50 %" PRIu64 "us, "
+                       "p99 %" PRIu64 "us, "
+                       "p99.9 %" PRIu64 "us, "
+                       "max %" PRIu64 "us",
+                       latency_names[i],
+                       summary.count,
+                       summary.p50,
+                       summary.p99,
+                       summary.p999,
+                       summary.max);
+        }
+}
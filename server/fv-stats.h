@@ -0,0 +1,212 @@
+/*
+ * Babiling
+ * Copyright (C) 2026  Neil Roberts
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+
+#ifndef FV_STATS_H
+#define FV_STATS_H
+
+#include <stdint.h>
+
+#include "fv-buffer.h"
+
+/* Counters of the work done by one thread of the server. Only the
+ * thread that owns a struct fv_stats adds to it so the hot paths
+ * don't need any locks. Other threads can read the counters at any
+ * time to sum them up. The counters only ever increase so the gauges
+ * are worked out as the difference between two of them, which stays
+ * correct when a connection moves to another thread.
+ */
+
+enum fv_stats_counter {
+        FV_STATS_CONNECTIONS_OPENED,
+        FV_STATS_CONNECTIONS_CLOSED,
+        FV_STATS_BYTES_READ,
+        FV_STATS_READ_CALLS,
+        /* Bytes added to the write queues of the connections and
+         * the bytes that were written or thrown away when the
+         * connection was closed */
+        FV_STATS_BYTES_QUEUED,
+        FV_STATS_BYTES_WRITTEN,
+        FV_STATS_BYTES_DISCARDED,
+        FV_STATS_WRITE_CALLS,
+        /* Writes that didn't write everything that was queued */
+        FV_STATS_PARTIAL_WRITES,
+        /* Speech packets that were never sent to a connection because
+         * it was too slow */
+        FV_STATS_DROPPED_SPEECHES,
+
+        FV_STATS_N_COUNTERS
+};
+
+/* The message IDs are counted without the top bit that marks the
+ * messages to the server */
+#define FV_STATS_N_MESSAGE_IDS 32
+
+/* The time in microseconds from when a message was read from the
+ * client that sent it until the resulting message was written to the
+ * socket of each of the other clients */
+enum fv_stats_latency {
+        FV_STATS_LATENCY_POSITION,
+        FV_STATS_LATENCY_SPEECH,
+        /* This is measured from when the mixing finished */
+        FV_STATS_LATENCY_MIXED_SPEECH,
+
+        FV_STATS_N_LATENCIES
+};
+
+/* The latencies are counted in buckets whose size doubles with every
+ * power of two, with each power split into a fixed number of
+ * sub-buckets. Every value is then counted with a precision of about
+ * 6%. Anything above the maximum goes in the last bucket.
+ */
+#define FV_STATS_LATENCY_SUB_BUCKET_BITS 4
+#define FV_STATS_LATENCY_SUB_BUCKETS (1 << FV_STATS_LATENCY_SUB_BUCKET_BITS)
+#define FV_STATS_LATENCY_MAX_BITS 32
+#define FV_STATS_LATENCY_N_BUCKETS ((FV_STATS_LATENCY_MAX_BITS - \
+                                     FV_STATS_LATENCY_SUB_BUCKET_BITS + \
+                                     1) * \
+                                    FV_STATS_LATENCY_SUB_BUCKETS)
+
+struct fv_stats {
+        uint64_t counters[FV_STATS_N_COUNTERS];
+        uint64_t messages_in[FV_STATS_N_MESSAGE_IDS];
+        uint64_t messages_out[FV_STATS_N_MESSAGE_IDS];
+        uint64_t latencies[FV_STATS_N_LATENCIES][FV_STATS_LATENCY_N_BUCKETS];
+};
+
+void
+fv_stats_init(struct fv_stats *stats);
+
+static inline void
+fv_stats_add_value(uint64_t *value,
+                   uint64_t amount)
+{
+        /* There is only one writer so this doesn't need to be a
+         * locked instruction. The atomic store only stops a reader
+         * on another thread from seeing a torn value. */
+        __atomic_store_n(value, *value + amount, __ATOMIC_RELAXED);
+}
+
+static inline void
+fv_stats_add(struct fv_stats *stats,
+             enum fv_stats_counter counter,
+             uint64_t amount)
+{
+        fv_stats_add_value(stats->counters + counter, amount);
+}
+
+static inline void
+fv_stats_count_message_in(struct fv_stats *stats,
+                          uint8_t message_id)
+{
+        message_id &= 0x7f;
+
+        if (message_id < FV_STATS_N_MESSAGE_IDS)
+                fv_stats_add_value(stats->messages_in + message_id, 1);
+}
+
+static inline void
+fv_stats_count_message_out(struct fv_stats *stats,
+                           uint8_t message_id)
+{
+        if (message_id < FV_STATS_N_MESSAGE_IDS)
+                fv_stats_add_value(stats->messages_out + message_id, 1);
+}
+
+static inline int
+fv_stats_get_latency_bucket(uint64_t value)
+{
+        int exponent;
+
+        if (value < FV_STATS_LATENCY_SUB_BUCKETS)
+                return value;
+
+        if (value >= (UINT64_C(1) << FV_STATS_LATENCY_MAX_BITS))
+                return FV_STATS_LATENCY_N_BUCKETS - 1;
+
+        exponent = 63 - __builtin_clzll(value);
+
+        return ((exponent - FV_STATS_LATENCY_SUB_BUCKET_BITS + 1) *
+                FV_STATS_LATENCY_SUB_BUCKETS +
+                ((value >> (exponent - FV_STATS_LATENCY_SUB_BUCKET_BITS)) &
+                 (FV_STATS_LATENCY_SUB_BUCKETS - 1)));
+}
+
+static inline void
+fv_stats_add_latency(struct fv_stats *stats,
+                     enum fv_stats_latency latency,
+                     uint64_t value)
+{
+        fv_stats_add_value(stats->latencies[latency] +
+                           fv_stats_get_latency_bucket(value),
+                           1);
+}
+
+/* Returns the monotonic clock in microseconds. Unlike
+ * fv_main_context_get_monotonic_clock this isn't cached so it can be
+ * used to time the work done in a single iteration of the main
+ * loop. */
+uint64_t
+fv_stats_get_latency_clock(void);
+
+/* Adds the counters of stats to total. This can be called from any
+ * thread. */
+void
+fv_stats_accumulate(struct fv_stats *total,
+                    const struct fv_stats *stats);
+
+/* Appends a line of the form "babiling_<name> <value>" */
+void
+fv_stats_append_value(struct fv_buffer *buf,
+                      const char *name,
+                      uint64_t value);
+
+/* Appends all of the counters in the same format as
+ * fv_stats_append_value. The messages are labelled with their ID. */
+void
+fv_stats_append(struct fv_buffer *buf,
+                const struct fv_stats *stats);
+
+struct fv_stats_latency_summary {
+        uint64_t count;
+        /* The 50th, 99th and 99.9th percentiles and the maximum in
+         * microseconds. Each one is the upper limit of its bucket. */
+        uint64_t p50, p99, p999, max;
+};
+
+void
+fv_stats_summarize_latency(const struct fv_stats *stats,
+                           enum fv_stats_latency latency,
+                           struct fv_stats_latency_summary *summary);
+
+/* Appends the summary of each latency histogram in the same format
+ * as the counters */
+void
+fv_stats_append_latencies(struct fv_buffer *buf,
+                          const struct fv_stats *stats);
+
+/* Writes the same summary as one line per histogram to the log */
+void
+fv_stats_log_latencies(const struct fv_stats *stats);
+
+#endif /* FV_STATS_H */
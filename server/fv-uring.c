@@ -0,0 +1,265 @@
+/*
+ * Babiling
+ * Copyright (C) 2026  Neil Roberts
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+#include "config.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+
+#include "fv-uring.h"
+#include "fv-file-error.h"
+#include "fv-util.h"
+
+static void
+unmap_rings(struct fv_uring *uring)
+{
+        if (uring->sqes != MAP_FAILED)
+                munmap(uring->sqes, uring->sqes_size);
+        if (uring->cq_ring != MAP_FAILED && uring->cq_ring != uring->sq_ring)
+                munmap(uring->cq_ring, uring->cq_ring_size);
+        if (uring->sq_ring != MAP_FAILED)
+                munmap(uring->sq_ring, uring->sq_ring_size);
+}
+
+static void *
+map_ring(struct fv_uring *uring,
+         size_t size,
+         off_t offset)
+{
+        return mmap(NULL, /* addr */
+                    size,
+                    PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE,
+                    uring->fd,
+                    offset);
+}
+
+bool
+fv_uring_init(struct fv_uring *uring,
+              unsigned entries,
+              struct fv_error **error)
+{
+        const unsigned required_features = (IORING_FEAT_SINGLE_MMAP |
+                                            IORING_FEAT_NODROP |
+                                            IORING_FEAT_EXT_ARG);
+        struct io_uring_params params;
+        uint8_t *sq_ring, *cq_ring;
+
+        memset(&params, 0, sizeof params);
+
+        uring->fd = syscall(__NR_io_uring_setup, entries, &params);
+
+        if (uring->fd == -1) {
+                fv_file_error_set(error,
+                                  errno,
+                                  "io_uring_setup failed: %s",
+                                  strerror(errno));
+                return false;
+        }
+
+        if ((params.features & required_features) != required_features) {
+                fv_file_error_set(error,
+                                  ENOSYS,
+                                  "io_uring is missing required features");
+                fv_close(uring->fd);
+                return false;
+        }
+
+        uring->sq_ring_size = (params.sq_off.array +
+                               params.sq_entries * sizeof (unsigned));
+        uring->cq_ring_size = (params.cq_off.cqes +
+                               params.cq_entries *
+                               sizeof (struct io_uring_cqe));
+        /* With IORING_FEAT_SINGLE_MMAP both rings are in one mapping */
+        if (uring->cq_ring_size > uring->sq_ring_size)
+                uring->sq_ring_size = uring->cq_ring_size;
+        uring->sqes_size = params.sq_entries * sizeof (struct io_uring_sqe);
+
+        uring->sq_ring = map_ring(uring,
+                                  uring->sq_ring_size,
+                                  IORING_OFF_SQ_RING);
+        uring->cq_ring = uring->sq_ring;
+        uring->sqes = map_ring(uring, uring->sqes_size, IORING_OFF_SQES);
+
+        if (uring->sq_ring == MAP_FAILED || uring->sqes == MAP_FAILED) {
+                fv_file_error_set(error,
+                                  errno,
+                                  "Failed to map the io_uring: %s",
+                                  strerror(errno));
+                unmap_rings(uring);
+                fv_close(uring->fd);
+                return false;
+        }
+
+        sq_ring = uring->sq_ring;
+        uring->sq_head = (unsigned *) (sq_ring + params.sq_off.head);
+        uring->sq_tail = (unsigned *) (sq_ring + params.sq_off.tail);
+        uring->sq_ring_mask =
+                *(unsigned *) (sq_ring + params.sq_off.ring_mask);
+        uring->sq_entries = params.sq_entries;
+        uring->sq_array = (unsigned *) (sq_ring + params.sq_off.array);
+
+        cq_ring = uring->cq_ring;
+        uring->cq_head = (unsigned *) (cq_ring + params.cq_off.head);
+        uring->cq_tail = (unsigned *) (cq_ring + params.cq_off.tail);
+        uring->cq_ring_mask =
+                *(unsigned *) (cq_ring + params.cq_off.ring_mask);
+        uring->cqes = (struct io_uring_cqe *) (cq_ring + params.cq_off.cqes);
+
+        uring->n_pending = 0;
+
+        return true;
+}
+
+static int
+enter(struct fv_uring *uring,
+      unsigned to_submit,
+      unsigned min_complete,
+      int timeout)
+{
+        struct io_uring_getevents_arg arg;
+        struct __kernel_timespec ts;
+        unsigned flags = IORING_ENTER_EXT_ARG;
+
+        memset(&arg, 0, sizeof arg);
+
+        if (min_complete > 0) {
+                flags |= IORING_ENTER_GETEVENTS;
+
+                if (timeout >= 0) {
+                        ts.tv_sec = timeout / 1000;
+                        ts.tv_nsec = timeout % 1000 * 1000000;
+                        arg.ts = (uint64_t) (uintptr_t) &ts;
+                }
+        }
+
+        return syscall(__NR_io_uring_enter,
+                       uring->fd,
+                       to_submit,
+                       min_complete,
+                       flags,
+                       &arg,
+                       sizeof arg);
+}
+
+static int
+submit(struct fv_uring *uring,
+       unsigned min_complete,
+       int timeout)
+{
+        unsigned tail = *uring->sq_tail + uring->n_pending;
+        unsigned to_submit;
+        int ret;
+
+        /* Make the new entries visible to the kernel */
+        __atomic_store_n(uring->sq_tail, tail, __ATOMIC_RELEASE);
+        uring->n_pending = 0;
+
+        /* The kernel only advances the head past the entries that it
+         * actually consumed. If a previous call failed or only
+         * submitted some of the entries then the rest are still
+         * between the head and the tail so they get submitted again
+         * here.
+         */
+        to_submit = tail - __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+
+        ret = enter(uring, to_submit, min_complete, timeout);
+
+        /* A timeout isn't an error from our point of view */
+        if (ret == -1 && errno == ETIME)
+                return 0;
+
+        return ret;
+}
+
+struct io_uring_sqe *
+fv_uring_get_sqe(struct fv_uring *uring)
+{
+        struct io_uring_sqe *sqe;
+        unsigned head, index;
+
+        head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+
+        if (*uring->sq_tail + uring->n_pending - head >= uring->sq_entries) {
+                if (submit(uring, 0 /* min_complete */, 0 /* timeout */) == -1)
+                        fv_warning("io_uring_enter failed: %s",
+                                   strerror(errno));
+                head = __atomic_load_n(uring->sq_head, __ATOMIC_ACQUIRE);
+                if (*uring->sq_tail - head >= uring->sq_entries)
+                        fv_fatal("The io_uring submission queue is full");
+        }
+
+        index = (*uring->sq_tail + uring->n_pending) & uring->sq_ring_mask;
+        uring->sq_array[index] = index;
+        uring->n_pending++;
+
+        sqe = uring->sqes + index;
+        memset(sqe, 0, sizeof *sqe);
+
+        return sqe;
+}
+
+int
+fv_uring_submit_and_wait(struct fv_uring *uring,
+                         int timeout)
+{
+        /* Don't block if there are already completions waiting */
+        if (fv_uring_peek_cqe(uring))
+                timeout = 0;
+
+        if (timeout == 0)
+                return submit(uring, 0 /* min_complete */, 0 /* timeout */);
+        else
+                return submit(uring, 1 /* min_complete */, timeout);
+}
+
+struct io_uring_cqe *
+fv_uring_peek_cqe(struct fv_uring *uring)
+{
+        unsigned head = *uring->cq_head;
+
+        if (head == __atomic_load_n(uring->cq_tail, __ATOMIC_ACQUIRE))
+                return NULL;
+
+        return uring->cqes + (head & uring->cq_ring_mask);
+}
+
+void
+fv_uring_cqe_seen(struct fv_uring *uring)
+{
+        __atomic_store_n(uring->cq_head,
+                         *uring->cq_head + 1,
+                         __ATOMIC_RELEASE);
+}
+
+void
+fv_uring_destroy(struct fv_uring *uring)
+{
+        unmap_rings(uring);
+        fv_close(uring->fd);
+}
@@ -0,0 +1,101 @@
+/*
+ * Babiling
+ * Copyright (C) 2026  Neil Roberts
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+#ifndef FV_URING_H
+#define FV_URING_H
+
+#include <stdbool.h>
+#include <linux/io_uring.h>
+
+#include "fv-error.h"
+
+/* A minimal wrapper around the io_uring system calls. This only
+ * implements what the main context needs so that it doesn't have to
+ * depend on liburing.
+ */
+
+struct fv_uring {
+        int fd;
+
+        void *sq_ring;
+        size_t sq_ring_size;
+        void *cq_ring;
+        size_t cq_ring_size;
+        struct io_uring_sqe *sqes;
+        size_t sqes_size;
+
+        unsigned *sq_head;
+        unsigned *sq_tail;
+        unsigned sq_ring_mask;
+        unsigned sq_entries;
+        unsigned *sq_array;
+
+        unsigned *cq_head;
+        unsigned *cq_tail;
+        unsigned cq_ring_mask;
+        struct io_uring_cqe *cqes;
+
+        /* Number of SQEs that have been filled in but not yet made
+         * visible to the kernel */
+        unsigned n_pending;
+};
+
+/* Returns false if io_uring isn't available or the kernel is missing
+ * a feature that we need. In that case the caller should fall back to
+ * epoll.
+ */
+bool
+fv_uring_init(struct fv_uring *uring,
+              unsigned entries,
+              struct fv_error **error);
+
+/* Returns a cleared SQE to fill in. If the submission queue is full
+ * then the pending entries will be submitted first.
+ */
+struct io_uring_sqe *
+fv_uring_get_sqe(struct fv_uring *uring);
+
+/* Submits all of the pending SQEs and waits for at least one
+ * completion in the same system call. If timeout is -1 then it will
+ * wait forever and if it is zero it won't wait at all. Returns -1 and
+ * sets errno on failure. Any entries that the kernel didn't consume
+ * are submitted again on the next call.
+ */
+int
+fv_uring_submit_and_wait(struct fv_uring *uring,
+                         int timeout);
+
+/* Returns the next completion or NULL if there aren't any. The
+ * completion must be released with fv_uring_cqe_seen before getting
+ * the next one.
+ */
+struct io_uring_cqe *
+fv_uring_peek_cqe(struct fv_uring *uring);
+
+void
+fv_uring_cqe_seen(struct fv_uring *uring);
+
+void
+fv_uring_destroy(struct fv_uring *uring);
+
+#endif /* FV_URING_H */
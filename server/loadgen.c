@@ -0,0 +1,1222 @@
+/*
+ * Babiling
+ * Copyright (C) 2026  Neil Roberts
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <string.h>
+#include <errno.h>
+#include <math.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <opus.h>
+
+#include "fv-main-context.h"
+#include "fv-buffer.h"
+#include "fv-netaddress.h"
+#include "fv-proto.h"
+#include "fv-socket.h"
+#include "fv-stats.h"
+#include "fv-file-error.h"
+#include "fv-util.h"
+
+/* The bots send their messages on a timer with the same interval as
+ * the length of a speech packet so that the talkers can send one
+ * packet every tick */
+#define FV_LOADGEN_TICK_TIME FV_PROTO_SPEECH_TIME
+
+/* Number of packets in the canned speech that the talkers loop */
+#define FV_LOADGEN_N_SPEECHES (1000 / FV_PROTO_SPEECH_TIME)
+
+#define FV_LOADGEN_SAMPLE_RATE 48000
+#define FV_LOADGEN_SPEECH_SAMPLES (FV_LOADGEN_SAMPLE_RATE * \
+                                   FV_PROTO_SPEECH_TIME / 1000)
+
+/* Number of sent messages of each type for which a bot remembers the
+ * time so that the other bots can work out the latency when they
+ * receive them. This must be a power of two. */
+#define FV_LOADGEN_HISTORY_SIZE 256
+
+/* The bots skip their messages if more than this is waiting to be
+ * written so that the load generator doesn't hide a slow server by
+ * buffering */
+#define FV_LOADGEN_MAX_QUEUED_BYTES 16384
+
+/* The low bits of the x position carry a count of the position
+ * updates so that the receivers can find the time it was sent. This
+ * is too small a distance to be visible. */
+#define FV_LOADGEN_POSITION_ID_MASK UINT32_C(0xffff)
+
+struct fv_loadgen_speech {
+        uint8_t size;
+        uint8_t packet[FV_PROTO_MAX_SPEECH_SIZE];
+};
+
+struct fv_loadgen_bot {
+        struct fv_loadgen *loadgen;
+
+        int sock;
+        struct fv_main_context_source *source;
+        bool connected;
+
+        /* Position along the end of the WebSocket response headers
+         * that has been received so far */
+        uint8_t ws_terminator_pos;
+
+        /* The player number that the server gave or -1 if it hasn't
+         * been received yet. The bot doesn't start moving or talking
+         * until then. */
+        int player_num;
+
+        uint8_t read_buf[1024];
+        size_t read_buf_pos;
+
+        struct fv_buffer write_buf;
+        size_t write_buf_pos;
+
+        /* Position in the range 0-1 and direction in radians */
+        float x, y, direction;
+        uint64_t next_move_time;
+
+        bool talker;
+        int next_speech;
+
+        /* Number of messages sent so far. The number of speeches
+         * matches the sequence number that the server gives them. */
+        uint16_t n_positions;
+        uint16_t n_speeches;
+
+        /* The time that each recent message was sent, indexed by its
+         * number modulo FV_LOADGEN_HISTORY_SIZE */
+        uint16_t position_ids[FV_LOADGEN_HISTORY_SIZE];
+        uint64_t position_times[FV_LOADGEN_HISTORY_SIZE];
+        uint16_t speech_ids[FV_LOADGEN_HISTORY_SIZE];
+        uint64_t speech_times[FV_LOADGEN_HISTORY_SIZE];
+};
+
+struct fv_loadgen {
+        struct fv_netaddress address;
+
+        struct fv_loadgen_bot *bots;
+        int n_bots;
+        int n_started_bots;
+        int n_live_bots;
+
+        /* Array of bot pointers indexed by player number. All of the
+         * bots are in the same room and use the stable player numbers
+         * so the numbers are the same for all of them. */
+        struct fv_buffer players;
+
+        struct fv_loadgen_speech speeches[FV_LOADGEN_N_SPEECHES];
+
+        uint64_t start_time;
+        uint64_t last_report_time;
+        int next_report;
+
+        /* The counters since the last report and for the whole run */
+        struct fv_stats interval_stats;
+        struct fv_stats total_stats;
+
+        uint32_t random_state;
+
+        bool quit;
+};
+
+static const char *option_address = "127.0.0.1";
+static const char *option_path = "/babiling";
+static int option_n_bots = 100;
+static int option_connect_rate = 500;
+static int option_move_interval = 100;
+static int option_talkers_percent = 10;
+static int option_duration = 10;
+static int option_report_interval = 1;
+static bool option_bundle = false;
+
+static const char options[] = "-a:P:n:r:m:t:d:i:bh";
+
+static const char
+websocket_header_format[] =
+        "GET %s HTTP/1.1\r\n"
+        "Host: loadgen\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: stub\r\n"
+        "\r\n";
+
+static const uint8_t
+websocket_headers_terminator[] =
+        "\r\n\r\n";
+
+static uint32_t
+get_random(struct fv_loadgen *loadgen)
+{
+        /* xorshift32 */
+        uint32_t x = loadgen->random_state;
+
+        x ^= x << 13;
+        x ^= x >> 17;
+        x ^= x << 5;
+
+        return loadgen->random_state = x;
+}
+
+static float
+get_random_float(struct fv_loadgen *loadgen)
+{
+        return (get_random(loadgen) >> 8) / (float) (1 << 24);
+}
+
+static void
+usage(void)
+{
+        printf("Babiling load generator. Version " PACKAGE_VERSION "\n"
+               "usage: babiling-loadgen [options]...\n"
+               " -h                    Show this help message\n"
+               " -a <address[:port]>   Address of the server. Defaults to\n"
+               "                       127.0.0.1:"
+               FV_STRINGIFY(FV_PROTO_DEFAULT_PORT) "\n"
+               " -P <path>             Request path which selects the\n"
+               "                       room. Defaults to /babiling\n"
+               " -n <bots>             Number of connections. Defaults to\n"
+               "                       100.\n"
+               " -r <rate>             Connections to open per second.\n"
+               "                       Defaults to 500.\n"
+               " -m <ms>               Time between position updates of\n"
+               "                       each bot. Defaults to 100.\n"
+               " -t <percent>          Percentage of the bots that talk\n"
+               "                       continuously. Defaults to 10.\n"
+               " -d <seconds>          How long to run for after all of the\n"
+               "                       bots have connected. Defaults to 10.\n"
+               " -i <seconds>          Time between progress reports.\n"
+               "                       Defaults to 1.\n"
+               " -b                    Ask the server to bundle the\n"
+               "                       messages into fewer frames.\n"
+               "\n"
+               "At the end the totals are printed with one value per\n"
+               "line in the same format as the server statistics.\n");
+        exit(EXIT_FAILURE);
+}
+
+static bool
+parse_int_option(const char *value,
+                 int min,
+                 int max,
+                 int *result)
+{
+        char *tail;
+        long n;
+
+        errno = 0;
+        n = strtol(value, &tail, 10);
+
+        if (errno || *tail || tail == value || n < min || n > max)
+                return false;
+
+        *result = n;
+
+        return true;
+}
+
+static bool
+process_arguments(int argc, char **argv)
+{
+        bool ok = true;
+        int opt;
+
+        opterr = false;
+
+        while ((opt = getopt(argc, argv, options)) != -1) {
+                switch (opt) {
+                case ':':
+                case '?':
+                        fprintf(stderr, "invalid option '%c'\n", optopt);
+                        return false;
+
+                case '\1':
+                        fprintf(stderr, "unexpected argument \"%s\"\n",
+                                optarg);
+                        return false;
+
+                case 'a':
+                        option_address = optarg;
+                        break;
+
+                case 'P':
+                        option_path = optarg;
+                        break;
+
+                case 'n':
+                        ok = parse_int_option(optarg, 1, 1000000,
+                                              &option_n_bots);
+                        break;
+
+                case 'r':
+                        ok = parse_int_option(optarg, 1, 1000000,
+                                              &option_connect_rate);
+                        break;
+
+                case 'm':
+                        ok = parse_int_option(optarg, 1, 3600000,
+                                              &option_move_interval);
+                        break;
+
+                case 't':
+                        ok = parse_int_option(optarg, 0, 100,
+                                              &option_talkers_percent);
+                        break;
+
+                case 'd':
+                        ok = parse_int_option(optarg, 1, 86400,
+                                              &option_duration);
+                        break;
+
+                case 'i':
+                        ok = parse_int_option(optarg, 1, 86400,
+                                              &option_report_interval);
+                        break;
+
+                case 'b':
+                        option_bundle = true;
+                        break;
+
+                case 'h':
+                        usage();
+                        break;
+                }
+
+                if (!ok) {
+                        fprintf(stderr,
+                                "invalid value \"%s\" for -%c\n",
+                                optarg,
+                                opt);
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+/* Encodes a second of a tone to be replayed by all of the talkers */
+static bool
+make_speeches(struct fv_loadgen *loadgen)
+{
+        int16_t samples[FV_LOADGEN_SPEECH_SAMPLES];
+        struct fv_loadgen_speech *speech;
+        OpusEncoder *encoder;
+        opus_int32 size;
+        int error;
+        int i, j;
+
+        encoder = opus_encoder_create(FV_LOADGEN_SAMPLE_RATE,
+                                      1, /* channels */
+                                      OPUS_APPLICATION_VOIP,
+                                      &error);
+
+        if (error != OPUS_OK) {
+                fprintf(stderr, "error creating Opus encoder\n");
+                return false;
+        }
+
+        opus_encoder_ctl(encoder, OPUS_SET_BITRATE(8192));
+
+        for (i = 0; i < FV_LOADGEN_N_SPEECHES; i++) {
+                speech = loadgen->speeches + i;
+
+                for (j = 0; j < FV_LOADGEN_SPEECH_SAMPLES; j++) {
+                        samples[j] = sinf((i * FV_LOADGEN_SPEECH_SAMPLES + j) *
+                                          2.0f * M_PI * 220.0f /
+                                          FV_LOADGEN_SAMPLE_RATE) * 8000.0f;
+                }
+
+                size = opus_encode(encoder,
+                                   samples,
+                                   FV_LOADGEN_SPEECH_SAMPLES,
+                                   speech->packet,
+                                   sizeof speech->packet);
+
+                if (size < 0) {
+                        fprintf(stderr, "error encoding speech\n");
+                        opus_encoder_destroy(encoder);
+                        return false;
+                }
+
+                speech->size = size;
+        }
+
+        opus_encoder_destroy(encoder);
+
+        return true;
+}
+
+static struct fv_loadgen_bot **
+get_player_slot(struct fv_loadgen *loadgen,
+                int player_num)
+{
+        size_t old_length = loadgen->players.length;
+        size_t new_length;
+
+        new_length = (player_num + 1) * sizeof (struct fv_loadgen_bot *);
+
+        if (new_length > old_length) {
+                fv_buffer_set_length(&loadgen->players, new_length);
+                memset(loadgen->players.data + old_length,
+                       0,
+                       new_length - old_length);
+        }
+
+        return (struct fv_loadgen_bot **) loadgen->players.data + player_num;
+}
+
+static struct fv_loadgen_bot *
+get_player(struct fv_loadgen *loadgen,
+           int player_num)
+{
+        size_t n_players = (loadgen->players.length /
+                            sizeof (struct fv_loadgen_bot *));
+
+        if (player_num >= n_players)
+                return NULL;
+
+        return ((struct fv_loadgen_bot **) loadgen->players.data)[player_num];
+}
+
+static void
+close_bot(struct fv_loadgen_bot *bot)
+{
+        struct fv_loadgen *loadgen = bot->loadgen;
+
+        if (bot->sock == -1)
+                return;
+
+        if (bot->player_num != -1 &&
+            get_player(loadgen, bot->player_num) == bot)
+                *get_player_slot(loadgen, bot->player_num) = NULL;
+
+        fv_main_context_remove_source(bot->source);
+        fv_close(bot->sock);
+        bot->sock = -1;
+        fv_buffer_destroy(&bot->write_buf);
+
+        loadgen->n_live_bots--;
+        fv_stats_add(&loadgen->interval_stats,
+                     FV_STATS_CONNECTIONS_CLOSED,
+                     1);
+}
+
+static void
+update_poll_flags(struct fv_loadgen_bot *bot)
+{
+        enum fv_main_context_poll_flags flags = FV_MAIN_CONTEXT_POLL_IN;
+
+        if (!bot->connected || bot->write_buf_pos < bot->write_buf.length)
+                flags |= FV_MAIN_CONTEXT_POLL_OUT;
+
+        fv_main_context_modify_poll(bot->source, flags);
+}
+
+static void
+flush_bot(struct fv_loadgen_bot *bot)
+{
+        struct fv_stats *stats = &bot->loadgen->interval_stats;
+        ssize_t wrote;
+
+        if (!bot->connected || bot->write_buf_pos >= bot->write_buf.length)
+                return;
+
+        do {
+                wrote = write(bot->sock,
+                              bot->write_buf.data + bot->write_buf_pos,
+                              bot->write_buf.length - bot->write_buf_pos);
+        } while (wrote == -1 && errno == EINTR);
+
+        fv_stats_add(stats, FV_STATS_WRITE_CALLS, 1);
+
+        if (wrote == -1) {
+                if (fv_file_error_from_errno(errno) != FV_FILE_ERROR_AGAIN) {
+                        fprintf(stderr, "error writing to server: %s\n",
+                                strerror(errno));
+                        close_bot(bot);
+                        return;
+                }
+        } else {
+                fv_stats_add(stats, FV_STATS_BYTES_WRITTEN, wrote);
+                bot->write_buf_pos += wrote;
+
+                if (bot->write_buf_pos >= bot->write_buf.length) {
+                        fv_buffer_set_length(&bot->write_buf, 0);
+                        bot->write_buf_pos = 0;
+                } else {
+                        fv_stats_add(stats, FV_STATS_PARTIAL_WRITES, 1);
+                }
+        }
+
+        update_poll_flags(bot);
+}
+
+/* Returns a pointer to write a message of the given size to with one
+ * of the fv_proto_write_* functions or NULL if too much is already
+ * queued. The message is queued with add_message. */
+static uint8_t *
+get_message_space(struct fv_loadgen_bot *bot,
+                  uint8_t command,
+                  size_t size)
+{
+        struct fv_buffer *buf = &bot->write_buf;
+        uint8_t *space;
+
+        if (buf->length - bot->write_buf_pos >= FV_LOADGEN_MAX_QUEUED_BYTES)
+                return NULL;
+
+        fv_buffer_ensure_size(buf, buf->length + size);
+        space = buf->data + buf->length;
+
+        fv_stats_count_message_out(&bot->loadgen->interval_stats,
+                                   command & 0x7f);
+
+        return space;
+}
+
+static void
+add_message(struct fv_loadgen_bot *bot,
+            size_t length)
+{
+        bot->write_buf.length += length;
+}
+
+static void
+move_bot(struct fv_loadgen_bot *bot,
+         uint64_t now)
+{
+        struct fv_loadgen *loadgen = bot->loadgen;
+        struct fv_proto_update_position message;
+        uint16_t id = bot->n_positions;
+        float direction;
+        uint8_t *buf;
+
+        buf = get_message_space(bot,
+                                FV_PROTO_UPDATE_POSITION,
+                                FV_PROTO_UPDATE_POSITION_SIZE);
+        if (buf == NULL)
+                return;
+
+        bot->direction += (get_random_float(loadgen) - 0.5f) * 0.5f;
+        bot->x += cosf(bot->direction) * 0.001f;
+        bot->y += sinf(bot->direction) * 0.001f;
+
+        /* Turn around at the edges */
+        if (bot->x < 0.0f || bot->x > 1.0f || bot->y < 0.0f || bot->y > 1.0f) {
+                bot->x = MIN(MAX(bot->x, 0.0f), 1.0f);
+                bot->y = MIN(MAX(bot->y, 0.0f), 1.0f);
+                bot->direction += M_PI;
+        }
+
+        bot->direction = fmodf(bot->direction, 2.0f * M_PI);
+        direction = bot->direction;
+        if (direction < 0.0f)
+                direction += 2.0f * M_PI;
+
+        message.x_position =
+                ((uint32_t) (bot->x *
+                             (UINT32_MAX - FV_LOADGEN_POSITION_ID_MASK)) &
+                 ~FV_LOADGEN_POSITION_ID_MASK) | id;
+        message.y_position = bot->y * UINT32_MAX;
+        message.direction = direction / (2.0f * M_PI) * UINT16_MAX;
+
+        add_message(bot, fv_proto_write_update_position(buf, &message));
+
+        bot->position_ids[id % FV_LOADGEN_HISTORY_SIZE] = id;
+        bot->position_times[id % FV_LOADGEN_HISTORY_SIZE] = now;
+        bot->n_positions++;
+}
+
+static void
+talk_bot(struct fv_loadgen_bot *bot,
+         uint64_t now)
+{
+        const struct fv_loadgen_speech *speech =
+                bot->loadgen->speeches + bot->next_speech;
+        struct fv_proto_speech message = {
+                .packet = speech->packet,
+                .packet_size = speech->size
+        };
+        uint16_t id = bot->n_speeches;
+        uint8_t *buf;
+
+        buf = get_message_space(bot,
+                                FV_PROTO_SPEECH,
+                                FV_PROTO_BLOB_MESSAGE_SIZE(SPEECH,
+                                                           speech->size));
+        if (buf == NULL)
+                return;
+
+        add_message(bot, fv_proto_write_speech(buf, &message));
+
+        bot->next_speech = (bot->next_speech + 1) % FV_LOADGEN_N_SPEECHES;
+        bot->speech_ids[id % FV_LOADGEN_HISTORY_SIZE] = id;
+        bot->speech_times[id % FV_LOADGEN_HISTORY_SIZE] = now;
+        bot->n_speeches++;
+}
+
+static void
+handle_player_num(struct fv_loadgen_bot *bot,
+                  const uint8_t *payload,
+                  size_t length)
+{
+        struct fv_proto_player_num message;
+        uint16_t player_num;
+
+        if (!fv_proto_read_player_num(payload, length, &message))
+                return;
+
+        player_num = message.player_num;
+
+        if (bot->player_num != -1 &&
+            get_player(bot->loadgen, bot->player_num) == bot)
+                *get_player_slot(bot->loadgen, bot->player_num) = NULL;
+
+        bot->player_num = player_num;
+        *get_player_slot(bot->loadgen, player_num) = bot;
+}
+
+static void
+handle_player_position(struct fv_loadgen_bot *bot,
+                       const uint8_t *payload,
+                       size_t length,
+                       uint64_t now)
+{
+        struct fv_proto_player_position message;
+        struct fv_loadgen_bot *sender;
+        uint32_t x;
+        int slot;
+
+        if (!fv_proto_read_player_position(payload, length, &message))
+                return;
+
+        x = message.x_position;
+        sender = get_player(bot->loadgen, message.player_num);
+
+        if (sender == NULL)
+                return;
+
+        slot = (x & FV_LOADGEN_POSITION_ID_MASK) % FV_LOADGEN_HISTORY_SIZE;
+
+        if (sender->n_positions == 0 ||
+            sender->position_ids[slot] != (x & FV_LOADGEN_POSITION_ID_MASK))
+                return;
+
+        fv_stats_add_latency(&bot->loadgen->interval_stats,
+                             FV_STATS_LATENCY_POSITION,
+                             now - sender->position_times[slot]);
+}
+
+static void
+handle_player_speech(struct fv_loadgen_bot *bot,
+                     const uint8_t *payload,
+                     size_t length,
+                     uint64_t now)
+{
+        struct fv_proto_player_speech_sequence message;
+        struct fv_loadgen_bot *sender;
+        uint16_t sequence;
+        int slot;
+
+        if (!fv_proto_read_player_speech_sequence(payload, length, &message))
+                return;
+
+        sequence = message.sequence;
+        sender = get_player(bot->loadgen, message.player_num);
+
+        if (sender == NULL)
+                return;
+
+        slot = sequence % FV_LOADGEN_HISTORY_SIZE;
+
+        if (sender->n_speeches == 0 || sender->speech_ids[slot] != sequence)
+                return;
+
+        fv_stats_add_latency(&bot->loadgen->interval_stats,
+                             FV_STATS_LATENCY_SPEECH,
+                             now - sender->speech_times[slot]);
+}
+
+static void
+handle_message(struct fv_loadgen_bot *bot,
+               const uint8_t *message,
+               size_t length,
+               uint64_t now);
+
+static void
+handle_bundle(struct fv_loadgen_bot *bot,
+              const uint8_t *payload,
+              size_t length,
+              uint64_t now)
+{
+        size_t message_length;
+
+        while (length > 0) {
+                message_length = payload[0];
+
+                if (message_length == 0 || message_length >= length)
+                        break;
+
+                handle_message(bot, payload + 1, message_length, now);
+
+                payload += message_length + 1;
+                length -= message_length + 1;
+        }
+}
+
+static void
+handle_message(struct fv_loadgen_bot *bot,
+               const uint8_t *message,
+               size_t length,
+               uint64_t now)
+{
+        fv_stats_count_message_in(&bot->loadgen->interval_stats, message[0]);
+
+        switch (message[0]) {
+        case FV_PROTO_PLAYER_NUM:
+                handle_player_num(bot, message + 1, length - 1);
+                break;
+
+        case FV_PROTO_PLAYER_POSITION:
+                handle_player_position(bot, message + 1, length - 1, now);
+                break;
+
+        case FV_PROTO_PLAYER_SPEECH:
+                handle_player_speech(bot, message + 1, length - 1, now);
+                break;
+
+        case FV_PROTO_BUNDLE:
+                handle_bundle(bot, message + 1, length - 1, now);
+                break;
+        }
+}
+
+/* Returns the number of bytes before the WebSocket response headers
+ * have finished */
+static size_t
+skip_headers(struct fv_loadgen_bot *bot,
+             const uint8_t *data,
+             size_t length)
+{
+        size_t i;
+
+        for (i = 0;
+             i < length &&
+                     bot->ws_terminator_pos <
+                     sizeof websocket_headers_terminator - 1;
+             i++) {
+                if (data[i] ==
+                    websocket_headers_terminator[bot->ws_terminator_pos])
+                        bot->ws_terminator_pos++;
+                else
+                        bot->ws_terminator_pos = 0;
+        }
+
+        return i;
+}
+
+static void
+process_frames(struct fv_loadgen_bot *bot,
+               uint64_t now)
+{
+        const uint8_t *frame = bot->read_buf;
+        size_t remaining = bot->read_buf_pos;
+        size_t header_length, payload_length;
+
+        /* The server never fragments or masks the messages and they
+         * are always short enough to have at most a 16-bit length */
+        while (remaining >= 2) {
+                payload_length = frame[1];
+                header_length = 2;
+
+                if (payload_length == 126) {
+                        if (remaining < 4)
+                                break;
+                        payload_length = (frame[2] << 8) | frame[3];
+                        header_length = 4;
+                }
+
+                if (header_length + payload_length > remaining)
+                        break;
+
+                /* Only binary frames contain messages */
+                if ((frame[0] & 0x0f) == 0x02 && payload_length > 0) {
+                        handle_message(bot,
+                                       frame + header_length,
+                                       payload_length,
+                                       now);
+                }
+
+                frame += header_length + payload_length;
+                remaining -= header_length + payload_length;
+        }
+
+        memmove(bot->read_buf, frame, remaining);
+        bot->read_buf_pos = remaining;
+}
+
+static void
+handle_read(struct fv_loadgen_bot *bot)
+{
+        struct fv_stats *stats = &bot->loadgen->interval_stats;
+        size_t skipped;
+        ssize_t got;
+
+        got = read(bot->sock,
+                   bot->read_buf + bot->read_buf_pos,
+                   sizeof bot->read_buf - bot->read_buf_pos);
+
+        fv_stats_add(stats, FV_STATS_READ_CALLS, 1);
+
+        if (got == -1) {
+                if (fv_file_error_from_errno(errno) == FV_FILE_ERROR_AGAIN ||
+                    errno == EINTR)
+                        return;
+                fprintf(stderr, "error reading from server: %s\n",
+                        strerror(errno));
+                close_bot(bot);
+                return;
+        }
+
+        if (got == 0) {
+                fprintf(stderr, "server closed a connection\n");
+                close_bot(bot);
+                return;
+        }
+
+        fv_stats_add(stats, FV_STATS_BYTES_READ, got);
+
+        skipped = skip_headers(bot, bot->read_buf + bot->read_buf_pos, got);
+
+        if (skipped > 0) {
+                memmove(bot->read_buf + bot->read_buf_pos,
+                        bot->read_buf + bot->read_buf_pos + skipped,
+                        got - skipped);
+                got -= skipped;
+        }
+
+        bot->read_buf_pos += got;
+
+        process_frames(bot, fv_stats_get_latency_clock());
+}
+
+static void
+handle_connected(struct fv_loadgen_bot *bot)
+{
+        int value;
+        socklen_t value_len = sizeof value;
+
+        if (getsockopt(bot->sock,
+                       SOL_SOCKET,
+                       SO_ERROR,
+                       &value,
+                       &value_len) == -1 ||
+            value != 0) {
+                fprintf(stderr, "error connecting to server: %s\n",
+                        strerror(value_len == sizeof value ? value : errno));
+                close_bot(bot);
+                return;
+        }
+
+        bot->connected = true;
+        flush_bot(bot);
+}
+
+static void
+bot_poll_cb(struct fv_main_context_source *source,
+            int fd,
+            enum fv_main_context_poll_flags flags,
+            void *user_data)
+{
+        struct fv_loadgen_bot *bot = user_data;
+
+        if (flags & FV_MAIN_CONTEXT_POLL_ERROR) {
+                if (bot->connected)
+                        fprintf(stderr, "error on connection to server\n");
+                else
+                        handle_connected(bot);
+                close_bot(bot);
+        } else if (flags & FV_MAIN_CONTEXT_POLL_IN) {
+                handle_read(bot);
+        } else if (flags & FV_MAIN_CONTEXT_POLL_OUT) {
+                if (bot->connected)
+                        flush_bot(bot);
+                else
+                        handle_connected(bot);
+        }
+}
+
+static void
+start_bot(struct fv_loadgen *loadgen,
+          struct fv_loadgen_bot *bot,
+          uint64_t now)
+{
+        struct fv_netaddress_native address;
+        struct fv_proto_request_features features;
+        struct fv_proto_update_appearance appearance;
+        struct fv_error *error = NULL;
+        uint8_t *buf;
+
+        bot->loadgen = loadgen;
+        bot->connected = false;
+        bot->ws_terminator_pos = 0;
+        bot->player_num = -1;
+        bot->read_buf_pos = 0;
+        fv_buffer_init(&bot->write_buf);
+        bot->write_buf_pos = 0;
+        bot->x = get_random_float(loadgen);
+        bot->y = get_random_float(loadgen);
+        bot->direction = get_random_float(loadgen) * 2.0f * M_PI;
+        bot->next_move_time = (now +
+                               get_random(loadgen) %
+                               (option_move_interval * 1000));
+        bot->talker = get_random(loadgen) % 100 < option_talkers_percent;
+        bot->next_speech = get_random(loadgen) % FV_LOADGEN_N_SPEECHES;
+        bot->n_positions = 0;
+        bot->n_speeches = 0;
+
+        fv_netaddress_to_native(&loadgen->address, &address);
+
+        bot->sock = socket(address.sockaddr.sa_family == AF_INET6 ?
+                           PF_INET6 : PF_INET,
+                           SOCK_STREAM,
+                           0);
+
+        if (bot->sock == -1) {
+                fprintf(stderr, "error creating socket: %s\n",
+                        strerror(errno));
+                return;
+        }
+
+        if (!fv_socket_set_nonblock(bot->sock, &error)) {
+                fprintf(stderr, "%s\n", error->message);
+                fv_error_free(error);
+                goto error;
+        }
+
+        if (connect(bot->sock, &address.sockaddr, address.length) == -1 &&
+            errno != EINPROGRESS) {
+                fprintf(stderr, "error connecting to server: %s\n",
+                        strerror(errno));
+                goto error;
+        }
+
+        bot->source = fv_main_context_add_poll(NULL, /* context */
+                                               bot->sock,
+                                               FV_MAIN_CONTEXT_POLL_OUT,
+                                               bot_poll_cb,
+                                               bot);
+
+        loadgen->n_live_bots++;
+        fv_stats_add(&loadgen->interval_stats,
+                     FV_STATS_CONNECTIONS_OPENED,
+                     1);
+
+        /* The messages can be sent straight after the request without
+         * waiting for the response */
+        fv_buffer_append_printf(&bot->write_buf,
+                                websocket_header_format,
+                                option_path);
+
+        /* The queue is empty so there is always space for these */
+        features.features = (FV_PROTO_FEATURE_STABLE_PLAYER_NUMS |
+                             FV_PROTO_FEATURE_SPEECH_SEQUENCE);
+        if (option_bundle)
+                features.features |= FV_PROTO_FEATURE_BUNDLE;
+        buf = get_message_space(bot,
+                                FV_PROTO_REQUEST_FEATURES,
+                                FV_PROTO_REQUEST_FEATURES_SIZE);
+        add_message(bot, fv_proto_write_request_features(buf, &features));
+
+        buf = get_message_space(bot,
+                                FV_PROTO_NEW_PLAYER,
+                                FV_PROTO_NEW_PLAYER_SIZE);
+        add_message(bot, fv_proto_write_new_player(buf));
+
+        appearance.image = get_random(loadgen) % 256;
+        buf = get_message_space(bot,
+                                FV_PROTO_UPDATE_APPEARANCE,
+                                FV_PROTO_UPDATE_APPEARANCE_SIZE);
+        add_message(bot, fv_proto_write_update_appearance(buf, &appearance));
+
+        return;
+
+error:
+        fv_buffer_destroy(&bot->write_buf);
+        fv_close(bot->sock);
+        bot->sock = -1;
+}
+
+static uint64_t
+sum_values(const uint64_t *values,
+           int n_values)
+{
+        uint64_t sum = 0;
+        int i;
+
+        for (i = 0; i < n_values; i++)
+                sum += values[i];
+
+        return sum;
+}
+
+static void
+report(struct fv_loadgen *loadgen,
+       uint64_t now)
+{
+        const struct fv_stats *stats = &loadgen->interval_stats;
+        struct fv_stats_latency_summary position, speech;
+        float seconds = (now - loadgen->last_report_time) / 1e6f;
+
+        fv_stats_summarize_latency(stats, FV_STATS_LATENCY_POSITION, &position);
+        fv_stats_summarize_latency(stats, FV_STATS_LATENCY_SPEECH, &speech);
+
+        printf("%5.1fs %6i bots | "
+               "sent %8.0f msg/s %9.0f B/s | "
+               "received %8.0f msg/s %9.0f B/s | "
+               "position p50 %6" PRIu64 "us p99 %6" PRIu64 "us | "
+               "speech p50 %6" PRIu64 "us p99 %6" PRIu64 "us\n",
+               (now - loadgen->start_time) / 1e6f,
+               loadgen->n_live_bots,
+               sum_values(stats->messages_out,
+                          FV_STATS_N_MESSAGE_IDS) / seconds,
+               stats->counters[FV_STATS_BYTES_WRITTEN] / seconds,
+               sum_values(stats->messages_in,
+                          FV_STATS_N_MESSAGE_IDS) / seconds,
+               stats->counters[FV_STATS_BYTES_READ] / seconds,
+               position.p50,
+               position.p99,
+               speech.p50,
+               speech.p99);
+        fflush(stdout);
+
+        fv_stats_accumulate(&loadgen->total_stats, &loadgen->interval_stats);
+        fv_stats_init(&loadgen->interval_stats);
+        loadgen->last_report_time = now;
+}
+
+static void
+report_totals(struct fv_loadgen *loadgen,
+              uint64_t now)
+{
+        const struct fv_stats *stats = &loadgen->total_stats;
+        uint64_t seconds = (now - loadgen->start_time) / 1000000;
+        struct fv_buffer buf;
+
+        if (seconds < 1)
+                seconds = 1;
+
+        fv_buffer_init(&buf);
+
+        fv_stats_append_value(&buf, "loadgen_bots", loadgen->n_bots);
+        fv_stats_append_value(&buf, "loadgen_seconds", seconds);
+        fv_stats_append_value(&buf,
+                              "loadgen_sent_messages_per_second",
+                              sum_values(stats->messages_out,
+                                         FV_STATS_N_MESSAGE_IDS) /
+                              seconds);
+        fv_stats_append_value(&buf,
+                              "loadgen_sent_bytes_per_second",
+                              stats->counters[FV_STATS_BYTES_WRITTEN] /
+                              seconds);
+        fv_stats_append_value(&buf,
+                              "loadgen_received_messages_per_second",
+                              sum_values(stats->messages_in,
+                                         FV_STATS_N_MESSAGE_IDS) /
+                              seconds);
+        fv_stats_append_value(&buf,
+                              "loadgen_received_bytes_per_second",
+                              stats->counters[FV_STATS_BYTES_READ] /
+                              seconds);
+        fv_stats_append_value(&buf,
+                              "loadgen_lost_connections",
+                              stats->counters[FV_STATS_CONNECTIONS_CLOSED]);
+        fv_stats_append_latencies(&buf, stats);
+
+        fwrite(buf.data, 1, buf.length, stdout);
+
+        fv_buffer_destroy(&buf);
+}
+
+static void
+tick_cb(struct fv_main_context_source *source,
+        void *user_data)
+{
+        struct fv_loadgen *loadgen = user_data;
+        struct fv_loadgen_bot *bot;
+        uint64_t now = fv_stats_get_latency_clock();
+        uint64_t end_time, n_closed;
+        int n_to_start;
+        int i;
+
+        /* Open the connections gradually so the server's listen
+         * backlog doesn't overflow */
+        n_to_start = MAX(option_connect_rate * FV_LOADGEN_TICK_TIME / 1000, 1);
+        n_to_start = MIN(n_to_start,
+                         loadgen->n_bots - loadgen->n_started_bots);
+
+        for (i = 0; i < n_to_start; i++) {
+                start_bot(loadgen,
+                          loadgen->bots + loadgen->n_started_bots++,
+                          now);
+        }
+
+        if (n_to_start > 0 && loadgen->n_started_bots >= loadgen->n_bots) {
+                /* The duration is counted from when all of the bots
+                 * have started */
+                report(loadgen, now);
+                loadgen->start_time = now;
+                n_closed = loadgen->total_stats.counters[
+                        FV_STATS_CONNECTIONS_CLOSED];
+                fv_stats_init(&loadgen->total_stats);
+                loadgen->total_stats.counters[FV_STATS_CONNECTIONS_CLOSED] =
+                        n_closed;
+        }
+
+        for (i = 0; i < loadgen->n_started_bots; i++) {
+                bot = loadgen->bots + i;
+
+                if (bot->sock == -1 || bot->player_num == -1)
+                        continue;
+
+                if (now >= bot->next_move_time) {
+                        move_bot(bot, now);
+                        bot->next_move_time += option_move_interval * 1000;
+                        if (bot->next_move_time <= now) {
+                                bot->next_move_time =
+                                        now + option_move_interval * 1000;
+                        }
+                }
+
+                if (bot->talker)
+                        talk_bot(bot, now);
+
+                flush_bot(bot);
+        }
+
+        if (now - loadgen->last_report_time >=
+            option_report_interval * UINT64_C(1000000))
+                report(loadgen, now);
+
+        if (loadgen->n_started_bots >= loadgen->n_bots) {
+                end_time = loadgen->start_time +
+                        option_duration * UINT64_C(1000000);
+                if (now >= end_time)
+                        loadgen->quit = true;
+        }
+}
+
+static void
+quit_cb(struct fv_main_context_source *source,
+        void *user_data)
+{
+        struct fv_loadgen *loadgen = user_data;
+
+        loadgen->quit = true;
+}
+
+int
+main(int argc, char **argv)
+{
+        struct fv_main_context *mc;
+        struct fv_main_context_source *tick_source, *quit_source;
+        struct fv_error *error = NULL;
+        struct fv_loadgen *loadgen;
+        uint64_t now;
+        int i;
+
+        if (!process_arguments(argc, argv))
+                return EXIT_FAILURE;
+
+        loadgen = fv_calloc(sizeof *loadgen);
+
+        if (!fv_netaddress_from_string(&loadgen->address,
+                                       option_address,
+                                       FV_PROTO_DEFAULT_PORT)) {
+                fprintf(stderr, "invalid address \"%s\"\n", option_address);
+                fv_free(loadgen);
+                return EXIT_FAILURE;
+        }
+
+        if (!make_speeches(loadgen)) {
+                fv_free(loadgen);
+                return EXIT_FAILURE;
+        }
+
+        mc = fv_main_context_get_default(&error);
+
+        if (mc == NULL) {
+                fprintf(stderr, "%s\n", error->message);
+                fv_error_free(error);
+                fv_free(loadgen);
+                return EXIT_FAILURE;
+        }
+
+        signal(SIGPIPE, SIG_IGN);
+
+        loadgen->n_bots = option_n_bots;
+        loadgen->bots = fv_alloc(sizeof (struct fv_loadgen_bot) *
+                                 option_n_bots);
+        fv_buffer_init(&loadgen->players);
+        fv_stats_init(&loadgen->interval_stats);
+        fv_stats_init(&loadgen->total_stats);
+
+        now = fv_stats_get_latency_clock();
+        loadgen->start_time = now;
+        loadgen->last_report_time = now;
+        loadgen->random_state = now | 1;
+
+        tick_source = fv_main_context_add_timeout(mc,
+                                                  FV_LOADGEN_TICK_TIME,
+                                                  tick_cb,
+                                                  loadgen);
+        quit_source = fv_main_context_add_quit(mc, quit_cb, loadgen);
+
+        while (!loadgen->quit)
+                fv_main_context_poll(mc);
+
+        now = fv_stats_get_latency_clock();
+        report(loadgen, now);
+        report_totals(loadgen, now);
+
+        for (i = 0; i < loadgen->n_started_bots; i++)
+                close_bot(loadgen->bots + i);
+
+        fv_main_context_remove_source(quit_source);
+        fv_main_context_remove_source(tick_source);
+        fv_main_context_free(mc);
+
+        fv_buffer_destroy(&loadgen->players);
+        fv_free(loadgen->bots);
+        fv_free(loadgen);
+
+        return EXIT_SUCCESS;
+}
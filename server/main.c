@@ -26,6 +26,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <inttypes.h>
 #include <stdbool.h>
 #include <unistd.h>
 #include <string.h>
@@ -43,6 +44,7 @@
 #include "fv-main-context.h"
 #include "fv-log.h"
 #include "fv-network.h"
+#include "fv-connection.h"
 #include "fv-file-error.h"
 #include "fv-proto.h"
 
@@ -68,8 +70,21 @@ static char *option_log_file = NULL;
 static bool option_daemonize = false;
 static char *option_user = NULL;
 static char *option_group = NULL;
-
-static const char options[] = "-a:l:du:g:p:h";
+static int option_n_threads = 1;
+static int option_tick_rate = 0;
+static int option_interest_radius = -1;
+static int option_hearing_radius = 0;
+static long option_max_queued_bytes = FV_CONNECTION_DEFAULT_MAX_QUEUED_BYTES;
+static long option_max_stall_seconds = FV_CONNECTION_DEFAULT_MAX_STALL_SECONDS;
+static int option_max_rooms = FV_NETWORK_DEFAULT_MAX_ROOMS;
+static bool option_pin_rooms = false;
+static const char *option_relay_listen_path = NULL;
+static const char *option_relay_connect_path = NULL;
+static int option_n_mixer_threads = 0;
+static const char *option_stats_address = NULL;
+static bool option_record_latency = false;
+
+static const char options[] = "-a:l:du:g:p:j:t:i:r:b:s:m:kf:c:x:S:Lh";
 
 static void
 add_address(struct address **list,
@@ -129,6 +144,49 @@ usage(void)
                " -u <user>             Specify a user to run as. Used to drop\n"
                "                       privileges.\n"
                " -g <group>            Specify a group to run as.\n"
+               " -j <threads>          Number of threads to handle the\n"
+               "                       connections with. Defaults to 1.\n"
+               " -t <rate>             Send player state changes at a fixed\n"
+               "                       rate of <rate> times per second\n"
+               "                       instead of immediately.\n"
+               " -i <radius>           Only send immediate updates for the\n"
+               "                       players within <radius> cells of the\n"
+               "                       map grid. Further players are updated\n"
+               "                       once a second.\n"
+               " -r <distance>         Only send speech to the players within\n"
+               "                       <distance> map units of the speaker.\n"
+               " -b <bytes>            Maximum number of bytes to queue for\n"
+               "                       each connection. Defaults to "
+               FV_STRINGIFY(FV_CONNECTION_DEFAULT_MAX_QUEUED_BYTES) ".\n"
+               " -s <seconds>          Close connections that haven't read\n"
+               "                       anything for this many seconds. Zero\n"
+               "                       means never. Defaults to "
+               FV_STRINGIFY(FV_CONNECTION_DEFAULT_MAX_STALL_SECONDS) ".\n"
+               " -m <rooms>            Maximum number of rooms. A room is\n"
+               "                       created for each request path and\n"
+               "                       released once it is empty.\n"
+               "                       Defaults to "
+               FV_STRINGIFY(FV_NETWORK_DEFAULT_MAX_ROOMS) ".\n"
+               " -k                    Keep all of the connections of a room\n"
+               "                       on the same thread.\n"
+               " -f <path>             Share the rooms with other server\n"
+               "                       processes that connect to a UNIX\n"
+               "                       socket at <path>.\n"
+               " -c <path>             Share the rooms with the server\n"
+               "                       process listening at <path>.\n"
+               " -x <threads>          Let clients ask for the speech to be\n"
+               "                       mixed into a single stream, using\n"
+               "                       <threads> threads for the mixing.\n"
+               "                       Defaults to 0 which disables it.\n"
+               " -S <address>          Answer HTTP requests on <address>\n"
+               "                       with the server statistics. The\n"
+               "                       port defaults to "
+               FV_STRINGIFY(FV_NETWORK_DEFAULT_STATS_PORT) ".\n"
+               " -L                    Measure how long the position and\n"
+               "                       speech messages take to reach the\n"
+               "                       other clients. The times are in the\n"
+               "                       statistics and are logged when the\n"
+               "                       server receives SIGUSR1.\n"
                "\n");
         exit(EXIT_FAILURE);
 }
@@ -136,6 +194,7 @@ usage(void)
 static bool
 process_arguments(int argc, char **argv, struct fv_error **error)
 {
+        char *tail;
         int opt;
 
         opterr = false;
@@ -183,6 +242,159 @@ process_arguments(int argc, char **argv, struct fv_error **error)
                         option_group = optarg;
                         break;
 
+                case 'j':
+                        errno = 0;
+                        option_n_threads = strtol(optarg, &tail, 10);
+                        if (errno ||
+                            *tail ||
+                            option_n_threads < 1 ||
+                            option_n_threads > 256) {
+                                fv_set_error(error,
+                                              &arguments_error,
+                                              FV_ARGUMENTS_ERROR_INVALID,
+                                              "invalid number of threads "
+                                              "\"%s\"",
+                                              optarg);
+                                goto error;
+                        }
+                        break;
+
+                case 't':
+                        errno = 0;
+                        option_tick_rate = strtol(optarg, &tail, 10);
+                        if (errno ||
+                            *tail ||
+                            option_tick_rate < 1 ||
+                            option_tick_rate > 1000) {
+                                fv_set_error(error,
+                                              &arguments_error,
+                                              FV_ARGUMENTS_ERROR_INVALID,
+                                              "invalid tick rate \"%s\"",
+                                              optarg);
+                                goto error;
+                        }
+                        break;
+
+                case 'i':
+                        errno = 0;
+                        option_interest_radius = strtol(optarg, &tail, 10);
+                        if (errno ||
+                            *tail ||
+                            option_interest_radius < 0 ||
+                            option_interest_radius > 7) {
+                                fv_set_error(error,
+                                              &arguments_error,
+                                              FV_ARGUMENTS_ERROR_INVALID,
+                                              "invalid interest radius "
+                                              "\"%s\"",
+                                              optarg);
+                                goto error;
+                        }
+                        break;
+
+                case 'r':
+                        errno = 0;
+                        option_hearing_radius = strtol(optarg, &tail, 10);
+                        if (errno ||
+                            *tail ||
+                            option_hearing_radius < 1 ||
+                            option_hearing_radius > 1000) {
+                                fv_set_error(error,
+                                              &arguments_error,
+                                              FV_ARGUMENTS_ERROR_INVALID,
+                                              "invalid hearing radius "
+                                              "\"%s\"",
+                                              optarg);
+                                goto error;
+                        }
+                        break;
+
+                case 'b':
+                        errno = 0;
+                        option_max_queued_bytes = strtol(optarg, &tail, 10);
+                        if (errno ||
+                            *tail ||
+                            option_max_queued_bytes < 1024 ||
+                            option_max_queued_bytes > 64 * 1024 * 1024) {
+                                fv_set_error(error,
+                                              &arguments_error,
+                                              FV_ARGUMENTS_ERROR_INVALID,
+                                              "invalid queue size \"%s\"",
+                                              optarg);
+                                goto error;
+                        }
+                        break;
+
+                case 's':
+                        errno = 0;
+                        option_max_stall_seconds = strtol(optarg, &tail, 10);
+                        if (errno ||
+                            *tail ||
+                            option_max_stall_seconds < 0 ||
+                            option_max_stall_seconds > 24 * 60 * 60) {
+                                fv_set_error(error,
+                                              &arguments_error,
+                                              FV_ARGUMENTS_ERROR_INVALID,
+                                              "invalid stall time \"%s\"",
+                                              optarg);
+                                goto error;
+                        }
+                        break;
+
+                case 'm':
+                        errno = 0;
+                        option_max_rooms = strtol(optarg, &tail, 10);
+                        if (errno ||
+                            *tail ||
+                            option_max_rooms < 1 ||
+                            option_max_rooms > 65536) {
+                                fv_set_error(error,
+                                              &arguments_error,
+                                              FV_ARGUMENTS_ERROR_INVALID,
+                                              "invalid number of rooms "
+                                              "\"%s\"",
+                                              optarg);
+                                goto error;
+                        }
+                        break;
+
+                case 'k':
+                        option_pin_rooms = true;
+                        break;
+
+                case 'f':
+                        option_relay_listen_path = optarg;
+                        break;
+
+                case 'c':
+                        option_relay_connect_path = optarg;
+                        break;
+
+                case 'x':
+                        errno = 0;
+                        option_n_mixer_threads = strtol(optarg, &tail, 10);
+                        if (errno ||
+                            *tail ||
+                            option_n_mixer_threads < 0 ||
+                            option_n_mixer_threads > 256) {
+                                fv_set_error(error,
+                                              &arguments_error,
+                                              FV_ARGUMENTS_ERROR_INVALID,
+                                              "invalid number of mixer "
+                                              "threads \"%s\"",
+                                              optarg);
+                                goto error;
+                        }
+                        break;
+
+                case 'S':
+                        option_stats_address = optarg;
+                        break;
+
+                case 'L':
+                        option_record_latency = true;
+                        break;
+
                 case 'h':
                         usage();
                         break;
@@ -291,6 +503,15 @@ quit_cb(struct fv_main_context_source *source,
         *quit = true;
 }
 
+static void
+usr1_cb(struct fv_main_context_source *source,
+        void *user_data)
+{
+        struct fv_network *nw = user_data;
+
+        fv_network_log_latency(nw);
+}
+
 static bool
 add_listen_address_to_network(struct fv_network *nw,
                               struct address *address,
@@ -371,6 +592,10 @@ add_addresses(struct fv_network *nw,
 {
         struct address *address;
 
+        if (option_stats_address &&
+            !fv_network_add_stats_address(nw, option_stats_address, error))
+                return false;
+
 #ifdef USE_SYSTEMD
         {
                 int nfds = add_systemd_sockets(nw, error);
@@ -394,6 +619,20 @@ add_addresses(struct fv_network *nw,
         return true;
 }
 
+static bool
+add_relay(struct fv_network *nw,
+          struct fv_error **error)
+{
+        if (option_relay_listen_path &&
+            !fv_network_listen_relay(nw, option_relay_listen_path, error))
+                return false;
+
+        if (option_relay_connect_path)
+                fv_network_connect_relay(nw, option_relay_connect_path);
+
+        return true;
+}
+
 static bool
 set_log_file(struct fv_error **error)
 {
@@ -413,6 +652,7 @@ static void
 run_main_loop(struct fv_network *nw)
 {
         struct fv_main_context_source *quit_source;
+        struct fv_main_context_source *usr1_source = NULL;
         bool quit = false;
 
         if (option_group)
@@ -427,14 +667,27 @@ run_main_loop(struct fv_network *nw)
 
         fv_log_start();
 
+        fv_network_start(nw);
+
         quit_source = fv_main_context_add_quit(NULL, quit_cb, &quit);
 
+        if (option_record_latency)
+                usr1_source = fv_main_context_add_usr1(NULL, usr1_cb, nw);
+
         do
                 fv_main_context_poll(NULL);
         while(!quit);
 
+        if (option_hearing_radius > 0) {
+                fv_log("%" PRIu64 " speech packets were out of the "
+                       "hearing radius",
+                       fv_network_get_n_suppressed_speeches(nw));
+        }
+
         fv_log("Exiting...");
 
+        if (usr1_source)
+                fv_main_context_remove_source(usr1_source);
         fv_main_context_remove_source(quit_source);
 }
 
@@ -445,7 +698,25 @@ run_network(void)
         int ret = EXIT_SUCCESS;
         struct fv_error *error = NULL;
 
-        nw = fv_network_new();
+        nw = fv_network_new(option_n_threads, &error);
+
+        if (nw == NULL) {
+                fprintf(stderr, "%s\n", error->message);
+                fv_error_clear(&error);
+                return EXIT_FAILURE;
+        }
+
+        fv_network_set_tick_rate(nw, option_tick_rate);
+        fv_network_set_interest_radius(nw, option_interest_radius);
+        fv_network_set_hearing_radius(nw, option_hearing_radius);
+        fv_network_set_max_queued_bytes(nw, option_max_queued_bytes);
+        fv_network_set_max_stall_time(nw,
+                                      (uint64_t) option_max_stall_seconds *
+                                      1000000);
+        fv_network_set_max_rooms(nw, option_max_rooms);
+        fv_network_set_pin_rooms(nw, option_pin_rooms);
+        fv_network_set_mixer_threads(nw, option_n_mixer_threads);
+        fv_network_set_record_latency(nw, option_record_latency);
 
         if (!add_addresses(nw, &error)) {
                 fprintf(stderr, "%s\n", error->message);
@@ -455,6 +726,11 @@ run_network(void)
                 fprintf(stderr, "%s\n", error->message);
                 fv_error_clear(&error);
                 ret = EXIT_FAILURE;
+        } else if (!add_relay(nw, &error)) {
+                fprintf(stderr, "%s\n", error->message);
+                fv_error_clear(&error);
+                fv_log_close();
+                ret = EXIT_FAILURE;
         } else {
                 run_main_loop(nw);
 
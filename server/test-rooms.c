@@ -0,0 +1,373 @@
+/*
+ * Babiling
+ * Copyright (C) 2026  Neil Roberts
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+
+/* Checks that a room is released once its last client has gone so
+ * that the maximum number of rooms doesn't stop a different room from
+ * being created afterwards. The server and the clients all run on
+ * the same main context.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+#include "fv-proto.h"
+#include "fv-network.h"
+#include "fv-main-context.h"
+#include "fv-buffer.h"
+#include "fv-util.h"
+
+struct test_client {
+        int sock;
+        struct fv_main_context_source *source;
+        /* Everything that the server has sent */
+        struct fv_buffer buf;
+        /* Set once the server has closed the connection */
+        bool closed;
+};
+
+static void
+client_source_cb(struct fv_main_context_source *source,
+                 int fd,
+                 enum fv_main_context_poll_flags flags,
+                 void *user_data)
+{
+        struct test_client *client = user_data;
+        ssize_t got;
+
+        fv_buffer_ensure_size(&client->buf, client->buf.length + 1024);
+
+        got = read(client->sock,
+                   client->buf.data + client->buf.length,
+                   client->buf.size - client->buf.length);
+
+        if (got == -1 && errno == EINTR)
+                return;
+
+        if (got <= 0) {
+                client->closed = true;
+                fv_main_context_remove_source(source);
+                client->source = NULL;
+                return;
+        }
+
+        client->buf.length += got;
+}
+
+static bool
+write_all(int sock,
+          const uint8_t *data,
+          size_t length)
+{
+        ssize_t wrote;
+
+        while (length > 0) {
+                wrote = write(sock, data, length);
+
+                if (wrote == -1) {
+                        if (errno == EINTR)
+                                continue;
+                        return false;
+                }
+
+                data += wrote;
+                length -= wrote;
+        }
+
+        return true;
+}
+
+static void
+free_client(struct test_client *client)
+{
+        if (client->source)
+                fv_main_context_remove_source(client->source);
+        fv_close(client->sock);
+        fv_buffer_destroy(&client->buf);
+        fv_free(client);
+}
+
+/* Connects to the room and sends the WebSocket request without
+ * waiting for the reply */
+static struct test_client *
+connect_client(const struct sockaddr_in *addr,
+               const char *room)
+{
+        struct test_client *client;
+        struct fv_buffer request = FV_BUFFER_STATIC_INIT;
+        int sock;
+
+        sock = socket(PF_INET, SOCK_STREAM, 0);
+
+        if (sock == -1 ||
+            connect(sock, (const struct sockaddr *) addr, sizeof *addr) == -1) {
+                fprintf(stderr, "connect: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+        }
+
+        fv_buffer_append_printf(&request,
+                                "GET %s HTTP/1.1\r\n"
+                                "Host: example.com\r\n"
+                                "Upgrade: websocket\r\n"
+                                "Connection: Upgrade\r\n"
+                                "Sec-WebSocket-Key: "
+                                "dGhlIHNhbXBsZSBub25jZQ==\r\n"
+                                "Sec-WebSocket-Version: 13\r\n"
+                                "\r\n",
+                                room);
+
+        if (!write_all(sock, request.data, request.length)) {
+                fprintf(stderr, "write: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+        }
+
+        fv_buffer_destroy(&request);
+
+        client = fv_alloc(sizeof *client);
+        client->sock = sock;
+        fv_buffer_init(&client->buf);
+        client->closed = false;
+        client->source = fv_main_context_add_poll(NULL, /* context */
+                                                  sock,
+                                                  FV_MAIN_CONTEXT_POLL_IN,
+                                                  client_source_cb,
+                                                  client);
+
+        return client;
+}
+
+/* Returns the offset of the first frame after the handshake reply or
+ * -1 if the whole reply hasn't been received yet */
+static int
+get_frames_start(const struct test_client *client)
+{
+        const uint8_t *end;
+
+        end = memmem(client->buf.data, client->buf.length, "\r\n\r\n", 4);
+
+        if (end == NULL)
+                return -1;
+
+        return end + 4 - client->buf.data;
+}
+
+static bool
+has_player_id(const struct test_client *client)
+{
+        const uint8_t *frame, *buf_end;
+        size_t payload_length;
+        int start = get_frames_start(client);
+
+        if (start == -1)
+                return false;
+
+        frame = client->buf.data + start;
+        buf_end = client->buf.data + client->buf.length;
+
+        /* The server's messages are all short and unmasked */
+        while (buf_end - frame >= 2) {
+                payload_length = frame[1];
+
+                if (payload_length >= 126 ||
+                    buf_end - frame < 2 + payload_length)
+                        break;
+
+                if (payload_length > 0 && frame[2] == FV_PROTO_PLAYER_ID)
+                        return true;
+
+                frame += 2 + payload_length;
+        }
+
+        return false;
+}
+
+/* Adds a player and returns whether the server replied with its ID.
+ * If the server rejected the client it will close the connection
+ * instead. */
+static bool
+create_player(struct test_client *client)
+{
+        static const uint8_t mask[] = { 0x37, 0xfa, 0x21, 0x3d };
+        uint8_t frame[2 + sizeof mask + 1];
+
+        frame[0] = 0x82;
+        frame[1] = 0x80 | 1;
+        memcpy(frame + 2, mask, sizeof mask);
+        frame[6] = FV_PROTO_NEW_PLAYER ^ mask[0];
+
+        if (!write_all(client->sock, frame, sizeof frame))
+                return false;
+
+        while (!client->closed && !has_player_id(client))
+                fv_main_context_poll(NULL);
+
+        return has_player_id(client);
+}
+
+/* Closes the client's side of the connection and waits for the
+ * server to notice and close its side */
+static void
+disconnect_client(struct test_client *client)
+{
+        shutdown(client->sock, SHUT_WR);
+
+        while (!client->closed)
+                fv_main_context_poll(NULL);
+
+        free_client(client);
+}
+
+static bool
+wait_for_handshake(struct test_client *client)
+{
+        while (!client->closed && get_frames_start(client) == -1)
+                fv_main_context_poll(NULL);
+
+        return get_frames_start(client) != -1;
+}
+
+static bool
+check_can_create_player(const struct sockaddr_in *addr,
+                        const char *room,
+                        bool expected)
+{
+        struct test_client *client = connect_client(addr, room);
+        bool ret = create_player(client);
+
+        disconnect_client(client);
+
+        if (ret != expected) {
+                fprintf(stderr,
+                        "A player %s be created in room %s\n",
+                        expected ? "could not" : "should not",
+                        room);
+                return false;
+        }
+
+        return true;
+}
+
+static bool
+run_test(const struct sockaddr_in *addr)
+{
+        struct test_client *first, *second;
+
+        first = connect_client(addr, "/first");
+        second = connect_client(addr, "/first");
+
+        if (!wait_for_handshake(first) || !wait_for_handshake(second)) {
+                fprintf(stderr, "The handshake failed\n");
+                return false;
+        }
+
+        /* The room is still in use by one of the clients */
+        disconnect_client(first);
+
+        if (!check_can_create_player(addr, "/other", false))
+                return false;
+
+        /* The last client hasn't added a player so the room is
+         * released straight away */
+        disconnect_client(second);
+
+        if (!check_can_create_player(addr, "/other", true))
+                return false;
+
+        /* The player is kept for a while after the client has gone
+         * in case it reconnects so the room isn't released yet */
+        if (!check_can_create_player(addr, "/first", false))
+                return false;
+
+        return true;
+}
+
+int
+main(int argc, char **argv)
+{
+        struct fv_main_context *mc;
+        struct fv_network *nw;
+        struct fv_error *error = NULL;
+        struct sockaddr_in addr;
+        socklen_t addr_len = sizeof addr;
+        int ret = EXIT_SUCCESS;
+        int sock;
+
+        mc = fv_main_context_get_default(&error);
+
+        if (mc == NULL) {
+                fprintf(stderr, "%s\n", error->message);
+                fv_error_free(error);
+                return EXIT_FAILURE;
+        }
+
+        nw = fv_network_new(1 /* n_workers */, &error);
+
+        if (nw == NULL) {
+                fprintf(stderr, "%s\n", error->message);
+                fv_error_free(error);
+                fv_main_context_free(mc);
+                return EXIT_FAILURE;
+        }
+
+        fv_network_set_max_rooms(nw, 1);
+
+        sock = socket(PF_INET, SOCK_STREAM, 0);
+
+        memset(&addr, 0, sizeof addr);
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+        if (sock == -1 ||
+            bind(sock, (struct sockaddr *) &addr, sizeof addr) == -1 ||
+            listen(sock, 10) == -1 ||
+            getsockname(sock, (struct sockaddr *) &addr, &addr_len) == -1) {
+                fprintf(stderr, "listen: %s\n", strerror(errno));
+                exit(EXIT_FAILURE);
+        }
+
+        if (!fv_network_add_listen_socket(nw, sock, &error)) {
+                fprintf(stderr, "%s\n", error->message);
+                fv_error_free(error);
+                exit(EXIT_FAILURE);
+        }
+
+        fv_network_start(nw);
+
+        if (!run_test(&addr))
+                ret = EXIT_FAILURE;
+
+        fv_network_free(nw);
+        fv_main_context_free(mc);
+
+        return ret;
+}
@@ -0,0 +1,382 @@
+/*
+ * Babiling
+ * Copyright (C) 2026  Neil Roberts
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+
+/* Drives the timer wheel with a fake clock and random timeouts to
+ * check that no timeout fires early, none is missed and the poll
+ * timeout never sleeps past the next one. The clock starts just
+ * before the top level of the wheel wraps around and jumps far
+ * enough to cascade every level. The callbacks remove and modify
+ * other timeouts while the wheel is emitting a slot.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sys/epoll.h>
+
+#include "fv-main-context.h"
+#include "fv-util.h"
+
+#ifdef HAVE_IO_URING
+#include "fv-uring.h"
+#endif
+
+#define TEST_MAX_TIMEOUTS 3000
+
+/* The wheel covers 2²⁴ms before the top level wraps around */
+#define TEST_WHEEL_RANGE (UINT64_C(1) << 24)
+
+struct test_data;
+
+struct test_timeout {
+        struct test_data *data;
+        struct fv_main_context_source *source;
+        int interval;
+        /* The time in milliseconds when the timeout should next fire */
+        uint64_t due;
+};
+
+struct test_data {
+        struct fv_main_context *mc;
+        uint64_t random_state;
+        uint64_t n_fired;
+        bool failed;
+        int n_timeouts;
+        struct test_timeout timeouts[TEST_MAX_TIMEOUTS];
+};
+
+/* clock_gettime is wrapped with the linker so that the monotonic
+ * clock only moves when the test advances it. The time is in
+ * microseconds. */
+static uint64_t fake_time;
+
+/* epoll_wait is wrapped so that it returns straight away and the
+ * test can check the timeout that it was given */
+static int last_poll_timeout;
+
+int
+__real_clock_gettime(clockid_t clk_id, struct timespec *ts);
+
+int
+__wrap_clock_gettime(clockid_t clk_id, struct timespec *ts);
+
+int
+__wrap_epoll_wait(int epfd,
+                  struct epoll_event *events,
+                  int maxevents,
+                  int timeout);
+
+#ifdef HAVE_IO_URING
+bool
+__wrap_fv_uring_init(struct fv_uring *uring,
+                     unsigned entries,
+                     struct fv_error **error);
+
+/* Pretend that io_uring isn't available so that the main context
+ * uses epoll_wait */
+bool
+__wrap_fv_uring_init(struct fv_uring *uring,
+                     unsigned entries,
+                     struct fv_error **error)
+{
+        return false;
+}
+#endif
+
+int
+__wrap_epoll_wait(int epfd,
+                  struct epoll_event *events,
+                  int maxevents,
+                  int timeout)
+{
+        last_poll_timeout = timeout;
+
+        return 0;
+}
+
+int
+__wrap_clock_gettime(clockid_t clk_id, struct timespec *ts)
+{
+        if (clk_id != CLOCK_MONOTONIC)
+                return __real_clock_gettime(clk_id, ts);
+
+        ts->tv_sec = fake_time / 1000000;
+        ts->tv_nsec = fake_time % 1000000 * 1000;
+
+        return 0;
+}
+
+/* SplitMix64 */
+static uint64_t
+get_random(struct test_data *data)
+{
+        uint64_t z = (data->random_state += UINT64_C(0x9e3779b97f4a7c15));
+
+        z = (z ^ (z >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+        z = (z ^ (z >> 27)) * UINT64_C(0x94d049bb133111eb);
+
+        return z ^ (z >> 31);
+}
+
+static uint64_t
+get_now(struct test_data *data)
+{
+        /* This is the same cached clock that the wheel uses */
+        return fv_main_context_get_monotonic_clock(data->mc) / 1000;
+}
+
+static int
+get_random_interval(struct test_data *data)
+{
+        /* Pick a level of the wheel first so that they all get used.
+         * The last range goes beyond the end of the wheel. */
+        static const int max_intervals[] = {
+                64, 4096, 262144, 16777216, 20000000
+        };
+        int max = max_intervals[get_random(data) %
+                                FV_N_ELEMENTS(max_intervals)];
+
+        return get_random(data) % max + 1;
+}
+
+static void
+timeout_cb(struct fv_main_context_source *source,
+           void *user_data);
+
+static void
+add_timeout(struct test_data *data,
+            struct test_timeout *timeout)
+{
+        timeout->data = data;
+        timeout->interval = get_random_interval(data);
+        timeout->due = get_now(data) + timeout->interval;
+        timeout->source = fv_main_context_add_timeout(data->mc,
+                                                      timeout->interval,
+                                                      timeout_cb,
+                                                      timeout);
+}
+
+static void
+change_random_timeout(struct test_data *data)
+{
+        struct test_timeout *timeout =
+                data->timeouts + get_random(data) % data->n_timeouts;
+
+        if (get_random(data) & 1) {
+                fv_main_context_remove_source(timeout->source);
+                add_timeout(data, timeout);
+        } else {
+                timeout->interval = get_random_interval(data);
+                timeout->due = get_now(data) + timeout->interval;
+                fv_main_context_modify_timeout(timeout->source,
+                                               timeout->interval);
+        }
+}
+
+static void
+timeout_cb(struct fv_main_context_source *source,
+           void *user_data)
+{
+        struct test_timeout *timeout = user_data;
+        struct test_data *data = timeout->data;
+        uint64_t now = get_now(data);
+
+        if (now < timeout->due) {
+                fprintf(stderr,
+                        "Timeout fired %" PRIu64 "ms early\n",
+                        timeout->due - now);
+                data->failed = true;
+        }
+
+        data->n_fired++;
+        timeout->due = now + timeout->interval;
+
+        /* This can hit a timeout that is waiting to be emitted in
+         * the same slot or the one that is being emitted */
+        if (get_random(data) % 4 == 0)
+                change_random_timeout(data);
+}
+
+static uint64_t
+get_random_step(struct test_data *data)
+{
+        uint64_t r = get_random(data) % 100;
+
+        /* Mostly small steps so that neighbouring timeouts fire in
+         * separate iterations but sometimes big enough to skip over
+         * whole slots of the higher levels. The result is in
+         * microseconds. */
+        if (r < 60)
+                return get_random(data) % 3000;
+        else if (r < 90)
+                return get_random(data) % 100000;
+        else if (r < 99)
+                return get_random(data) % 10000000;
+        else
+                return get_random(data) % UINT64_C(1000000000);
+}
+
+static bool
+check_missed(struct test_data *data)
+{
+        uint64_t now = get_now(data);
+        int i;
+
+        for (i = 0; i < data->n_timeouts; i++) {
+                if (data->timeouts[i].due <= now) {
+                        fprintf(stderr,
+                                "Timeout with interval %ims is "
+                                "%" PRIu64 "ms late\n",
+                                data->timeouts[i].interval,
+                                now - data->timeouts[i].due);
+                        return false;
+                }
+        }
+
+        return true;
+}
+
+static uint64_t
+get_next_due(struct test_data *data)
+{
+        uint64_t next_due = UINT64_MAX;
+        int i;
+
+        for (i = 0; i < data->n_timeouts; i++)
+                next_due = MIN(next_due, data->timeouts[i].due);
+
+        return next_due;
+}
+
+static bool
+check_poll_timeout(uint64_t now,
+                   uint64_t next_due)
+{
+        if (last_poll_timeout < 0 ||
+            now + last_poll_timeout > next_due) {
+                fprintf(stderr,
+                        "Poll timeout of %ims is past the next timeout "
+                        "in %" PRIu64 "ms\n",
+                        last_poll_timeout,
+                        next_due - now);
+                return false;
+        }
+
+        return true;
+}
+
+static bool
+run_iterations(struct test_data *data,
+               int n_iterations)
+{
+        uint64_t now, next_due;
+        int i;
+
+        for (i = 0; i < n_iterations; i++) {
+                fake_time += get_random_step(data);
+
+                if (get_random(data) % 16 == 0)
+                        change_random_timeout(data);
+
+                /* The main context works out the poll timeout with
+                 * the time from the end of the last poll */
+                now = get_now(data);
+                next_due = get_next_due(data);
+
+                fv_main_context_poll(data->mc);
+
+                if (data->failed ||
+                    !check_poll_timeout(now, next_due) ||
+                    !check_missed(data))
+                        return false;
+        }
+
+        return true;
+}
+
+static bool
+run_test(struct test_data *data,
+         int n_timeouts,
+         int n_iterations)
+{
+        bool ret;
+        int i;
+
+        data->n_timeouts = n_timeouts;
+        data->n_fired = 0;
+        data->failed = false;
+
+        for (i = 0; i < data->n_timeouts; i++)
+                add_timeout(data, data->timeouts + i);
+
+        ret = run_iterations(data, n_iterations);
+
+        if (ret && data->n_fired == 0) {
+                fprintf(stderr, "No timeouts fired\n");
+                ret = false;
+        }
+
+        for (i = 0; i < data->n_timeouts; i++)
+                fv_main_context_remove_source(data->timeouts[i].source);
+
+        return ret;
+}
+
+int
+main(int argc, char **argv)
+{
+        struct test_data *data = fv_alloc(sizeof *data);
+        struct fv_error *error = NULL;
+        int ret = EXIT_SUCCESS;
+
+        /* Start just before the top level of the wheel wraps around */
+        fake_time = (TEST_WHEEL_RANGE * 3 - 1000) * 1000;
+
+        data->mc = fv_main_context_new(&error);
+
+        if (data->mc == NULL) {
+                fprintf(stderr, "%s\n", error->message);
+                fv_error_free(error);
+                fv_free(data);
+                return EXIT_FAILURE;
+        }
+
+        data->random_state = 42;
+
+        /* With only a few timeouts the next one is often in a slot
+         * of the top level that is past where it wraps around */
+        if (!run_test(data, TEST_MAX_TIMEOUTS, 200000) ||
+            !run_test(data, 3, 200000))
+                ret = EXIT_FAILURE;
+
+        fv_main_context_free(data->mc);
+        fv_free(data);
+
+        return ret;
+}
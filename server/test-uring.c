@@ -0,0 +1,168 @@
+/*
+ * Babiling
+ * Copyright (C) 2026  Neil Roberts
+ *
+ * Permission to use, copy, modify, distribute, and sell this software and its
+ * documentation for any purpose is hereby granted without fee, provided that
+ * the above copyright notice appear in all copies and that both that copyright
+ * notice and this permission notice appear in supporting documentation, and
+ * that the name of the copyright holders not be used in advertising or
+ * publicity pertaining to distribution of the software without specific,
+ * written prior permission.  The copyright holders make no representations
+ * about the suitability of this software for any purpose.  It is provided "as
+ * is" without express or implied warranty.
+ *
+ * THE COPYRIGHT HOLDERS DISCLAIM ALL WARRANTIES WITH REGARD TO THIS SOFTWARE,
+ * INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS, IN NO
+ * EVENT SHALL THE COPYRIGHT HOLDERS BE LIABLE FOR ANY SPECIAL, INDIRECT OR
+ * CONSEQUENTIAL DAMAGES OR ANY DAMAGES WHATSOEVER RESULTING FROM LOSS OF USE,
+ * DATA OR PROFITS, WHETHER IN AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER
+ * TORTIOUS ACTION, ARISING OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE
+ * OF THIS SOFTWARE.
+ */
+
+
+/* Makes io_uring_enter fail and then only take some of the
+ * submissions to check that the entries that the kernel didn't
+ * consume are submitted again on the next call.
+ */
+
+#include "config.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+#include "fv-uring.h"
+#include "fv-util.h"
+
+#define TEST_N_ENTRIES 5
+
+/* The exit status that tells automake that the test was skipped */
+#define TEST_SKIP_STATUS 77
+
+long
+__real_syscall(long number, ...);
+
+long
+__wrap_syscall(long number, ...);
+
+/* Number of io_uring_enter calls so far */
+static int n_enter_calls;
+
+/* syscall is wrapped with the linker. The first io_uring_enter fails
+ * with EAGAIN without reaching the kernel and the second one only
+ * asks it to take up to two entries. */
+long
+__wrap_syscall(long number, ...)
+{
+        long args[6];
+        va_list ap;
+        int i;
+
+        va_start(ap, number);
+        for (i = 0; i < FV_N_ELEMENTS(args); i++)
+                args[i] = va_arg(ap, long);
+        va_end(ap);
+
+        if (number == __NR_io_uring_enter) {
+                switch (n_enter_calls++) {
+                case 0:
+                        errno = EAGAIN;
+                        return -1;
+                case 1:
+                        if (args[1] > 2)
+                                args[1] = 2;
+                        break;
+                }
+        }
+
+        return __real_syscall(number,
+                              args[0], args[1], args[2],
+                              args[3], args[4], args[5]);
+}
+
+static bool
+reap_completions(struct fv_uring *uring,
+                 int *n_completions)
+{
+        struct io_uring_cqe *cqe;
+        int entry;
+
+        while ((cqe = fv_uring_peek_cqe(uring))) {
+                entry = cqe->user_data;
+
+                if (entry < 0 || entry >= TEST_N_ENTRIES ||
+                    n_completions[entry] > 0) {
+                        fprintf(stderr,
+                                "Unexpected completion for entry %i\n",
+                                entry);
+                        return false;
+                }
+
+                n_completions[entry]++;
+                fv_uring_cqe_seen(uring);
+        }
+
+        return true;
+}
+
+int
+main(int argc, char **argv)
+{
+        struct fv_uring uring;
+        struct fv_error *error = NULL;
+        struct io_uring_sqe *sqe;
+        int n_completions[TEST_N_ENTRIES] = { 0 };
+        int ret = EXIT_SUCCESS;
+        int i;
+
+        if (!fv_uring_init(&uring, 8, &error)) {
+                fprintf(stderr, "Skipping: %s\n", error->message);
+                fv_error_free(error);
+                return TEST_SKIP_STATUS;
+        }
+
+        for (i = 0; i < TEST_N_ENTRIES; i++) {
+                sqe = fv_uring_get_sqe(&uring);
+                sqe->opcode = IORING_OP_NOP;
+                sqe->user_data = i;
+        }
+
+        /* The first call fails, the second submits two entries and
+         * the third should submit the rest */
+        for (i = 0; i < 3; i++) {
+                if (fv_uring_submit_and_wait(&uring, 0) == -1 &&
+                    errno != EAGAIN) {
+                        fprintf(stderr,
+                                "io_uring_enter failed: %s\n",
+                                strerror(errno));
+                        ret = EXIT_FAILURE;
+                        goto out;
+                }
+
+                if (!reap_completions(&uring, n_completions)) {
+                        ret = EXIT_FAILURE;
+                        goto out;
+                }
+        }
+
+        for (i = 0; i < TEST_N_ENTRIES; i++) {
+                if (n_completions[i] != 1) {
+                        fprintf(stderr,
+                                "Entry %i was never submitted\n",
+                                i);
+                        ret = EXIT_FAILURE;
+                }
+        }
+
+out:
+        fv_uring_destroy(&uring);
+
+        return ret;
+}